@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Lock-free asynchronous logging for audio callbacks and signal handlers.
+ *
+ * printf() can block and allocate so it should never be called from audio
+ * thread. With this one the callback only stores a fixed size binary record
+ * (time stamp, format string pointer and up to four long arguments) to a
+ * ring buffer owned by the calling thread. Background thread formats and
+ * prints records, limits how many lines per second are printed and tells
+ * how many messages were lost. Report of lost messages is at most one line
+ * a second and it is counted in same lines per second.
+ *
+ * Rules:
+ *  - Format must be a string literal and every argument is printed as long
+ *    so use only %ld (or %lx etc.) conversions.
+ *  - Signal handlers must use asynclog_signal_printf() which has own ring.
+ *  - Call asynclog_start() in the beginning of main() and asynclog_stop()
+ *    before exit so nothing is left in rings.
+ *
+ * Header only: just include it. Needs C11 atomics and pthreads.
+ */
+
+#ifndef ASYNCLOG_H
+#define ASYNCLOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ringbuffer.h"
+
+/* How many threads can log. Ring 0 is for signal handlers */
+#define ASYNCLOG_MAX_RINGS 8
+/* How many records fit in one ring (power of two) */
+#define ASYNCLOG_RING_RECORDS 256
+#define ASYNCLOG_MAX_ARGS 4
+/* How many lines per second are printed at most */
+#define ASYNCLOG_LINES_PER_SECOND 50
+/* How often background thread looks rings in milliseconds */
+#define ASYNCLOG_FLUSH_MS 20
+
+typedef struct asynclog_record {
+    uint64_t time_ns;
+    const char *fmt;
+    long args[ASYNCLOG_MAX_ARGS];
+} asynclog_record;
+
+typedef struct asynclog_ring {
+    ringbuffer ring;
+    atomic_int used;
+    atomic_long dropped;
+} asynclog_ring;
+
+static asynclog_ring m_SAsyncLogRings[ASYNCLOG_MAX_RINGS];
+static _Thread_local asynclog_ring *m_SAsyncLogThreadRing = NULL;
+static pthread_t m_SAsyncLogThread;
+static atomic_int m_iAsyncLogRunning;
+static atomic_long m_lAsyncLogNoRing;
+static long m_lAsyncLogRateLimited = 0;
+static uint64_t m_lAsyncLogStart = 0;
+/* One second window for rate limiting */
+static uint64_t m_lAsyncLogWindowStart = 0;
+static long m_lAsyncLogWindowLines = 0;
+
+static inline uint64_t asynclog_now(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return (uint64_t)l_STs.tv_sec * 1000000000ULL + l_STs.tv_nsec;
+}
+
+/* Never blocks. If ring is full record is counted as dropped */
+static inline void asynclog_push(asynclog_ring *ring, const char *fmt, const long *args) {
+    asynclog_record l_SRecord;
+    int i = 0;
+
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&m_lAsyncLogNoRing, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (ringbuffer_write_space(&ring->ring) < sizeof(asynclog_record)) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    l_SRecord.time_ns = asynclog_now();
+    l_SRecord.fmt = fmt;
+
+    for (i = 0; i < ASYNCLOG_MAX_ARGS; i++) {
+        l_SRecord.args[i] = args[i];
+    }
+
+    ringbuffer_write(&ring->ring, &l_SRecord, sizeof(asynclog_record));
+}
+
+/* Claim ring for calling thread. Rings are allocated in asynclog_start()
+   so this does not allocate. Returns NULL if all rings are taken */
+static inline asynclog_ring *asynclog_thread_ring(void) {
+    int i = 0;
+    int l_iFree = 0;
+
+    if (m_SAsyncLogThreadRing != NULL) {
+        return m_SAsyncLogThreadRing;
+    }
+
+    for (i = 1; i < ASYNCLOG_MAX_RINGS; i++) {
+        l_iFree = 0;
+
+        if (atomic_compare_exchange_strong(&m_SAsyncLogRings[i].used, &l_iFree, 1)) {
+            m_SAsyncLogThreadRing = &m_SAsyncLogRings[i];
+            break;
+        }
+    }
+
+    return m_SAsyncLogThreadRing;
+}
+
+/* Log from any thread (not signal handler). Only long arguments */
+#define asynclog_printf(fmt, ...) \
+    asynclog_push(asynclog_thread_ring(), (fmt), (const long[ASYNCLOG_MAX_ARGS + 1]){0, __VA_ARGS__} + 1)
+
+/* Log from signal handler. Handlers using it must not interrupt each other
+   so add all of them to sa_mask */
+#define asynclog_signal_printf(fmt, ...) \
+    asynclog_push(&m_SAsyncLogRings[0], (fmt), (const long[ASYNCLOG_MAX_ARGS + 1]){0, __VA_ARGS__} + 1)
+
+/* Simple one second window for rate limiting */
+static inline void asynclog_window(uint64_t now) {
+    if (now - m_lAsyncLogWindowStart >= 1000000000ULL) {
+        m_lAsyncLogWindowStart = now;
+        m_lAsyncLogWindowLines = 0;
+    }
+}
+
+/* Print everything from rings. Returns number of records printed */
+static inline long asynclog_flush(int limit) {
+    asynclog_record l_SRecord;
+    long l_lPrinted = 0;
+    int i = 0;
+
+    asynclog_window(asynclog_now());
+
+    for (i = 0; i < ASYNCLOG_MAX_RINGS; i++) {
+        if (m_SAsyncLogRings[i].ring.data == NULL) {
+            continue;
+        }
+
+        while (ringbuffer_read_space(&m_SAsyncLogRings[i].ring) >= sizeof(asynclog_record)) {
+            ringbuffer_read(&m_SAsyncLogRings[i].ring, &l_SRecord, sizeof(asynclog_record));
+
+            if (limit && m_lAsyncLogWindowLines >= ASYNCLOG_LINES_PER_SECOND) {
+                m_lAsyncLogRateLimited++;
+                continue;
+            }
+
+            printf("[%10.6f] ", (l_SRecord.time_ns - m_lAsyncLogStart) / 1e9);
+            printf(l_SRecord.fmt, l_SRecord.args[0], l_SRecord.args[1], l_SRecord.args[2], l_SRecord.args[3]);
+            m_lAsyncLogWindowLines++;
+            l_lPrinted++;
+        }
+    }
+
+    if (l_lPrinted > 0) {
+        fflush(stdout);
+    }
+
+    return l_lPrinted;
+}
+
+/* How many messages have been lost because ring was full or there was no ring */
+static inline long asynclog_dropped(void) {
+    long l_lDropped = atomic_load(&m_lAsyncLogNoRing);
+    int i = 0;
+
+    for (i = 0; i < ASYNCLOG_MAX_RINGS; i++) {
+        l_lDropped += atomic_load(&m_SAsyncLogRings[i].dropped);
+    }
+
+    return l_lDropped;
+}
+
+static void *asynclog_thread(void *userdata) {
+    struct timespec l_SSleep = { 0, ASYNCLOG_FLUSH_MS * 1000000L };
+    uint64_t l_lReportedAt = 0;
+    uint64_t l_lNow = 0;
+    long l_lReported = 0;
+    long l_lLost = 0;
+
+    while (atomic_load(&m_iAsyncLogRunning)) {
+        nanosleep(&l_SSleep, NULL);
+
+        l_lLost = asynclog_dropped() + m_lAsyncLogRateLimited;
+        l_lNow = asynclog_now();
+        asynclog_window(l_lNow);
+
+        /* Flood must not make flood of reports: one summary a second and
+           it takes one line of budget. It goes before records so flood
+           can't use whole window first */
+        if (l_lLost != l_lReported && l_lNow - l_lReportedAt >= 1000000000ULL
+                && m_lAsyncLogWindowLines < ASYNCLOG_LINES_PER_SECOND) {
+            printf("asynclog: %ld messages dropped (%ld rate limited)\n", l_lLost, m_lAsyncLogRateLimited);
+            fflush(stdout);
+            m_lAsyncLogWindowLines++;
+            l_lReported = l_lLost;
+            l_lReportedAt = l_lNow;
+        }
+
+        asynclog_flush(1);
+    }
+
+    /* Print everything left without limits */
+    asynclog_flush(0);
+    return NULL;
+}
+
+static inline void asynclog_free_rings(void) {
+    int i = 0;
+
+    for (i = 0; i < ASYNCLOG_MAX_RINGS; i++) {
+        ringbuffer_free(&m_SAsyncLogRings[i].ring);
+    }
+}
+
+static inline int asynclog_start(void) {
+    int i = 0;
+
+    m_lAsyncLogStart = asynclog_now();
+    atomic_init(&m_lAsyncLogNoRing, 0);
+
+    for (i = 0; i < ASYNCLOG_MAX_RINGS; i++) {
+        if (ringbuffer_init(&m_SAsyncLogRings[i].ring, ASYNCLOG_RING_RECORDS * sizeof(asynclog_record)) < 0) {
+            asynclog_free_rings();
+            return -1;
+        }
+
+        atomic_init(&m_SAsyncLogRings[i].used, 0);
+        atomic_init(&m_SAsyncLogRings[i].dropped, 0);
+    }
+
+    /* Ring 0 is for signal handlers */
+    atomic_store(&m_SAsyncLogRings[0].used, 1);
+    atomic_store(&m_iAsyncLogRunning, 1);
+
+    if (pthread_create(&m_SAsyncLogThread, NULL, asynclog_thread, NULL) != 0) {
+        atomic_store(&m_iAsyncLogRunning, 0);
+        asynclog_free_rings();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Rings are freed also when start failed half way */
+static inline void asynclog_stop(void) {
+    if (!atomic_load(&m_iAsyncLogRunning)) {
+        asynclog_free_rings();
+        return;
+    }
+
+    atomic_store(&m_iAsyncLogRunning, 0);
+    pthread_join(m_SAsyncLogThread, NULL);
+
+    if (asynclog_dropped() + m_lAsyncLogRateLimited > 0) {
+        printf("asynclog: %ld messages dropped (%ld rate limited)\n",
+               asynclog_dropped() + m_lAsyncLogRateLimited, m_lAsyncLogRateLimited);
+    }
+
+    asynclog_free_rings();
+}
+
+#endif
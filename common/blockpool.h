@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Pool of equal sized buffers handed between decoder thread and player.
+ *
+ * Decoder takes free buffer with blockpool_get_free(), fills it and gives
+ * it back with blockpool_put_full(). Player takes filled buffers in same
+ * order with blockpool_get_full() and returns them with
+ * blockpool_put_free() after they are played. So decoding of next blocks
+ * overlaps with blocking write of current one and only one block has to
+ * be decoded before first sound.
+ *
+ * Buffers go round in order so pool is just ring of 'count' blocks with
+ * two counters under one mutex. Both sides may block, so this is for
+ * blocking APIs (ao_play, Pa_WriteStream) and not for audio callbacks.
+ *
+ * Header only: just include it. Needs pthreads.
+ */
+
+#ifndef BLOCKPOOL_H
+#define BLOCKPOOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct blockpool {
+    int count;
+    size_t block_bytes;
+    unsigned char *data;
+    /* Bytes in every filled block */
+    size_t *used;
+    /* Blocks filled and played so far */
+    long filled;
+    long played;
+    int eof;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Statistics */
+    long decoder_waits;
+    long player_waits;
+} blockpool;
+
+static inline int blockpool_init(blockpool *pool, int count, size_t block_bytes) {
+    memset(pool, 0x00, sizeof(blockpool));
+
+    if (count < 2 || block_bytes == 0) {
+        return -1;
+    }
+
+    pool->count = count;
+    pool->block_bytes = block_bytes;
+    pool->data = (unsigned char *)malloc(count * block_bytes);
+    pool->used = (size_t *)calloc(count, sizeof(size_t));
+
+    if (pool->data == NULL || pool->used == NULL) {
+        free(pool->data);
+        free(pool->used);
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    return 0;
+}
+
+static inline void blockpool_free(blockpool *pool) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->data);
+    free(pool->used);
+    pool->data = NULL;
+    pool->used = NULL;
+}
+
+/* Decoder side. Waits for free block. NULL if player has stopped */
+static inline void *blockpool_get_free(blockpool *pool) {
+    void *l_ptrBlock = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->filled - pool->played == pool->count && !pool->stop) {
+        pool->decoder_waits++;
+    }
+
+    while (pool->filled - pool->played == pool->count && !pool->stop) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+
+    if (!pool->stop) {
+        l_ptrBlock = pool->data + (pool->filled % pool->count) * pool->block_bytes;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return l_ptrBlock;
+}
+
+/* Decoder side. Block from blockpool_get_free() has 'bytes' in it */
+static inline void blockpool_put_full(blockpool *pool, size_t bytes) {
+    pthread_mutex_lock(&pool->lock);
+    pool->used[pool->filled % pool->count] = bytes;
+    pool->filled++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Decoder side. Nothing more is coming */
+static inline void blockpool_finish(blockpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->eof = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Player side. Waits for filled block. NULL at end or when stopped */
+static inline void *blockpool_get_full(blockpool *pool, size_t *bytes) {
+    void *l_ptrBlock = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    /* First block is not counted. Decoder has had no chance yet */
+    if (pool->filled == pool->played && !pool->eof && !pool->stop && pool->played > 0) {
+        pool->player_waits++;
+    }
+
+    while (pool->filled == pool->played && !pool->eof && !pool->stop) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+
+    if (pool->filled > pool->played && !pool->stop) {
+        l_ptrBlock = pool->data + (pool->played % pool->count) * pool->block_bytes;
+        *bytes = pool->used[pool->played % pool->count];
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return l_ptrBlock;
+}
+
+/* Player side. Block from blockpool_get_full() has been played */
+static inline void blockpool_put_free(blockpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->played++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Either side. Wakes up everyone waiting */
+static inline void blockpool_stop(blockpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#endif
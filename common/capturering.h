@@ -0,0 +1,537 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Always-on capture ring with triggered dump.
+ *
+ * Capture goes all the time to one big ring in memory that holds last
+ * 'history' seconds. Nothing is written to disk until trigger comes. Then
+ * dumper thread writes history before trigger and 'post' seconds after it
+ * to new file 'rec.wav' -> 'rec-000000-20151231-235959.wav' (dump number
+ * and wall clock time of trigger). Trigger during dump only makes it
+ * longer. Triggers are:
+ *  - capturering_trigger(). Async signal safe so it can be called from
+ *    SIGUSR1 handler
+ *  - line 'dump' written to FIFO (capturering_fifo())
+ *  - block peak over level given to capturering_open()
+ *
+ * Ring is allocated and faulted in once: hugetlbfs pages if there are any
+ * reserved, otherwise normal pages with transparent huge page advice. It
+ * is also locked if RLIMIT_MEMLOCK allows so audio callback never takes
+ * page fault and TLB misses stay low even with hundreds of megabytes.
+ *
+ * Capture side only copies and publishes frame counter. It never waits
+ * for dumper: if dumper falls more than ring behind, oldest frames are
+ * lost and counted. Dumper copies block out of ring and checks counter
+ * again afterwards so torn blocks are never written.
+ *
+ * Header only: just include it. Needs C11 atomics, pthreads, libsndfile,
+ * _GNU_SOURCE (MAP_HUGETLB, MADV_HUGEPAGE) and levels.h.
+ */
+
+#ifndef CAPTURERING_H
+#define CAPTURERING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sndfile.h>
+
+#include "levels.h"
+
+/* Ring is rounded up to this. Also size of x86-64 huge page */
+#define CAPTURERING_HUGEPAGE (2UL << 20)
+/* Dumper may be this much behind capture before frames are lost */
+#define CAPTURERING_SPARE_SECONDS 10
+/* Capture publishes at least this often (in seconds) when given big
+   blocks. Frames younger than this are never read by dumper */
+#define CAPTURERING_GUARD_SECONDS 1
+/* Frames written with one sf_writef_float */
+#define CAPTURERING_BLOCK_FRAMES 4096
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "capturering needs lock-free 64-bit atomics");
+
+enum {
+    CAPTURERING_PAGES_NORMAL = 0,
+    CAPTURERING_PAGES_THP,
+    CAPTURERING_PAGES_HUGETLB
+};
+
+typedef struct capturering {
+    char template[PATH_MAX];
+    char fifo_path[PATH_MAX];
+    SF_INFO info;
+    float *ring;
+    size_t map_bytes;
+    int pages;
+    int locked;
+    /* Frames in ring and what dumper may use of them */
+    uint64_t capacity;
+    uint64_t guard;
+    uint64_t history;
+    uint64_t post;
+    /* Linear peak for level trigger. 0 is off */
+    float level;
+    /* Frames captured so far. Only capture side writes it */
+    _Atomic uint64_t written;
+    /* Capture frame of last trigger + 1. 0 when there is none */
+    _Atomic uint64_t trigger;
+    atomic_int dumping;
+    atomic_int stop;
+    sem_t wake;
+    pthread_t dumper;
+    pthread_t fifo_thread;
+    int fifo_fd;
+    int fifo_made;
+    float *block;
+    int error;
+    /* Statistics */
+    atomic_long triggers;
+    atomic_long level_triggers;
+    atomic_long lost;
+    long dumps;
+    uint64_t dumped_frames;
+} capturering;
+
+/* 'dir/rec.wav' + 3 -> 'dir/rec-000003-20151231-235959.wav' */
+static inline void capturering_name(const char *template, long index, time_t when, char *out, size_t len) {
+    const char *l_strDot = strrchr(template, '.');
+    const char *l_strSlash = strrchr(template, '/');
+    char l_strTime[32];
+    struct tm l_STm;
+
+    localtime_r(&when, &l_STm);
+    strftime(l_strTime, sizeof(l_strTime), "%Y%m%d-%H%M%S", &l_STm);
+
+    if (l_strDot == NULL || (l_strSlash != NULL && l_strDot < l_strSlash)) {
+        snprintf(out, len, "%s-%06ld-%s", template, index, l_strTime);
+    } else {
+        snprintf(out, len, "%.*s-%06ld-%s%s", (int)(l_strDot - template), template, index, l_strTime, l_strDot);
+    }
+}
+
+/* Map and fault in ring. Tries reserved huge pages first */
+static inline int capturering_map(capturering *cr, size_t bytes) {
+    void *l_ptrMap = NULL;
+
+    cr->map_bytes = (bytes + CAPTURERING_HUGEPAGE - 1) & ~(CAPTURERING_HUGEPAGE - 1);
+    l_ptrMap = mmap(NULL, cr->map_bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+    if (l_ptrMap != MAP_FAILED) {
+        cr->pages = CAPTURERING_PAGES_HUGETLB;
+    } else {
+        /* No hugetlbfs pages reserved. Advice has to come before pages are touched */
+        l_ptrMap = mmap(NULL, cr->map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (l_ptrMap == MAP_FAILED) {
+            return -1;
+        }
+
+        cr->pages = madvise(l_ptrMap, cr->map_bytes, MADV_HUGEPAGE) == 0 ? CAPTURERING_PAGES_THP : CAPTURERING_PAGES_NORMAL;
+        /* Touch every page now and not in audio callback */
+        memset(l_ptrMap, 0x00, cr->map_bytes);
+    }
+
+    cr->locked = mlock(l_ptrMap, cr->map_bytes) == 0;
+    cr->ring = (float *)l_ptrMap;
+    return 0;
+}
+
+/* Free ring and copy block. Keeps errno for caller */
+static inline void capturering_unmap(capturering *cr) {
+    int l_iError = errno;
+
+    munmap(cr->ring, cr->map_bytes);
+    free(cr->block);
+    cr->ring = NULL;
+    cr->block = NULL;
+    errno = l_iError;
+}
+
+/* Copy frames [from, from + frames) out of ring. Returns frames that were
+   still valid after copy. Rest of them were overwritten while copying */
+static inline uint64_t capturering_copy(capturering *cr, uint64_t from, uint64_t frames, float *out) {
+    uint64_t l_lOffset = from % cr->capacity;
+    uint64_t l_lPart = cr->capacity - l_lOffset;
+    uint64_t l_lOldest = 0;
+    uint64_t l_lNow = 0;
+    int l_iChannels = cr->info.channels;
+
+    l_lPart = frames < l_lPart ? frames : l_lPart;
+    memcpy(out, cr->ring + l_lOffset * l_iChannels, l_lPart * l_iChannels * sizeof(float));
+
+    if (frames > l_lPart) {
+        memcpy(out + l_lPart * l_iChannels, cr->ring, (frames - l_lPart) * l_iChannels * sizeof(float));
+    }
+
+    /* Capture may be writing up to guard past published counter */
+    l_lNow = atomic_load_explicit(&cr->written, memory_order_acquire);
+    l_lOldest = l_lNow + cr->guard > cr->capacity ? l_lNow + cr->guard - cr->capacity : 0;
+
+    if (l_lOldest <= from) {
+        return frames;
+    }
+
+    return l_lOldest >= from + frames ? 0 : from + frames - l_lOldest;
+}
+
+/* First frame that dumper can still use */
+static inline uint64_t capturering_oldest(const capturering *cr, uint64_t now) {
+    return now + cr->guard > cr->capacity ? now + cr->guard - cr->capacity : 0;
+}
+
+/* Write one dump. Starts from 'trigger' - history and follows capture
+   until 'post' frames after last trigger */
+static inline int capturering_dump(capturering *cr, uint64_t trigger, long index) {
+    char l_strPath[PATH_MAX + 64];
+    SF_INFO l_SInfo = cr->info;
+    SNDFILE *l_SFile = NULL;
+    uint64_t l_lPos = trigger > cr->history ? trigger - cr->history : 0;
+    uint64_t l_lEnd = trigger + cr->post;
+    uint64_t l_lNow = 0;
+    uint64_t l_lNext = 0;
+    uint64_t l_lOldest = 0;
+    uint64_t l_lFrames = 0;
+    uint64_t l_lValid = 0;
+    int l_iChannels = cr->info.channels;
+
+    capturering_name(cr->template, index, time(NULL), l_strPath, sizeof(l_strPath));
+    l_SFile = sf_open(l_strPath, SFM_WRITE, &l_SInfo);
+
+    if (l_SFile == NULL) {
+        return -1;
+    }
+
+    atomic_store(&cr->dumping, 1);
+    printf("capturering: Dumping %.1f s before trigger to %s\n",
+           (double)(trigger - l_lPos) / cr->info.samplerate, l_strPath);
+
+    while (l_lPos < l_lEnd) {
+        l_lNow = atomic_load_explicit(&cr->written, memory_order_acquire);
+
+        /* Trigger during dump makes it longer */
+        l_lNext = atomic_exchange(&cr->trigger, 0);
+
+        if (l_lNext > 0 && l_lNext - 1 + cr->post > l_lEnd) {
+            l_lEnd = l_lNext - 1 + cr->post;
+        }
+
+        /* Capture stopped. Write what there is */
+        if (atomic_load(&cr->stop) && l_lNow < l_lEnd) {
+            l_lEnd = l_lNow;
+        }
+
+        l_lOldest = capturering_oldest(cr, l_lNow);
+
+        if (l_lPos < l_lOldest) {
+            atomic_fetch_add(&cr->lost, (long)(l_lOldest - l_lPos));
+            l_lPos = l_lOldest;
+        }
+
+        l_lFrames = (l_lNow < l_lEnd ? l_lNow : l_lEnd) - l_lPos;
+
+        if (l_lPos >= l_lNow || (l_lFrames < CAPTURERING_BLOCK_FRAMES && l_lNow < l_lEnd)) {
+            if (l_lPos >= l_lEnd) {
+                break;
+            }
+
+            /* Wait for more. Capture posts every block while dumping */
+            sem_wait(&cr->wake);
+            continue;
+        }
+
+        l_lFrames = l_lFrames < CAPTURERING_BLOCK_FRAMES ? l_lFrames : CAPTURERING_BLOCK_FRAMES;
+        l_lValid = capturering_copy(cr, l_lPos, l_lFrames, cr->block);
+
+        /* Overwritten head of block is dropped. Next round skips to oldest */
+        if (l_lValid < l_lFrames) {
+            atomic_fetch_add(&cr->lost, (long)(l_lFrames - l_lValid));
+        }
+
+        if (l_lValid > 0 && sf_writef_float(l_SFile, cr->block + (l_lFrames - l_lValid) * l_iChannels, l_lValid) != (sf_count_t)l_lValid) {
+            sf_close(l_SFile);
+            atomic_store(&cr->dumping, 0);
+            return -1;
+        }
+
+        cr->dumped_frames += l_lValid;
+        l_lPos += l_lFrames;
+    }
+
+    atomic_store(&cr->dumping, 0);
+    sf_close(l_SFile);
+    cr->dumps++;
+    printf("capturering: Dump %s done\n", l_strPath);
+    return 0;
+}
+
+static void *capturering_dumper_thread(void *userdata) {
+    capturering *l_SCr = (capturering *)userdata;
+    uint64_t l_lTrigger = 0;
+    long l_lIndex = 0;
+
+    while (1) {
+        sem_wait(&l_SCr->wake);
+        l_lTrigger = atomic_exchange(&l_SCr->trigger, 0);
+
+        if (l_lTrigger > 0 && capturering_dump(l_SCr, l_lTrigger - 1, l_lIndex++) < 0) {
+            fprintf(stderr, "capturering: Can't write dump!\n");
+            l_SCr->error = errno ? errno : EIO;
+        }
+
+        if (atomic_load(&l_SCr->stop)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Start dump (or make running one longer). Async signal safe */
+static inline void capturering_trigger(capturering *cr) {
+    atomic_store(&cr->trigger, atomic_load_explicit(&cr->written, memory_order_relaxed) + 1);
+    atomic_fetch_add_explicit(&cr->triggers, 1, memory_order_relaxed);
+    sem_post(&cr->wake);
+}
+
+/* Capture side. Never blocks so it can be called from audio callback */
+static inline void capturering_write(capturering *cr, const float *pcm, long frames) {
+    uint64_t l_lNow = atomic_load_explicit(&cr->written, memory_order_relaxed);
+    uint64_t l_lOffset = 0;
+    uint64_t l_lPart = 0;
+    int l_iChannels = cr->info.channels;
+    levels l_SLevels;
+
+    if (cr->level > 0.0f) {
+        levels_scan(pcm, frames * l_iChannels, &l_SLevels);
+
+        if (levels_peak(&l_SLevels) >= cr->level) {
+            atomic_fetch_add_explicit(&cr->level_triggers, 1, memory_order_relaxed);
+            capturering_trigger(cr);
+        }
+    }
+
+    while (frames > 0) {
+        /* Publish at least every guard so dumper knows what is being written */
+        l_lOffset = l_lNow % cr->capacity;
+        l_lPart = cr->capacity - l_lOffset;
+        l_lPart = l_lPart < cr->guard ? l_lPart : cr->guard;
+        l_lPart = (uint64_t)frames < l_lPart ? (uint64_t)frames : l_lPart;
+
+        memcpy(cr->ring + l_lOffset * l_iChannels, pcm, l_lPart * l_iChannels * sizeof(float));
+        l_lNow += l_lPart;
+        atomic_store_explicit(&cr->written, l_lNow, memory_order_release);
+        pcm += l_lPart * l_iChannels;
+        frames -= l_lPart;
+    }
+
+    if (atomic_load_explicit(&cr->dumping, memory_order_relaxed)) {
+        sem_post(&cr->wake);
+    }
+}
+
+/* Keep 'history_seconds' in memory and dump 'post_seconds' after trigger.
+   'level_db' over 0 dBFS turns level trigger off */
+static inline int capturering_open(capturering *cr, const char *template, const SF_INFO *info,
+                                   double history_seconds, double post_seconds, float level_db) {
+    uint64_t l_lFrames = 0;
+    int l_iError = 0;
+
+    memset(cr, 0x00, sizeof(capturering));
+
+    if (history_seconds <= 0.0 || post_seconds < 0.0 || strlen(template) >= sizeof(cr->template)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    strcpy(cr->template, template);
+    cr->info = *info;
+    cr->fifo_fd = -1;
+    cr->history = (uint64_t)(history_seconds * info->samplerate);
+    cr->post = (uint64_t)(post_seconds * info->samplerate);
+    cr->guard = (uint64_t)info->samplerate * CAPTURERING_GUARD_SECONDS;
+    cr->level = level_db <= 0.0f ? levels_from_db(level_db) : 0.0f;
+
+    l_lFrames = cr->history + cr->guard + (uint64_t)info->samplerate * CAPTURERING_SPARE_SECONDS;
+    cr->block = (float *)malloc(CAPTURERING_BLOCK_FRAMES * info->channels * sizeof(float));
+
+    if (cr->block == NULL || capturering_map(cr, l_lFrames * info->channels * sizeof(float)) < 0) {
+        free(cr->block);
+        return -1;
+    }
+
+    /* Rounding up to huge page gives a bit more history for free */
+    cr->capacity = cr->map_bytes / (info->channels * sizeof(float));
+
+    if (sem_init(&cr->wake, 0, 0) < 0) {
+        capturering_unmap(cr);
+        return -1;
+    }
+
+    atomic_init(&cr->written, 0);
+    atomic_init(&cr->trigger, 0);
+    atomic_init(&cr->dumping, 0);
+    atomic_init(&cr->stop, 0);
+    atomic_init(&cr->triggers, 0);
+    atomic_init(&cr->level_triggers, 0);
+    atomic_init(&cr->lost, 0);
+
+    if ((l_iError = pthread_create(&cr->dumper, NULL, capturering_dumper_thread, cr)) != 0) {
+        sem_destroy(&cr->wake);
+        capturering_unmap(cr);
+        errno = l_iError;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *capturering_fifo_thread(void *userdata) {
+    capturering *l_SCr = (capturering *)userdata;
+    char l_strLine[256];
+    size_t l_lLen = 0;
+    ssize_t l_lGot = 0;
+    char l_cChar = 0;
+
+    while (!atomic_load(&l_SCr->stop)) {
+        l_lGot = read(l_SCr->fifo_fd, &l_cChar, 1);
+
+        if (l_lGot < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (l_lGot <= 0) {
+            break;
+        }
+
+        if (l_cChar != '\n') {
+            if (l_lLen < sizeof(l_strLine) - 1) {
+                l_strLine[l_lLen++] = l_cChar;
+            }
+
+            continue;
+        }
+
+        l_strLine[l_lLen] = 0x00;
+        l_lLen = 0;
+
+        if (!strcmp(l_strLine, "dump") || !strcmp(l_strLine, "trigger")) {
+            capturering_trigger(l_SCr);
+        } else if (l_strLine[0] != 0x00) {
+            fprintf(stderr, "capturering: Unknown FIFO command '%s'\n", l_strLine);
+        }
+    }
+
+    return NULL;
+}
+
+/* Take commands from FIFO: 'echo dump > path'. FIFO is made if needed */
+static inline int capturering_fifo(capturering *cr, const char *path) {
+    int l_iError = 0;
+
+    if (strlen(path) >= sizeof(cr->fifo_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mkfifo(path, 0600) == 0) {
+        cr->fifo_made = 1;
+    } else if (errno != EEXIST) {
+        return -1;
+    }
+
+    /* Read and write so there is no EOF when last writer closes and
+       close can wake reader by writing empty line */
+    cr->fifo_fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if (cr->fifo_fd < 0) {
+        return -1;
+    }
+
+    strcpy(cr->fifo_path, path);
+
+    /* Without reader close must not wait for it */
+    if ((l_iError = pthread_create(&cr->fifo_thread, NULL, capturering_fifo_thread, cr)) != 0) {
+        close(cr->fifo_fd);
+        cr->fifo_fd = -1;
+
+        if (cr->fifo_made) {
+            unlink(path);
+            cr->fifo_made = 0;
+        }
+
+        errno = l_iError;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Finish running dump with what was captured and free ring */
+static inline int capturering_close(capturering *cr) {
+    atomic_store(&cr->stop, 1);
+    sem_post(&cr->wake);
+    pthread_join(cr->dumper, NULL);
+
+    if (cr->fifo_fd >= 0) {
+        if (write(cr->fifo_fd, "\n", 1) == 1) {
+            pthread_join(cr->fifo_thread, NULL);
+        }
+
+        close(cr->fifo_fd);
+        cr->fifo_fd = -1;
+
+        if (cr->fifo_made) {
+            unlink(cr->fifo_path);
+        }
+    }
+
+    sem_destroy(&cr->wake);
+    capturering_unmap(cr);
+    return cr->error ? -1 : 0;
+}
+
+static inline void capturering_print_info(const capturering *cr) {
+    static const char *l_strPages[] = { "normal", "transparent huge", "hugetlbfs" };
+
+    printf("capturering: %.1f s ring (%.1f MB) in %s pages%s. Dump is %.1f s before and %.1f s after trigger\n",
+           (double)cr->capacity / cr->info.samplerate, cr->map_bytes / 1048576.0, l_strPages[cr->pages],
+           cr->locked ? ", locked" : "", (double)cr->history / cr->info.samplerate, (double)cr->post / cr->info.samplerate);
+}
+
+static inline void capturering_print_stats(const capturering *cr) {
+    printf("capturering: %ld dumps, %llu frames dumped, %ld triggers (%ld by level), lost frames %ld\n",
+           cr->dumps, (unsigned long long)cr->dumped_frames, (long)atomic_load(&cr->triggers),
+           (long)atomic_load(&cr->level_triggers), (long)atomic_load(&cr->lost));
+}
+
+#endif
@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Multichannel capture split to one file per channel or channel group.
+ *
+ * One interleaved 64 channel WAV is a single huge write stream that one
+ * thread has to convert and write. Here capture thread only copies
+ * frames to lock-free ring with chansplit_write() (like flacpool.h).
+ * Coordinator thread cuts ring to CHANSPLIT_BLOCKSIZE frame blocks and
+ * every worker takes same block and handles its own contiguous range of
+ * groups: it deinterleaves channels of its groups and writes their files.
+ * Workers never touch same file so they convert, encode (FLAC) and write
+ * in parallel and throughput grows with cores.
+ *
+ *   capture -> ring -> coordinator -> job slots -> worker 0: groups 0..3
+ *                          ^                    -> worker 1: groups 4..7
+ *                          +--- all workers done <-   ...
+ *
+ * Mono groups are deinterleaved with 4x4 transposes: four frames of four
+ * channels are loaded as four vectors and shuffled to four vectors of one
+ * channel each. GCC vector extensions make it SSE on x86 and NEON on ARM
+ * (same way as levels.h). Larger groups are copied frame by frame.
+ *
+ * Files are named 'rec.wav' -> 'rec-ch01.wav' ... for mono groups and
+ * 'rec-ch01-04.wav' ... for groups of 4. If ring gets full samples are
+ * dropped and counted as overrun.
+ *
+ * Header only: just include it. Needs C11 atomics, pthreads and libsndfile.
+ */
+
+#ifndef CHANSPLIT_H
+#define CHANSPLIT_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#include "ringbuffer.h"
+
+#define CHANSPLIT_BLOCKSIZE 4096
+#define CHANSPLIT_MAX_WORKERS 16
+#define CHANSPLIT_MAX_CHANNELS 256
+/* How many seconds capture ring holds */
+#define CHANSPLIT_RING_SECONDS 4
+
+typedef float chansplit_v4 __attribute__((vector_size(16)));
+typedef int chansplit_v4i __attribute__((vector_size(16)));
+
+typedef struct chansplit_group {
+    SNDFILE *file;
+    int first;
+    int count;
+    float *pcm;
+} chansplit_group;
+
+typedef struct chansplit_job {
+    uint64_t seq;
+    int frames;
+    /* Workers that have not finished this block yet */
+    atomic_int pending;
+    float *pcm;
+} chansplit_job;
+
+typedef struct chansplit_worker {
+    struct chansplit *split;
+    pthread_t thread;
+    int first_group;
+    int groups;
+    uint64_t next;
+    double split_seconds;
+    double write_seconds;
+} chansplit_worker;
+
+typedef struct chansplit {
+    int channels;
+    int group_size;
+    int groups;
+    int workers;
+    int jobs;
+    ringbuffer ring;
+    sem_t wake;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_t coordinator;
+    chansplit_group *group;
+    chansplit_job *job;
+    chansplit_worker worker[CHANSPLIT_MAX_WORKERS];
+    uint64_t next_submit;
+    uint64_t next_free;
+    atomic_int closing;
+    int stop;
+    atomic_int error;
+    /* Statistics */
+    atomic_long overruns;
+    uint64_t frames;
+    int max_in_flight;
+} chansplit;
+
+static inline double chansplit_thread_seconds(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+/* 'dir/rec.wav' + channels 1..4 -> 'dir/rec-ch01-04.wav' */
+static inline void chansplit_name(const char *template, int first, int count, char *out, size_t len) {
+    const char *l_strDot = strrchr(template, '.');
+    const char *l_strSlash = strrchr(template, '/');
+    char l_strSuffix[32];
+
+    if (count == 1) {
+        snprintf(l_strSuffix, sizeof(l_strSuffix), "-ch%02d", first + 1);
+    } else {
+        snprintf(l_strSuffix, sizeof(l_strSuffix), "-ch%02d-%02d", first + 1, first + count);
+    }
+
+    if (l_strDot == NULL || (l_strSlash != NULL && l_strDot < l_strSlash)) {
+        snprintf(out, len, "%s%s", template, l_strSuffix);
+    } else {
+        snprintf(out, len, "%.*s%s%s", (int)(l_strDot - template), template, l_strSuffix, l_strDot);
+    }
+}
+
+static inline chansplit_v4 chansplit_load(const float *pcm) {
+    chansplit_v4 l_v4Value;
+    memcpy(&l_v4Value, pcm, sizeof(chansplit_v4));
+    return l_v4Value;
+}
+
+/* Channels first .. first + count - 1 of interleaved frames to one plane
+   each. Planes are 'frames' long */
+static inline void chansplit_deinterleave(const float *pcm, long frames, int channels, int first, int count, float **planes) {
+    chansplit_v4 l_v4A, l_v4B, l_v4C, l_v4D;
+    chansplit_v4 l_v4T0, l_v4T1, l_v4T2, l_v4T3;
+    const float *l_fIn = NULL;
+    long i = 0;
+    int c = 0;
+
+    for (c = 0; c + 4 <= count; c += 4) {
+        l_fIn = pcm + first + c;
+
+        for (i = 0; i + 4 <= frames; i += 4) {
+            /* Rows are frames i .. i + 3 of channels c .. c + 3 */
+            l_v4A = chansplit_load(l_fIn + (i + 0) * channels);
+            l_v4B = chansplit_load(l_fIn + (i + 1) * channels);
+            l_v4C = chansplit_load(l_fIn + (i + 2) * channels);
+            l_v4D = chansplit_load(l_fIn + (i + 3) * channels);
+
+            l_v4T0 = __builtin_shuffle(l_v4A, l_v4B, (chansplit_v4i){ 0, 4, 1, 5 });
+            l_v4T1 = __builtin_shuffle(l_v4A, l_v4B, (chansplit_v4i){ 2, 6, 3, 7 });
+            l_v4T2 = __builtin_shuffle(l_v4C, l_v4D, (chansplit_v4i){ 0, 4, 1, 5 });
+            l_v4T3 = __builtin_shuffle(l_v4C, l_v4D, (chansplit_v4i){ 2, 6, 3, 7 });
+
+            l_v4A = __builtin_shuffle(l_v4T0, l_v4T2, (chansplit_v4i){ 0, 1, 4, 5 });
+            l_v4B = __builtin_shuffle(l_v4T0, l_v4T2, (chansplit_v4i){ 2, 3, 6, 7 });
+            l_v4C = __builtin_shuffle(l_v4T1, l_v4T3, (chansplit_v4i){ 0, 1, 4, 5 });
+            l_v4D = __builtin_shuffle(l_v4T1, l_v4T3, (chansplit_v4i){ 2, 3, 6, 7 });
+
+            memcpy(planes[c + 0] + i, &l_v4A, sizeof(chansplit_v4));
+            memcpy(planes[c + 1] + i, &l_v4B, sizeof(chansplit_v4));
+            memcpy(planes[c + 2] + i, &l_v4C, sizeof(chansplit_v4));
+            memcpy(planes[c + 3] + i, &l_v4D, sizeof(chansplit_v4));
+        }
+
+        for (; i < frames; i++) {
+            planes[c + 0][i] = l_fIn[i * channels + 0];
+            planes[c + 1][i] = l_fIn[i * channels + 1];
+            planes[c + 2][i] = l_fIn[i * channels + 2];
+            planes[c + 3][i] = l_fIn[i * channels + 3];
+        }
+    }
+
+    /* Less than four channels left */
+    for (; c < count; c++) {
+        l_fIn = pcm + first + c;
+
+        for (i = 0; i < frames; i++) {
+            planes[c][i] = l_fIn[i * channels];
+        }
+    }
+}
+
+/* Channels first .. first + count - 1 of interleaved frames to smaller
+   interleaved frames */
+static inline void chansplit_copy_group(const float *pcm, long frames, int channels, int first, int count, float *out) {
+    long i = 0;
+
+    for (i = 0; i < frames; i++) {
+        memcpy(out + i * count, pcm + i * channels + first, count * sizeof(float));
+    }
+}
+
+/* Split and write one block for groups of this worker */
+static inline void chansplit_process(chansplit_worker *worker, const chansplit_job *job) {
+    chansplit *l_SSplit = worker->split;
+    chansplit_group *l_SGroup = &l_SSplit->group[worker->first_group];
+    float *l_fPlanes[CHANSPLIT_MAX_CHANNELS];
+    double l_dStart = chansplit_thread_seconds();
+    double l_dMiddle = 0.0;
+    int i = 0;
+
+    /* Mono groups of worker are neighbour channels: one pass for all */
+    if (l_SSplit->group_size == 1) {
+        for (i = 0; i < worker->groups; i++) {
+            l_fPlanes[i] = l_SGroup[i].pcm;
+        }
+
+        chansplit_deinterleave(job->pcm, job->frames, l_SSplit->channels, l_SGroup[0].first, worker->groups, l_fPlanes);
+    } else {
+        for (i = 0; i < worker->groups; i++) {
+            chansplit_copy_group(job->pcm, job->frames, l_SSplit->channels, l_SGroup[i].first, l_SGroup[i].count, l_SGroup[i].pcm);
+        }
+    }
+
+    l_dMiddle = chansplit_thread_seconds();
+
+    for (i = 0; i < worker->groups; i++) {
+        if (sf_writef_float(l_SGroup[i].file, l_SGroup[i].pcm, job->frames) != job->frames) {
+            atomic_store(&l_SSplit->error, 1);
+        }
+    }
+
+    worker->split_seconds += l_dMiddle - l_dStart;
+    worker->write_seconds += chansplit_thread_seconds() - l_dMiddle;
+}
+
+static void *chansplit_worker_thread(void *userdata) {
+    chansplit_worker *l_SWorker = (chansplit_worker *)userdata;
+    chansplit *l_SSplit = l_SWorker->split;
+    chansplit_job *l_SJob = NULL;
+
+    while (1) {
+        /* Blocks are handled in order so files get them in order */
+        pthread_mutex_lock(&l_SSplit->lock);
+
+        while (l_SWorker->next >= l_SSplit->next_submit && !l_SSplit->stop) {
+            pthread_cond_wait(&l_SSplit->work, &l_SSplit->lock);
+        }
+
+        if (l_SWorker->next >= l_SSplit->next_submit) {
+            pthread_mutex_unlock(&l_SSplit->lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&l_SSplit->lock);
+
+        l_SJob = &l_SSplit->job[l_SWorker->next % l_SSplit->jobs];
+        chansplit_process(l_SWorker, l_SJob);
+        l_SWorker->next++;
+
+        /* Last one frees slot */
+        if (atomic_fetch_sub(&l_SJob->pending, 1) == 1) {
+            sem_post(&l_SSplit->wake);
+        }
+    }
+
+    return NULL;
+}
+
+/* Free slots all workers are done with. Returns how many */
+static inline int chansplit_reclaim(chansplit *split) {
+    int l_iFreed = 0;
+
+    while (split->next_free < split->next_submit && atomic_load(&split->job[split->next_free % split->jobs].pending) == 0) {
+        split->next_free++;
+        l_iFreed++;
+    }
+
+    return l_iFreed;
+}
+
+/* Give blocks from ring to workers. Last short block only when closing */
+static inline int chansplit_submit(chansplit *split, int closing) {
+    size_t l_lFrameBytes = split->channels * sizeof(float);
+    size_t l_lBlockBytes = CHANSPLIT_BLOCKSIZE * l_lFrameBytes;
+    size_t l_lAvailable = 0;
+    chansplit_job *l_SJob = NULL;
+    int l_iSubmitted = 0;
+
+    while (split->next_submit - split->next_free < (uint64_t)split->jobs) {
+        l_lAvailable = ringbuffer_read_space(&split->ring);
+
+        if (l_lAvailable < l_lBlockBytes && !(closing && l_lAvailable >= l_lFrameBytes)) {
+            break;
+        }
+
+        l_lAvailable = l_lAvailable < l_lBlockBytes ? l_lAvailable - l_lAvailable % l_lFrameBytes : l_lBlockBytes;
+        l_SJob = &split->job[split->next_submit % split->jobs];
+        ringbuffer_read(&split->ring, l_SJob->pcm, l_lAvailable);
+        l_SJob->frames = l_lAvailable / l_lFrameBytes;
+        l_SJob->seq = split->next_submit;
+        atomic_store(&l_SJob->pending, split->workers);
+        split->frames += l_SJob->frames;
+
+        pthread_mutex_lock(&split->lock);
+        split->next_submit++;
+        pthread_cond_broadcast(&split->work);
+        pthread_mutex_unlock(&split->lock);
+
+        l_iSubmitted++;
+
+        if (split->next_submit - split->next_free > (uint64_t)split->max_in_flight) {
+            split->max_in_flight = split->next_submit - split->next_free;
+        }
+    }
+
+    return l_iSubmitted;
+}
+
+static void *chansplit_coordinator_thread(void *userdata) {
+    chansplit *l_SSplit = (chansplit *)userdata;
+    int l_iClosing = 0;
+
+    while (1) {
+        sem_wait(&l_SSplit->wake);
+        l_iClosing = atomic_load(&l_SSplit->closing);
+
+        /* Free first so there are slots for new blocks */
+        while (chansplit_reclaim(l_SSplit) + chansplit_submit(l_SSplit, l_iClosing) > 0) {
+        }
+
+        if (l_iClosing && l_SSplit->next_free == l_SSplit->next_submit && ringbuffer_read_space(&l_SSplit->ring) < l_SSplit->channels * sizeof(float)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Capture side. Never blocks so it can be called from audio callback.
+   Returns frames taken. Rest are counted as overrun */
+static inline long chansplit_write(chansplit *split, const float *pcm, long frames) {
+    size_t l_lFrameBytes = split->channels * sizeof(float);
+    size_t l_lSpace = ringbuffer_write_space(&split->ring) / l_lFrameBytes;
+    long l_lTake = frames < (long)l_lSpace ? frames : (long)l_lSpace;
+
+    if (l_lTake < frames) {
+        atomic_fetch_add_explicit(&split->overruns, frames - l_lTake, memory_order_relaxed);
+    }
+
+    ringbuffer_write(&split->ring, pcm, l_lTake * l_lFrameBytes);
+
+    if (ringbuffer_read_space(&split->ring) >= CHANSPLIT_BLOCKSIZE * l_lFrameBytes) {
+        sem_post(&split->wake);
+    }
+
+    return l_lTake;
+}
+
+static inline void chansplit_free(chansplit *split) {
+    int i = 0;
+
+    for (i = 0; split->group != NULL && i < split->groups; i++) {
+        if (split->group[i].file != NULL) {
+            sf_close(split->group[i].file);
+        }
+
+        free(split->group[i].pcm);
+    }
+
+    for (i = 0; split->job != NULL && i < split->jobs; i++) {
+        free(split->job[i].pcm);
+    }
+
+    free(split->group);
+    free(split->job);
+    split->group = NULL;
+    split->job = NULL;
+    ringbuffer_free(&split->ring);
+}
+
+/* Close and remove files of first 'count' groups. Nothing half made is left
+   behind if some later file can't be opened */
+static inline void chansplit_remove(chansplit *split, const char *template, int count) {
+    char l_strPath[PATH_MAX + 32];
+    int i = 0;
+
+    for (i = 0; i < count; i++) {
+        if (split->group[i].file != NULL) {
+            sf_close(split->group[i].file);
+            split->group[i].file = NULL;
+            chansplit_name(template, split->group[i].first, split->group[i].count, l_strPath, sizeof(l_strPath));
+            unlink(l_strPath);
+        }
+    }
+}
+
+/* Open file of every group and start threads. 'info' has all channels,
+   group files get same format with fewer channels. Workers 0 means one
+   per CPU. Last group is smaller if channels don't divide evenly */
+static inline int chansplit_open(chansplit *split, const char *template, const SF_INFO *info, int group_size, int workers) {
+    char l_strPath[PATH_MAX + 32];
+    SF_INFO l_SInfo;
+    int l_iGroups = 0;
+    int i = 0;
+
+    memset(split, 0x00, sizeof(chansplit));
+
+    if (info->channels <= 0 || info->channels > CHANSPLIT_MAX_CHANNELS || group_size <= 0) {
+        return -1;
+    }
+
+    if (workers <= 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    split->channels = info->channels;
+    split->group_size = group_size < info->channels ? group_size : info->channels;
+    split->groups = (info->channels + split->group_size - 1) / split->group_size;
+    split->workers = workers < 1 ? 1 : (workers > CHANSPLIT_MAX_WORKERS ? CHANSPLIT_MAX_WORKERS : workers);
+    split->workers = split->workers < split->groups ? split->workers : split->groups;
+    split->jobs = 4;
+
+    if (ringbuffer_init(&split->ring, (size_t)info->samplerate * info->channels * sizeof(float) * CHANSPLIT_RING_SECONDS) < 0) {
+        return -1;
+    }
+
+    split->group = (chansplit_group *)calloc(split->groups, sizeof(chansplit_group));
+    split->job = (chansplit_job *)calloc(split->jobs, sizeof(chansplit_job));
+
+    if (split->group == NULL || split->job == NULL) {
+        chansplit_free(split);
+        return -1;
+    }
+
+    for (i = 0; i < split->jobs; i++) {
+        atomic_init(&split->job[i].pending, 0);
+
+        if ((split->job[i].pcm = (float *)malloc(CHANSPLIT_BLOCKSIZE * info->channels * sizeof(float))) == NULL) {
+            chansplit_free(split);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < split->groups; i++) {
+        split->group[i].first = i * split->group_size;
+        split->group[i].count = info->channels - split->group[i].first < split->group_size ? info->channels - split->group[i].first : split->group_size;
+        split->group[i].pcm = (float *)malloc(CHANSPLIT_BLOCKSIZE * split->group[i].count * sizeof(float));
+
+        l_SInfo = *info;
+        l_SInfo.channels = split->group[i].count;
+        chansplit_name(template, split->group[i].first, split->group[i].count, l_strPath, sizeof(l_strPath));
+
+        if (split->group[i].pcm == NULL || !(split->group[i].file = sf_open(l_strPath, SFM_WRITE, &l_SInfo))) {
+            chansplit_remove(split, template, i);
+            chansplit_free(split);
+            return -1;
+        }
+    }
+
+    /* Contiguous ranges so mono channels of worker are neighbours */
+    for (i = 0; i < split->workers; i++) {
+        split->worker[i].split = split;
+        split->worker[i].first_group = l_iGroups;
+        split->worker[i].groups = (split->groups - l_iGroups) / (split->workers - i);
+        l_iGroups += split->worker[i].groups;
+    }
+
+    sem_init(&split->wake, 0, 0);
+    pthread_mutex_init(&split->lock, NULL);
+    pthread_cond_init(&split->work, NULL);
+    atomic_init(&split->closing, 0);
+    atomic_init(&split->error, 0);
+    atomic_init(&split->overruns, 0);
+
+    for (i = 0; i < split->workers; i++) {
+        pthread_create(&split->worker[i].thread, NULL, chansplit_worker_thread, &split->worker[i]);
+    }
+
+    pthread_create(&split->coordinator, NULL, chansplit_coordinator_thread, split);
+    return 0;
+}
+
+/* Write everything left and close all files */
+static inline int chansplit_close(chansplit *split) {
+    int l_iError = 0;
+    int i = 0;
+
+    atomic_store(&split->closing, 1);
+    sem_post(&split->wake);
+    pthread_join(split->coordinator, NULL);
+
+    pthread_mutex_lock(&split->lock);
+    split->stop = 1;
+    pthread_cond_broadcast(&split->work);
+    pthread_mutex_unlock(&split->lock);
+
+    for (i = 0; i < split->workers; i++) {
+        pthread_join(split->worker[i].thread, NULL);
+    }
+
+    l_iError = atomic_load(&split->error);
+    chansplit_free(split);
+    sem_destroy(&split->wake);
+    pthread_mutex_destroy(&split->lock);
+    pthread_cond_destroy(&split->work);
+    return l_iError ? -1 : 0;
+}
+
+static inline void chansplit_print_stats(const chansplit *split) {
+    int i = 0;
+
+    printf("chansplit: %d channels to %d files of %d, %llu frames, %d workers, max %d blocks in flight, overrun frames %ld\n",
+           split->channels, split->groups, split->group_size, (unsigned long long)split->frames, split->workers,
+           split->max_in_flight, (long)atomic_load(&split->overruns));
+
+    for (i = 0; i < split->workers; i++) {
+        printf("chansplit: worker %d files %d-%d split %.3f s write %.3f s\n", i, split->worker[i].first_group + 1,
+               split->worker[i].first_group + split->worker[i].groups, split->worker[i].split_seconds, split->worker[i].write_seconds);
+    }
+}
+
+#endif
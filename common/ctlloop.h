@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Event driven control loop for main thread of tools.
+ *
+ * Main thread used to spin (SDL_PollEvent() in loop) or sleep fixed time
+ * (Pa_Sleep()) while audio ran in callbacks. Here it sleeps in epoll_wait()
+ * until one of these happens:
+ *
+ *   CTLLOOP_SIGNAL    SIGINT, SIGHUP or SIGTERM (signalfd). They are
+ *                     blocked so no handler runs in middle of anything
+ *   CTLLOOP_DONE      ctlloop_notify() was called (eventfd). It is one
+ *                     write() so audio callback can call it when stream ends
+ *   CTLLOOP_TICK      periodic timer of ctlloop_tick() (timerfd)
+ *   CTLLOOP_DEADLINE  one shot timer of ctlloop_deadline() (timerfd)
+ *   CTLLOOP_INPUT     descriptor of ctlloop_input() (like stdin) can be
+ *                     read. Caller reads it
+ *   CTLLOOP_FD        some of descriptors of ctlloop_watch() (like
+ *                     sockets) can be read. They are in 'ready' array
+ *
+ * ctlloop_wait() returns all that happened as bit mask. Call
+ * ctlloop_open() first in main(): signals are blocked only in threads
+ * created after it (audio library threads, log thread etc).
+ *
+ * Header only: just include it. Linux only.
+ */
+
+#ifndef CTLLOOP_H
+#define CTLLOOP_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+enum {
+    CTLLOOP_SIGNAL = 1,
+    CTLLOOP_DONE = 2,
+    CTLLOOP_TICK = 4,
+    CTLLOOP_DEADLINE = 8,
+    CTLLOOP_INPUT = 16,
+    CTLLOOP_FD = 32
+};
+
+/* Events taken from epoll at once */
+#define CTLLOOP_MAX_EVENTS 32
+
+typedef struct ctlloop {
+    int epoll_fd;
+    int signal_fd;
+    int event_fd;
+    int tick_fd;
+    int deadline_fd;
+    /* Not owned. Not closed by ctlloop_close() */
+    int input_fd;
+    /* Descriptors of ctlloop_watch() that woke up last ctlloop_wait() */
+    int ready[CTLLOOP_MAX_EVENTS];
+    int ready_count;
+    /* Last signal got */
+    int signal;
+    /* How many times ctlloop_wait() woke up */
+    long wakeups;
+} ctlloop;
+
+static inline int ctlloop_add(ctlloop *cl, int fd) {
+    struct epoll_event l_SEvent;
+
+    memset(&l_SEvent, 0x00, sizeof(l_SEvent));
+    l_SEvent.events = EPOLLIN;
+    l_SEvent.data.fd = fd;
+    return epoll_ctl(cl->epoll_fd, EPOLL_CTL_ADD, fd, &l_SEvent);
+}
+
+static inline void ctlloop_close(ctlloop *cl) {
+    int *l_ptrFds[] = { &cl->epoll_fd, &cl->signal_fd, &cl->event_fd, &cl->tick_fd, &cl->deadline_fd };
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(l_ptrFds) / sizeof(l_ptrFds[0]); i++) {
+        if (*l_ptrFds[i] >= 0) {
+            close(*l_ptrFds[i]);
+            *l_ptrFds[i] = -1;
+        }
+    }
+}
+
+/* Block SIGINT, SIGHUP and SIGTERM and make descriptors */
+static inline int ctlloop_open(ctlloop *cl) {
+    sigset_t l_SMask;
+
+    memset(cl, 0x00, sizeof(ctlloop));
+    cl->epoll_fd = cl->signal_fd = cl->event_fd = cl->tick_fd = cl->deadline_fd = cl->input_fd = -1;
+
+    sigemptyset(&l_SMask);
+    sigaddset(&l_SMask, SIGINT);
+    sigaddset(&l_SMask, SIGHUP);
+    sigaddset(&l_SMask, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &l_SMask, NULL) != 0) {
+        return -1;
+    }
+
+    cl->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    cl->signal_fd = signalfd(-1, &l_SMask, SFD_CLOEXEC | SFD_NONBLOCK);
+    cl->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    cl->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    cl->deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    if (cl->epoll_fd < 0 || cl->signal_fd < 0 || cl->event_fd < 0 || cl->tick_fd < 0 || cl->deadline_fd < 0
+            || ctlloop_add(cl, cl->signal_fd) < 0 || ctlloop_add(cl, cl->event_fd) < 0
+            || ctlloop_add(cl, cl->tick_fd) < 0 || ctlloop_add(cl, cl->deadline_fd) < 0) {
+        fprintf(stderr, "ctlloop_open: Can't make control loop: %s\n", strerror(errno));
+        ctlloop_close(cl);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Wake up main thread. Safe from audio callback and signal handler */
+static inline void ctlloop_notify(ctlloop *cl) {
+    uint64_t l_lOne = 1;
+    ssize_t l_lIgnored = write(cl->event_fd, &l_lOne, sizeof(l_lOne));
+    (void)l_lIgnored;
+}
+
+static inline int ctlloop_set_timer(int fd, long first_ms, long interval_ms) {
+    struct itimerspec l_STimer;
+
+    memset(&l_STimer, 0x00, sizeof(l_STimer));
+    l_STimer.it_value.tv_sec = first_ms / 1000;
+    l_STimer.it_value.tv_nsec = (first_ms % 1000) * 1000000L;
+    l_STimer.it_interval.tv_sec = interval_ms / 1000;
+    l_STimer.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    return timerfd_settime(fd, 0, &l_STimer, NULL);
+}
+
+/* CTLLOOP_TICK every 'ms'. 0 stops */
+static inline int ctlloop_tick(ctlloop *cl, long ms) {
+    return ctlloop_set_timer(cl->tick_fd, ms, ms);
+}
+
+/* CTLLOOP_DEADLINE once after 'ms'. 0 stops */
+static inline int ctlloop_deadline(ctlloop *cl, long ms) {
+    return ctlloop_set_timer(cl->deadline_fd, ms, 0);
+}
+
+/* CTLLOOP_INPUT when 'fd' can be read. -1 stops watching (do it at end
+   of file or epoll keeps waking up) */
+static inline int ctlloop_input(ctlloop *cl, int fd) {
+    if (cl->input_fd >= 0) {
+        epoll_ctl(cl->epoll_fd, EPOLL_CTL_DEL, cl->input_fd, NULL);
+        cl->input_fd = -1;
+    }
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    if (ctlloop_add(cl, fd) < 0) {
+        return -1;
+    }
+
+    cl->input_fd = fd;
+    return 0;
+}
+
+/* CTLLOOP_FD when 'fd' can be read or is closed. Any number of them */
+static inline int ctlloop_watch(ctlloop *cl, int fd) {
+    return ctlloop_add(cl, fd);
+}
+
+/* Stop watching before closing 'fd' */
+static inline void ctlloop_unwatch(ctlloop *cl, int fd) {
+    int i = 0;
+
+    epoll_ctl(cl->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    /* It may still be in ready array of last wait */
+    for (i = 0; i < cl->ready_count; i++) {
+        if (cl->ready[i] == fd) {
+            cl->ready[i] = -1;
+        }
+    }
+}
+
+/* Sleep until something happens. Returns CTLLOOP_* bits or -1 */
+static inline int ctlloop_wait(ctlloop *cl) {
+    struct epoll_event l_SEvents[CTLLOOP_MAX_EVENTS];
+    struct signalfd_siginfo l_SInfo;
+    uint64_t l_lCount = 0;
+    int l_iReady = 0;
+    int l_iWhat = 0;
+    int i = 0;
+
+    do {
+        l_iReady = epoll_wait(cl->epoll_fd, l_SEvents, CTLLOOP_MAX_EVENTS, -1);
+    } while (l_iReady < 0 && errno == EINTR);
+
+    if (l_iReady < 0) {
+        return -1;
+    }
+
+    cl->wakeups++;
+    cl->ready_count = 0;
+
+    for (i = 0; i < l_iReady; i++) {
+        if (l_SEvents[i].data.fd == cl->input_fd) {
+            l_iWhat |= CTLLOOP_INPUT;
+        } else if (l_SEvents[i].data.fd != cl->signal_fd && l_SEvents[i].data.fd != cl->event_fd
+                   && l_SEvents[i].data.fd != cl->tick_fd && l_SEvents[i].data.fd != cl->deadline_fd) {
+            cl->ready[cl->ready_count++] = l_SEvents[i].data.fd;
+            l_iWhat |= CTLLOOP_FD;
+        } else if (l_SEvents[i].data.fd == cl->signal_fd) {
+            while (read(cl->signal_fd, &l_SInfo, sizeof(l_SInfo)) == sizeof(l_SInfo)) {
+                cl->signal = l_SInfo.ssi_signo;
+                l_iWhat |= CTLLOOP_SIGNAL;
+            }
+        } else if (read(l_SEvents[i].data.fd, &l_lCount, sizeof(l_lCount)) == sizeof(l_lCount)) {
+            if (l_SEvents[i].data.fd == cl->event_fd) {
+                l_iWhat |= CTLLOOP_DONE;
+            } else if (l_SEvents[i].data.fd == cl->tick_fd) {
+                l_iWhat |= CTLLOOP_TICK;
+            } else {
+                l_iWhat |= CTLLOOP_DEADLINE;
+            }
+        }
+    }
+
+    return l_iWhat;
+}
+
+#endif
@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Realtime insert chain for players: gain, peaking EQ and look-ahead
+ * limiter in audio callback.
+ *
+ * Stages run in this order on interleaved float frames:
+ *
+ *   gain     dB, ramped sample by sample over block
+ *   eq       one RBJ peaking biquad (freq, gain dB, Q), transposed
+ *            direct form II
+ *   limit    ceiling dBFS. Gain needed by every frame goes through
+ *            sliding minimum of lookahead + 1 frames, release and moving
+ *            average of lookahead frames, so gain is down before peak
+ *            comes out of delay line. Channels are linked
+ *
+ * Filter and delay line state is kept as structure of arrays: one vector
+ * lane per channel, four channels in one vector (GCC vector extensions
+ * like levels.h), so every frame is one vector operation per 4 channels.
+ *
+ * Limiter delays signal by look-ahead. For files dspchain_prime_sndfile()
+ * runs first look-ahead frames through chain before playback starts so
+ * output stays in step with file and there is no extra latency. Only
+ * parameter changes are heard look-ahead later. dspchain_process() tells
+ * how many frames are valid so last look-ahead frames are flushed at end.
+ *
+ * Control thread changes parameters with dspchain_post() or
+ * dspchain_command() ('gain -6', 'eq 2000 3 0.7', 'limit -1'). They go
+ * through lock-free ring (ringbuffer.h) and audio thread moves 30 ms worth
+ * towards them every block. dspchain_process() never allocates, locks or
+ * calls system.
+ *
+ * Players enable chain with DSPCHAIN in environment. Empty value is
+ * defaults (0 dB gain, flat EQ at 1 kHz, -0.3 dBFS ceiling, 5 ms):
+ *
+ *   DSPCHAIN="gain=-3,eq=100:4:0.7,limit=-1,lookahead=5" ./player some.wav
+ *
+ * Header only: just include it. Needs C11 atomics and -lm.
+ */
+
+#ifndef DSPCHAIN_H
+#define DSPCHAIN_H
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#include "levels.h"
+#include "ringbuffer.h"
+
+#define DSPCHAIN_MAX_CHANNELS 16
+#define DSPCHAIN_GROUPS (DSPCHAIN_MAX_CHANNELS / 4)
+#define DSPCHAIN_MAX_LOOKAHEAD_MS 50.0
+/* How fast parameters follow changes */
+#define DSPCHAIN_SMOOTH_SECONDS 0.03
+#define DSPCHAIN_RELEASE_SECONDS 0.05
+/* Messages in control ring */
+#define DSPCHAIN_QUEUE 64
+
+enum {
+    DSPCHAIN_GAIN = 0,
+    DSPCHAIN_EQ_FREQ,
+    DSPCHAIN_EQ_GAIN,
+    DSPCHAIN_EQ_Q,
+    DSPCHAIN_LIMIT,
+    DSPCHAIN_PARAMS
+};
+
+typedef struct dspchain_msg {
+    int param;
+    float value;
+} dspchain_msg;
+
+typedef struct dspchain {
+    int samplerate;
+    int channels;
+    int groups;
+    long lookahead;
+    /* Written by control thread, read by audio thread */
+    ringbuffer queue;
+    /* Audio thread only from here */
+    double target[DSPCHAIN_PARAMS];
+    double current[DSPCHAIN_PARAMS];
+    float gain;
+    float ceiling;
+    levels_v4 b0, b1, b2, a1, a2;
+    levels_v4 z1[DSPCHAIN_GROUPS];
+    levels_v4 z2[DSPCHAIN_GROUPS];
+    int eq_dirty;
+    /* Delay line: lookahead frames of every group */
+    levels_v4 *delay;
+    long delay_pos;
+    /* Sliding minimum of needed gain (monotonic queue) */
+    uint64_t *min_index;
+    float *min_value;
+    long min_head;
+    long min_count;
+    /* Moving average of released gain */
+    float *box;
+    long box_pos;
+    double box_sum;
+    float release_gain;
+    float release;
+    uint64_t frame;
+    /* Frames of real audio in delay line */
+    long pending;
+    /* Statistics */
+    float min_gain;
+    long messages;
+    /* Control side line buffer of dspchain_read_commands() */
+    char line[256];
+    size_t line_len;
+} dspchain;
+
+/* Is DSPCHAIN set in environment */
+static inline int dspchain_wanted(void) {
+    return getenv("DSPCHAIN") != NULL;
+}
+
+static inline double dspchain_db_to_gain(double db) {
+    return pow(10.0, db / 20.0);
+}
+
+/* RBJ cookbook peaking EQ. Same coefficients for every lane */
+static inline void dspchain_eq_coefficients(dspchain *chain) {
+    double l_dA = pow(10.0, chain->current[DSPCHAIN_EQ_GAIN] / 40.0);
+    double l_dW = 2.0 * M_PI * chain->current[DSPCHAIN_EQ_FREQ] / chain->samplerate;
+    double l_dAlpha = sin(l_dW) / (2.0 * chain->current[DSPCHAIN_EQ_Q]);
+    double l_dA0 = 1.0 + l_dAlpha / l_dA;
+    float l_fB0 = (1.0 + l_dAlpha * l_dA) / l_dA0;
+    float l_fB1 = -2.0 * cos(l_dW) / l_dA0;
+    float l_fB2 = (1.0 - l_dAlpha * l_dA) / l_dA0;
+    float l_fA2 = (1.0 - l_dAlpha / l_dA) / l_dA0;
+
+    chain->b0 = (levels_v4){ l_fB0, l_fB0, l_fB0, l_fB0 };
+    chain->b1 = (levels_v4){ l_fB1, l_fB1, l_fB1, l_fB1 };
+    chain->b2 = (levels_v4){ l_fB2, l_fB2, l_fB2, l_fB2 };
+    chain->a1 = chain->b1;
+    chain->a2 = (levels_v4){ l_fA2, l_fA2, l_fA2, l_fA2 };
+}
+
+/* Keep parameters where filter is stable and makes sense */
+static inline double dspchain_clamp(const dspchain *chain, int param, double value) {
+    double l_dMin[DSPCHAIN_PARAMS] = { -60.0, 20.0, -24.0, 0.1, -30.0 };
+    double l_dMax[DSPCHAIN_PARAMS] = { 24.0, chain->samplerate * 0.45, 24.0, 10.0, 0.0 };
+
+    return value < l_dMin[param] ? l_dMin[param] : (value > l_dMax[param] ? l_dMax[param] : value);
+}
+
+/* Control side. Never blocks. Returns -1 if ring is full */
+static inline int dspchain_post(dspchain *chain, int param, float value) {
+    dspchain_msg l_SMsg;
+
+    if (param < 0 || param >= DSPCHAIN_PARAMS || ringbuffer_write_space(&chain->queue) < sizeof(dspchain_msg)) {
+        return -1;
+    }
+
+    l_SMsg.param = param;
+    l_SMsg.value = value;
+    ringbuffer_write(&chain->queue, &l_SMsg, sizeof(dspchain_msg));
+    return 0;
+}
+
+/* 'gain dB', 'eq freq dB Q' or 'limit dB'. Also 'key=a:b:c' form of
+   DSPCHAIN. Returns -1 if line is not understood */
+static inline int dspchain_command(dspchain *chain, const char *line) {
+    char l_strKey[16];
+    double l_dValue[3];
+    int l_iGot = 0;
+
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+
+    l_iGot = sscanf(line, "%15[a-z]%*[ =]%lf%*[ :]%lf%*[ :]%lf", l_strKey, &l_dValue[0], &l_dValue[1], &l_dValue[2]);
+
+    if (l_iGot >= 2 && !strcmp(l_strKey, "gain")) {
+        return dspchain_post(chain, DSPCHAIN_GAIN, l_dValue[0]);
+    }
+
+    if (l_iGot >= 2 && !strcmp(l_strKey, "limit")) {
+        return dspchain_post(chain, DSPCHAIN_LIMIT, l_dValue[0]);
+    }
+
+    if (l_iGot >= 2 && !strcmp(l_strKey, "eq")) {
+        if (dspchain_post(chain, DSPCHAIN_EQ_FREQ, l_dValue[0]) < 0
+                || (l_iGot >= 3 && dspchain_post(chain, DSPCHAIN_EQ_GAIN, l_dValue[1]) < 0)
+                || (l_iGot >= 4 && dspchain_post(chain, DSPCHAIN_EQ_Q, l_dValue[2]) < 0)) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Read commands from 'fd' (stdin) when it is readable. Control side.
+   Returns -1 at end of input so caller stops watching it */
+static inline int dspchain_read_commands(dspchain *chain, int fd) {
+    char l_strBuf[256];
+    ssize_t l_lGot = read(fd, l_strBuf, sizeof(l_strBuf));
+    ssize_t i = 0;
+
+    if (l_lGot < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+
+    if (l_lGot == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < l_lGot; i++) {
+        if (l_strBuf[i] != '\n') {
+            if (chain->line_len < sizeof(chain->line) - 1) {
+                chain->line[chain->line_len++] = l_strBuf[i];
+            }
+
+            continue;
+        }
+
+        chain->line[chain->line_len] = '\0';
+
+        if (chain->line_len > 0 && dspchain_command(chain, chain->line) < 0) {
+            fprintf(stderr, "dspchain: '%s'? Use 'gain dB', 'eq freq dB Q' or 'limit dB'\n", chain->line);
+        }
+
+        chain->line_len = 0;
+    }
+
+    return 0;
+}
+
+/* Take messages and move parameters towards them. Audio thread */
+static inline void dspchain_update(dspchain *chain, long frames, int jump) {
+    dspchain_msg l_SMsg;
+    double l_dStep = jump ? 1.0 : 1.0 - exp(-(double)frames / (DSPCHAIN_SMOOTH_SECONDS * chain->samplerate));
+    double l_dOld = 0.0;
+    int i = 0;
+
+    while (ringbuffer_read_space(&chain->queue) >= sizeof(dspchain_msg)) {
+        ringbuffer_read(&chain->queue, &l_SMsg, sizeof(dspchain_msg));
+        chain->target[l_SMsg.param] = dspchain_clamp(chain, l_SMsg.param, l_SMsg.value);
+        chain->messages++;
+    }
+
+    for (i = 0; i < DSPCHAIN_PARAMS; i++) {
+        l_dOld = chain->current[i];
+
+        /* Frequency moves in octaves, others in dB */
+        if (i == DSPCHAIN_EQ_FREQ && !jump) {
+            chain->current[i] = exp(log(l_dOld) + (log(chain->target[i]) - log(l_dOld)) * l_dStep);
+        } else {
+            chain->current[i] += (chain->target[i] - chain->current[i]) * l_dStep;
+        }
+
+        if (fabs(chain->target[i] - chain->current[i]) < 1e-4 * (i == DSPCHAIN_EQ_FREQ ? chain->target[i] : 1.0)) {
+            chain->current[i] = chain->target[i];
+        }
+
+        if (i >= DSPCHAIN_EQ_FREQ && i <= DSPCHAIN_EQ_Q && chain->current[i] != l_dOld) {
+            chain->eq_dirty = 1;
+        }
+    }
+
+    if (chain->eq_dirty || jump) {
+        dspchain_eq_coefficients(chain);
+        chain->eq_dirty = 0;
+    }
+
+    chain->ceiling = dspchain_db_to_gain(chain->current[DSPCHAIN_LIMIT]);
+}
+
+static inline void dspchain_free(dspchain *chain) {
+    free(chain->delay);
+    free(chain->min_index);
+    free(chain->min_value);
+    free(chain->box);
+    chain->delay = NULL;
+    chain->min_index = NULL;
+    chain->min_value = NULL;
+    chain->box = NULL;
+    ringbuffer_free(&chain->queue);
+}
+
+/* Allocate everything and set parameters from 'spec' (DSPCHAIN). Spec
+   NULL or empty gives defaults */
+static inline int dspchain_open(dspchain *chain, int samplerate, int channels, const char *spec) {
+    char l_strSpec[256];
+    char *l_strItem = NULL;
+    char *l_strSave = NULL;
+    double l_dLookaheadMs = 5.0;
+    long i = 0;
+
+    memset(chain, 0x00, sizeof(dspchain));
+
+    if (channels < 1 || channels > DSPCHAIN_MAX_CHANNELS || samplerate < 8000) {
+        fprintf(stderr, "dspchain_open: %d channels at %d Hz not supported\n", channels, samplerate);
+        return -1;
+    }
+
+    chain->samplerate = samplerate;
+    chain->channels = channels;
+    chain->groups = (channels + 3) / 4;
+
+    if (ringbuffer_init(&chain->queue, DSPCHAIN_QUEUE * sizeof(dspchain_msg)) < 0) {
+        return -1;
+    }
+
+    chain->target[DSPCHAIN_GAIN] = 0.0;
+    chain->target[DSPCHAIN_EQ_FREQ] = 1000.0;
+    chain->target[DSPCHAIN_EQ_GAIN] = 0.0;
+    chain->target[DSPCHAIN_EQ_Q] = 0.707;
+    chain->target[DSPCHAIN_LIMIT] = -0.3;
+
+    /* Spec goes through same queue. Drained below so it starts in place */
+    snprintf(l_strSpec, sizeof(l_strSpec), "%s", spec != NULL ? spec : "");
+
+    for (l_strItem = strtok_r(l_strSpec, ",", &l_strSave); l_strItem != NULL; l_strItem = strtok_r(NULL, ",", &l_strSave)) {
+        if (!strncmp(l_strItem, "lookahead=", 10)) {
+            l_dLookaheadMs = atof(l_strItem + 10);
+        } else if (dspchain_command(chain, l_strItem) < 0) {
+            fprintf(stderr, "dspchain_open: Unknown '%s' in DSPCHAIN\n", l_strItem);
+            dspchain_free(chain);
+            return -1;
+        }
+    }
+
+    l_dLookaheadMs = l_dLookaheadMs < 0.1 ? 0.1 : (l_dLookaheadMs > DSPCHAIN_MAX_LOOKAHEAD_MS ? DSPCHAIN_MAX_LOOKAHEAD_MS : l_dLookaheadMs);
+    chain->lookahead = (long)(l_dLookaheadMs * samplerate / 1000.0);
+    chain->lookahead = chain->lookahead < 1 ? 1 : chain->lookahead;
+
+    chain->delay = (levels_v4 *)calloc(chain->lookahead * chain->groups, sizeof(levels_v4));
+    chain->min_index = (uint64_t *)calloc(chain->lookahead + 1, sizeof(uint64_t));
+    chain->min_value = (float *)calloc(chain->lookahead + 1, sizeof(float));
+    chain->box = (float *)malloc(chain->lookahead * sizeof(float));
+
+    if (chain->delay == NULL || chain->min_index == NULL || chain->min_value == NULL || chain->box == NULL) {
+        dspchain_free(chain);
+        return -1;
+    }
+
+    for (i = 0; i < chain->lookahead; i++) {
+        chain->box[i] = 1.0f;
+    }
+
+    chain->box_sum = chain->lookahead;
+    chain->release_gain = 1.0f;
+    chain->release = 1.0f - expf(-1.0f / (DSPCHAIN_RELEASE_SECONDS * samplerate));
+    chain->min_gain = 1.0f;
+
+    /* Start with parameters of spec, not smoothing from zero */
+    dspchain_update(chain, 0, 1);
+    chain->gain = dspchain_db_to_gain(chain->current[DSPCHAIN_GAIN]);
+    return 0;
+}
+
+/* Channels 4 * group ... of frame as vector. Missing lanes are zero */
+static inline levels_v4 dspchain_load(const dspchain *chain, const float *frame, int group) {
+    levels_v4 l_v4Value = { 0.0f, 0.0f, 0.0f, 0.0f };
+    int l_iLanes = chain->channels - group * 4;
+
+    memcpy(&l_v4Value, frame + group * 4, (l_iLanes < 4 ? l_iLanes : 4) * sizeof(float));
+    return l_v4Value;
+}
+
+static inline void dspchain_store(const dspchain *chain, float *frame, int group, levels_v4 value) {
+    int l_iLanes = chain->channels - group * 4;
+
+    memcpy(frame + group * 4, &value, (l_iLanes < 4 ? l_iLanes : 4) * sizeof(float));
+}
+
+/* Limiter gain for frame whose highest peak is 'peak' */
+static inline float dspchain_limiter_gain(dspchain *chain, float peak) {
+    float l_fNeed = peak > chain->ceiling ? chain->ceiling / peak : 1.0f;
+    long l_lWindow = chain->lookahead + 1;
+    long l_lBack = 0;
+
+    /* Sliding minimum over lookahead + 1 frames. Expired head goes first
+       so push never lands on it when all slots are in use */
+    if (chain->min_count > 0 && chain->min_index[chain->min_head] + l_lWindow <= chain->frame) {
+        chain->min_head = (chain->min_head + 1) % l_lWindow;
+        chain->min_count--;
+    }
+
+    while (chain->min_count > 0) {
+        l_lBack = (chain->min_head + chain->min_count - 1) % l_lWindow;
+
+        if (chain->min_value[l_lBack] < l_fNeed) {
+            break;
+        }
+
+        chain->min_count--;
+    }
+
+    l_lBack = (chain->min_head + chain->min_count) % l_lWindow;
+    chain->min_index[l_lBack] = chain->frame;
+    chain->min_value[l_lBack] = l_fNeed;
+    chain->min_count++;
+
+    /* Release never goes over minimum so peak is still covered */
+    chain->release_gain += (1.0f - chain->release_gain) * chain->release;
+
+    if (chain->min_value[chain->min_head] < chain->release_gain) {
+        chain->release_gain = chain->min_value[chain->min_head];
+    }
+
+    /* Every gain in average covers peak leaving delay now */
+    chain->box_sum += chain->release_gain - chain->box[chain->box_pos];
+    chain->box[chain->box_pos] = chain->release_gain;
+    chain->box_pos = chain->box_pos + 1 < chain->lookahead ? chain->box_pos + 1 : 0;
+    chain->frame++;
+
+    return (float)(chain->box_sum / chain->lookahead);
+}
+
+/* Run all stages in place on 'frames' interleaved frames */
+static inline void dspchain_run(dspchain *chain, float *pcm, long frames) {
+    levels_v4 l_v4In[DSPCHAIN_GROUPS];
+    levels_v4 l_v4Peak;
+    levels_v4 l_v4Abs;
+    levels_v4 l_v4Out;
+    levels_v4 *l_v4Delay = NULL;
+    float l_fGain = chain->gain;
+    float l_fGainEnd = dspchain_db_to_gain(chain->current[DSPCHAIN_GAIN]);
+    float l_fStep = frames > 0 ? (l_fGainEnd - l_fGain) / frames : 0.0f;
+    float l_fPeak = 0.0f;
+    float l_fLimit = 0.0f;
+    float *l_fFrame = NULL;
+    long i = 0;
+    int g = 0;
+
+    for (i = 0; i < frames; i++) {
+        l_fFrame = pcm + i * chain->channels;
+        l_fGain += l_fStep;
+        l_v4Peak = (levels_v4){ 0.0f, 0.0f, 0.0f, 0.0f };
+
+        for (g = 0; g < chain->groups; g++) {
+            l_v4In[g] = dspchain_load(chain, l_fFrame, g) * l_fGain;
+
+            /* Transposed direct form II */
+            l_v4Out = chain->b0 * l_v4In[g] + chain->z1[g];
+            chain->z1[g] = chain->b1 * l_v4In[g] - chain->a1 * l_v4Out + chain->z2[g];
+            chain->z2[g] = chain->b2 * l_v4In[g] - chain->a2 * l_v4Out;
+            l_v4In[g] = l_v4Out;
+
+            l_v4Abs = levels_select(l_v4Out < 0.0f, -l_v4Out, l_v4Out);
+            l_v4Peak = levels_vmax(l_v4Peak, l_v4Abs);
+        }
+
+        l_fPeak = l_v4Peak[0] > l_v4Peak[1] ? l_v4Peak[0] : l_v4Peak[1];
+        l_fPeak = l_v4Peak[2] > l_fPeak ? l_v4Peak[2] : l_fPeak;
+        l_fPeak = l_v4Peak[3] > l_fPeak ? l_v4Peak[3] : l_fPeak;
+        l_fLimit = dspchain_limiter_gain(chain, l_fPeak);
+        chain->min_gain = l_fLimit < chain->min_gain ? l_fLimit : chain->min_gain;
+
+        /* Out comes frame from lookahead ago */
+        l_v4Delay = chain->delay + chain->delay_pos * chain->groups;
+
+        for (g = 0; g < chain->groups; g++) {
+            dspchain_store(chain, l_fFrame, g, l_v4Delay[g] * l_fLimit);
+            l_v4Delay[g] = l_v4In[g];
+        }
+
+        chain->delay_pos = chain->delay_pos + 1 < chain->lookahead ? chain->delay_pos + 1 : 0;
+    }
+
+    chain->gain = l_fGainEnd;
+}
+
+/* Audio thread. 'pcm' has room for 'capacity' frames and 'got' of them
+   are new samples (less at end of file). Returns how many frames of pcm
+   are real audio: at end it is more than 'got' while delay empties */
+static inline long dspchain_process(dspchain *chain, float *pcm, long got, long capacity) {
+    long l_lValid = 0;
+
+    got = got < 0 ? 0 : got;
+
+    if (got < capacity) {
+        memset(pcm + got * chain->channels, 0x00, (capacity - got) * chain->channels * sizeof(float));
+    }
+
+    dspchain_update(chain, capacity, 0);
+    dspchain_run(chain, pcm, capacity);
+
+    l_lValid = got + chain->pending < capacity ? got + chain->pending : capacity;
+    chain->pending += got - l_lValid;
+    return l_lValid;
+}
+
+/* Run first frames of stream into delay line before playback. They come
+   out with first dspchain_process() so output is not late. Players with
+   other stages before chain run them first (see dspchain_prime_sndfile()) */
+static inline void dspchain_prime(dspchain *chain, float *pcm, long frames) {
+    dspchain_update(chain, frames, 0);
+    dspchain_run(chain, pcm, frames);
+    chain->pending += frames;
+}
+
+/* Fill delay line with first frames of file before playback so output
+   is not late. Gain is loudness gain player applies before chain */
+static inline void dspchain_prime_sndfile(dspchain *chain, SNDFILE *file, float gain) {
+    float l_fPrime[1024];
+    long l_lWant = 1024 / chain->channels;
+    long l_lLeft = chain->lookahead;
+    long l_lGot = 0;
+    long i = 0;
+
+    while (l_lLeft > 0) {
+        l_lGot = sf_readf_float(file, l_fPrime, l_lLeft < l_lWant ? l_lLeft : l_lWant);
+
+        if (l_lGot <= 0) {
+            break;
+        }
+
+        for (i = 0; i < l_lGot * chain->channels; i++) {
+            l_fPrime[i] *= gain;
+        }
+
+        dspchain_prime(chain, l_fPrime, l_lGot);
+        l_lLeft -= l_lGot;
+    }
+}
+
+static inline void dspchain_print(const dspchain *chain) {
+    printf("dspchain: %d channels, look-ahead %ld frames (%.1f ms). Commands from stdin: 'gain dB', 'eq freq dB Q', 'limit dB'\n",
+           chain->channels, chain->lookahead, chain->lookahead * 1000.0 / chain->samplerate);
+}
+
+static inline void dspchain_print_stats(const dspchain *chain) {
+    printf("dspchain: gain %.1f dB, eq %.0f Hz %.1f dB Q %.2f, ceiling %.1f dBFS, deepest limiting %.1f dB, %ld messages\n",
+           chain->current[DSPCHAIN_GAIN], chain->current[DSPCHAIN_EQ_FREQ], chain->current[DSPCHAIN_EQ_GAIN],
+           chain->current[DSPCHAIN_EQ_Q], chain->current[DSPCHAIN_LIMIT], 20.0 * log10(chain->min_gain), chain->messages);
+}
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Zero latency FIR convolution for long room correction filters.
+ *
+ * Filter of any length (64k taps and more) is cut to partitions of P
+ * frames (default 256):
+ *
+ *   head   first P taps run in time domain every sample (vector dot
+ *          product), so output does not wait for a block
+ *   tail   rest of taps as K = (taps - P) / P uniform partitions in
+ *          frequency domain (overlap-save, FFT size 2P). Spectrum of every
+ *          input block goes to frequency domain delay line and output is
+ *          sum of K complex products. Tail taps start at P so block
+ *          computed when input block is full is just in time for next one
+ *
+ * Spectra are kept as separate real and imaginary arrays so complex
+ * multiply-accumulate over bins is four bins per vector operation (GCC
+ * vector extensions like levels.h). FFT is in realfft.h.
+ *
+ * fftconv_open() reads only header of filter file. Taps are read and
+ * their spectra made on background thread while playback starts. Until
+ * then audio passes through dry, input spectra still go to delay line so
+ * filter is right from first sample it is on and one block crossfade
+ * takes it in. Filter file has one channel for all or one per channel.
+ *
+ * Players enable it with FIRFILTER in environment:
+ *
+ *   FIRFILTER="room.wav:256" ./libsndfile_port_play some.wav
+ *
+ * Header only: just include it. Needs C11 atomics, pthreads, libsndfile
+ * and -lm.
+ */
+
+#ifndef FFTCONV_H
+#define FFTCONV_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sndfile.h>
+
+#include "levels.h"
+#include "realfft.h"
+
+#define FFTCONV_MAX_CHANNELS 16
+#define FFTCONV_DEFAULT_PARTITION 256
+#define FFTCONV_MIN_PARTITION 16
+#define FFTCONV_MAX_PARTITION 8192
+/* 2^22 taps is over 90 seconds at 44.1 kHz */
+#define FFTCONV_MAX_TAPS (1L << 22)
+
+typedef struct fftconv_channel {
+    /* Input twice so last P frames are always in one piece */
+    float *history;
+    /* Previous and current block for overlap-save */
+    float *input;
+    /* Spectra of last K input blocks */
+    float *fdl_re;
+    float *fdl_im;
+    /* Tail output for block now playing */
+    float *tail;
+} fftconv_channel;
+
+typedef struct fftconv {
+    char path[1024];
+    int samplerate;
+    int channels;
+    int filter_channels;
+    long partition;
+    long taps;
+    long partitions;
+    /* Bins of spectrum rounded up to whole vectors */
+    long bins;
+    realfft fft;
+    /* Filter. Written by loader before 'ready' */
+    float *head;
+    float *filter_re;
+    float *filter_im;
+    fftconv_channel channel[FFTCONV_MAX_CHANNELS];
+    /* Audio thread scratch */
+    float *scratch;
+    float *acc_re;
+    float *acc_im;
+    long pos;
+    long fdl_pos;
+    int active;
+    int fading;
+    pthread_t loader;
+    int loader_started;
+    atomic_int ready;
+    atomic_int failed;
+    /* Statistics */
+    double load_ms;
+    long blocks;
+} fftconv;
+
+/* Is FIRFILTER set in environment */
+static inline int fftconv_wanted(void) {
+    return getenv("FIRFILTER") != NULL;
+}
+
+static inline double fftconv_now(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+static inline levels_v4 fftconv_load(const float *pcm) {
+    levels_v4 l_v4Value;
+    memcpy(&l_v4Value, pcm, sizeof(levels_v4));
+    return l_v4Value;
+}
+
+/* acc += x * h over 'bins' (multiple of 4) complex bins */
+static inline void fftconv_cmac(float *acc_re, float *acc_im, const float *x_re, const float *x_im,
+                                const float *h_re, const float *h_im, long bins) {
+    levels_v4 l_v4Xr, l_v4Xi, l_v4Hr, l_v4Hi, l_v4Ar, l_v4Ai;
+    long i = 0;
+
+    for (i = 0; i < bins; i += 4) {
+        l_v4Xr = fftconv_load(x_re + i);
+        l_v4Xi = fftconv_load(x_im + i);
+        l_v4Hr = fftconv_load(h_re + i);
+        l_v4Hi = fftconv_load(h_im + i);
+        l_v4Ar = fftconv_load(acc_re + i) + l_v4Xr * l_v4Hr - l_v4Xi * l_v4Hi;
+        l_v4Ai = fftconv_load(acc_im + i) + l_v4Xr * l_v4Hi + l_v4Xi * l_v4Hr;
+        memcpy(acc_re + i, &l_v4Ar, sizeof(levels_v4));
+        memcpy(acc_im + i, &l_v4Ai, sizeof(levels_v4));
+    }
+}
+
+/* Dot product of 'count' (multiple of 4) floats */
+static inline float fftconv_dot(const float *a, const float *b, long count) {
+    levels_v4 l_v4Sum0 = { 0.0f, 0.0f, 0.0f, 0.0f };
+    levels_v4 l_v4Sum1 = { 0.0f, 0.0f, 0.0f, 0.0f };
+    long i = 0;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        l_v4Sum0 += fftconv_load(a + i) * fftconv_load(b + i);
+        l_v4Sum1 += fftconv_load(a + i + 4) * fftconv_load(b + i + 4);
+    }
+
+    for (; i < count; i += 4) {
+        l_v4Sum0 += fftconv_load(a + i) * fftconv_load(b + i);
+    }
+
+    l_v4Sum0 += l_v4Sum1;
+    return (l_v4Sum0[0] + l_v4Sum0[1]) + (l_v4Sum0[2] + l_v4Sum0[3]);
+}
+
+static inline void fftconv_free(fftconv *conv) {
+    int i = 0;
+
+    for (i = 0; i < FFTCONV_MAX_CHANNELS; i++) {
+        free(conv->channel[i].history);
+        free(conv->channel[i].input);
+        free(conv->channel[i].fdl_re);
+        free(conv->channel[i].fdl_im);
+        free(conv->channel[i].tail);
+    }
+
+    free(conv->head);
+    free(conv->filter_re);
+    free(conv->filter_im);
+    free(conv->scratch);
+    free(conv->acc_re);
+    free(conv->acc_im);
+    realfft_free(&conv->fft);
+    memset(conv->channel, 0x00, sizeof(conv->channel));
+    conv->head = conv->filter_re = conv->filter_im = NULL;
+    conv->scratch = conv->acc_re = conv->acc_im = NULL;
+}
+
+/* Allocate everything for 'taps' long filter with 'filter_channels'.
+   Filter is not in use before fftconv_prepare() */
+static inline int fftconv_init(fftconv *conv, int channels, long partition, long taps, int filter_channels) {
+    long l_lFilterBins = 0;
+    long l_lSize = FFTCONV_MIN_PARTITION;
+    int i = 0;
+
+    memset(conv, 0x00, sizeof(fftconv));
+
+    while (l_lSize < partition && l_lSize < FFTCONV_MAX_PARTITION) {
+        l_lSize <<= 1;
+    }
+
+    if (channels < 1 || channels > FFTCONV_MAX_CHANNELS || taps < 1 || taps > FFTCONV_MAX_TAPS
+            || (filter_channels != 1 && filter_channels != channels)) {
+        return -1;
+    }
+
+    conv->channels = channels;
+    conv->filter_channels = filter_channels;
+    conv->partition = l_lSize;
+    conv->taps = taps;
+    conv->partitions = taps > l_lSize ? (taps - l_lSize + l_lSize - 1) / l_lSize : 0;
+    conv->bins = (l_lSize + 1 + 3) & ~3L;
+    l_lFilterBins = conv->partitions * conv->bins * filter_channels;
+    atomic_init(&conv->ready, 0);
+    atomic_init(&conv->failed, 0);
+
+    if (realfft_init(&conv->fft, l_lSize) < 0) {
+        return -1;
+    }
+
+    conv->head = (float *)calloc(l_lSize * filter_channels, sizeof(float));
+    conv->filter_re = (float *)calloc(l_lFilterBins + 4, sizeof(float));
+    conv->filter_im = (float *)calloc(l_lFilterBins + 4, sizeof(float));
+    conv->scratch = (float *)calloc(l_lSize * 4, sizeof(float));
+    conv->acc_re = (float *)calloc(conv->bins, sizeof(float));
+    conv->acc_im = (float *)calloc(conv->bins, sizeof(float));
+
+    if (conv->head == NULL || conv->filter_re == NULL || conv->filter_im == NULL || conv->scratch == NULL
+            || conv->acc_re == NULL || conv->acc_im == NULL) {
+        fftconv_free(conv);
+        return -1;
+    }
+
+    for (i = 0; i < channels; i++) {
+        conv->channel[i].history = (float *)calloc(l_lSize * 2, sizeof(float));
+        conv->channel[i].input = (float *)calloc(l_lSize * 2, sizeof(float));
+        conv->channel[i].fdl_re = (float *)calloc(conv->partitions * conv->bins + 4, sizeof(float));
+        conv->channel[i].fdl_im = (float *)calloc(conv->partitions * conv->bins + 4, sizeof(float));
+        conv->channel[i].tail = (float *)calloc(l_lSize, sizeof(float));
+
+        if (conv->channel[i].history == NULL || conv->channel[i].input == NULL || conv->channel[i].fdl_re == NULL
+                || conv->channel[i].fdl_im == NULL || conv->channel[i].tail == NULL) {
+            fftconv_free(conv);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Make head and partition spectra from interleaved taps and switch filter
+   on. Can be run on other thread while fftconv_process() runs */
+static inline int fftconv_prepare(fftconv *conv, const float *taps) {
+    long P = conv->partition;
+    float *l_fBlock = (float *)calloc(P * 2, sizeof(float));
+    float *l_fScratch = (float *)calloc(P * 2, sizeof(float));
+    float *l_fRe = NULL;
+    float *l_fIm = NULL;
+    long l_lFirst = 0;
+    long k = 0;
+    long i = 0;
+    int c = 0;
+
+    if (l_fBlock == NULL || l_fScratch == NULL) {
+        free(l_fBlock);
+        free(l_fScratch);
+        return -1;
+    }
+
+    for (c = 0; c < conv->filter_channels; c++) {
+        /* Head backwards so dot product runs over history forwards */
+        for (i = 0; i < P && i < conv->taps; i++) {
+            conv->head[c * P + P - 1 - i] = taps[i * conv->filter_channels + c];
+        }
+
+        for (k = 0; k < conv->partitions; k++) {
+            l_fRe = conv->filter_re + (c * conv->partitions + k) * conv->bins;
+            l_fIm = conv->filter_im + (c * conv->partitions + k) * conv->bins;
+            l_lFirst = (k + 1) * P;
+            memset(l_fBlock, 0x00, P * 2 * sizeof(float));
+
+            /* Inverse FFT scale is folded in here */
+            for (i = 0; i < P && l_lFirst + i < conv->taps; i++) {
+                l_fBlock[i] = taps[(l_lFirst + i) * conv->filter_channels + c] / P;
+            }
+
+            realfft_forward(&conv->fft, l_fBlock, l_fRe, l_fIm, l_fScratch);
+        }
+    }
+
+    free(l_fBlock);
+    free(l_fScratch);
+    atomic_store_explicit(&conv->ready, 1, memory_order_release);
+    return 0;
+}
+
+/* Spectrum of last input block to delay line and tail for next block */
+static inline void fftconv_block(fftconv *conv) {
+    fftconv_channel *l_SChannel = NULL;
+    long P = conv->partition;
+    long l_lSlot = 0;
+    long k = 0;
+    int l_iFilter = 0;
+    int c = 0;
+
+    if (!conv->active && atomic_load_explicit(&conv->ready, memory_order_acquire)) {
+        conv->active = 1;
+        conv->fading = 1;
+    }
+
+    conv->blocks++;
+
+    for (c = 0; c < conv->channels; c++) {
+        l_SChannel = &conv->channel[c];
+        l_iFilter = conv->filter_channels == 1 ? 0 : c;
+
+        if (conv->partitions > 0) {
+            realfft_forward(&conv->fft, l_SChannel->input, l_SChannel->fdl_re + conv->fdl_pos * conv->bins,
+                         l_SChannel->fdl_im + conv->fdl_pos * conv->bins, conv->scratch);
+
+            if (conv->active) {
+                memset(conv->acc_re, 0x00, conv->bins * sizeof(float));
+                memset(conv->acc_im, 0x00, conv->bins * sizeof(float));
+
+                /* Newest input with first partition, older with later ones */
+                for (k = 0; k < conv->partitions; k++) {
+                    l_lSlot = (conv->fdl_pos + conv->partitions - k) % conv->partitions;
+                    fftconv_cmac(conv->acc_re, conv->acc_im,
+                                 l_SChannel->fdl_re + l_lSlot * conv->bins, l_SChannel->fdl_im + l_lSlot * conv->bins,
+                                 conv->filter_re + (l_iFilter * conv->partitions + k) * conv->bins,
+                                 conv->filter_im + (l_iFilter * conv->partitions + k) * conv->bins, conv->bins);
+                }
+
+                /* Second half of overlap-save result is valid */
+                realfft_inverse(&conv->fft, conv->acc_re, conv->acc_im, conv->scratch + P * 2, conv->scratch);
+                memcpy(l_SChannel->tail, conv->scratch + P * 3, P * sizeof(float));
+            }
+        }
+
+        memcpy(l_SChannel->input, l_SChannel->input + P, P * sizeof(float));
+    }
+
+    if (conv->partitions > 0) {
+        conv->fdl_pos = (conv->fdl_pos + 1) % conv->partitions;
+    }
+}
+
+/* Filter interleaved frames in place. Audio thread. No latency, no
+   allocation, no locks */
+static inline void fftconv_process(fftconv *conv, float *pcm, long frames) {
+    fftconv_channel *l_SChannel = NULL;
+    long P = conv->partition;
+    float l_fDry = 0.0f;
+    float l_fWet = 0.0f;
+    float l_fFade = 0.0f;
+    long i = 0;
+    int l_iFilter = 0;
+    int c = 0;
+
+    /* Filter ready before first frame needs no crossfade */
+    if (!conv->active && conv->blocks == 0 && conv->pos == 0 && atomic_load_explicit(&conv->ready, memory_order_acquire)) {
+        conv->active = 1;
+    }
+
+    for (i = 0; i < frames; i++) {
+        l_fFade = conv->fading ? (float)(conv->pos + 1) / P : 1.0f;
+
+        for (c = 0; c < conv->channels; c++) {
+            l_SChannel = &conv->channel[c];
+            l_fDry = pcm[i * conv->channels + c];
+            l_SChannel->history[conv->pos] = l_fDry;
+            l_SChannel->history[conv->pos + P] = l_fDry;
+            l_SChannel->input[P + conv->pos] = l_fDry;
+
+            if (conv->active) {
+                l_iFilter = conv->filter_channels == 1 ? 0 : c;
+                /* History from pos + 1 is last P frames, oldest first */
+                l_fWet = fftconv_dot(conv->head + l_iFilter * P, l_SChannel->history + conv->pos + 1, P) + l_SChannel->tail[conv->pos];
+                pcm[i * conv->channels + c] = l_fDry + (l_fWet - l_fDry) * l_fFade;
+            }
+        }
+
+        if (++conv->pos == P) {
+            conv->pos = 0;
+            conv->fading = 0;
+            fftconv_block(conv);
+        }
+    }
+}
+
+static void *fftconv_loader_thread(void *userdata) {
+    fftconv *l_SConv = (fftconv *)userdata;
+    double l_dStart = fftconv_now();
+    SF_INFO l_SInfo;
+    SNDFILE *l_SFile = NULL;
+    float *l_fTaps = NULL;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if ((l_SFile = sf_open(l_SConv->path, SFM_READ, &l_SInfo)) == NULL
+            || (l_fTaps = (float *)malloc(l_SConv->taps * l_SConv->filter_channels * sizeof(float))) == NULL
+            || sf_readf_float(l_SFile, l_fTaps, l_SConv->taps) != l_SConv->taps
+            || fftconv_prepare(l_SConv, l_fTaps) < 0) {
+        atomic_store(&l_SConv->failed, 1);
+    }
+
+    if (l_SFile != NULL) {
+        sf_close(l_SFile);
+    }
+
+    free(l_fTaps);
+    l_SConv->load_ms = (fftconv_now() - l_dStart) * 1000.0;
+    return NULL;
+}
+
+/* 'spec' is 'filter.wav[:partition]'. Reads header, allocates and starts
+   loader thread. Until it is done audio passes through */
+static inline int fftconv_open(fftconv *conv, int samplerate, int channels, const char *spec) {
+    char l_strPath[1024];
+    const char *l_strColon = strrchr(spec, ':');
+    long l_lPartition = FFTCONV_DEFAULT_PARTITION;
+    SF_INFO l_SInfo;
+    SNDFILE *l_SFile = NULL;
+
+    snprintf(l_strPath, sizeof(l_strPath), "%s", spec);
+
+    if (l_strColon != NULL && atol(l_strColon + 1) > 0) {
+        l_lPartition = atol(l_strColon + 1);
+        l_strPath[l_strColon - spec] = '\0';
+    }
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if ((l_SFile = sf_open(l_strPath, SFM_READ, &l_SInfo)) == NULL) {
+        fprintf(stderr, "fftconv_open: Can't open filter %s\n", l_strPath);
+        return -1;
+    }
+
+    sf_close(l_SFile);
+
+    if (l_SInfo.samplerate != samplerate) {
+        fprintf(stderr, "fftconv_open: Filter is for %d Hz but audio is %d Hz\n", l_SInfo.samplerate, samplerate);
+    }
+
+    if (fftconv_init(conv, channels, l_lPartition, l_SInfo.frames, l_SInfo.channels) < 0) {
+        fprintf(stderr, "fftconv_open: Filter with %d channels and %ld taps can't be used for %d channels\n",
+                l_SInfo.channels, (long)l_SInfo.frames, channels);
+        return -1;
+    }
+
+    conv->samplerate = samplerate;
+    snprintf(conv->path, sizeof(conv->path), "%s", l_strPath);
+
+    if (pthread_create(&conv->loader, NULL, fftconv_loader_thread, conv) != 0) {
+        fftconv_free(conv);
+        return -1;
+    }
+
+    conv->loader_started = 1;
+    return 0;
+}
+
+static inline void fftconv_close(fftconv *conv) {
+    if (conv->loader_started) {
+        pthread_join(conv->loader, NULL);
+        conv->loader_started = 0;
+    }
+
+    fftconv_free(conv);
+}
+
+static inline void fftconv_print(const fftconv *conv) {
+    printf("fftconv: %s %ld taps, %d filter channels, head %ld + %ld partitions of %ld frames\n",
+           conv->path, conv->taps, conv->filter_channels, conv->partition, conv->partitions, conv->partition);
+}
+
+static inline void fftconv_print_stats(const fftconv *conv) {
+    printf("fftconv: %ld blocks, filter %s in %.1f ms\n", conv->blocks,
+           atomic_load(&conv->failed) ? "failed" : (conv->active ? "was on" : "was not ready"), conv->load_ms);
+}
+
+#endif
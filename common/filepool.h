@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * File list and worker pool for tools that do same thing to many files.
+ *
+ * Files come from command line or one per line from stream (find ... |
+ * tool -). Workers take next file with one atomic add so there is no
+ * queue to lock and slow file does not hold others back. Callback
+ * returns negative on failure and failures are counted. If no worker
+ * thread can be started files are done in calling thread.
+ *
+ * Header only: just include it. Needs C11 atomics and pthreads.
+ */
+
+#ifndef FILEPOOL_H
+#define FILEPOOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FILEPOOL_MAX_WORKERS 64
+#define FILEPOOL_MAX_LINE 4096
+
+typedef int (*filepool_cb)(const char *path);
+
+typedef struct filepool {
+    char **files;
+    long count;
+    /* Names were read from list and are freed by filepool_free() */
+    int owned;
+    filepool_cb cb;
+    atomic_long next;
+    atomic_long failed;
+    /* Statistics of last filepool_run() */
+    long workers;
+    double seconds;
+} filepool;
+
+/* Use names from command line as they are */
+static inline void filepool_args(filepool *pool, char **names, long count) {
+    memset(pool, 0x00, sizeof(filepool));
+    pool->files = names;
+    pool->count = count;
+}
+
+/* File names one per line, empty lines skipped. Returns -1 if out of memory */
+static inline int filepool_read_list(filepool *pool, FILE *list) {
+    char l_strLine[FILEPOOL_MAX_LINE];
+    char **l_strGrow = NULL;
+    long l_lCapacity = 0;
+    size_t l_lLen = 0;
+
+    memset(pool, 0x00, sizeof(filepool));
+    pool->owned = 1;
+
+    while (fgets(l_strLine, sizeof(l_strLine), list)) {
+        l_lLen = strlen(l_strLine);
+
+        while (l_lLen > 0 && (l_strLine[l_lLen - 1] == '\n' || l_strLine[l_lLen - 1] == '\r')) {
+            l_strLine[--l_lLen] = '\0';
+        }
+
+        if (l_lLen == 0) {
+            continue;
+        }
+
+        if (pool->count == l_lCapacity) {
+            l_lCapacity = l_lCapacity ? l_lCapacity * 2 : 256;
+            l_strGrow = (char **)realloc(pool->files, l_lCapacity * sizeof(char *));
+
+            if (l_strGrow == NULL) {
+                return -1;
+            }
+
+            pool->files = l_strGrow;
+        }
+
+        if (!(pool->files[pool->count] = strdup(l_strLine))) {
+            return -1;
+        }
+
+        pool->count++;
+    }
+
+    return 0;
+}
+
+static void *filepool_worker(void *userdata) {
+    filepool *l_SPool = (filepool *)userdata;
+    long l_lIndex = 0;
+
+    while ((l_lIndex = atomic_fetch_add(&l_SPool->next, 1)) < l_SPool->count) {
+        if (l_SPool->cb(l_SPool->files[l_lIndex]) < 0) {
+            atomic_fetch_add(&l_SPool->failed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/* Call cb for every file with 'workers' threads (never more than files).
+   Returns number of failed files */
+static inline long filepool_run(filepool *pool, long workers, filepool_cb cb) {
+    pthread_t l_SThreads[FILEPOOL_MAX_WORKERS];
+    struct timespec l_SStart;
+    struct timespec l_SEnd;
+    long i = 0;
+
+    workers = workers < 1 ? 1 : workers;
+    workers = workers > FILEPOOL_MAX_WORKERS ? FILEPOOL_MAX_WORKERS : workers;
+    workers = workers > pool->count ? pool->count : workers;
+
+    pool->cb = cb;
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->failed, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &l_SStart);
+
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&l_SThreads[i], NULL, filepool_worker, pool) != 0) {
+            fprintf(stderr, "filepool_run: Can't start worker %ld\n", i);
+            workers = i;
+            break;
+        }
+    }
+
+    /* Do rest in calling thread if no worker could start */
+    if (workers == 0) {
+        filepool_worker(pool);
+    }
+
+    for (i = 0; i < workers; i++) {
+        pthread_join(l_SThreads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &l_SEnd);
+    pool->workers = workers;
+    pool->seconds = (l_SEnd.tv_sec - l_SStart.tv_sec) + (l_SEnd.tv_nsec - l_SStart.tv_nsec) / 1e9;
+
+    return (long)atomic_load(&pool->failed);
+}
+
+static inline void filepool_free(filepool *pool) {
+    long i = 0;
+
+    if (pool->owned) {
+        for (i = 0; i < pool->count; i++) {
+            free(pool->files[i]);
+        }
+
+        free(pool->files);
+    }
+
+    memset(pool, 0x00, sizeof(filepool));
+}
+
+#endif
@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Minimal FLAC frame encoder.
+ *
+ * libsndfile encodes FLAC through one stateful stream so frames can't be
+ * encoded in many threads with it. FLAC frames are independent of each
+ * other though, so this small encoder makes one complete frame from one
+ * block of samples and any number of them can run at the same time.
+ *
+ * Only 16-bit samples. Every channel is CONSTANT, VERBATIM or FIXED
+ * (order 0-4) subframe with partitioned Rice residual. Stereo is coded as
+ * left/right, left/side, right/side or mid/side whichever is smallest.
+ * That is roughly what 'flac -2' does. No LPC and no MD5 (it is zero which
+ * means unknown).
+ *
+ * Header only: just include it.
+ */
+
+#ifndef FLACENC_H
+#define FLACENC_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLACENC_MAX_CHANNELS 8
+#define FLACENC_BITS_PER_SAMPLE 16
+#define FLACENC_MAX_FIXED_ORDER 4
+#define FLACENC_MAX_PARTITION_ORDER 8
+#define FLACENC_MAX_RICE_PARAM 14
+/* 'fLaC' and STREAMINFO block */
+#define FLACENC_HEADER_BYTES 42
+
+#define FLACENC_CONSTANT 0
+#define FLACENC_VERBATIM 1
+#define FLACENC_FIXED 8
+
+/* Channel assignments of frame header */
+#define FLACENC_LEFT_SIDE 8
+#define FLACENC_RIGHT_SIDE 9
+#define FLACENC_MID_SIDE 10
+
+typedef struct flacenc_bits {
+    uint8_t *buf;
+    size_t len;
+    uint64_t acc;
+    int bits;
+} flacenc_bits;
+
+/* Plan for one subframe */
+typedef struct flacenc_subframe {
+    int type;
+    int order;
+    int bps;
+    int partition_order;
+    int params[1 << FLACENC_MAX_PARTITION_ORDER];
+    uint64_t bits;
+} flacenc_subframe;
+
+typedef struct flacenc {
+    int channels;
+    int blocksize;
+    /* Channels and mid and side for stereo */
+    int32_t *signal[FLACENC_MAX_CHANNELS + 2];
+    uint32_t *residual[FLACENC_MAX_CHANNELS + 2];
+    flacenc_subframe subframe[FLACENC_MAX_CHANNELS + 2];
+    uint64_t sums[FLACENC_MAX_PARTITION_ORDER + 1][1 << FLACENC_MAX_PARTITION_ORDER];
+    uint8_t *out;
+    size_t out_size;
+} flacenc;
+
+static inline void flacenc_put(flacenc_bits *bw, uint32_t value, int bits) {
+    if (bits == 0) {
+        return;
+    }
+
+    bw->acc = (bw->acc << bits) | (bits == 32 ? value : (value & ((1U << bits) - 1)));
+    bw->bits += bits;
+
+    while (bw->bits >= 8) {
+        bw->bits -= 8;
+        bw->buf[bw->len++] = (uint8_t)(bw->acc >> bw->bits);
+    }
+}
+
+static inline void flacenc_put_rice(flacenc_bits *bw, uint32_t value, int param) {
+    uint32_t l_iHigh = value >> param;
+
+    while (l_iHigh >= 31) {
+        flacenc_put(bw, 0, 31);
+        l_iHigh -= 31;
+    }
+
+    /* Unary quotient and stop bit in one go when it fits */
+    if (l_iHigh + 1 + param <= 32) {
+        flacenc_put(bw, (1U << param) | (value & ((1U << param) - 1)), l_iHigh + 1 + param);
+    } else {
+        flacenc_put(bw, 1, l_iHigh + 1);
+        flacenc_put(bw, value, param);
+    }
+}
+
+static inline void flacenc_align(flacenc_bits *bw) {
+    if (bw->bits > 0) {
+        flacenc_put(bw, 0, 8 - bw->bits);
+    }
+}
+
+static inline void flacenc_put_utf8(flacenc_bits *bw, uint32_t value) {
+    if (value < 0x80) {
+        flacenc_put(bw, value, 8);
+    } else if (value < 0x800) {
+        flacenc_put(bw, 0xC0 | (value >> 6), 8);
+        flacenc_put(bw, 0x80 | (value & 0x3F), 8);
+    } else if (value < 0x10000) {
+        flacenc_put(bw, 0xE0 | (value >> 12), 8);
+        flacenc_put(bw, 0x80 | ((value >> 6) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | (value & 0x3F), 8);
+    } else if (value < 0x200000) {
+        flacenc_put(bw, 0xF0 | (value >> 18), 8);
+        flacenc_put(bw, 0x80 | ((value >> 12) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | ((value >> 6) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | (value & 0x3F), 8);
+    } else if (value < 0x4000000) {
+        flacenc_put(bw, 0xF8 | (value >> 24), 8);
+        flacenc_put(bw, 0x80 | ((value >> 18) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | ((value >> 12) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | ((value >> 6) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | (value & 0x3F), 8);
+    } else {
+        flacenc_put(bw, 0xFC | (value >> 30), 8);
+        flacenc_put(bw, 0x80 | ((value >> 24) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | ((value >> 18) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | ((value >> 12) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | ((value >> 6) & 0x3F), 8);
+        flacenc_put(bw, 0x80 | (value & 0x3F), 8);
+    }
+}
+
+static inline uint8_t flacenc_crc8(const uint8_t *data, size_t len) {
+    uint8_t l_iCrc = 0;
+    size_t i = 0;
+    int b = 0;
+
+    for (i = 0; i < len; i++) {
+        l_iCrc ^= data[i];
+
+        for (b = 0; b < 8; b++) {
+            l_iCrc = (l_iCrc & 0x80) ? (uint8_t)((l_iCrc << 1) ^ 0x07) : (uint8_t)(l_iCrc << 1);
+        }
+    }
+
+    return l_iCrc;
+}
+
+static inline uint16_t flacenc_crc16(const uint8_t *data, size_t len) {
+    uint16_t l_iCrc = 0;
+    size_t i = 0;
+    int b = 0;
+
+    for (i = 0; i < len; i++) {
+        l_iCrc ^= (uint16_t)data[i] << 8;
+
+        for (b = 0; b < 8; b++) {
+            l_iCrc = (l_iCrc & 0x8000) ? (uint16_t)((l_iCrc << 1) ^ 0x8005) : (uint16_t)(l_iCrc << 1);
+        }
+    }
+
+    return l_iCrc;
+}
+
+static inline void flacenc_free(flacenc *enc) {
+    int i = 0;
+
+    for (i = 0; i < FLACENC_MAX_CHANNELS + 2; i++) {
+        free(enc->signal[i]);
+        free(enc->residual[i]);
+        enc->signal[i] = NULL;
+        enc->residual[i] = NULL;
+    }
+
+    free(enc->out);
+    enc->out = NULL;
+}
+
+static inline int flacenc_init(flacenc *enc, int channels, int blocksize) {
+    int i = 0;
+
+    memset(enc, 0x00, sizeof(flacenc));
+
+    if (channels < 1 || channels > FLACENC_MAX_CHANNELS || blocksize < 16 || blocksize > 65535) {
+        return -1;
+    }
+
+    enc->channels = channels;
+    enc->blocksize = blocksize;
+
+    for (i = 0; i < channels + (channels == 2 ? 2 : 0); i++) {
+        enc->signal[i] = (int32_t *)calloc(blocksize, sizeof(int32_t));
+        enc->residual[i] = (uint32_t *)calloc(blocksize, sizeof(uint32_t));
+
+        if (enc->signal[i] == NULL || enc->residual[i] == NULL) {
+            flacenc_free(enc);
+            return -1;
+        }
+    }
+
+    /* Verbatim worst case with one extra bit for side and headers */
+    enc->out_size = (size_t)blocksize * channels * (FLACENC_BITS_PER_SAMPLE + 1) / 8 + 64 * channels + 64;
+    enc->out = (uint8_t *)malloc(enc->out_size);
+
+    if (enc->out == NULL) {
+        flacenc_free(enc);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Choose fixed predictor, compute zigzag residual and find best Rice
+   partitioning. Stores plan to 'sub' and returns estimated bits */
+static inline uint64_t flacenc_plan(flacenc *enc, int32_t *signal, uint32_t *residual, int n, int bps, flacenc_subframe *sub) {
+    uint64_t l_lAbs[FLACENC_MAX_FIXED_ORDER + 1] = { 0 };
+    uint64_t l_lBest = 0;
+    uint64_t l_lBits = 0;
+    uint64_t l_lPartitionBits = 0;
+    int32_t l_iE0, l_iE1, l_iE2, l_iE3, l_iE4;
+    int32_t l_iRes = 0;
+    int l_iMaxOrder = FLACENC_MAX_FIXED_ORDER;
+    int l_iMaxPartition = 0;
+    int l_iPartitions = 0;
+    int l_iSize = 0;
+    int l_iCount = 0;
+    int i = 0;
+    int p = 0;
+    int k = 0;
+    int o = 0;
+
+    memset(sub, 0x00, sizeof(flacenc_subframe));
+    sub->bps = bps;
+
+    for (i = 1; i < n && signal[i] == signal[0]; i++) {
+    }
+
+    if (i == n) {
+        sub->type = FLACENC_CONSTANT;
+        sub->bits = 8 + bps;
+        return sub->bits;
+    }
+
+    if (n <= l_iMaxOrder) {
+        l_iMaxOrder = n - 1;
+    }
+
+    /* Sum of absolute residuals of every order in one pass */
+    for (i = FLACENC_MAX_FIXED_ORDER; i < n; i++) {
+        l_iE0 = signal[i];
+        l_iE1 = l_iE0 - signal[i - 1];
+        l_iE2 = l_iE1 - (signal[i - 1] - signal[i - 2]);
+        l_iE3 = l_iE2 - (signal[i - 1] - 2 * signal[i - 2] + signal[i - 3]);
+        l_iE4 = l_iE3 - (signal[i - 1] - 3 * signal[i - 2] + 3 * signal[i - 3] - signal[i - 4]);
+        l_lAbs[0] += abs(l_iE0);
+        l_lAbs[1] += abs(l_iE1);
+        l_lAbs[2] += abs(l_iE2);
+        l_lAbs[3] += abs(l_iE3);
+        l_lAbs[4] += abs(l_iE4);
+    }
+
+    sub->order = 0;
+
+    for (o = 1; o <= l_iMaxOrder; o++) {
+        if (l_lAbs[o] < l_lAbs[sub->order]) {
+            sub->order = o;
+        }
+    }
+
+    for (i = 0; i < sub->order; i++) {
+        residual[i] = 0;
+    }
+
+    for (i = sub->order; i < n; i++) {
+        switch (sub->order) {
+            case 0:
+                l_iRes = signal[i];
+                break;
+
+            case 1:
+                l_iRes = signal[i] - signal[i - 1];
+                break;
+
+            case 2:
+                l_iRes = signal[i] - 2 * signal[i - 1] + signal[i - 2];
+                break;
+
+            case 3:
+                l_iRes = signal[i] - 3 * signal[i - 1] + 3 * signal[i - 2] - signal[i - 3];
+                break;
+
+            default:
+                l_iRes = signal[i] - 4 * signal[i - 1] + 6 * signal[i - 2] - 4 * signal[i - 3] + signal[i - 4];
+                break;
+        }
+
+        residual[i] = ((uint32_t)l_iRes << 1) ^ (uint32_t)(l_iRes >> 31);
+    }
+
+    /* Finest partitioning that block size and predictor order allow */
+    while (l_iMaxPartition < FLACENC_MAX_PARTITION_ORDER
+            && (n % (2 << l_iMaxPartition)) == 0
+            && (n >> (l_iMaxPartition + 1)) > sub->order) {
+        l_iMaxPartition++;
+    }
+
+    l_iPartitions = 1 << l_iMaxPartition;
+    l_iSize = n >> l_iMaxPartition;
+
+    for (p = 0; p < l_iPartitions; p++) {
+        enc->sums[l_iMaxPartition][p] = 0;
+
+        for (i = p * l_iSize; i < (p + 1) * l_iSize; i++) {
+            enc->sums[l_iMaxPartition][p] += residual[i];
+        }
+    }
+
+    for (o = l_iMaxPartition - 1; o >= 0; o--) {
+        for (p = 0; p < (1 << o); p++) {
+            enc->sums[o][p] = enc->sums[o + 1][2 * p] + enc->sums[o + 1][2 * p + 1];
+        }
+    }
+
+    /* Estimate n * (k + 1) + sum >> k for every partition order and param */
+    l_lBest = UINT64_MAX;
+
+    for (o = 0; o <= l_iMaxPartition; o++) {
+        l_lBits = 6;
+
+        for (p = 0; p < (1 << o); p++) {
+            l_iCount = (n >> o) - (p == 0 ? sub->order : 0);
+            l_lPartitionBits = UINT64_MAX;
+
+            for (k = 0; k <= FLACENC_MAX_RICE_PARAM; k++) {
+                uint64_t l_lTry = (uint64_t)l_iCount * (k + 1) + (enc->sums[o][p] >> k);
+
+                if (l_lTry < l_lPartitionBits) {
+                    l_lPartitionBits = l_lTry;
+                }
+            }
+
+            l_lBits += 4 + l_lPartitionBits;
+        }
+
+        if (l_lBits < l_lBest) {
+            l_lBest = l_lBits;
+            sub->partition_order = o;
+        }
+    }
+
+    /* Params of chosen partitioning */
+    for (p = 0; p < (1 << sub->partition_order); p++) {
+        l_iCount = (n >> sub->partition_order) - (p == 0 ? sub->order : 0);
+        l_lPartitionBits = UINT64_MAX;
+
+        for (k = 0; k <= FLACENC_MAX_RICE_PARAM; k++) {
+            uint64_t l_lTry = (uint64_t)l_iCount * (k + 1) + (enc->sums[sub->partition_order][p] >> k);
+
+            if (l_lTry < l_lPartitionBits) {
+                l_lPartitionBits = l_lTry;
+                sub->params[p] = k;
+            }
+        }
+    }
+
+    sub->type = FLACENC_FIXED;
+    sub->bits = 8 + (uint64_t)sub->order * bps + l_lBest;
+
+    if (sub->bits >= 8 + (uint64_t)n * bps) {
+        sub->type = FLACENC_VERBATIM;
+        sub->bits = 8 + (uint64_t)n * bps;
+    }
+
+    return sub->bits;
+}
+
+static inline void flacenc_write_subframe(flacenc_bits *bw, const int32_t *signal, const uint32_t *residual, int n, const flacenc_subframe *sub) {
+    int l_iSize = 0;
+    int p = 0;
+    int i = 0;
+
+    if (sub->type == FLACENC_CONSTANT) {
+        flacenc_put(bw, FLACENC_CONSTANT << 1, 8);
+        flacenc_put(bw, (uint32_t)signal[0], sub->bps);
+        return;
+    }
+
+    if (sub->type == FLACENC_VERBATIM) {
+        flacenc_put(bw, FLACENC_VERBATIM << 1, 8);
+
+        for (i = 0; i < n; i++) {
+            flacenc_put(bw, (uint32_t)signal[i], sub->bps);
+        }
+
+        return;
+    }
+
+    flacenc_put(bw, (FLACENC_FIXED | sub->order) << 1, 8);
+
+    for (i = 0; i < sub->order; i++) {
+        flacenc_put(bw, (uint32_t)signal[i], sub->bps);
+    }
+
+    /* Rice coding with 4-bit params */
+    flacenc_put(bw, 0, 2);
+    flacenc_put(bw, sub->partition_order, 4);
+    l_iSize = n >> sub->partition_order;
+
+    for (p = 0; p < (1 << sub->partition_order); p++) {
+        flacenc_put(bw, sub->params[p], 4);
+
+        for (i = (p == 0 ? sub->order : p * l_iSize); i < (p + 1) * l_iSize; i++) {
+            flacenc_put_rice(bw, residual[i], sub->params[p]);
+        }
+    }
+}
+
+/* Encode one frame from interleaved float samples. Frames must be equal
+   to block size except last one. Result is in enc->out. Returns bytes */
+static inline size_t flacenc_frame(flacenc *enc, const float *pcm, int frames, uint32_t frame_number) {
+    flacenc_bits l_SBits = { enc->out, 0, 0, 0 };
+    int32_t *l_iL = enc->signal[0];
+    int32_t *l_iR = enc->signal[1];
+    int32_t *l_iMid = enc->signal[2];
+    int32_t *l_iSide = enc->signal[3];
+    uint64_t l_lBits[4];
+    uint64_t l_lBest = 0;
+    int l_iAssign = enc->channels - 1;
+    int l_iFirst = 0;
+    int l_iSecond = 1;
+    float l_fSample = 0.0f;
+    size_t l_lHeader = 0;
+    uint16_t l_iCrc = 0;
+    int c = 0;
+    int i = 0;
+
+    /* Float to 16-bit like libsndfile does */
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < enc->channels; c++) {
+            l_fSample = pcm[i * enc->channels + c] * 32767.0f;
+            l_fSample = l_fSample > 32767.0f ? 32767.0f : (l_fSample < -32768.0f ? -32768.0f : l_fSample);
+            enc->signal[c][i] = (int32_t)lrintf(l_fSample);
+        }
+    }
+
+    if (enc->channels == 2) {
+        for (i = 0; i < frames; i++) {
+            l_iMid[i] = (l_iL[i] + l_iR[i]) >> 1;
+            l_iSide[i] = l_iL[i] - l_iR[i];
+        }
+
+        l_lBits[0] = flacenc_plan(enc, l_iL, enc->residual[0], frames, 16, &enc->subframe[0]);
+        l_lBits[1] = flacenc_plan(enc, l_iR, enc->residual[1], frames, 16, &enc->subframe[1]);
+        l_lBits[2] = flacenc_plan(enc, l_iMid, enc->residual[2], frames, 16, &enc->subframe[2]);
+        l_lBits[3] = flacenc_plan(enc, l_iSide, enc->residual[3], frames, 17, &enc->subframe[3]);
+
+        l_lBest = l_lBits[0] + l_lBits[1];
+        l_iAssign = 1;
+
+        if (l_lBits[0] + l_lBits[3] < l_lBest) {
+            l_lBest = l_lBits[0] + l_lBits[3];
+            l_iAssign = FLACENC_LEFT_SIDE;
+            l_iFirst = 0;
+            l_iSecond = 3;
+        }
+
+        if (l_lBits[3] + l_lBits[1] < l_lBest) {
+            l_lBest = l_lBits[3] + l_lBits[1];
+            l_iAssign = FLACENC_RIGHT_SIDE;
+            l_iFirst = 3;
+            l_iSecond = 1;
+        }
+
+        if (l_lBits[2] + l_lBits[3] < l_lBest) {
+            l_iAssign = FLACENC_MID_SIDE;
+            l_iFirst = 2;
+            l_iSecond = 3;
+        }
+    } else {
+        for (c = 0; c < enc->channels; c++) {
+            flacenc_plan(enc, enc->signal[c], enc->residual[c], frames, 16, &enc->subframe[c]);
+        }
+    }
+
+    /* Frame header: sync, fixed block size, 16-bit block size at end,
+       sample rate from STREAMINFO, 16 bits per sample */
+    flacenc_put(&l_SBits, 0x3FFE, 14);
+    flacenc_put(&l_SBits, 0, 2);
+    flacenc_put(&l_SBits, 0x7, 4);
+    flacenc_put(&l_SBits, 0x0, 4);
+    flacenc_put(&l_SBits, l_iAssign, 4);
+    flacenc_put(&l_SBits, 0x4, 3);
+    flacenc_put(&l_SBits, 0, 1);
+    flacenc_put_utf8(&l_SBits, frame_number);
+    flacenc_put(&l_SBits, frames - 1, 16);
+    l_lHeader = l_SBits.len;
+    flacenc_put(&l_SBits, flacenc_crc8(enc->out, l_lHeader), 8);
+
+    if (enc->channels == 2) {
+        flacenc_write_subframe(&l_SBits, enc->signal[l_iFirst], enc->residual[l_iFirst], frames, &enc->subframe[l_iFirst]);
+        flacenc_write_subframe(&l_SBits, enc->signal[l_iSecond], enc->residual[l_iSecond], frames, &enc->subframe[l_iSecond]);
+    } else {
+        for (c = 0; c < enc->channels; c++) {
+            flacenc_write_subframe(&l_SBits, enc->signal[c], enc->residual[c], frames, &enc->subframe[c]);
+        }
+    }
+
+    flacenc_align(&l_SBits);
+    l_iCrc = flacenc_crc16(enc->out, l_SBits.len);
+    flacenc_put(&l_SBits, l_iCrc, 16);
+    return l_SBits.len;
+}
+
+/* 'fLaC' marker and STREAMINFO. Frame sizes and total can be 0 (unknown)
+   and fixed afterwards by writing this again to start of file */
+static inline void flacenc_header(uint8_t *out, int samplerate, int channels, int blocksize,
+                                  uint32_t min_frame, uint32_t max_frame, uint64_t total_frames) {
+    flacenc_bits l_SBits = { out, 0, 0, 0 };
+
+    memcpy(out, "fLaC", 4);
+    l_SBits.len = 4;
+    /* Last metadata block, type STREAMINFO, 34 bytes */
+    flacenc_put(&l_SBits, 0x80, 8);
+    flacenc_put(&l_SBits, 34, 24);
+    flacenc_put(&l_SBits, blocksize, 16);
+    flacenc_put(&l_SBits, blocksize, 16);
+    flacenc_put(&l_SBits, min_frame, 24);
+    flacenc_put(&l_SBits, max_frame, 24);
+    flacenc_put(&l_SBits, samplerate, 20);
+    flacenc_put(&l_SBits, channels - 1, 3);
+    flacenc_put(&l_SBits, FLACENC_BITS_PER_SAMPLE - 1, 5);
+    flacenc_put(&l_SBits, (uint32_t)(total_frames >> 32) & 0xF, 4);
+    flacenc_put(&l_SBits, (uint32_t)total_frames, 32);
+    /* MD5 unknown */
+    memset(out + l_SBits.len, 0x00, 16);
+}
+
+#endif
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * FLAC file writer that encodes on a thread pool.
+ *
+ * Capture thread (even audio callback) only copies samples to a lock-free
+ * ring with flacpool_write() and never waits for compression. Coordinator
+ * thread cuts ring into FLACPOOL_BLOCKSIZE frame blocks and gives them to
+ * worker threads that encode them as independent FLAC frames (see
+ * flacenc.h). Coordinator writes finished frames to file in order.
+ *
+ *   capture -> ring -> coordinator -> job slots -> workers
+ *                          ^                         |
+ *                          +-------- in order <------+
+ *
+ * Job slot of block N is N % jobs so slots are reused in same order they
+ * are written and there is never more than 'jobs' blocks in flight.
+ * If ring gets full samples are dropped and counted as overrun.
+ *
+ * Header only: just include it. Needs C11 atomics and pthreads.
+ */
+
+#ifndef FLACPOOL_H
+#define FLACPOOL_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flacenc.h"
+#include "ringbuffer.h"
+
+#define FLACPOOL_BLOCKSIZE 4096
+#define FLACPOOL_MAX_WORKERS 8
+/* How many seconds capture ring holds */
+#define FLACPOOL_RING_SECONDS 4
+
+#define FLACPOOL_FREE 0
+#define FLACPOOL_READY 1
+#define FLACPOOL_BUSY 2
+#define FLACPOOL_DONE 3
+
+typedef struct flacpool_job {
+    int state;
+    uint64_t seq;
+    int frames;
+    float *pcm;
+    uint8_t *out;
+    size_t out_len;
+} flacpool_job;
+
+typedef struct flacpool_worker {
+    struct flacpool *pool;
+    pthread_t thread;
+    flacenc enc;
+} flacpool_worker;
+
+typedef struct flacpool {
+    FILE *file;
+    int samplerate;
+    int channels;
+    int workers;
+    int jobs;
+    ringbuffer ring;
+    sem_t wake;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_t coordinator;
+    flacpool_job *job;
+    flacpool_worker worker[FLACPOOL_MAX_WORKERS];
+    uint64_t next_submit;
+    uint64_t next_write;
+    atomic_int closing;
+    int stop;
+    int error;
+    /* Statistics */
+    atomic_long overruns;
+    uint64_t frames;
+    uint64_t bytes;
+    uint32_t min_frame;
+    uint32_t max_frame;
+    double encode_seconds;
+    int max_in_flight;
+} flacpool;
+
+/* Does file name end with '.flac' */
+static inline int flacpool_wanted(const char *path) {
+    size_t l_lLen = strlen(path);
+    const char *l_strExt = ".flac";
+    size_t i = 0;
+
+    if (l_lLen < 5) {
+        return 0;
+    }
+
+    for (i = 0; i < 5; i++) {
+        char l_cChar = path[l_lLen - 5 + i];
+
+        if ((l_cChar >= 'A' && l_cChar <= 'Z' ? l_cChar + 32 : l_cChar) != l_strExt[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static inline double flacpool_thread_seconds(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+static void *flacpool_worker_thread(void *userdata) {
+    flacpool_worker *l_SWorker = (flacpool_worker *)userdata;
+    flacpool *l_SPool = l_SWorker->pool;
+    flacpool_job *l_SJob = NULL;
+    double l_dStart = 0.0;
+    int i = 0;
+
+    pthread_mutex_lock(&l_SPool->lock);
+
+    while (1) {
+        l_SJob = NULL;
+
+        /* Oldest block first so writer is not kept waiting */
+        for (i = 0; i < l_SPool->jobs; i++) {
+            if (l_SPool->job[i].state == FLACPOOL_READY && (l_SJob == NULL || l_SPool->job[i].seq < l_SJob->seq)) {
+                l_SJob = &l_SPool->job[i];
+            }
+        }
+
+        if (l_SJob == NULL) {
+            if (l_SPool->stop) {
+                break;
+            }
+
+            pthread_cond_wait(&l_SPool->work, &l_SPool->lock);
+            continue;
+        }
+
+        l_SJob->state = FLACPOOL_BUSY;
+        pthread_mutex_unlock(&l_SPool->lock);
+
+        l_dStart = flacpool_thread_seconds();
+        l_SJob->out_len = flacenc_frame(&l_SWorker->enc, l_SJob->pcm, l_SJob->frames, (uint32_t)l_SJob->seq);
+        memcpy(l_SJob->out, l_SWorker->enc.out, l_SJob->out_len);
+
+        pthread_mutex_lock(&l_SPool->lock);
+        l_SPool->encode_seconds += flacpool_thread_seconds() - l_dStart;
+        l_SJob->state = FLACPOOL_DONE;
+        sem_post(&l_SPool->wake);
+    }
+
+    pthread_mutex_unlock(&l_SPool->lock);
+    return NULL;
+}
+
+/* Write finished frames in order. Returns how many were written */
+static inline int flacpool_write_done(flacpool *pool) {
+    flacpool_job *l_SJob = NULL;
+    int l_iWritten = 0;
+    int l_iState = 0;
+
+    while (pool->next_write < pool->next_submit) {
+        l_SJob = &pool->job[pool->next_write % pool->jobs];
+
+        pthread_mutex_lock(&pool->lock);
+        l_iState = l_SJob->state;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (l_iState != FLACPOOL_DONE) {
+            break;
+        }
+
+        /* Only coordinator touches DONE slots so no lock for writing */
+        if (fwrite(l_SJob->out, 1, l_SJob->out_len, pool->file) != l_SJob->out_len) {
+            pool->error = errno;
+        }
+
+        pool->bytes += l_SJob->out_len;
+        pool->min_frame = l_SJob->out_len < pool->min_frame ? l_SJob->out_len : pool->min_frame;
+        pool->max_frame = l_SJob->out_len > pool->max_frame ? l_SJob->out_len : pool->max_frame;
+
+        pthread_mutex_lock(&pool->lock);
+        l_SJob->state = FLACPOOL_FREE;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->next_write++;
+        l_iWritten++;
+    }
+
+    return l_iWritten;
+}
+
+/* Give blocks from ring to workers. Last short block only when closing */
+static inline int flacpool_submit(flacpool *pool, int closing) {
+    size_t l_lFrameBytes = pool->channels * sizeof(float);
+    size_t l_lBlockBytes = FLACPOOL_BLOCKSIZE * l_lFrameBytes;
+    size_t l_lAvailable = 0;
+    flacpool_job *l_SJob = NULL;
+    int l_iSubmitted = 0;
+
+    while (pool->next_submit - pool->next_write < (uint64_t)pool->jobs) {
+        l_lAvailable = ringbuffer_read_space(&pool->ring);
+
+        if (l_lAvailable < l_lBlockBytes && !(closing && l_lAvailable >= l_lFrameBytes)) {
+            break;
+        }
+
+        l_lAvailable = l_lAvailable < l_lBlockBytes ? l_lAvailable - l_lAvailable % l_lFrameBytes : l_lBlockBytes;
+        l_SJob = &pool->job[pool->next_submit % pool->jobs];
+        ringbuffer_read(&pool->ring, l_SJob->pcm, l_lAvailable);
+        l_SJob->frames = l_lAvailable / l_lFrameBytes;
+        l_SJob->seq = pool->next_submit;
+        pool->frames += l_SJob->frames;
+
+        pthread_mutex_lock(&pool->lock);
+        l_SJob->state = FLACPOOL_READY;
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->next_submit++;
+        l_iSubmitted++;
+
+        if (pool->next_submit - pool->next_write > (uint64_t)pool->max_in_flight) {
+            pool->max_in_flight = pool->next_submit - pool->next_write;
+        }
+    }
+
+    return l_iSubmitted;
+}
+
+static void *flacpool_coordinator_thread(void *userdata) {
+    flacpool *l_SPool = (flacpool *)userdata;
+    int l_iClosing = 0;
+
+    while (1) {
+        sem_wait(&l_SPool->wake);
+        l_iClosing = atomic_load(&l_SPool->closing);
+
+        /* Write first so there are free slots for new blocks */
+        while (flacpool_write_done(l_SPool) + flacpool_submit(l_SPool, l_iClosing) > 0) {
+        }
+
+        if (l_iClosing && l_SPool->next_write == l_SPool->next_submit && ringbuffer_read_space(&l_SPool->ring) < l_SPool->channels * sizeof(float)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Capture side. Never blocks so it can be called from audio callback.
+   Returns frames taken. Rest are counted as overrun */
+static inline long flacpool_write(flacpool *pool, const float *pcm, long frames) {
+    size_t l_lFrameBytes = pool->channels * sizeof(float);
+    size_t l_lSpace = ringbuffer_write_space(&pool->ring) / l_lFrameBytes;
+    long l_lTake = frames < (long)l_lSpace ? frames : (long)l_lSpace;
+
+    if (l_lTake < frames) {
+        atomic_fetch_add_explicit(&pool->overruns, frames - l_lTake, memory_order_relaxed);
+    }
+
+    ringbuffer_write(&pool->ring, pcm, l_lTake * l_lFrameBytes);
+
+    if (ringbuffer_read_space(&pool->ring) >= FLACPOOL_BLOCKSIZE * l_lFrameBytes) {
+        sem_post(&pool->wake);
+    }
+
+    return l_lTake;
+}
+
+static inline void flacpool_free(flacpool *pool) {
+    int i = 0;
+
+    for (i = 0; pool->job != NULL && i < pool->jobs; i++) {
+        free(pool->job[i].pcm);
+        free(pool->job[i].out);
+    }
+
+    for (i = 0; i < FLACPOOL_MAX_WORKERS; i++) {
+        flacenc_free(&pool->worker[i].enc);
+    }
+
+    free(pool->job);
+    pool->job = NULL;
+    ringbuffer_free(&pool->ring);
+}
+
+/* Open FLAC file and start threads. Workers 0 means one per CPU */
+static inline int flacpool_open(flacpool *pool, const char *path, int samplerate, int channels, int workers) {
+    uint8_t l_iHeader[FLACENC_HEADER_BYTES];
+    size_t l_lOutSize = 0;
+    int i = 0;
+
+    memset(pool, 0x00, sizeof(flacpool));
+
+    if (workers <= 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    pool->workers = workers < 1 ? 1 : (workers > FLACPOOL_MAX_WORKERS ? FLACPOOL_MAX_WORKERS : workers);
+    pool->jobs = pool->workers * 2 + 2;
+    pool->samplerate = samplerate;
+    pool->channels = channels;
+    pool->min_frame = UINT32_MAX;
+
+    if (ringbuffer_init(&pool->ring, (size_t)samplerate * channels * sizeof(float) * FLACPOOL_RING_SECONDS) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < pool->workers; i++) {
+        pool->worker[i].pool = pool;
+
+        if (flacenc_init(&pool->worker[i].enc, channels, FLACPOOL_BLOCKSIZE) < 0) {
+            flacpool_free(pool);
+            return -1;
+        }
+    }
+
+    l_lOutSize = pool->worker[0].enc.out_size;
+    pool->job = (flacpool_job *)calloc(pool->jobs, sizeof(flacpool_job));
+
+    for (i = 0; pool->job != NULL && i < pool->jobs; i++) {
+        pool->job[i].pcm = (float *)malloc(FLACPOOL_BLOCKSIZE * channels * sizeof(float));
+        pool->job[i].out = (uint8_t *)malloc(l_lOutSize);
+
+        if (pool->job[i].pcm == NULL || pool->job[i].out == NULL) {
+            break;
+        }
+    }
+
+    if (pool->job == NULL || i < pool->jobs || !(pool->file = fopen(path, "wb"))) {
+        flacpool_free(pool);
+        return -1;
+    }
+
+    /* Sizes and length are not known yet. Fixed in flacpool_close() */
+    flacenc_header(l_iHeader, samplerate, channels, FLACPOOL_BLOCKSIZE, 0, 0, 0);
+
+    if (fwrite(l_iHeader, 1, FLACENC_HEADER_BYTES, pool->file) != FLACENC_HEADER_BYTES) {
+        fclose(pool->file);
+        flacpool_free(pool);
+        return -1;
+    }
+
+    pool->bytes = FLACENC_HEADER_BYTES;
+    sem_init(&pool->wake, 0, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    atomic_init(&pool->closing, 0);
+    atomic_init(&pool->overruns, 0);
+
+    for (i = 0; i < pool->workers; i++) {
+        pthread_create(&pool->worker[i].thread, NULL, flacpool_worker_thread, &pool->worker[i]);
+    }
+
+    pthread_create(&pool->coordinator, NULL, flacpool_coordinator_thread, pool);
+    return 0;
+}
+
+/* Encode everything left, fix STREAMINFO and close file */
+static inline int flacpool_close(flacpool *pool) {
+    uint8_t l_iHeader[FLACENC_HEADER_BYTES];
+    int i = 0;
+
+    atomic_store(&pool->closing, 1);
+    sem_post(&pool->wake);
+    pthread_join(pool->coordinator, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->workers; i++) {
+        pthread_join(pool->worker[i].thread, NULL);
+    }
+
+    flacenc_header(l_iHeader, pool->samplerate, pool->channels, FLACPOOL_BLOCKSIZE,
+                   pool->min_frame == UINT32_MAX ? 0 : pool->min_frame, pool->max_frame, pool->frames);
+
+    if (fseek(pool->file, 0, SEEK_SET) < 0 || fwrite(l_iHeader, 1, FLACENC_HEADER_BYTES, pool->file) != FLACENC_HEADER_BYTES) {
+        pool->error = errno;
+    }
+
+    if (fclose(pool->file) != 0) {
+        pool->error = errno;
+    }
+
+    sem_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    flacpool_free(pool);
+    return pool->error ? -1 : 0;
+}
+
+/* Compression ratio against 16-bit PCM and how much faster than real time
+   encoders are. Call after flacpool_close() */
+static inline void flacpool_print_stats(const flacpool *pool) {
+    double l_dAudio = (double)pool->frames / pool->samplerate;
+    double l_dPcm = (double)pool->frames * pool->channels * 2;
+
+    printf("flacpool: %.2f s of audio, %llu bytes FLAC, ratio %.2f:1 against 16-bit PCM\n",
+           l_dAudio, (unsigned long long)pool->bytes, pool->bytes ? l_dPcm / pool->bytes : 0.0);
+    printf("flacpool: %d encoder threads used %.3f s CPU, headroom %.0fx real time per thread\n",
+           pool->workers, pool->encode_seconds, pool->encode_seconds > 0.0 ? l_dAudio / pool->encode_seconds : 0.0);
+    printf("flacpool: most blocks in flight %d of %d, overrun frames %ld\n",
+           pool->max_in_flight, pool->jobs, (long)atomic_load(&pool->overruns));
+}
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Vectorized block level analysis (min, max and sum of squares).
+ *
+ * Uses GCC vector extensions so same code becomes SSE on x86 and NEON on
+ * ARM without intrinsics. 16 samples per round in four independent
+ * accumulators. Unaligned buffers are fine: loads go through memcpy()
+ * which compiles to a single unaligned vector load.
+ *
+ * levels_scan_channels() does same per channel for interleaved frames.
+ * It walks in periods of lcm(channels, 4) samples (at least 16) so every
+ * vector lane always sees same channel and lanes are only folded at the end.
+ *
+ * Header only: just include it.
+ */
+
+#ifndef LEVELS_H
+#define LEVELS_H
+
+#include <math.h>
+#include <string.h>
+
+typedef float levels_v4 __attribute__((vector_size(16)));
+typedef int levels_v4i __attribute__((vector_size(16)));
+
+/* Most vectors in one period. More than that is scanned without vectors */
+#define LEVELS_MAX_VECTORS 8
+/* Float sums are moved to doubles after this many periods */
+#define LEVELS_FLUSH_PERIODS 1024
+
+typedef struct levels {
+    float min;
+    float max;
+    double sumsq;
+    long samples;
+} levels;
+
+static inline levels_v4 levels_load(const float *pcm) {
+    levels_v4 l_v4Value;
+    memcpy(&l_v4Value, pcm, sizeof(levels_v4));
+    return l_v4Value;
+}
+
+/* Comparison gives all ones lane mask. Compiles to minps/maxps or blend */
+static inline levels_v4 levels_select(levels_v4i mask, levels_v4 a, levels_v4 b) {
+    return (levels_v4)(((levels_v4i)a & mask) | ((levels_v4i)b & ~mask));
+}
+
+static inline levels_v4 levels_vmin(levels_v4 a, levels_v4 b) {
+    return levels_select(a < b, a, b);
+}
+
+static inline levels_v4 levels_vmax(levels_v4 a, levels_v4 b) {
+    return levels_select(a > b, a, b);
+}
+
+/* Scan 'samples' floats (all channels together) */
+static inline void levels_scan(const float *pcm, long samples, levels *out) {
+    levels_v4 l_v4Min0, l_v4Min1, l_v4Max0, l_v4Max1;
+    levels_v4 l_v4Sq0, l_v4Sq1, l_v4Sq2, l_v4Sq3;
+    levels_v4 l_v4A, l_v4B, l_v4C, l_v4D;
+    float l_fMin = INFINITY;
+    float l_fMax = -INFINITY;
+    double l_dSum = 0.0;
+    long i = 0;
+    int j = 0;
+
+    if (samples >= 16) {
+        l_v4Min0 = l_v4Min1 = l_v4Max0 = l_v4Max1 = levels_load(pcm);
+        l_v4Sq0 = l_v4Sq1 = l_v4Sq2 = l_v4Sq3 = (levels_v4){ 0.0f, 0.0f, 0.0f, 0.0f };
+
+        for (i = 0; i + 16 <= samples; i += 16) {
+            l_v4A = levels_load(pcm + i);
+            l_v4B = levels_load(pcm + i + 4);
+            l_v4C = levels_load(pcm + i + 8);
+            l_v4D = levels_load(pcm + i + 12);
+
+            l_v4Min0 = levels_vmin(l_v4Min0, levels_vmin(l_v4A, l_v4B));
+            l_v4Min1 = levels_vmin(l_v4Min1, levels_vmin(l_v4C, l_v4D));
+            l_v4Max0 = levels_vmax(l_v4Max0, levels_vmax(l_v4A, l_v4B));
+            l_v4Max1 = levels_vmax(l_v4Max1, levels_vmax(l_v4C, l_v4D));
+            l_v4Sq0 += l_v4A * l_v4A;
+            l_v4Sq1 += l_v4B * l_v4B;
+            l_v4Sq2 += l_v4C * l_v4C;
+            l_v4Sq3 += l_v4D * l_v4D;
+        }
+
+        l_v4Min0 = levels_vmin(l_v4Min0, l_v4Min1);
+        l_v4Max0 = levels_vmax(l_v4Max0, l_v4Max1);
+        l_v4Sq0 = (l_v4Sq0 + l_v4Sq1) + (l_v4Sq2 + l_v4Sq3);
+
+        for (j = 0; j < 4; j++) {
+            l_fMin = l_v4Min0[j] < l_fMin ? l_v4Min0[j] : l_fMin;
+            l_fMax = l_v4Max0[j] > l_fMax ? l_v4Max0[j] : l_fMax;
+            l_dSum += l_v4Sq0[j];
+        }
+    }
+
+    for (; i < samples; i++) {
+        l_fMin = pcm[i] < l_fMin ? pcm[i] : l_fMin;
+        l_fMax = pcm[i] > l_fMax ? pcm[i] : l_fMax;
+        l_dSum += (double)pcm[i] * pcm[i];
+    }
+
+    out->min = samples > 0 ? l_fMin : 0.0f;
+    out->max = samples > 0 ? l_fMax : 0.0f;
+    out->sumsq = l_dSum;
+    out->samples = samples;
+}
+
+/* Scan interleaved frames. 'out' has room for 'channels' results */
+static inline void levels_scan_channels(const float *pcm, long frames, int channels, levels *out) {
+    levels_v4 l_v4Min[LEVELS_MAX_VECTORS];
+    levels_v4 l_v4Max[LEVELS_MAX_VECTORS];
+    levels_v4 l_v4Sq[LEVELS_MAX_VECTORS];
+    levels_v4 l_v4Value;
+    long l_lSamples = frames * channels;
+    long l_lRounds = 0;
+    long i = 0;
+    int l_iPeriod = channels;
+    int l_iVectors = 0;
+    int l_iChannel = 0;
+    int j = 0;
+    int k = 0;
+
+    for (j = 0; j < channels; j++) {
+        out[j].min = INFINITY;
+        out[j].max = -INFINITY;
+        out[j].sumsq = 0.0;
+        out[j].samples = frames;
+    }
+
+    while (l_iPeriod % 4) {
+        l_iPeriod += channels;
+    }
+
+    /* Short periods are doubled so there are independent accumulators */
+    while (l_iPeriod < 16) {
+        l_iPeriod *= 2;
+    }
+
+    l_iVectors = l_iPeriod / 4;
+
+    if (l_iVectors <= LEVELS_MAX_VECTORS && l_lSamples >= l_iPeriod) {
+        for (j = 0; j < l_iVectors; j++) {
+            l_v4Min[j] = l_v4Max[j] = levels_load(pcm + j * 4);
+            l_v4Sq[j] = (levels_v4){ 0.0f, 0.0f, 0.0f, 0.0f };
+        }
+
+        while (i + l_iPeriod <= l_lSamples) {
+            l_lRounds = (l_lSamples - i) / l_iPeriod;
+            l_lRounds = l_lRounds < LEVELS_FLUSH_PERIODS ? l_lRounds : LEVELS_FLUSH_PERIODS;
+
+            for (; l_lRounds > 0; l_lRounds--, i += l_iPeriod) {
+                for (j = 0; j < l_iVectors; j++) {
+                    l_v4Value = levels_load(pcm + i + j * 4);
+                    l_v4Min[j] = levels_vmin(l_v4Min[j], l_v4Value);
+                    l_v4Max[j] = levels_vmax(l_v4Max[j], l_v4Value);
+                    l_v4Sq[j] += l_v4Value * l_v4Value;
+                }
+            }
+
+            /* Long blocks would lose precision in float sums */
+            for (j = 0; j < l_iVectors; j++) {
+                for (k = 0; k < 4; k++) {
+                    out[(j * 4 + k) % channels].sumsq += l_v4Sq[j][k];
+                }
+
+                l_v4Sq[j] = (levels_v4){ 0.0f, 0.0f, 0.0f, 0.0f };
+            }
+        }
+
+        for (j = 0; j < l_iVectors; j++) {
+            for (k = 0; k < 4; k++) {
+                l_iChannel = (j * 4 + k) % channels;
+                out[l_iChannel].min = l_v4Min[j][k] < out[l_iChannel].min ? l_v4Min[j][k] : out[l_iChannel].min;
+                out[l_iChannel].max = l_v4Max[j][k] > out[l_iChannel].max ? l_v4Max[j][k] : out[l_iChannel].max;
+            }
+        }
+    }
+
+    /* Tail starts always from first channel */
+    for (l_iChannel = 0; i < l_lSamples; i++) {
+        out[l_iChannel].min = pcm[i] < out[l_iChannel].min ? pcm[i] : out[l_iChannel].min;
+        out[l_iChannel].max = pcm[i] > out[l_iChannel].max ? pcm[i] : out[l_iChannel].max;
+        out[l_iChannel].sumsq += (double)pcm[i] * pcm[i];
+        l_iChannel = l_iChannel + 1 == channels ? 0 : l_iChannel + 1;
+    }
+
+    if (frames <= 0) {
+        for (j = 0; j < channels; j++) {
+            out[j].min = out[j].max = 0.0f;
+        }
+    }
+}
+
+/* Add levels of next piece of same block */
+static inline void levels_merge(levels *into, const levels *part, int channels) {
+    int i = 0;
+
+    for (i = 0; i < channels; i++) {
+        if (part[i].samples == 0) {
+            continue;
+        }
+
+        if (into[i].samples == 0) {
+            into[i] = part[i];
+            continue;
+        }
+
+        into[i].min = part[i].min < into[i].min ? part[i].min : into[i].min;
+        into[i].max = part[i].max > into[i].max ? part[i].max : into[i].max;
+        into[i].sumsq += part[i].sumsq;
+        into[i].samples += part[i].samples;
+    }
+}
+
+static inline float levels_peak(const levels *lv) {
+    return fabsf(lv->min) > fabsf(lv->max) ? fabsf(lv->min) : fabsf(lv->max);
+}
+
+static inline float levels_rms(const levels *lv) {
+    return lv->samples > 0 ? (float)sqrt(lv->sumsq / lv->samples) : 0.0f;
+}
+
+/* Linear level to dBFS. Silence is -200 dB */
+static inline float levels_db(float value) {
+    return value > 1e-10f ? 20.0f * log10f(value) : -200.0f;
+}
+
+static inline float levels_from_db(float db) {
+    return powf(10.0f, db / 20.0f);
+}
+
+#endif
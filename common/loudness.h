@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * EBU R128 / ITU-R BS.1770 loudness analysis and playback gain.
+ *
+ * Samples go through K-weighting filter (high shelf and high pass biquads)
+ * that runs all channels at once in vector lanes, four channels in one
+ * vector. Weighted mean square is summed to 100 ms sub-blocks and from
+ * them are made:
+ *
+ *   integrated loudness  400 ms blocks, 75% overlap, gated at -70 LUFS
+ *                        and 10 LU under ungated loudness
+ *   loudness range       3 s blocks every 100 ms, gated at -70 LUFS and
+ *                        20 LU under, 95th minus 10th percentile
+ *   true peak            4x oversampled with 48 tap polyphase FIR
+ *
+ * Result is cached next to audio file as 'file.flac.r128' text file with
+ * normalization gain. Players load it with loudness_gain_load() and scale
+ * output with loudness_apply() which is one vector multiply per 4 samples.
+ *
+ * Header only: just include it. Needs -lm.
+ */
+
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "levels.h"
+
+#define LOUDNESS_MAX_CHANNELS 16
+#define LOUDNESS_GROUPS (LOUDNESS_MAX_CHANNELS / 4)
+#define LOUDNESS_TP_PHASES 4
+#define LOUDNESS_TP_TAPS 12
+#define LOUDNESS_DEFAULT_TARGET -18.0
+/* Gain is limited so that true peak stays under this */
+#define LOUDNESS_PEAK_CEILING -1.0
+#define LOUDNESS_NONE -200.0
+
+typedef double loudness_v4d __attribute__((vector_size(32)));
+
+typedef struct loudness_result {
+    double integrated;
+    double range;
+    double true_peak;
+    double sample_peak;
+    double seconds;
+} loudness_result;
+
+typedef struct loudness {
+    int channels;
+    int samplerate;
+    int groups;
+    /* K-weighting: shelf b/a and high pass b/a */
+    double sb[3];
+    double sa[3];
+    double hb[3];
+    double ha[3];
+    /* Transposed direct form II states for both biquads */
+    loudness_v4d shelf_z1[LOUDNESS_GROUPS];
+    loudness_v4d shelf_z2[LOUDNESS_GROUPS];
+    loudness_v4d pass_z1[LOUDNESS_GROUPS];
+    loudness_v4d pass_z2[LOUDNESS_GROUPS];
+    loudness_v4d weight[LOUDNESS_GROUPS];
+    loudness_v4d sum[LOUDNESS_GROUPS];
+    long sub_frames;
+    long sub_fill;
+    /* Channel weighted mean square of every 100 ms */
+    double *subs;
+    long sub_count;
+    long sub_capacity;
+    /* True peak interpolator. History is written twice so window of
+       LOUDNESS_TP_TAPS samples is always in one piece */
+    float taps[LOUDNESS_TP_PHASES][LOUDNESS_TP_TAPS];
+    float history[LOUDNESS_MAX_CHANNELS][LOUDNESS_TP_TAPS * 2];
+    int history_pos;
+    float true_peak;
+    float sample_peak;
+    uint64_t frames;
+} loudness;
+
+/* BS.1770 K-weighting for any rate (same as 48 kHz table in standard) */
+static inline void loudness_coefficients(loudness *ld) {
+    double l_dF0 = 1681.974450955533;
+    double l_dG = 3.999843853973347;
+    double l_dQ = 0.7071752369554196;
+    double l_dK = tan(M_PI * l_dF0 / ld->samplerate);
+    double l_dVh = pow(10.0, l_dG / 20.0);
+    double l_dVb = pow(l_dVh, 0.4996667741545416);
+    double l_dA0 = 1.0 + l_dK / l_dQ + l_dK * l_dK;
+
+    ld->sb[0] = (l_dVh + l_dVb * l_dK / l_dQ + l_dK * l_dK) / l_dA0;
+    ld->sb[1] = 2.0 * (l_dK * l_dK - l_dVh) / l_dA0;
+    ld->sb[2] = (l_dVh - l_dVb * l_dK / l_dQ + l_dK * l_dK) / l_dA0;
+    ld->sa[0] = 1.0;
+    ld->sa[1] = 2.0 * (l_dK * l_dK - 1.0) / l_dA0;
+    ld->sa[2] = (1.0 - l_dK / l_dQ + l_dK * l_dK) / l_dA0;
+
+    l_dF0 = 38.13547087602444;
+    l_dQ = 0.5003270373238773;
+    l_dK = tan(M_PI * l_dF0 / ld->samplerate);
+    l_dA0 = 1.0 + l_dK / l_dQ + l_dK * l_dK;
+
+    ld->hb[0] = 1.0;
+    ld->hb[1] = -2.0;
+    ld->hb[2] = 1.0;
+    ld->ha[0] = 1.0;
+    ld->ha[1] = 2.0 * (l_dK * l_dK - 1.0) / l_dA0;
+    ld->ha[2] = (1.0 - l_dK / l_dQ + l_dK * l_dK) / l_dA0;
+}
+
+/* Windowed sinc, every phase scaled to unity gain */
+static inline void loudness_true_peak_taps(loudness *ld) {
+    double l_dSum = 0.0;
+    double l_dX = 0.0;
+    double l_dN = 0.0;
+    double l_dLen = LOUDNESS_TP_PHASES * LOUDNESS_TP_TAPS;
+    int p = 0;
+    int t = 0;
+
+    for (p = 0; p < LOUDNESS_TP_PHASES; p++) {
+        l_dSum = 0.0;
+
+        for (t = 0; t < LOUDNESS_TP_TAPS; t++) {
+            /* Taps are reversed so window can be multiplied as is */
+            l_dN = (LOUDNESS_TP_TAPS - 1 - t) * LOUDNESS_TP_PHASES + p;
+            l_dX = (l_dN - (l_dLen - 1) / 2.0) / LOUDNESS_TP_PHASES * 0.9;
+            ld->taps[p][t] = (float)((l_dX == 0.0 ? 1.0 : sin(M_PI * l_dX) / (M_PI * l_dX))
+                                     * (0.42 - 0.5 * cos(2.0 * M_PI * l_dN / (l_dLen - 1))
+                                        + 0.08 * cos(4.0 * M_PI * l_dN / (l_dLen - 1))));
+            l_dSum += ld->taps[p][t];
+        }
+
+        for (t = 0; t < LOUDNESS_TP_TAPS; t++) {
+            ld->taps[p][t] /= (float)l_dSum;
+        }
+    }
+}
+
+static inline int loudness_init(loudness *ld, int samplerate, int channels) {
+    int c = 0;
+    double l_dWeight = 1.0;
+
+    memset(ld, 0x00, sizeof(loudness));
+
+    if (channels < 1 || channels > LOUDNESS_MAX_CHANNELS || samplerate < 1000) {
+        return -1;
+    }
+
+    ld->channels = channels;
+    ld->samplerate = samplerate;
+    ld->groups = (channels + 3) / 4;
+    ld->sub_frames = samplerate / 10;
+    loudness_coefficients(ld);
+    loudness_true_peak_taps(ld);
+
+    /* 5.1 in WAV order is L R C LFE Ls Rs: LFE is left out and
+       surrounds weigh +1.5 dB. Other layouts count every channel */
+    for (c = 0; c < channels; c++) {
+        l_dWeight = 1.0;
+
+        if (channels == 6 && c == 3) {
+            l_dWeight = 0.0;
+        } else if (channels == 6 && c >= 4) {
+            l_dWeight = 1.41;
+        }
+
+        ld->weight[c / 4][c % 4] = l_dWeight;
+    }
+
+    return 0;
+}
+
+static inline void loudness_free(loudness *ld) {
+    free(ld->subs);
+    ld->subs = NULL;
+}
+
+static inline int loudness_push_sub(loudness *ld) {
+    double *l_dGrow = NULL;
+    double l_dEnergy = 0.0;
+    int g = 0;
+    int k = 0;
+
+    if (ld->sub_count == ld->sub_capacity) {
+        ld->sub_capacity = ld->sub_capacity ? ld->sub_capacity * 2 : 1024;
+        l_dGrow = (double *)realloc(ld->subs, ld->sub_capacity * sizeof(double));
+
+        if (l_dGrow == NULL) {
+            return -1;
+        }
+
+        ld->subs = l_dGrow;
+    }
+
+    for (g = 0; g < ld->groups; g++) {
+        for (k = 0; k < 4; k++) {
+            l_dEnergy += ld->sum[g][k];
+        }
+
+        ld->sum[g] = (loudness_v4d){ 0.0, 0.0, 0.0, 0.0 };
+    }
+
+    ld->subs[ld->sub_count++] = l_dEnergy / ld->sub_frames;
+    ld->sub_fill = 0;
+    return 0;
+}
+
+/* Biggest of four 4x oversampled values between history samples */
+static inline float loudness_interpolate(const loudness *ld, const float *window) {
+    levels_v4 l_v4Acc;
+    float l_fValue = 0.0f;
+    float l_fPeak = 0.0f;
+    int p = 0;
+    int t = 0;
+
+    for (p = 0; p < LOUDNESS_TP_PHASES; p++) {
+        l_v4Acc = levels_load(window) * levels_load(ld->taps[p]);
+
+        for (t = 4; t < LOUDNESS_TP_TAPS; t += 4) {
+            l_v4Acc += levels_load(window + t) * levels_load(ld->taps[p] + t);
+        }
+
+        l_fValue = fabsf((l_v4Acc[0] + l_v4Acc[1]) + (l_v4Acc[2] + l_v4Acc[3]));
+        l_fPeak = l_fValue > l_fPeak ? l_fValue : l_fPeak;
+    }
+
+    return l_fPeak;
+}
+
+/* Feed interleaved frames */
+static inline int loudness_process(loudness *ld, const float *pcm, long frames) {
+    loudness_v4d l_v4X;
+    loudness_v4d l_v4Y;
+    float l_fAbs = 0.0f;
+    float l_fPeak = 0.0f;
+    long i = 0;
+    int g = 0;
+    int c = 0;
+    int k = 0;
+
+    for (i = 0; i < frames; i++) {
+        const float *l_fFrame = pcm + i * ld->channels;
+
+        for (g = 0; g < ld->groups; g++) {
+            l_v4X = (loudness_v4d){ 0.0, 0.0, 0.0, 0.0 };
+
+            for (k = 0; k < 4 && g * 4 + k < ld->channels; k++) {
+                l_v4X[k] = l_fFrame[g * 4 + k];
+            }
+
+            /* High shelf */
+            l_v4Y = ld->sb[0] * l_v4X + ld->shelf_z1[g];
+            ld->shelf_z1[g] = ld->sb[1] * l_v4X - ld->sa[1] * l_v4Y + ld->shelf_z2[g];
+            ld->shelf_z2[g] = ld->sb[2] * l_v4X - ld->sa[2] * l_v4Y;
+
+            /* High pass */
+            l_v4X = l_v4Y;
+            l_v4Y = ld->hb[0] * l_v4X + ld->pass_z1[g];
+            ld->pass_z1[g] = ld->hb[1] * l_v4X - ld->ha[1] * l_v4Y + ld->pass_z2[g];
+            ld->pass_z2[g] = ld->hb[2] * l_v4X - ld->ha[2] * l_v4Y;
+
+            ld->sum[g] += ld->weight[g] * l_v4Y * l_v4Y;
+        }
+
+        for (c = 0; c < ld->channels; c++) {
+            l_fAbs = fabsf(l_fFrame[c]);
+            ld->sample_peak = l_fAbs > ld->sample_peak ? l_fAbs : ld->sample_peak;
+            ld->history[c][ld->history_pos] = l_fFrame[c];
+            ld->history[c][ld->history_pos + LOUDNESS_TP_TAPS] = l_fFrame[c];
+            l_fPeak = loudness_interpolate(ld, &ld->history[c][ld->history_pos + 1]);
+            ld->true_peak = l_fPeak > ld->true_peak ? l_fPeak : ld->true_peak;
+        }
+
+        ld->history_pos = ld->history_pos + 1 == LOUDNESS_TP_TAPS ? 0 : ld->history_pos + 1;
+        ld->frames++;
+
+        if (++ld->sub_fill == ld->sub_frames && loudness_push_sub(ld) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static inline double loudness_lufs(double energy) {
+    return energy > 0.0 ? -0.691 + 10.0 * log10(energy) : LOUDNESS_NONE;
+}
+
+static inline int loudness_compare(const void *a, const void *b) {
+    double l_dA = *(const double *)a;
+    double l_dB = *(const double *)b;
+    return (l_dA > l_dB) - (l_dA < l_dB);
+}
+
+/* Gate blocks of 'length' sub-blocks. Returns gated mean energy and puts
+   loudness of blocks that passed to 'passed' if it is not NULL */
+static inline double loudness_gate(const loudness *ld, long length, double relative,
+                                   double *passed, long *count) {
+    double l_dEnergy = 0.0;
+    double l_dSum = 0.0;
+    double l_dThreshold = 0.0;
+    long l_lAbove = 0;
+    long b = 0;
+    long j = 0;
+    int l_iPass = 0;
+
+    *count = 0;
+
+    /* Absolute gate first, then relative to what passed it */
+    for (l_iPass = 0; l_iPass < 2; l_iPass++) {
+        l_dSum = 0.0;
+        l_lAbove = 0;
+
+        for (b = 0; b + length <= ld->sub_count; b++) {
+            l_dEnergy = 0.0;
+
+            for (j = b; j < b + length; j++) {
+                l_dEnergy += ld->subs[j];
+            }
+
+            l_dEnergy /= length;
+
+            if (loudness_lufs(l_dEnergy) <= -70.0 || (l_iPass == 1 && loudness_lufs(l_dEnergy) <= l_dThreshold)) {
+                continue;
+            }
+
+            if (l_iPass == 1 && passed != NULL) {
+                passed[l_lAbove] = loudness_lufs(l_dEnergy);
+            }
+
+            l_dSum += l_dEnergy;
+            l_lAbove++;
+        }
+
+        if (l_lAbove == 0) {
+            return 0.0;
+        }
+
+        l_dThreshold = loudness_lufs(l_dSum / l_lAbove) - relative;
+    }
+
+    *count = l_lAbove;
+    return l_dSum / l_lAbove;
+}
+
+static inline void loudness_result_get(const loudness *ld, loudness_result *res) {
+    double *l_dShort = NULL;
+    long l_lCount = 0;
+
+    res->integrated = loudness_lufs(loudness_gate(ld, 4, 10.0, NULL, &l_lCount));
+    res->range = 0.0;
+    res->true_peak = levels_db(ld->true_peak > ld->sample_peak ? ld->true_peak : ld->sample_peak);
+    res->sample_peak = levels_db(ld->sample_peak);
+    res->seconds = (double)ld->frames / ld->samplerate;
+
+    if (ld->sub_count >= 30 && (l_dShort = (double *)malloc(ld->sub_count * sizeof(double)))) {
+        loudness_gate(ld, 30, 20.0, l_dShort, &l_lCount);
+
+        if (l_lCount > 0) {
+            qsort(l_dShort, l_lCount, sizeof(double), loudness_compare);
+            res->range = l_dShort[(long)lround((l_lCount - 1) * 0.95)] - l_dShort[(long)lround((l_lCount - 1) * 0.10)];
+        }
+
+        free(l_dShort);
+    }
+}
+
+/* Gain to reach target without true peak going over ceiling */
+static inline double loudness_gain(const loudness_result *res, double target) {
+    double l_dGain = 0.0;
+
+    if (res->integrated <= LOUDNESS_NONE) {
+        return 0.0;
+    }
+
+    l_dGain = target - res->integrated;
+
+    if (res->true_peak + l_dGain > LOUDNESS_PEAK_CEILING) {
+        l_dGain = LOUDNESS_PEAK_CEILING - res->true_peak;
+    }
+
+    return l_dGain;
+}
+
+static inline void loudness_cache_path(const char *audiopath, char *path, size_t len) {
+    snprintf(path, len, "%s.r128", audiopath);
+}
+
+static inline int loudness_cache_save(const char *audiopath, const loudness_result *res, double target) {
+    char l_strPath[4096 + 8];
+    struct stat l_SStat;
+    FILE *l_SFile = NULL;
+    int l_iRetval = 0;
+
+    loudness_cache_path(audiopath, l_strPath, sizeof(l_strPath));
+
+    if (stat(audiopath, &l_SStat) < 0 || !(l_SFile = fopen(l_strPath, "w"))) {
+        return -1;
+    }
+
+    fprintf(l_SFile, "size %lld\nmtime %lld\nintegrated %.2f\nrange %.2f\ntrue_peak %.2f\n"
+            "sample_peak %.2f\nseconds %.3f\ntarget %.2f\ngain %.2f\n",
+            (long long)l_SStat.st_size, (long long)l_SStat.st_mtime, res->integrated, res->range,
+            res->true_peak, res->sample_peak, res->seconds, target, loudness_gain(res, target));
+
+    if (fclose(l_SFile) != 0) {
+        l_iRetval = -1;
+    }
+
+    return l_iRetval;
+}
+
+/* Read cached result. -1 if there is none or audio file has changed */
+static inline int loudness_cache_load(const char *audiopath, loudness_result *res, double *target, double *gain) {
+    char l_strPath[4096 + 8];
+    struct stat l_SStat;
+    FILE *l_SFile = NULL;
+    long long l_lSize = 0;
+    long long l_lMtime = 0;
+    int l_iGot = 0;
+
+    loudness_cache_path(audiopath, l_strPath, sizeof(l_strPath));
+
+    if (stat(audiopath, &l_SStat) < 0 || !(l_SFile = fopen(l_strPath, "r"))) {
+        return -1;
+    }
+
+    l_iGot = fscanf(l_SFile, "size %lld\nmtime %lld\nintegrated %lf\nrange %lf\ntrue_peak %lf\n"
+                    "sample_peak %lf\nseconds %lf\ntarget %lf\ngain %lf\n",
+                    &l_lSize, &l_lMtime, &res->integrated, &res->range, &res->true_peak,
+                    &res->sample_peak, &res->seconds, target, gain);
+    fclose(l_SFile);
+
+    if (l_iGot != 9 || l_lSize != (long long)l_SStat.st_size || l_lMtime != (long long)l_SStat.st_mtime) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* For players: linear gain of file or 1.0 if it is not analyzed */
+static inline float loudness_gain_load(const char *audiopath) {
+    loudness_result l_SResult;
+    double l_dTarget = 0.0;
+    double l_dGain = 0.0;
+
+    if (loudness_cache_load(audiopath, &l_SResult, &l_dTarget, &l_dGain) < 0) {
+        return 1.0f;
+    }
+
+    printf("Loudness %.1f LUFS, gain %+.1f dB to %.1f LUFS\n", l_SResult.integrated, l_dGain, l_dTarget);
+    return (float)pow(10.0, l_dGain / 20.0);
+}
+
+/* Scale samples in place. Nothing is done for unity gain */
+static inline void loudness_apply(float *pcm, long samples, float gain) {
+    levels_v4 l_v4Gain = { gain, gain, gain, gain };
+    levels_v4 l_v4Value;
+    long i = 0;
+
+    if (gain == 1.0f || pcm == NULL) {
+        return;
+    }
+
+    for (i = 0; i + 4 <= samples; i += 4) {
+        l_v4Value = levels_load(pcm + i) * l_v4Gain;
+        memcpy(pcm + i, &l_v4Value, sizeof(levels_v4));
+    }
+
+    for (; i < samples; i++) {
+        pcm[i] *= gain;
+    }
+}
+
+#endif
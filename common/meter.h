@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Realtime peak/RMS meter.
+ *
+ * Audio callback calls meter_update() for every block. It does one
+ * vectorized min/max/sum of squares pass (see levels.h) and publishes
+ * per channel peak and RMS with a seqlock: sequence is odd while writing,
+ * readers copy snapshot and retry if sequence moved. Callback never waits
+ * and readers never block it.
+ *
+ * Meter lives in memfd so other process can map it read only through
+ * '/proc/PID/fd/N' (meter_path()). See tools/meter_watch.c. If memfd can't
+ * be made meter is private memory and works only inside the process.
+ *
+ * Header only: just include it. Needs _GNU_SOURCE for memfd_create(),
+ * C11 atomics and -lm.
+ */
+
+#ifndef METER_H
+#define METER_H
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "levels.h"
+
+#define METER_MAGIC "LAEMTR01"
+#define METER_MAX_CHANNELS 64
+/* Reader gives up after this many torn reads */
+#define METER_READ_TRIES 64
+/* Samples converted at once in meter_update_int() */
+#define METER_INT_CHUNK 1024
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "meter needs lock-free 32-bit atomics");
+
+typedef struct meter_snapshot {
+    uint32_t samplerate;
+    uint32_t channels;
+    /* Blocks and frames metered so far */
+    uint64_t blocks;
+    uint64_t frames;
+    /* Blocks that had sample at full scale */
+    uint64_t clipped;
+    /* Of last block. Linear, 1.0 is full scale */
+    float peak[METER_MAX_CHANNELS];
+    float rms[METER_MAX_CHANNELS];
+} meter_snapshot;
+
+typedef struct meter_shared {
+    char magic[8];
+    uint32_t size;
+    uint32_t pid;
+    _Alignas(64) _Atomic uint32_t seq;
+    meter_snapshot snap;
+} meter_shared;
+
+typedef struct meter {
+    int fd;
+    size_t map_size;
+    meter_shared *shared;
+} meter;
+
+static inline int meter_map(meter *mtr, int prot) {
+    mtr->shared = (meter_shared *)mmap(NULL, mtr->map_size, prot, MAP_SHARED, mtr->fd, 0);
+
+    if (mtr->shared == MAP_FAILED) {
+        mtr->shared = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Writer: make meter for stream */
+static inline int meter_open(meter *mtr, uint32_t samplerate, uint32_t channels) {
+    memset(mtr, 0x00, sizeof(meter));
+    mtr->map_size = sizeof(meter_shared);
+
+    if (channels == 0 || channels > METER_MAX_CHANNELS) {
+        mtr->fd = -1;
+        return -1;
+    }
+
+    mtr->fd = memfd_create("meter", MFD_CLOEXEC);
+
+    if (mtr->fd >= 0 && (ftruncate(mtr->fd, mtr->map_size) < 0 || meter_map(mtr, PROT_READ | PROT_WRITE) < 0)) {
+        close(mtr->fd);
+        mtr->fd = -1;
+    }
+
+    /* Still useful inside this process */
+    if (mtr->fd < 0) {
+        mtr->shared = (meter_shared *)calloc(1, sizeof(meter_shared));
+
+        if (mtr->shared == NULL) {
+            return -1;
+        }
+    }
+
+    memcpy(mtr->shared->magic, METER_MAGIC, 8);
+    mtr->shared->size = sizeof(meter_shared);
+    mtr->shared->pid = (uint32_t)getpid();
+    mtr->shared->snap.samplerate = samplerate;
+    mtr->shared->snap.channels = channels;
+    atomic_init(&mtr->shared->seq, 0);
+    return 0;
+}
+
+/* Path other processes can give to meter_attach(). -1 if meter is private */
+static inline int meter_path(const meter *mtr, char *path, size_t len) {
+    if (mtr->fd < 0) {
+        return -1;
+    }
+
+    snprintf(path, len, "/proc/%ld/fd/%d", (long)getpid(), mtr->fd);
+    return 0;
+}
+
+/* Reader: map meter of other process read only */
+static inline int meter_attach(meter *mtr, const char *path) {
+    meter_shared l_SHead;
+
+    memset(mtr, 0x00, sizeof(meter));
+    mtr->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (mtr->fd < 0) {
+        return -1;
+    }
+
+    if (pread(mtr->fd, &l_SHead, sizeof(meter_shared), 0) != sizeof(meter_shared)
+            || memcmp(l_SHead.magic, METER_MAGIC, 8)
+            || l_SHead.size != sizeof(meter_shared)) {
+        close(mtr->fd);
+        mtr->fd = -1;
+        return -1;
+    }
+
+    mtr->map_size = sizeof(meter_shared);
+
+    if (meter_map(mtr, PROT_READ) < 0) {
+        close(mtr->fd);
+        mtr->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void meter_close(meter *mtr) {
+    if (mtr->shared != NULL && mtr->fd >= 0) {
+        munmap(mtr->shared, mtr->map_size);
+    } else {
+        free(mtr->shared);
+    }
+
+    if (mtr->fd >= 0) {
+        close(mtr->fd);
+    }
+
+    mtr->shared = NULL;
+    mtr->fd = -1;
+}
+
+/* Writer side of seqlock. Only one writer (audio callback) */
+static inline void meter_publish(meter *mtr, const levels *lv, long frames) {
+    meter_shared *l_SShared = mtr->shared;
+    uint32_t l_iSeq = atomic_load_explicit(&l_SShared->seq, memory_order_relaxed);
+    uint32_t i = 0;
+    int l_iClipped = 0;
+
+    atomic_store_explicit(&l_SShared->seq, l_iSeq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (i = 0; i < l_SShared->snap.channels; i++) {
+        l_SShared->snap.peak[i] = levels_peak(&lv[i]);
+        l_SShared->snap.rms[i] = levels_rms(&lv[i]);
+        l_iClipped |= l_SShared->snap.peak[i] >= 1.0f;
+    }
+
+    l_SShared->snap.blocks++;
+    l_SShared->snap.frames += frames;
+    l_SShared->snap.clipped += l_iClipped;
+
+    atomic_store_explicit(&l_SShared->seq, l_iSeq + 2, memory_order_release);
+}
+
+/* Call from audio callback with interleaved float frames */
+static inline void meter_update(meter *mtr, const float *pcm, long frames) {
+    levels l_SLevels[METER_MAX_CHANNELS];
+
+    if (mtr->shared == NULL || pcm == NULL || frames <= 0) {
+        return;
+    }
+
+    levels_scan_channels(pcm, frames, mtr->shared->snap.channels, l_SLevels);
+    meter_publish(mtr, l_SLevels, frames);
+}
+
+/* Block that is in two pieces, like both read regions of ring */
+static inline void meter_update2(meter *mtr, const float *first, long first_frames,
+                                 const float *second, long second_frames) {
+    levels l_SLevels[METER_MAX_CHANNELS];
+    levels l_SPart[METER_MAX_CHANNELS];
+
+    if (mtr->shared == NULL || first_frames + second_frames <= 0) {
+        return;
+    }
+
+    levels_scan_channels(first, first_frames, mtr->shared->snap.channels, l_SLevels);
+    levels_scan_channels(second, second_frames, mtr->shared->snap.channels, l_SPart);
+    levels_merge(l_SLevels, l_SPart, mtr->shared->snap.channels);
+    meter_publish(mtr, l_SLevels, first_frames + second_frames);
+}
+
+/* Integer samples of 2, 3 (packed little endian) or 4 bytes. Converted
+   to float in small chunks on stack */
+static inline void meter_update_int(meter *mtr, const void *pcm, int sample_bytes, long frames) {
+    levels l_SLevels[METER_MAX_CHANNELS];
+    levels l_SPart[METER_MAX_CHANNELS];
+    float l_fChunk[METER_INT_CHUNK];
+    const unsigned char *l_ptrBytes = (const unsigned char *)pcm;
+    const unsigned char *l_ptrSample = NULL;
+    long l_lChunkFrames = 0;
+    long l_lDone = 0;
+    long l_lPart = 0;
+    long l_lFirst = 0;
+    long i = 0;
+    uint32_t l_iChannels = 0;
+
+    if (mtr->shared == NULL || pcm == NULL || frames <= 0) {
+        return;
+    }
+
+    l_iChannels = mtr->shared->snap.channels;
+    l_lChunkFrames = METER_INT_CHUNK / l_iChannels;
+    memset(l_SLevels, 0x00, sizeof(levels) * l_iChannels);
+
+    for (l_lDone = 0; l_lDone < frames; l_lDone += l_lPart) {
+        l_lPart = frames - l_lDone < l_lChunkFrames ? frames - l_lDone : l_lChunkFrames;
+        l_lFirst = l_lDone * l_iChannels;
+
+        if (sample_bytes == 2) {
+            for (i = 0; i < l_lPart * l_iChannels; i++) {
+                l_fChunk[i] = ((const short *)pcm)[l_lFirst + i] * (1.0f / 32768.0f);
+            }
+        } else if (sample_bytes == 3) {
+            for (i = 0; i < l_lPart * l_iChannels; i++) {
+                l_ptrSample = l_ptrBytes + (l_lFirst + i) * 3;
+                l_fChunk[i] = (int32_t)((uint32_t)l_ptrSample[0] << 8 | (uint32_t)l_ptrSample[1] << 16
+                                        | (uint32_t)l_ptrSample[2] << 24) * (1.0f / 2147483648.0f);
+            }
+        } else {
+            for (i = 0; i < l_lPart * l_iChannels; i++) {
+                l_fChunk[i] = ((const int32_t *)pcm)[l_lFirst + i] * (1.0f / 2147483648.0f);
+            }
+        }
+
+        levels_scan_channels(l_fChunk, l_lPart, l_iChannels, l_SPart);
+        levels_merge(l_SLevels, l_SPart, l_iChannels);
+    }
+
+    meter_publish(mtr, l_SLevels, frames);
+}
+
+static inline void meter_update_s16(meter *mtr, const short *pcm, long frames) {
+    meter_update_int(mtr, pcm, sizeof(short), frames);
+}
+
+/* Any thread or process. Returns -1 if writer was always in middle of update */
+static inline int meter_read(const meter *mtr, meter_snapshot *snap) {
+    uint32_t l_iBefore = 0;
+    int i = 0;
+
+    for (i = 0; i < METER_READ_TRIES; i++) {
+        l_iBefore = atomic_load_explicit(&mtr->shared->seq, memory_order_acquire);
+
+        if (l_iBefore & 1) {
+            continue;
+        }
+
+        memcpy(snap, &mtr->shared->snap, sizeof(meter_snapshot));
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&mtr->shared->seq, memory_order_relaxed) == l_iBefore) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Print where meter can be watched */
+static inline void meter_print_path(const meter *mtr) {
+    char l_strPath[64];
+
+    if (meter_path(mtr, l_strPath, sizeof(l_strPath)) == 0) {
+        printf("Level meter: %s (watch with tools/meter_watch %s)\n", l_strPath, l_strPath);
+    }
+}
+
+/* Last levels and clipped blocks */
+static inline void meter_print_stats(const meter *mtr) {
+    meter_snapshot l_SSnap;
+    uint32_t i = 0;
+
+    if (mtr->shared == NULL || meter_read(mtr, &l_SSnap) < 0) {
+        return;
+    }
+
+    printf("meter: %llu blocks, %llu clipped. Last block peak/RMS dBFS:",
+           (unsigned long long)l_SSnap.blocks, (unsigned long long)l_SSnap.clipped);
+
+    for (i = 0; i < l_SSnap.channels; i++) {
+        printf(" %.1f/%.1f", levels_db(l_SSnap.peak[i]), levels_db(l_SSnap.rms[i]));
+    }
+
+    printf("\n");
+}
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Play file in its own sample format when nothing is done to samples.
+ *
+ * Players used to read everything with sf_read_float() and open float
+ * stream, so 16-bit file was expanded to float here and converted back
+ * to 16 bits by the server or driver. When no gain or other processing
+ * is needed samples can go as they are:
+ *
+ *   PCM 8/16 bit   sf_read_short()              S16 (2 bytes per sample)
+ *   PCM 24 bit     sf_read_raw() from WAV/AIFF  S24 (3 bytes, not decoded)
+ *                  sf_read_int() from FLAC      S32 (4 bytes)
+ *   PCM 32 bit     sf_read_int()                S32 (4 bytes)
+ *   anything else  sf_read_float()              FLOAT (4 bytes)
+ *
+ * Raw 24-bit bytes are used only when libsndfile says they are already
+ * in native byte order (SFC_RAW_DATA_NEEDS_ENDSWAP). All formats are
+ * native endian: S16LE, S24LE and S32LE on x86 and ARM.
+ *
+ * nativefmt_print() tells bytes per second against float stream.
+ *
+ * Header only: just include it. Needs libsndfile.
+ */
+
+#ifndef NATIVEFMT_H
+#define NATIVEFMT_H
+
+#include <stdio.h>
+#include <sndfile.h>
+
+enum {
+    NATIVEFMT_FLOAT = 0,
+    NATIVEFMT_S16,
+    NATIVEFMT_S24,
+    NATIVEFMT_S32
+};
+
+typedef struct nativefmt {
+    int kind;
+    /* Bytes of one sample in stream */
+    int sample_bytes;
+    /* S24 comes with sf_read_raw() */
+    int raw;
+    int channels;
+    int samplerate;
+} nativefmt;
+
+/* Choose stream format for file. 'processing' forces float */
+static inline void nativefmt_pick(nativefmt *nf, SNDFILE *file, const SF_INFO *info, int processing) {
+    nf->kind = NATIVEFMT_FLOAT;
+    nf->sample_bytes = sizeof(float);
+    nf->raw = 0;
+    nf->channels = info->channels;
+    nf->samplerate = info->samplerate;
+
+    if (processing || file == NULL) {
+        return;
+    }
+
+    switch (info->format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_PCM_U8:
+        case SF_FORMAT_PCM_16:
+            nf->kind = NATIVEFMT_S16;
+            nf->sample_bytes = sizeof(short);
+            break;
+
+        case SF_FORMAT_PCM_24:
+            /* FLAC has no raw samples to read */
+            if ((info->format & SF_FORMAT_TYPEMASK) != SF_FORMAT_FLAC
+                    && sf_command(file, SFC_RAW_DATA_NEEDS_ENDSWAP, NULL, 0) == SF_FALSE) {
+                nf->kind = NATIVEFMT_S24;
+                nf->sample_bytes = 3;
+                nf->raw = 1;
+            } else {
+                nf->kind = NATIVEFMT_S32;
+                nf->sample_bytes = sizeof(int);
+            }
+
+            break;
+
+        case SF_FORMAT_PCM_32:
+            nf->kind = NATIVEFMT_S32;
+            nf->sample_bytes = sizeof(int);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static inline const char *nativefmt_name(const nativefmt *nf) {
+    static const char *l_strNames[] = { "float32", "s16", "s24", "s32" };
+    return l_strNames[nf->kind];
+}
+
+static inline long nativefmt_frame_bytes(const nativefmt *nf) {
+    return (long)nf->sample_bytes * nf->channels;
+}
+
+/* Read 'samples' samples in stream format. Returns samples read */
+static inline long nativefmt_read(const nativefmt *nf, SNDFILE *file, void *buf, long samples) {
+    switch (nf->kind) {
+        case NATIVEFMT_S16:
+            return sf_read_short(file, (short *)buf, samples);
+
+        case NATIVEFMT_S24:
+            return sf_read_raw(file, buf, samples * 3) / 3;
+
+        case NATIVEFMT_S32:
+            return sf_read_int(file, (int *)buf, samples);
+
+        default:
+            return sf_read_float(file, (float *)buf, samples);
+    }
+}
+
+static inline void nativefmt_print(const nativefmt *nf) {
+    long l_lFloat = (long)nf->samplerate * nf->channels * sizeof(float);
+    long l_lNative = (long)nf->samplerate * nativefmt_frame_bytes(nf);
+
+    printf("nativefmt: Stream is %s%s, %ld bytes/s (%ld%% of float stream)\n",
+           nativefmt_name(nf), nf->kind == NATIVEFMT_FLOAT ? "" : " without float conversion",
+           l_lNative, l_lFloat > 0 ? l_lNative * 100 / l_lFloat : 0);
+}
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Waveform peak file: min/max/RMS pyramid for drawing overviews.
+ *
+ * Level 0 has one bin per PEAKFILE_BASE_FRAMES frames and every next level
+ * PEAKFILE_FACTOR times fewer bins. Drawing picks coarsest level that still
+ * has at least one bin per pixel (peakfile_pick_level()) so a one hour file
+ * is drawn from few thousand bins without decoding anything.
+ *
+ * File is saved next to audio file as 'file.flac.peaks' and is meant to be
+ * mmap()ed as is:
+ *
+ *   peakfile_header (native byte order, PEAKFILE_HEADER_SIZE bytes)
+ *   level 0 bins, level 1 bins ... (bins * channels peakfile_bin each)
+ *
+ * Bin has 16-bit min, max and RMS so it is 6 bytes per channel. Header
+ * remembers size and modification time of audio file so tool can tell if
+ * file is up to date or has only grown (recording still going on).
+ *
+ * Header only: just include it. Needs -lm.
+ */
+
+#ifndef PEAKFILE_H
+#define PEAKFILE_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "levels.h"
+
+#define PEAKFILE_MAGIC "LAEPEAK1"
+#define PEAKFILE_HEADER_SIZE 512
+#define PEAKFILE_MAX_LEVELS 8
+#define PEAKFILE_BASE_FRAMES 256
+#define PEAKFILE_FACTOR 4
+/* 256, 1024 ... 262144 frames per bin */
+#define PEAKFILE_LEVELS 7
+#define PEAKFILE_MAX_CHANNELS 64
+
+typedef struct peakfile_bin {
+    int16_t min;
+    int16_t max;
+    uint16_t rms;
+} peakfile_bin;
+
+typedef struct peakfile_level {
+    uint64_t offset;
+    uint64_t bins;
+    uint64_t frames_per_bin;
+} peakfile_level;
+
+typedef struct peakfile_header {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t samplerate;
+    uint32_t channels;
+    uint32_t levels;
+    uint64_t frames;
+    uint64_t source_size;
+    int64_t source_mtime;
+    peakfile_level level[PEAKFILE_MAX_LEVELS];
+} peakfile_header;
+
+_Static_assert(sizeof(peakfile_bin) == 6, "peakfile bin must be packed");
+_Static_assert(sizeof(peakfile_header) <= PEAKFILE_HEADER_SIZE, "peakfile header too big");
+
+typedef struct peakfile {
+    int fd;
+    size_t map_size;
+    const peakfile_header *header;
+} peakfile;
+
+static inline int16_t peakfile_quantize(float value) {
+    value = value > 1.0f ? 1.0f : (value < -1.0f ? -1.0f : value);
+    return (int16_t)lrintf(value * 32767.0f);
+}
+
+static inline uint16_t peakfile_quantize_rms(float value) {
+    value = value > 1.0f ? 1.0f : value;
+    return (uint16_t)lrintf(value * 65535.0f);
+}
+
+/* Bin from measured levels */
+static inline void peakfile_bin_set(peakfile_bin *bin, const levels *lv) {
+    bin->min = peakfile_quantize(lv->min);
+    bin->max = peakfile_quantize(lv->max);
+    bin->rms = peakfile_quantize_rms(levels_rms(lv));
+}
+
+/* Lay levels out after header. Returns file size */
+static inline size_t peakfile_layout(peakfile_header *header, uint64_t level0_bins) {
+    uint64_t l_lOffset = PEAKFILE_HEADER_SIZE;
+    uint64_t l_lBins = level0_bins;
+    uint64_t l_lFrames = PEAKFILE_BASE_FRAMES;
+    uint32_t i = 0;
+
+    header->header_size = PEAKFILE_HEADER_SIZE;
+    header->levels = PEAKFILE_LEVELS;
+
+    for (i = 0; i < PEAKFILE_LEVELS; i++) {
+        header->level[i].offset = l_lOffset;
+        header->level[i].bins = l_lBins;
+        header->level[i].frames_per_bin = l_lFrames;
+        l_lOffset += l_lBins * header->channels * sizeof(peakfile_bin);
+        l_lOffset = (l_lOffset + 7) & ~(uint64_t)7;
+        l_lBins = (l_lBins + PEAKFILE_FACTOR - 1) / PEAKFILE_FACTOR;
+        l_lFrames *= PEAKFILE_FACTOR;
+    }
+
+    return l_lOffset;
+}
+
+/* Make upper levels from level 0. 'base' holds level 0 bins and is followed
+   by room for other levels just like in file. Last bin of level may cover
+   fewer frames and its RMS is weighted so */
+static inline void peakfile_build_levels(peakfile_header *header, char *base) {
+    const peakfile_bin *l_SLower = NULL;
+    peakfile_bin *l_SUpper = NULL;
+    uint64_t l_lLowerFrames = 0;
+    uint64_t l_lFrames = 0;
+    uint64_t l_lBin = 0;
+    uint64_t l_lFirst = 0;
+    uint64_t l_lLast = 0;
+    uint64_t j = 0;
+    uint32_t l = 0;
+    uint32_t c = 0;
+    double l_dSum = 0.0;
+    double l_dRms = 0.0;
+    int16_t l_iMin = 0;
+    int16_t l_iMax = 0;
+
+    for (l = 1; l < header->levels; l++) {
+        l_SLower = (const peakfile_bin *)(base + header->level[l - 1].offset - PEAKFILE_HEADER_SIZE);
+        l_SUpper = (peakfile_bin *)(base + header->level[l].offset - PEAKFILE_HEADER_SIZE);
+
+        for (l_lBin = 0; l_lBin < header->level[l].bins; l_lBin++) {
+            l_lFirst = l_lBin * PEAKFILE_FACTOR;
+            l_lLast = l_lFirst + PEAKFILE_FACTOR;
+            l_lLast = l_lLast < header->level[l - 1].bins ? l_lLast : header->level[l - 1].bins;
+
+            for (c = 0; c < header->channels; c++) {
+                l_iMin = INT16_MAX;
+                l_iMax = INT16_MIN;
+                l_dSum = 0.0;
+                l_lFrames = 0;
+
+                for (j = l_lFirst; j < l_lLast; j++) {
+                    const peakfile_bin *l_SBin = &l_SLower[j * header->channels + c];
+                    l_lLowerFrames = header->level[l - 1].frames_per_bin;
+
+                    /* Last bin of whole file */
+                    if ((j + 1) * l_lLowerFrames > header->frames) {
+                        l_lLowerFrames = header->frames - j * l_lLowerFrames;
+                    }
+
+                    l_iMin = l_SBin->min < l_iMin ? l_SBin->min : l_iMin;
+                    l_iMax = l_SBin->max > l_iMax ? l_SBin->max : l_iMax;
+                    l_dRms = l_SBin->rms / 65535.0;
+                    l_dSum += l_dRms * l_dRms * l_lLowerFrames;
+                    l_lFrames += l_lLowerFrames;
+                }
+
+                l_SUpper[l_lBin * header->channels + c].min = l_iMin;
+                l_SUpper[l_lBin * header->channels + c].max = l_iMax;
+                l_SUpper[l_lBin * header->channels + c].rms = l_lFrames > 0
+                        ? peakfile_quantize_rms((float)sqrt(l_dSum / l_lFrames)) : 0;
+            }
+        }
+    }
+}
+
+/* Map peak file read only */
+static inline int peakfile_map(peakfile *pf, const char *path) {
+    struct stat l_SStat;
+    const peakfile_header *l_SHeader = NULL;
+    uint32_t i = 0;
+
+    memset(pf, 0x00, sizeof(peakfile));
+    pf->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (pf->fd < 0) {
+        return -1;
+    }
+
+    if (fstat(pf->fd, &l_SStat) < 0 || (size_t)l_SStat.st_size < PEAKFILE_HEADER_SIZE) {
+        close(pf->fd);
+        pf->fd = -1;
+        return -1;
+    }
+
+    pf->map_size = l_SStat.st_size;
+    l_SHeader = (const peakfile_header *)mmap(NULL, pf->map_size, PROT_READ, MAP_SHARED, pf->fd, 0);
+
+    if (l_SHeader == MAP_FAILED) {
+        close(pf->fd);
+        pf->fd = -1;
+        return -1;
+    }
+
+    pf->header = l_SHeader;
+
+    if (memcmp(l_SHeader->magic, PEAKFILE_MAGIC, 8) || l_SHeader->header_size != PEAKFILE_HEADER_SIZE
+            || l_SHeader->channels == 0 || l_SHeader->levels == 0 || l_SHeader->levels > PEAKFILE_MAX_LEVELS) {
+        munmap((void *)l_SHeader, pf->map_size);
+        close(pf->fd);
+        memset(pf, 0x00, sizeof(peakfile));
+        pf->fd = -1;
+        return -1;
+    }
+
+    /* Every level must be inside file */
+    for (i = 0; i < l_SHeader->levels; i++) {
+        if (l_SHeader->level[i].offset + l_SHeader->level[i].bins * l_SHeader->channels * sizeof(peakfile_bin) > pf->map_size) {
+            munmap((void *)l_SHeader, pf->map_size);
+            close(pf->fd);
+            memset(pf, 0x00, sizeof(peakfile));
+            pf->fd = -1;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static inline void peakfile_unmap(peakfile *pf) {
+    if (pf->header != NULL) {
+        munmap((void *)pf->header, pf->map_size);
+    }
+
+    if (pf->fd >= 0) {
+        close(pf->fd);
+    }
+
+    pf->header = NULL;
+    pf->fd = -1;
+}
+
+/* Bins of level. Channels are interleaved like in audio */
+static inline const peakfile_bin *peakfile_bins(const peakfile *pf, uint32_t level) {
+    return (const peakfile_bin *)((const char *)pf->header + pf->header->level[level].offset);
+}
+
+/* Coarsest level that has at least one bin for every 'frames_per_pixel' */
+static inline uint32_t peakfile_pick_level(const peakfile *pf, uint64_t frames_per_pixel) {
+    uint32_t l = 0;
+
+    while (l + 1 < pf->header->levels && pf->header->level[l + 1].frames_per_bin <= frames_per_pixel) {
+        l++;
+    }
+
+    return l;
+}
+
+#endif
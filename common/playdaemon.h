@@ -0,0 +1,745 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Resident player engine for daemons that keep audio stream open.
+ *
+ * Starting player for every short sound costs server connection, device
+ * setup and stream start before first sample. Daemon does that once and
+ * then its stream runs all the time playing silence when there is nothing
+ * to play. Clients connect to UNIX socket and send lines:
+ *
+ *   play PATH    stop everything and play PATH now   -> 'ok ID'
+ *   queue PATH   play PATH after everything queued   -> 'ok ID'
+ *   stop         stop playing and empty queue        -> 'ok'
+ *   status       -> 'status playing ID queued N played N' or 'status idle ...'
+ *
+ * Socket is '$XDG_RUNTIME_DIR/playdaemon.sock' (or '/tmp/playdaemon-UID.sock'
+ * without it) and only its owner can connect. Line longer than
+ * PLAYDAEMON_LINE is answered with error and ignored up to its newline.
+ *
+ * Errors are answered with 'error message'. Later client gets 'started ID
+ * US' when first frame of its item was given to device (US is micro
+ * seconds from reading command) and 'done ID' or 'stopped ID' at end.
+ * Statistics of time to first sample leave out items that waited in queue.
+ *
+ * Main thread (control loop, see ctlloop.h) owns sockets and files. It
+ * opens file, reads first PLAYDAEMON_PRIME_FRAMES to ring of item and
+ * passes item to audio thread through lock-free command ring. Audio
+ * callback calls playdaemon_fill() which only copies from ring of
+ * current item and moves to next one at end. Started and finished items
+ * come back through event ring and main thread is woken with
+ * ctlloop_notify() to answer client, refill rings and close files. Audio
+ * thread never reads files, allocates or locks.
+ *
+ * Files must have stream sample rate. Mono files are played on every
+ * channel. Loudness gain of 'file.r128' (see loudness.h) is applied.
+ *
+ * Header only: just include it. Needs C11 atomics, libsndfile and -lm.
+ */
+
+#ifndef PLAYDAEMON_H
+#define PLAYDAEMON_H
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sndfile.h>
+
+#include "ctlloop.h"
+#include "loudness.h"
+#include "ringbuffer.h"
+
+#define PLAYDAEMON_SOCKET_NAME "playdaemon.sock"
+#define PLAYDAEMON_MAX_CLIENTS 64
+/* Items playing or waiting in queue */
+#define PLAYDAEMON_MAX_ITEMS 64
+/* Ring of every item. Main thread refills when half of it is played */
+#define PLAYDAEMON_ITEM_FRAMES 16384
+/* Read before item is given to audio thread. Rest after answer */
+#define PLAYDAEMON_PRIME_FRAMES 2048
+/* Frames read from file at once */
+#define PLAYDAEMON_READ_FRAMES 2048
+#define PLAYDAEMON_LINE 4096
+
+/* Commands to audio thread */
+enum {
+    PLAYDAEMON_PLAY = 0,
+    PLAYDAEMON_QUEUE,
+    PLAYDAEMON_STOP
+};
+
+/* Events from audio thread */
+enum {
+    PLAYDAEMON_STARTED = 0,
+    PLAYDAEMON_DONE,
+    PLAYDAEMON_STOPPED
+};
+
+typedef struct playdaemon_item {
+    uint32_t id;
+    /* Client slot and its generation so answer goes to right connection */
+    int client;
+    uint32_t client_gen;
+    SNDFILE *file;
+    int channels;
+    float gain;
+    /* Frames in stream format. Main thread writes, audio thread reads */
+    ringbuffer ring;
+    /* Whole file is in ring */
+    atomic_int eof;
+    /* Monotonic seconds when command was read */
+    double requested;
+    /* Audio thread only until started/finished event */
+    double started;
+    /* Was queued behind other item so start time is not latency */
+    int waited;
+    long frames;
+    /* Playlist of audio thread */
+    struct playdaemon_item *next;
+    /* All items main thread has not got back yet */
+    struct playdaemon_item *live_next;
+} playdaemon_item;
+
+typedef struct playdaemon_msg {
+    int type;
+    playdaemon_item *item;
+} playdaemon_msg;
+
+typedef struct playdaemon_client {
+    int fd;
+    uint32_t gen;
+    size_t used;
+    /* Rest of too long line is thrown away up to newline */
+    int discard;
+    char line[PLAYDAEMON_LINE];
+} playdaemon_client;
+
+typedef struct playdaemon {
+    int samplerate;
+    int channels;
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    ctlloop *control;
+    playdaemon_client client[PLAYDAEMON_MAX_CLIENTS];
+    /* Main thread */
+    playdaemon_item *live;
+    int live_count;
+    uint32_t next_id;
+    float *block;
+    /* Main thread -> audio thread and back */
+    ringbuffer commands;
+    ringbuffer events;
+    atomic_int refill_asked;
+    /* Audio thread */
+    playdaemon_item *current;
+    playdaemon_item *last;
+    atomic_long callbacks;
+    atomic_long underruns;
+    /* Statistics of main thread */
+    long played;
+    long stopped;
+    long failed;
+    long started;
+    double ttfs_min;
+    double ttfs_max;
+    double ttfs_sum;
+} playdaemon;
+
+/* Socket of this user when -s is not given. Private runtime directory if
+   there is one, /tmp with user id otherwise */
+static inline void playdaemon_default_socket(char *path, size_t len) {
+    const char *l_strRuntime = getenv("XDG_RUNTIME_DIR");
+
+    if (l_strRuntime != NULL && l_strRuntime[0] == '/') {
+        snprintf(path, len, "%s/%s", l_strRuntime, PLAYDAEMON_SOCKET_NAME);
+    } else {
+        snprintf(path, len, "/tmp/playdaemon-%u.sock", (unsigned int)getuid());
+    }
+}
+
+static inline double playdaemon_now(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+/* Audio thread: hand item back to main thread */
+static inline void playdaemon_post(playdaemon *pd, int type, playdaemon_item *item) {
+    playdaemon_msg l_SMsg;
+
+    l_SMsg.type = type;
+    l_SMsg.item = item;
+    /* Can't be full: there are never more items than it has room for */
+    ringbuffer_write(&pd->events, &l_SMsg, sizeof(playdaemon_msg));
+    ctlloop_notify(pd->control);
+}
+
+/* Audio thread: stop current and everything queued */
+static inline void playdaemon_stop_all(playdaemon *pd) {
+    playdaemon_item *l_SNext = NULL;
+
+    while (pd->current != NULL) {
+        l_SNext = pd->current->next;
+        playdaemon_post(pd, PLAYDAEMON_STOPPED, pd->current);
+        pd->current = l_SNext;
+    }
+
+    pd->last = NULL;
+}
+
+static inline void playdaemon_append(playdaemon *pd, playdaemon_item *item) {
+    item->next = NULL;
+    item->waited = pd->current != NULL;
+
+    if (pd->current == NULL) {
+        pd->current = item;
+    } else {
+        pd->last->next = item;
+    }
+
+    pd->last = item;
+}
+
+/* Audio thread: fill interleaved float block of stream. Silence when
+   there is nothing to play */
+static inline void playdaemon_fill(playdaemon *pd, float *out, long frames) {
+    size_t l_lFrameBytes = pd->channels * sizeof(float);
+    playdaemon_item *l_SItem = NULL;
+    playdaemon_msg l_SMsg;
+    long l_lDone = 0;
+    long l_lGot = 0;
+
+    atomic_fetch_add_explicit(&pd->callbacks, 1, memory_order_relaxed);
+
+    while (ringbuffer_read(&pd->commands, &l_SMsg, sizeof(playdaemon_msg)) == sizeof(playdaemon_msg)) {
+        if (l_SMsg.type != PLAYDAEMON_QUEUE) {
+            playdaemon_stop_all(pd);
+        }
+
+        if (l_SMsg.item != NULL) {
+            playdaemon_append(pd, l_SMsg.item);
+        }
+    }
+
+    while (l_lDone < frames && pd->current != NULL) {
+        l_SItem = pd->current;
+        l_lGot = ringbuffer_read(&l_SItem->ring, out + l_lDone * pd->channels, (frames - l_lDone) * l_lFrameBytes) / l_lFrameBytes;
+
+        if (l_lGot > 0 && l_SItem->frames == 0) {
+            l_SItem->started = playdaemon_now();
+            playdaemon_post(pd, PLAYDAEMON_STARTED, l_SItem);
+        }
+
+        l_SItem->frames += l_lGot;
+        l_lDone += l_lGot;
+
+        if (l_lDone < frames) {
+            if (!atomic_load_explicit(&l_SItem->eof, memory_order_acquire)) {
+                /* Main thread did not keep up */
+                atomic_fetch_add_explicit(&pd->underruns, 1, memory_order_relaxed);
+                break;
+            }
+
+            /* Ring may have got last frames after read above */
+            if (ringbuffer_read_space(&l_SItem->ring) >= l_lFrameBytes) {
+                continue;
+            }
+
+            pd->current = l_SItem->next;
+            pd->last = pd->current == NULL ? NULL : pd->last;
+            playdaemon_post(pd, PLAYDAEMON_DONE, l_SItem);
+        }
+    }
+
+    memset(out + l_lDone * pd->channels, 0x00, (frames - l_lDone) * l_lFrameBytes);
+
+    /* Ask main thread to read more when half of ring is played */
+    l_SItem = pd->current;
+
+    if (l_SItem != NULL && !atomic_load_explicit(&l_SItem->eof, memory_order_relaxed)
+            && ringbuffer_read_space(&l_SItem->ring) < l_SItem->ring.size / 2
+            && !atomic_exchange_explicit(&pd->refill_asked, 1, memory_order_relaxed)) {
+        ctlloop_notify(pd->control);
+    }
+}
+
+/* Main thread: read file to ring of item until ring is full, 'limit'
+   frames are read or file ends */
+static inline void playdaemon_refill(playdaemon *pd, playdaemon_item *item, long limit) {
+    size_t l_lFrameBytes = pd->channels * sizeof(float);
+    long l_lSpace = 0;
+    long l_lWant = 0;
+    long l_lGot = 0;
+    long i = 0;
+    int c = 0;
+
+    while (!atomic_load(&item->eof) && limit > 0) {
+        l_lSpace = ringbuffer_write_space(&item->ring) / l_lFrameBytes;
+        l_lWant = l_lSpace < PLAYDAEMON_READ_FRAMES ? l_lSpace : PLAYDAEMON_READ_FRAMES;
+        l_lWant = l_lWant < limit ? l_lWant : limit;
+
+        if (l_lWant <= 0) {
+            break;
+        }
+
+        l_lGot = sf_readf_float(item->file, pd->block, l_lWant);
+
+        if (l_lGot <= 0) {
+            atomic_store_explicit(&item->eof, 1, memory_order_release);
+            break;
+        }
+
+        /* Mono to every channel. Backwards so it can be done in place */
+        if (item->channels == 1 && pd->channels > 1) {
+            for (i = l_lGot - 1; i >= 0; i--) {
+                for (c = 0; c < pd->channels; c++) {
+                    pd->block[i * pd->channels + c] = pd->block[i];
+                }
+            }
+        }
+
+        loudness_apply(pd->block, l_lGot * pd->channels, item->gain);
+        ringbuffer_write(&item->ring, pd->block, l_lGot * l_lFrameBytes);
+        limit -= l_lGot;
+    }
+}
+
+static inline void playdaemon_item_free(playdaemon_item *item) {
+    if (item->file != NULL) {
+        sf_close(item->file);
+    }
+
+    ringbuffer_free(&item->ring);
+    free(item);
+}
+
+/* Main thread: open file and read its first frames. Message of failure
+   goes to 'error' */
+static inline playdaemon_item *playdaemon_item_open(playdaemon *pd, const char *path, char *error, size_t len) {
+    playdaemon_item *l_SItem = NULL;
+    SF_INFO l_SInfo;
+    SNDFILE *l_SFile = NULL;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if (pd->live_count >= PLAYDAEMON_MAX_ITEMS) {
+        snprintf(error, len, "queue is full (%d items)", PLAYDAEMON_MAX_ITEMS);
+        return NULL;
+    }
+
+    if ((l_SFile = sf_open(path, SFM_READ, &l_SInfo)) == NULL) {
+        snprintf(error, len, "can't open %s: %s", path, sf_strerror(NULL));
+        return NULL;
+    }
+
+    if (l_SInfo.samplerate != pd->samplerate || (l_SInfo.channels != 1 && l_SInfo.channels != pd->channels)) {
+        snprintf(error, len, "%s is %d Hz %d channels but stream is %d Hz %d channels",
+                 path, l_SInfo.samplerate, l_SInfo.channels, pd->samplerate, pd->channels);
+        sf_close(l_SFile);
+        return NULL;
+    }
+
+    l_SItem = (playdaemon_item *)calloc(1, sizeof(playdaemon_item));
+
+    if (l_SItem == NULL || ringbuffer_init(&l_SItem->ring, PLAYDAEMON_ITEM_FRAMES * pd->channels * sizeof(float)) < 0) {
+        snprintf(error, len, "out of memory");
+        free(l_SItem);
+        sf_close(l_SFile);
+        return NULL;
+    }
+
+    l_SItem->file = l_SFile;
+    l_SItem->channels = l_SInfo.channels;
+    l_SItem->gain = loudness_gain_load(path);
+    l_SItem->id = ++pd->next_id;
+    atomic_init(&l_SItem->eof, 0);
+    playdaemon_refill(pd, l_SItem, PLAYDAEMON_PRIME_FRAMES);
+    return l_SItem;
+}
+
+/* Main thread: answer to client if it is still same connection */
+static inline void playdaemon_send(playdaemon *pd, int client, uint32_t gen, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static inline void playdaemon_send(playdaemon *pd, int client, uint32_t gen, const char *format, ...) {
+    char l_strLine[PLAYDAEMON_LINE];
+    va_list l_SArgs;
+    int l_iLen = 0;
+
+    if (client < 0 || pd->client[client].fd < 0 || pd->client[client].gen != gen) {
+        return;
+    }
+
+    va_start(l_SArgs, format);
+    l_iLen = vsnprintf(l_strLine, sizeof(l_strLine), format, l_SArgs);
+    va_end(l_SArgs);
+
+    /* Client that does not read its answers loses them */
+    if (send(pd->client[client].fd, l_strLine, l_iLen < (int)sizeof(l_strLine) ? l_iLen : (int)sizeof(l_strLine) - 1,
+             MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "playdaemon_send: %s\n", strerror(errno));
+    }
+}
+
+/* Main thread: run one command line of client */
+static inline void playdaemon_command(playdaemon *pd, int client, char *line, double requested) {
+    playdaemon_item *l_SItem = NULL;
+    playdaemon_msg l_SMsg;
+    uint32_t l_iGen = pd->client[client].gen;
+    char l_strError[512];
+    int l_iQueued = pd->live_count;
+
+    memset(&l_SMsg, 0x00, sizeof(playdaemon_msg));
+
+    /* Audio thread has not run for long time (stream is stuck) */
+    if (ringbuffer_write_space(&pd->commands) < sizeof(playdaemon_msg)
+            && (!strncmp(line, "play ", 5) || !strncmp(line, "queue ", 6) || !strcmp(line, "stop"))) {
+        playdaemon_send(pd, client, l_iGen, "error audio thread is not running\n");
+        return;
+    }
+
+    if (!strncmp(line, "play ", 5) || !strncmp(line, "queue ", 6)) {
+        l_SMsg.type = line[0] == 'p' ? PLAYDAEMON_PLAY : PLAYDAEMON_QUEUE;
+        l_SItem = playdaemon_item_open(pd, strchr(line, ' ') + 1, l_strError, sizeof(l_strError));
+
+        if (l_SItem == NULL) {
+            pd->failed++;
+            playdaemon_send(pd, client, l_iGen, "error %s\n", l_strError);
+            return;
+        }
+
+        l_SItem->client = client;
+        l_SItem->client_gen = l_iGen;
+        l_SItem->requested = requested;
+        l_SItem->live_next = pd->live;
+        pd->live = l_SItem;
+        pd->live_count++;
+        l_SMsg.item = l_SItem;
+        ringbuffer_write(&pd->commands, &l_SMsg, sizeof(playdaemon_msg));
+        playdaemon_send(pd, client, l_iGen, "ok %u\n", l_SItem->id);
+        /* Rest of ring after audio thread already has first frames */
+        playdaemon_refill(pd, l_SItem, PLAYDAEMON_ITEM_FRAMES);
+    } else if (!strcmp(line, "stop")) {
+        l_SMsg.type = PLAYDAEMON_STOP;
+        ringbuffer_write(&pd->commands, &l_SMsg, sizeof(playdaemon_msg));
+        playdaemon_send(pd, client, l_iGen, "ok\n");
+    } else if (!strcmp(line, "status")) {
+        /* Newest is first in list so oldest live item is playing */
+        for (l_SItem = pd->live; l_SItem != NULL && l_SItem->live_next != NULL; l_SItem = l_SItem->live_next) {
+        }
+
+        if (l_SItem != NULL) {
+            playdaemon_send(pd, client, l_iGen, "status playing %u queued %d played %ld\n", l_SItem->id, l_iQueued - 1, pd->played);
+        } else {
+            playdaemon_send(pd, client, l_iGen, "status idle queued 0 played %ld\n", pd->played);
+        }
+    } else {
+        playdaemon_send(pd, client, l_iGen, "error unknown command '%s'\n", line);
+    }
+}
+
+static inline void playdaemon_client_close(playdaemon *pd, int client) {
+    ctlloop_unwatch(pd->control, pd->client[client].fd);
+    close(pd->client[client].fd);
+    pd->client[client].fd = -1;
+    pd->client[client].gen++;
+    pd->client[client].used = 0;
+    pd->client[client].discard = 0;
+}
+
+static inline void playdaemon_accept(playdaemon *pd) {
+    int l_iFd = 0;
+    int i = 0;
+
+    while ((l_iFd = accept4(pd->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+        for (i = 0; i < PLAYDAEMON_MAX_CLIENTS && pd->client[i].fd >= 0; i++) {
+        }
+
+        if (i == PLAYDAEMON_MAX_CLIENTS || ctlloop_watch(pd->control, l_iFd) < 0) {
+            if (send(l_iFd, "error too many clients\n", 23, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+                fprintf(stderr, "playdaemon_accept: %s\n", strerror(errno));
+            }
+
+            close(l_iFd);
+            continue;
+        }
+
+        pd->client[i].fd = l_iFd;
+        pd->client[i].used = 0;
+        pd->client[i].discard = 0;
+    }
+}
+
+/* Main thread: read what client sent and run every whole line */
+static inline void playdaemon_client_read(playdaemon *pd, int client) {
+    playdaemon_client *l_SClient = &pd->client[client];
+    double l_dNow = 0.0;
+    ssize_t l_lGot = 0;
+    char *l_strStart = NULL;
+    char *l_strEnd = NULL;
+
+    while ((l_lGot = recv(l_SClient->fd, l_SClient->line + l_SClient->used, sizeof(l_SClient->line) - 1 - l_SClient->used, 0)) > 0) {
+        l_dNow = playdaemon_now();
+        l_SClient->used += l_lGot;
+
+        /* Still in line that was too long */
+        if (l_SClient->discard) {
+            if ((l_strEnd = memchr(l_SClient->line, '\n', l_SClient->used)) == NULL) {
+                l_SClient->used = 0;
+                continue;
+            }
+
+            l_SClient->used -= l_strEnd + 1 - l_SClient->line;
+            memmove(l_SClient->line, l_strEnd + 1, l_SClient->used);
+            l_SClient->discard = 0;
+        }
+
+        l_SClient->line[l_SClient->used] = '\0';
+        l_strStart = l_SClient->line;
+
+        while ((l_strEnd = strchr(l_strStart, '\n')) != NULL) {
+            *l_strEnd = '\0';
+
+            if (l_strEnd > l_strStart && l_strEnd[-1] == '\r') {
+                l_strEnd[-1] = '\0';
+            }
+
+            playdaemon_command(pd, client, l_strStart, l_dNow);
+            l_strStart = l_strEnd + 1;
+        }
+
+        l_SClient->used -= l_strStart - l_SClient->line;
+        memmove(l_SClient->line, l_strStart, l_SClient->used);
+
+        if (l_SClient->used == sizeof(l_SClient->line) - 1) {
+            playdaemon_send(pd, client, l_SClient->gen, "error line too long\n");
+            l_SClient->used = 0;
+            l_SClient->discard = 1;
+        }
+    }
+
+    if (l_lGot == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        playdaemon_client_close(pd, client);
+    }
+}
+
+/* Main thread: events from audio thread and refills */
+static inline void playdaemon_events(playdaemon *pd) {
+    playdaemon_item **l_SLink = NULL;
+    playdaemon_item *l_SItem = NULL;
+    playdaemon_msg l_SMsg;
+    double l_dTtfs = 0.0;
+
+    atomic_store(&pd->refill_asked, 0);
+
+    while (ringbuffer_read(&pd->events, &l_SMsg, sizeof(playdaemon_msg)) == sizeof(playdaemon_msg)) {
+        l_SItem = l_SMsg.item;
+
+        if (l_SMsg.type == PLAYDAEMON_STARTED) {
+            l_dTtfs = l_SItem->started - l_SItem->requested;
+            playdaemon_send(pd, l_SItem->client, l_SItem->client_gen, "started %u %ld\n", l_SItem->id, (long)(l_dTtfs * 1e6));
+
+            if (l_SItem->waited) {
+                continue;
+            }
+
+            pd->ttfs_min = pd->started == 0 || l_dTtfs < pd->ttfs_min ? l_dTtfs : pd->ttfs_min;
+            pd->ttfs_max = l_dTtfs > pd->ttfs_max ? l_dTtfs : pd->ttfs_max;
+            pd->ttfs_sum += l_dTtfs;
+            pd->started++;
+            continue;
+        }
+
+        if (l_SMsg.type == PLAYDAEMON_DONE) {
+            pd->played++;
+        } else {
+            pd->stopped++;
+        }
+
+        playdaemon_send(pd, l_SItem->client, l_SItem->client_gen, "%s %u\n", l_SMsg.type == PLAYDAEMON_DONE ? "done" : "stopped", l_SItem->id);
+
+        for (l_SLink = &pd->live; *l_SLink != NULL && *l_SLink != l_SItem; l_SLink = &(*l_SLink)->live_next) {
+        }
+
+        if (*l_SLink != NULL) {
+            *l_SLink = l_SItem->live_next;
+            pd->live_count--;
+        }
+
+        playdaemon_item_free(l_SItem);
+    }
+
+    for (l_SItem = pd->live; l_SItem != NULL; l_SItem = l_SItem->live_next) {
+        playdaemon_refill(pd, l_SItem, PLAYDAEMON_ITEM_FRAMES);
+    }
+}
+
+/* Main thread: handle what ctlloop_wait() returned */
+static inline void playdaemon_handle(playdaemon *pd, int what) {
+    int l_iFd = 0;
+    int i = 0;
+    int c = 0;
+
+    if (what & CTLLOOP_FD) {
+        for (i = 0; i < pd->control->ready_count; i++) {
+            l_iFd = pd->control->ready[i];
+
+            if (l_iFd == pd->listen_fd) {
+                playdaemon_accept(pd);
+                continue;
+            }
+
+            for (c = 0; l_iFd >= 0 && c < PLAYDAEMON_MAX_CLIENTS; c++) {
+                if (pd->client[c].fd == l_iFd) {
+                    playdaemon_client_read(pd, c);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (what & CTLLOOP_DONE) {
+        playdaemon_events(pd);
+    }
+}
+
+/* Make listening socket at 'path' (NULL is playdaemon_default_socket()).
+   Stream of 'samplerate' and 'channels' float frames is started by
+   caller after this */
+static inline int playdaemon_open(playdaemon *pd, ctlloop *control, int samplerate, int channels, const char *path) {
+    struct sockaddr_un l_SAddr;
+    int i = 0;
+
+    memset(pd, 0x00, sizeof(playdaemon));
+    pd->listen_fd = -1;
+    pd->control = control;
+    pd->samplerate = samplerate;
+    pd->channels = channels;
+
+    for (i = 0; i < PLAYDAEMON_MAX_CLIENTS; i++) {
+        pd->client[i].fd = -1;
+    }
+
+    if (path == NULL) {
+        playdaemon_default_socket(pd->path, sizeof(pd->path));
+    } else if (strlen(path) < sizeof(pd->path)) {
+        snprintf(pd->path, sizeof(pd->path), "%s", path);
+    } else {
+        fprintf(stderr, "playdaemon_open: Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    path = pd->path;
+
+    pd->block = (float *)malloc(PLAYDAEMON_READ_FRAMES * channels * sizeof(float));
+
+    /* Room for every item to start and finish at once */
+    if (pd->block == NULL || ringbuffer_init(&pd->commands, (PLAYDAEMON_MAX_ITEMS + 16) * sizeof(playdaemon_msg)) < 0
+            || ringbuffer_init(&pd->events, PLAYDAEMON_MAX_ITEMS * 2 * sizeof(playdaemon_msg)) < 0) {
+        free(pd->block);
+        ringbuffer_free(&pd->commands);
+        return -1;
+    }
+
+    atomic_init(&pd->refill_asked, 0);
+    atomic_init(&pd->callbacks, 0);
+    atomic_init(&pd->underruns, 0);
+
+    memset(&l_SAddr, 0x00, sizeof(l_SAddr));
+    l_SAddr.sun_family = AF_UNIX;
+    snprintf(l_SAddr.sun_path, sizeof(l_SAddr.sun_path), "%s", path);
+
+    /* Socket of daemon that died is left behind */
+    unlink(path);
+    pd->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    /* Other users must not play files as this user. Nobody can connect
+       before listen() so mode is right before first client */
+    if (pd->listen_fd < 0 || bind(pd->listen_fd, (struct sockaddr *)&l_SAddr, sizeof(l_SAddr)) < 0
+            || chmod(path, S_IRUSR | S_IWUSR) < 0 || listen(pd->listen_fd, 16) < 0
+            || ctlloop_watch(control, pd->listen_fd) < 0) {
+        fprintf(stderr, "playdaemon_open: Can't listen %s: %s\n", path, strerror(errno));
+
+        if (pd->listen_fd >= 0) {
+            close(pd->listen_fd);
+        }
+
+        free(pd->block);
+        ringbuffer_free(&pd->commands);
+        ringbuffer_free(&pd->events);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Call after audio stream is stopped so audio thread is not running */
+static inline void playdaemon_close(playdaemon *pd) {
+    playdaemon_item *l_SItem = NULL;
+    int i = 0;
+
+    for (i = 0; i < PLAYDAEMON_MAX_CLIENTS; i++) {
+        if (pd->client[i].fd >= 0) {
+            playdaemon_client_close(pd, i);
+        }
+    }
+
+    while ((l_SItem = pd->live) != NULL) {
+        pd->live = l_SItem->live_next;
+        playdaemon_item_free(l_SItem);
+    }
+
+    if (pd->listen_fd >= 0) {
+        ctlloop_unwatch(pd->control, pd->listen_fd);
+        close(pd->listen_fd);
+        unlink(pd->path);
+    }
+
+    free(pd->block);
+    ringbuffer_free(&pd->commands);
+    ringbuffer_free(&pd->events);
+    pd->listen_fd = -1;
+}
+
+static inline void playdaemon_print_path(const playdaemon *pd) {
+    printf("Commands: %s (%d Hz, %d channels, send with tools/playctl -s %s)\n", pd->path, pd->samplerate, pd->channels, pd->path);
+}
+
+static inline void playdaemon_print_stats(const playdaemon *pd) {
+    printf("playdaemon: %ld played, %ld stopped, %ld failed, %ld callbacks, %ld underruns\n",
+           pd->played, pd->stopped, pd->failed, atomic_load(&pd->callbacks), atomic_load(&pd->underruns));
+
+    if (pd->started > 0) {
+        printf("playdaemon: command to first sample min %.2f ms, avg %.2f ms, max %.2f ms\n",
+               pd->ttfs_min * 1000.0, pd->ttfs_sum * 1000.0 / pd->started, pd->ttfs_max * 1000.0);
+    }
+}
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Real FFT for block convolution and spectrum analysis.
+ *
+ * Radix 2 complex FFT of 'size' points on separate real and imaginary
+ * arrays. Real FFT of 2 * size samples is one complex FFT of size: even
+ * samples go to real part and odd to imaginary and the two spectra are
+ * split afterwards with twiddles. Output is size + 1 bins from DC to
+ * Nyquist. Inverse is not scaled, result is 'size' times too big.
+ *
+ * Tables are made once with realfft_init(). After that transforms do not
+ * allocate so they can be run from audio thread.
+ *
+ * Header only: just include it. Needs -lm.
+ */
+
+#ifndef REALFFT_H
+#define REALFFT_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Tables for complex FFT of 'size' and real FFT of 2 * size */
+typedef struct realfft {
+    int size;
+    int *bitrev;
+    float *cos;
+    float *sin;
+    float *rcos;
+    float *rsin;
+} realfft;
+
+static inline void realfft_free(realfft *fft) {
+    free(fft->bitrev);
+    free(fft->cos);
+    free(fft->sin);
+    free(fft->rcos);
+    free(fft->rsin);
+    memset(fft, 0x00, sizeof(realfft));
+}
+
+/* 'size' is power of two */
+static inline int realfft_init(realfft *fft, int size) {
+    int l_iBits = 0;
+    int i = 0;
+    int j = 0;
+
+    memset(fft, 0x00, sizeof(realfft));
+    fft->size = size;
+    fft->bitrev = (int *)malloc(size * sizeof(int));
+    fft->cos = (float *)malloc(size / 2 * sizeof(float));
+    fft->sin = (float *)malloc(size / 2 * sizeof(float));
+    fft->rcos = (float *)malloc(size * sizeof(float));
+    fft->rsin = (float *)malloc(size * sizeof(float));
+
+    if (fft->bitrev == NULL || fft->cos == NULL || fft->sin == NULL || fft->rcos == NULL || fft->rsin == NULL) {
+        realfft_free(fft);
+        return -1;
+    }
+
+    while ((1 << l_iBits) < size) {
+        l_iBits++;
+    }
+
+    for (i = 0; i < size; i++) {
+        fft->bitrev[i] = 0;
+
+        for (j = 0; j < l_iBits; j++) {
+            fft->bitrev[i] |= ((i >> j) & 1) << (l_iBits - 1 - j);
+        }
+    }
+
+    for (i = 0; i < size / 2; i++) {
+        fft->cos[i] = cos(2.0 * M_PI * i / size);
+        fft->sin[i] = -sin(2.0 * M_PI * i / size);
+    }
+
+    /* Twiddles of real FFT of 2 * size */
+    for (i = 0; i < size; i++) {
+        fft->rcos[i] = cos(M_PI * i / size);
+        fft->rsin[i] = -sin(M_PI * i / size);
+    }
+
+    return 0;
+}
+
+/* In place complex FFT. Inverse is unscaled */
+static inline void realfft_complex(const realfft *fft, float *re, float *im, int inverse) {
+    float l_fSign = inverse ? -1.0f : 1.0f;
+    float l_fWr = 0.0f;
+    float l_fWi = 0.0f;
+    float l_fTr = 0.0f;
+    float l_fTi = 0.0f;
+    float l_fSwap = 0.0f;
+    int l_iHalf = 0;
+    int l_iStep = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    for (i = 0; i < fft->size; i++) {
+        j = fft->bitrev[i];
+
+        if (j > i) {
+            l_fSwap = re[i];
+            re[i] = re[j];
+            re[j] = l_fSwap;
+            l_fSwap = im[i];
+            im[i] = im[j];
+            im[j] = l_fSwap;
+        }
+    }
+
+    for (l_iHalf = 1; l_iHalf < fft->size; l_iHalf <<= 1) {
+        l_iStep = fft->size / (l_iHalf * 2);
+
+        for (k = 0; k < l_iHalf; k++) {
+            l_fWr = fft->cos[k * l_iStep];
+            l_fWi = fft->sin[k * l_iStep] * l_fSign;
+
+            for (i = k; i < fft->size; i += l_iHalf * 2) {
+                j = i + l_iHalf;
+                l_fTr = re[j] * l_fWr - im[j] * l_fWi;
+                l_fTi = re[j] * l_fWi + im[j] * l_fWr;
+                re[j] = re[i] - l_fTr;
+                im[j] = im[i] - l_fTi;
+                re[i] += l_fTr;
+                im[i] += l_fTi;
+            }
+        }
+    }
+}
+
+/* Real FFT of 2 * size samples to size + 1 bins. Scratch has 2 * size */
+static inline void realfft_forward(const realfft *fft, const float *in, float *out_re, float *out_im, float *scratch) {
+    float *l_fRe = scratch;
+    float *l_fIm = scratch + fft->size;
+    float l_fEr = 0.0f, l_fEi = 0.0f, l_fOr = 0.0f, l_fOi = 0.0f;
+    int l_iSize = fft->size;
+    int k = 0;
+    int l_iMirror = 0;
+
+    /* Even samples to real part, odd to imaginary */
+    for (k = 0; k < l_iSize; k++) {
+        l_fRe[k] = in[2 * k];
+        l_fIm[k] = in[2 * k + 1];
+    }
+
+    realfft_complex(fft, l_fRe, l_fIm, 0);
+
+    for (k = 0; k <= l_iSize; k++) {
+        l_iMirror = (l_iSize - k) & (l_iSize - 1);
+        /* Spectra of even and odd samples */
+        l_fEr = 0.5f * (l_fRe[k & (l_iSize - 1)] + l_fRe[l_iMirror]);
+        l_fEi = 0.5f * (l_fIm[k & (l_iSize - 1)] - l_fIm[l_iMirror]);
+        l_fOr = 0.5f * (l_fIm[k & (l_iSize - 1)] + l_fIm[l_iMirror]);
+        l_fOi = -0.5f * (l_fRe[k & (l_iSize - 1)] - l_fRe[l_iMirror]);
+
+        if (k == l_iSize) {
+            out_re[k] = l_fEr - l_fOr;
+            out_im[k] = 0.0f;
+        } else {
+            out_re[k] = l_fEr + l_fOr * fft->rcos[k] - l_fOi * fft->rsin[k];
+            out_im[k] = l_fEi + l_fOr * fft->rsin[k] + l_fOi * fft->rcos[k];
+        }
+    }
+}
+
+/* Inverse of realfft_forward(). Output is 'size' times too big */
+static inline void realfft_inverse(const realfft *fft, const float *in_re, const float *in_im, float *out, float *scratch) {
+    float *l_fRe = scratch;
+    float *l_fIm = scratch + fft->size;
+    float l_fEr = 0.0f, l_fEi = 0.0f, l_fDr = 0.0f, l_fDi = 0.0f, l_fOr = 0.0f, l_fOi = 0.0f;
+    int l_iSize = fft->size;
+    int k = 0;
+
+    for (k = 0; k < l_iSize; k++) {
+        l_fEr = 0.5f * (in_re[k] + in_re[l_iSize - k]);
+        l_fEi = 0.5f * (in_im[k] - in_im[l_iSize - k]);
+        l_fDr = 0.5f * (in_re[k] - in_re[l_iSize - k]);
+        l_fDi = 0.5f * (in_im[k] + in_im[l_iSize - k]);
+        /* Odd spectrum is difference turned back by twiddle */
+        l_fOr = l_fDr * fft->rcos[k] + l_fDi * fft->rsin[k];
+        l_fOi = l_fDi * fft->rcos[k] - l_fDr * fft->rsin[k];
+        l_fRe[k] = l_fEr - l_fOi;
+        l_fIm[k] = l_fEi + l_fOr;
+    }
+
+    realfft_complex(fft, l_fRe, l_fIm, 1);
+
+    for (k = 0; k < l_iSize; k++) {
+        out[2 * k] = l_fRe[k];
+        out[2 * k + 1] = l_fIm[k];
+    }
+}
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Single producer / single consumer lock-free ring buffer.
+ *
+ * One thread writes and one thread reads. Neither side ever takes a lock or
+ * allocates memory, so it is safe to use from an audio callback. Read and
+ * write positions are free running byte counters; the size must be a power
+ * of two so that wrap around is a simple mask.
+ *
+ * Header only: just include it. Needs C11 atomics (gcc -std=c11 or newer).
+ */
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct ringbuffer {
+    /* Keep producer and consumer positions on own cache lines */
+    _Alignas(64) atomic_size_t write_pos;
+    _Alignas(64) atomic_size_t read_pos;
+    _Alignas(64) char *data;
+    size_t size;
+    size_t mask;
+} ringbuffer;
+
+/* Allocate ring. Size is rounded up to next power of two */
+static inline int ringbuffer_init(ringbuffer *rb, size_t size) {
+    size_t l_lSize = 1;
+
+    while (l_lSize < size) {
+        l_lSize <<= 1;
+    }
+
+    rb->data = (char *)malloc(l_lSize);
+
+    if (rb->data == NULL) {
+        return -1;
+    }
+
+    memset(rb->data, 0x00, l_lSize);
+    rb->size = l_lSize;
+    rb->mask = l_lSize - 1;
+    atomic_init(&rb->write_pos, 0);
+    atomic_init(&rb->read_pos, 0);
+    return 0;
+}
+
+static inline void ringbuffer_free(ringbuffer *rb) {
+    free(rb->data);
+    rb->data = NULL;
+    rb->size = 0;
+    rb->mask = 0;
+}
+
+/* How many bytes consumer can read */
+static inline size_t ringbuffer_read_space(ringbuffer *rb) {
+    size_t l_lWrite = atomic_load_explicit(&rb->write_pos, memory_order_acquire);
+    size_t l_lRead = atomic_load_explicit(&rb->read_pos, memory_order_relaxed);
+    return l_lWrite - l_lRead;
+}
+
+/* How many bytes producer can write */
+static inline size_t ringbuffer_write_space(ringbuffer *rb) {
+    size_t l_lWrite = atomic_load_explicit(&rb->write_pos, memory_order_relaxed);
+    size_t l_lRead = atomic_load_explicit(&rb->read_pos, memory_order_acquire);
+    return rb->size - (l_lWrite - l_lRead);
+}
+
+/* Producer side: get one or two contiguous areas where we can write.
+   Call ringbuffer_write_advance() after filling them */
+static inline size_t ringbuffer_get_write_regions(ringbuffer *rb, void **first, size_t *first_len,
+                                                  void **second, size_t *second_len) {
+    size_t l_lWrite = atomic_load_explicit(&rb->write_pos, memory_order_relaxed);
+    size_t l_lFree = ringbuffer_write_space(rb);
+    size_t l_lOffset = l_lWrite & rb->mask;
+    size_t l_lTail = rb->size - l_lOffset;
+
+    *first = rb->data + l_lOffset;
+    *first_len = l_lFree < l_lTail ? l_lFree : l_lTail;
+    *second = rb->data;
+    *second_len = l_lFree - *first_len;
+    return l_lFree;
+}
+
+static inline void ringbuffer_write_advance(ringbuffer *rb, size_t bytes) {
+    size_t l_lWrite = atomic_load_explicit(&rb->write_pos, memory_order_relaxed);
+    atomic_store_explicit(&rb->write_pos, l_lWrite + bytes, memory_order_release);
+}
+
+/* Consumer side: get one or two contiguous areas which can be read.
+   Call ringbuffer_read_advance() after using them */
+static inline size_t ringbuffer_get_read_regions(ringbuffer *rb, const void **first, size_t *first_len,
+                                                 const void **second, size_t *second_len) {
+    size_t l_lRead = atomic_load_explicit(&rb->read_pos, memory_order_relaxed);
+    size_t l_lUsed = ringbuffer_read_space(rb);
+    size_t l_lOffset = l_lRead & rb->mask;
+    size_t l_lTail = rb->size - l_lOffset;
+
+    *first = rb->data + l_lOffset;
+    *first_len = l_lUsed < l_lTail ? l_lUsed : l_lTail;
+    *second = rb->data;
+    *second_len = l_lUsed - *first_len;
+    return l_lUsed;
+}
+
+static inline void ringbuffer_read_advance(ringbuffer *rb, size_t bytes) {
+    size_t l_lRead = atomic_load_explicit(&rb->read_pos, memory_order_relaxed);
+    atomic_store_explicit(&rb->read_pos, l_lRead + bytes, memory_order_release);
+}
+
+/* Copy in as much as fits. Returns bytes written */
+static inline size_t ringbuffer_write(ringbuffer *rb, const void *src, size_t bytes) {
+    void *l_ptrFirst = NULL;
+    void *l_ptrSecond = NULL;
+    size_t l_lFirst = 0;
+    size_t l_lSecond = 0;
+    size_t l_lFree = ringbuffer_get_write_regions(rb, &l_ptrFirst, &l_lFirst, &l_ptrSecond, &l_lSecond);
+
+    if (bytes > l_lFree) {
+        bytes = l_lFree;
+    }
+
+    if (bytes <= l_lFirst) {
+        memcpy(l_ptrFirst, src, bytes);
+    } else {
+        memcpy(l_ptrFirst, src, l_lFirst);
+        memcpy(l_ptrSecond, (const char *)src + l_lFirst, bytes - l_lFirst);
+    }
+
+    ringbuffer_write_advance(rb, bytes);
+    return bytes;
+}
+
+/* Copy out as much as there is. Returns bytes read */
+static inline size_t ringbuffer_read(ringbuffer *rb, void *dst, size_t bytes) {
+    const void *l_ptrFirst = NULL;
+    const void *l_ptrSecond = NULL;
+    size_t l_lFirst = 0;
+    size_t l_lSecond = 0;
+    size_t l_lUsed = ringbuffer_get_read_regions(rb, &l_ptrFirst, &l_lFirst, &l_ptrSecond, &l_lSecond);
+
+    if (bytes > l_lUsed) {
+        bytes = l_lUsed;
+    }
+
+    if (bytes <= l_lFirst) {
+        memcpy(dst, l_ptrFirst, bytes);
+    } else {
+        memcpy(dst, l_ptrFirst, l_lFirst);
+        memcpy((char *)dst + l_lFirst, l_ptrSecond, bytes - l_lFirst);
+    }
+
+    ringbuffer_read_advance(rb, bytes);
+    return bytes;
+}
+
+/* Consumer side flush: throw away everything that is readable right now */
+static inline size_t ringbuffer_flush(ringbuffer *rb) {
+    size_t l_lUsed = ringbuffer_read_space(rb);
+    ringbuffer_read_advance(rb, l_lUsed);
+    return l_lUsed;
+}
+
+#endif
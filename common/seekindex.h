@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Seek index for compressed files (FLAC, Ogg etc).
+ *
+ * libsndfile does not tell byte offsets of compressed frames so we can't
+ * jump straight to them. What we can do is to have the first samples of
+ * every cue point already decoded. Player writes those right away after
+ * seek and decoder has time to do its own sf_seek() while they are playing.
+ * For PCM files sf_seek() is just lseek() so there is no index for them.
+ *
+ * Cue points are every SEEKINDEX_INTERVAL_SECONDS. Index is built on first
+ * open and saved next to the audio file as 'file.flac.seekidx':
+ *
+ *   seekindex_header (native byte order)
+ *   count * head_frames * channels floats (interleaved)
+ *
+ * Index is thrown away if size or modification time of audio file changes.
+ */
+
+#ifndef SEEKINDEX_H
+#define SEEKINDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sndfile.h>
+
+#define SEEKINDEX_MAGIC "LAESIDX1"
+#define SEEKINDEX_INTERVAL_SECONDS 10
+/* How many frames are cached for every cue point */
+#define SEEKINDEX_HEAD_FRAMES 2048
+
+typedef struct seekindex_header {
+    char magic[8];
+    uint32_t samplerate;
+    uint32_t channels;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint64_t frames;
+    uint64_t interval;
+    uint64_t head_frames;
+    uint64_t count;
+} seekindex_header;
+
+typedef struct seekindex {
+    seekindex_header header;
+    float *heads;
+} seekindex;
+
+/* Is index worth of it? Only for compressed formats */
+static inline int seekindex_needed(const SF_INFO *info) {
+    switch (info->format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_PCM_16:
+        case SF_FORMAT_PCM_24:
+        case SF_FORMAT_PCM_32:
+        case SF_FORMAT_PCM_U8:
+        case SF_FORMAT_FLOAT:
+        case SF_FORMAT_DOUBLE:
+            return (info->format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC;
+
+        default:
+            return 1;
+    }
+}
+
+static inline void seekindex_free(seekindex *idx) {
+    free(idx->heads);
+    idx->heads = NULL;
+    memset(&idx->header, 0x00, sizeof(seekindex_header));
+}
+
+/* Cached samples of cue point */
+static inline const float *seekindex_head(const seekindex *idx, uint64_t point) {
+    return idx->heads + point * idx->header.head_frames * idx->header.channels;
+}
+
+/* Which cue point cache covers frame. -1 if none */
+static inline long seekindex_find(const seekindex *idx, uint64_t frame) {
+    uint64_t l_lPoint = 0;
+
+    if (idx->heads == NULL || idx->header.interval == 0) {
+        return -1;
+    }
+
+    l_lPoint = frame / idx->header.interval;
+
+    if (l_lPoint >= idx->header.count || frame - l_lPoint * idx->header.interval >= idx->header.head_frames) {
+        return -1;
+    }
+
+    return (long)l_lPoint;
+}
+
+static inline int seekindex_stat(const char *audiopath, seekindex_header *header) {
+    struct stat l_SStat;
+
+    if (stat(audiopath, &l_SStat) < 0) {
+        return -1;
+    }
+
+    header->file_size = l_SStat.st_size;
+    header->file_mtime = l_SStat.st_mtime;
+    return 0;
+}
+
+/* Load saved index. Returns -1 if there is none or it is stale */
+static inline int seekindex_load(seekindex *idx, const char *audiopath, const char *indexpath, const SF_INFO *info) {
+    seekindex_header l_SNow;
+    struct stat l_SStat;
+    FILE *l_SFile = NULL;
+    uint64_t l_lFloats = 0;
+    uint64_t l_lMaxCount = 0;
+
+    memset(idx, 0x00, sizeof(seekindex));
+
+    if (seekindex_stat(audiopath, &l_SNow) < 0 || !(l_SFile = fopen(indexpath, "rb"))) {
+        return -1;
+    }
+
+    if (fread(&idx->header, sizeof(seekindex_header), 1, l_SFile) != 1
+            || memcmp(idx->header.magic, SEEKINDEX_MAGIC, 8)
+            || idx->header.file_size != l_SNow.file_size
+            || idx->header.file_mtime != l_SNow.file_mtime
+            || idx->header.samplerate != (uint32_t)info->samplerate
+            || idx->header.channels != (uint32_t)info->channels
+            || idx->header.head_frames != SEEKINDEX_HEAD_FRAMES
+            || idx->header.interval != (uint64_t)info->samplerate * SEEKINDEX_INTERVAL_SECONDS
+            || info->channels < 1 || fstat(fileno(l_SFile), &l_SStat) < 0) {
+        fclose(l_SFile);
+        memset(idx, 0x00, sizeof(seekindex));
+        return -1;
+    }
+
+    /* Count comes from file so it must fit both audio file and index
+       file before anything is allocated with it */
+    if (info->frames > SEEKINDEX_HEAD_FRAMES) {
+        l_lMaxCount = (info->frames - SEEKINDEX_HEAD_FRAMES) / idx->header.interval + 1;
+    }
+
+    l_lFloats = idx->header.count * idx->header.head_frames * idx->header.channels;
+
+    if (idx->header.count > l_lMaxCount
+            || (uint64_t)l_SStat.st_size != sizeof(seekindex_header) + l_lFloats * sizeof(float)) {
+        fclose(l_SFile);
+        memset(idx, 0x00, sizeof(seekindex));
+        return -1;
+    }
+
+    idx->heads = (float *)malloc(l_lFloats * sizeof(float) + 1);
+
+    if (idx->heads == NULL || fread(idx->heads, sizeof(float), l_lFloats, l_SFile) != l_lFloats) {
+        fclose(l_SFile);
+        seekindex_free(idx);
+        return -1;
+    }
+
+    fclose(l_SFile);
+    return 0;
+}
+
+/* Decode head of every cue point. Uses own SNDFILE so this can be
+   run in background thread while player is using its own */
+static inline int seekindex_build(seekindex *idx, const char *audiopath) {
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    uint64_t i = 0;
+    sf_count_t l_lGot = 0;
+
+    memset(idx, 0x00, sizeof(seekindex));
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if (seekindex_stat(audiopath, &idx->header) < 0 || !(l_SFile = sf_open(audiopath, SFM_READ, &l_SInfo))) {
+        return -1;
+    }
+
+    memcpy(idx->header.magic, SEEKINDEX_MAGIC, 8);
+    idx->header.samplerate = l_SInfo.samplerate;
+    idx->header.channels = l_SInfo.channels;
+    idx->header.frames = l_SInfo.frames;
+    idx->header.interval = (uint64_t)l_SInfo.samplerate * SEEKINDEX_INTERVAL_SECONDS;
+    idx->header.head_frames = SEEKINDEX_HEAD_FRAMES;
+
+    if (l_SInfo.frames > SEEKINDEX_HEAD_FRAMES) {
+        idx->header.count = (l_SInfo.frames - SEEKINDEX_HEAD_FRAMES) / idx->header.interval + 1;
+    }
+
+    idx->heads = (float *)calloc(idx->header.count * SEEKINDEX_HEAD_FRAMES * l_SInfo.channels + 1, sizeof(float));
+
+    if (idx->heads == NULL) {
+        sf_close(l_SFile);
+        seekindex_free(idx);
+        return -1;
+    }
+
+    for (i = 0; i < idx->header.count; i++) {
+        if (sf_seek(l_SFile, i * idx->header.interval, SEEK_SET) < 0) {
+            break;
+        }
+
+        l_lGot = sf_readf_float(l_SFile, idx->heads + i * SEEKINDEX_HEAD_FRAMES * l_SInfo.channels, SEEKINDEX_HEAD_FRAMES);
+
+        if (l_lGot < SEEKINDEX_HEAD_FRAMES) {
+            break;
+        }
+    }
+
+    /* Drop points that could not be decoded */
+    idx->header.count = i;
+    sf_close(l_SFile);
+    return 0;
+}
+
+static inline int seekindex_save(const seekindex *idx, const char *indexpath) {
+    FILE *l_SFile = fopen(indexpath, "wb");
+    size_t l_lFloats = idx->header.count * idx->header.head_frames * idx->header.channels;
+    int l_iRetval = 0;
+
+    if (l_SFile == NULL) {
+        return -1;
+    }
+
+    if (fwrite(&idx->header, sizeof(seekindex_header), 1, l_SFile) != 1
+            || fwrite(idx->heads, sizeof(float), l_lFloats, l_SFile) != l_lFloats) {
+        l_iRetval = -1;
+    }
+
+    if (fclose(l_SFile) != 0) {
+        l_iRetval = -1;
+    }
+
+    return l_iRetval;
+}
+
+#endif
@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Gapless segmented recording for 24/7 capture.
+ *
+ * Recording is cut to files of exactly 'segment_frames' frames: segment
+ * k holds frames [k * segment_frames, (k + 1) * segment_frames) so no
+ * sample is lost or written twice at boundary. Names come from template
+ * 'rec.wav' -> 'rec-000000.wav', 'rec-000001.wav' ...
+ *
+ * Three parties:
+ *  - capture (audio callback or read loop) only copies to a lock-free
+ *    ring with segwriter_write() and never blocks
+ *  - writer thread writes ring to current file and at boundary swaps in
+ *    next file that is already open
+ *  - housekeeping thread opens and preallocates next file before it is
+ *    needed and closes finished ones (sf_close rewrites header) so writer
+ *    never waits for file system
+ *
+ * Header only: just include it. Needs C11 atomics, pthreads, libsndfile
+ * and _GNU_SOURCE (fallocate).
+ */
+
+#ifndef SEGWRITER_H
+#define SEGWRITER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#include "ringbuffer.h"
+
+/* How many seconds capture ring holds */
+#define SEGWRITER_RING_SECONDS 4
+/* Frames written with one sf_writef_float */
+#define SEGWRITER_BLOCK_FRAMES 4096
+/* Roughly what WAV header takes. Used when segment is given in bytes */
+#define SEGWRITER_HEADER_BYTES 44
+/* Finished files waiting for sf_close() */
+#define SEGWRITER_CLOSE_QUEUE 4
+
+typedef struct segwriter {
+    char template[PATH_MAX];
+    SF_INFO info;
+    uint64_t segment_frames;
+    ringbuffer ring;
+    float *block;
+    sem_t wake;
+    pthread_t writer;
+    pthread_t housekeeper;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Writer owns current. Next and closing are handed over under lock */
+    SNDFILE *current;
+    SNDFILE *next;
+    SNDFILE *closing[SEGWRITER_CLOSE_QUEUE];
+    int closing_count;
+    long index;
+    long next_index;
+    uint64_t frames_in_segment;
+    atomic_int stop;
+    int done;
+    int error;
+    /* Statistics */
+    atomic_long overruns;
+    uint64_t frames;
+    long segments;
+    long late_opens;
+    double longest_open_ms;
+    double longest_switch_us;
+} segwriter;
+
+static inline double segwriter_now(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+/* Bytes of one sample in file for given libsndfile format */
+static inline int segwriter_sample_bytes(int format) {
+    switch (format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_PCM_U8:
+            return 1;
+
+        case SF_FORMAT_PCM_16:
+            return 2;
+
+        case SF_FORMAT_PCM_24:
+            return 3;
+
+        case SF_FORMAT_DOUBLE:
+            return 8;
+
+        default:
+            return 4;
+    }
+}
+
+/* 'dir/rec.wav' + 7 -> 'dir/rec-000007.wav' */
+static inline void segwriter_name(const char *template, long index, char *out, size_t len) {
+    const char *l_strDot = strrchr(template, '.');
+    const char *l_strSlash = strrchr(template, '/');
+
+    if (l_strDot == NULL || (l_strSlash != NULL && l_strDot < l_strSlash)) {
+        snprintf(out, len, "%s-%06ld", template, index);
+    } else {
+        snprintf(out, len, "%.*s-%06ld%s", (int)(l_strDot - template), template, index, l_strDot);
+    }
+}
+
+/* Open and preallocate one segment. Run in housekeeping thread */
+static inline SNDFILE *segwriter_open_segment(segwriter *seg, long index) {
+    char l_strPath[PATH_MAX + 16];
+    SF_INFO l_SInfo = seg->info;
+    SNDFILE *l_SFile = NULL;
+    off_t l_lBytes = 0;
+    int l_iFd = 0;
+
+    segwriter_name(seg->template, index, l_strPath, sizeof(l_strPath));
+    l_iFd = open(l_strPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (l_iFd < 0) {
+        return NULL;
+    }
+
+    /* Reserve blocks but keep size so header and length stay right */
+    l_lBytes = SEGWRITER_HEADER_BYTES + (off_t)seg->segment_frames * seg->info.channels * segwriter_sample_bytes(seg->info.format);
+    fallocate(l_iFd, FALLOC_FL_KEEP_SIZE, 0, l_lBytes);
+
+    l_SFile = sf_open_fd(l_iFd, SFM_WRITE, &l_SInfo, SF_TRUE);
+
+    if (l_SFile == NULL) {
+        close(l_iFd);
+        unlink(l_strPath);
+    }
+
+    return l_SFile;
+}
+
+static void *segwriter_housekeeper_thread(void *userdata) {
+    segwriter *l_SSeg = (segwriter *)userdata;
+    SNDFILE *l_SClose = NULL;
+    SNDFILE *l_SOpened = NULL;
+    long l_lIndex = 0;
+    double l_dStart = 0.0;
+
+    pthread_mutex_lock(&l_SSeg->lock);
+
+    while (1) {
+        /* Next file first. Writer may be waiting for it */
+        if (l_SSeg->next == NULL && !l_SSeg->done && !l_SSeg->error) {
+            l_lIndex = l_SSeg->next_index;
+            pthread_mutex_unlock(&l_SSeg->lock);
+
+            l_dStart = segwriter_now();
+            l_SOpened = segwriter_open_segment(l_SSeg, l_lIndex);
+
+            pthread_mutex_lock(&l_SSeg->lock);
+
+            if ((segwriter_now() - l_dStart) * 1000.0 > l_SSeg->longest_open_ms) {
+                l_SSeg->longest_open_ms = (segwriter_now() - l_dStart) * 1000.0;
+            }
+
+            if (l_SOpened == NULL) {
+                l_SSeg->error = errno ? errno : EIO;
+            }
+
+            l_SSeg->next = l_SOpened;
+            l_SSeg->next_index++;
+            pthread_cond_broadcast(&l_SSeg->cond);
+            continue;
+        }
+
+        if (l_SSeg->closing_count > 0) {
+            l_SClose = l_SSeg->closing[--l_SSeg->closing_count];
+            pthread_mutex_unlock(&l_SSeg->lock);
+            sf_close(l_SClose);
+            pthread_mutex_lock(&l_SSeg->lock);
+            pthread_cond_broadcast(&l_SSeg->cond);
+            continue;
+        }
+
+        if (l_SSeg->done) {
+            break;
+        }
+
+        pthread_cond_wait(&l_SSeg->cond, &l_SSeg->lock);
+    }
+
+    pthread_mutex_unlock(&l_SSeg->lock);
+    return NULL;
+}
+
+/* Swap to pre-opened next segment. Old one is closed in background */
+static inline int segwriter_rotate(segwriter *seg) {
+    double l_dStart = segwriter_now();
+    double l_dUs = 0.0;
+
+    pthread_mutex_lock(&seg->lock);
+
+    if (seg->next == NULL && !seg->error) {
+        seg->late_opens++;
+    }
+
+    /* Only waits if file system is so slow that close queue is full */
+    while ((seg->next == NULL || seg->closing_count == SEGWRITER_CLOSE_QUEUE) && !seg->error) {
+        pthread_cond_wait(&seg->cond, &seg->lock);
+    }
+
+    if (seg->next == NULL || seg->closing_count == SEGWRITER_CLOSE_QUEUE) {
+        pthread_mutex_unlock(&seg->lock);
+        return -1;
+    }
+
+    seg->closing[seg->closing_count++] = seg->current;
+    seg->current = seg->next;
+    seg->next = NULL;
+    seg->index++;
+    seg->segments++;
+    seg->frames_in_segment = 0;
+    pthread_cond_broadcast(&seg->cond);
+    pthread_mutex_unlock(&seg->lock);
+
+    l_dUs = (segwriter_now() - l_dStart) * 1e6;
+
+    if (l_dUs > seg->longest_switch_us) {
+        seg->longest_switch_us = l_dUs;
+    }
+
+    return 0;
+}
+
+/* Write block that may cross segment boundaries */
+static inline int segwriter_write_block(segwriter *seg, const float *pcm, uint64_t frames) {
+    uint64_t l_lPart = 0;
+
+    while (frames > 0) {
+        if (seg->frames_in_segment == seg->segment_frames && segwriter_rotate(seg) < 0) {
+            return -1;
+        }
+
+        l_lPart = seg->segment_frames - seg->frames_in_segment;
+        l_lPart = frames < l_lPart ? frames : l_lPart;
+
+        if (sf_writef_float(seg->current, pcm, l_lPart) != (sf_count_t)l_lPart) {
+            return -1;
+        }
+
+        seg->frames_in_segment += l_lPart;
+        seg->frames += l_lPart;
+        pcm += l_lPart * seg->info.channels;
+        frames -= l_lPart;
+    }
+
+    return 0;
+}
+
+static void *segwriter_writer_thread(void *userdata) {
+    segwriter *l_SSeg = (segwriter *)userdata;
+    size_t l_lFrameBytes = l_SSeg->info.channels * sizeof(float);
+    size_t l_lGot = 0;
+    int l_iStop = 0;
+
+    while (1) {
+        sem_wait(&l_SSeg->wake);
+        l_iStop = atomic_load(&l_SSeg->stop);
+
+        while (ringbuffer_read_space(&l_SSeg->ring) >= SEGWRITER_BLOCK_FRAMES * l_lFrameBytes
+                || (l_iStop && ringbuffer_read_space(&l_SSeg->ring) >= l_lFrameBytes)) {
+            l_lGot = ringbuffer_read(&l_SSeg->ring, l_SSeg->block, SEGWRITER_BLOCK_FRAMES * l_lFrameBytes);
+
+            if (segwriter_write_block(l_SSeg, l_SSeg->block, l_lGot / l_lFrameBytes) < 0) {
+                pthread_mutex_lock(&l_SSeg->lock);
+                l_SSeg->error = l_SSeg->error ? l_SSeg->error : EIO;
+                pthread_mutex_unlock(&l_SSeg->lock);
+                /* Keep draining so capture does not see full ring forever */
+                ringbuffer_flush(&l_SSeg->ring);
+            }
+        }
+
+        if (l_iStop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Capture side. Never blocks so it can be called from audio callback.
+   Returns frames taken. Rest are counted as overrun */
+static inline long segwriter_write(segwriter *seg, const float *pcm, long frames) {
+    size_t l_lFrameBytes = seg->info.channels * sizeof(float);
+    long l_lSpace = (long)(ringbuffer_write_space(&seg->ring) / l_lFrameBytes);
+    long l_lTake = frames < l_lSpace ? frames : l_lSpace;
+
+    if (l_lTake < frames) {
+        atomic_fetch_add_explicit(&seg->overruns, frames - l_lTake, memory_order_relaxed);
+    }
+
+    ringbuffer_write(&seg->ring, pcm, l_lTake * l_lFrameBytes);
+
+    if (ringbuffer_read_space(&seg->ring) >= SEGWRITER_BLOCK_FRAMES * l_lFrameBytes) {
+        sem_post(&seg->wake);
+    }
+
+    return l_lTake;
+}
+
+/* Frames for 'bytes' sized files of given format */
+static inline uint64_t segwriter_frames_for_bytes(const SF_INFO *info, uint64_t bytes) {
+    uint64_t l_lFrameBytes = (uint64_t)info->channels * segwriter_sample_bytes(info->format);
+
+    if (bytes <= SEGWRITER_HEADER_BYTES + l_lFrameBytes) {
+        return 1;
+    }
+
+    return (bytes - SEGWRITER_HEADER_BYTES) / l_lFrameBytes;
+}
+
+/* Open first segment right away and start threads */
+static inline int segwriter_open(segwriter *seg, const char *template, const SF_INFO *info, uint64_t segment_frames) {
+    memset(seg, 0x00, sizeof(segwriter));
+
+    if (segment_frames == 0 || strlen(template) >= sizeof(seg->template)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    strcpy(seg->template, template);
+    seg->info = *info;
+    seg->segment_frames = segment_frames;
+    seg->block = (float *)malloc(SEGWRITER_BLOCK_FRAMES * info->channels * sizeof(float));
+
+    if (seg->block == NULL || ringbuffer_init(&seg->ring, (size_t)info->samplerate * info->channels * sizeof(float) * SEGWRITER_RING_SECONDS) < 0) {
+        free(seg->block);
+        return -1;
+    }
+
+    seg->current = segwriter_open_segment(seg, 0);
+
+    if (seg->current == NULL) {
+        ringbuffer_free(&seg->ring);
+        free(seg->block);
+        return -1;
+    }
+
+    seg->next_index = 1;
+    sem_init(&seg->wake, 0, 0);
+    pthread_mutex_init(&seg->lock, NULL);
+    pthread_cond_init(&seg->cond, NULL);
+    atomic_init(&seg->stop, 0);
+    atomic_init(&seg->overruns, 0);
+    pthread_create(&seg->housekeeper, NULL, segwriter_housekeeper_thread, seg);
+    pthread_create(&seg->writer, NULL, segwriter_writer_thread, seg);
+    return 0;
+}
+
+/* Write what is left, close all files and remove unused pre-opened one */
+static inline int segwriter_close(segwriter *seg) {
+    char l_strPath[PATH_MAX + 16];
+
+    atomic_store(&seg->stop, 1);
+    sem_post(&seg->wake);
+    pthread_join(seg->writer, NULL);
+
+    pthread_mutex_lock(&seg->lock);
+    seg->done = 1;
+    pthread_cond_broadcast(&seg->cond);
+    pthread_mutex_unlock(&seg->lock);
+    pthread_join(seg->housekeeper, NULL);
+
+    sf_close(seg->current);
+    seg->segments++;
+
+    if (seg->next != NULL) {
+        sf_close(seg->next);
+        segwriter_name(seg->template, seg->next_index - 1, l_strPath, sizeof(l_strPath));
+        unlink(l_strPath);
+    }
+
+    sem_destroy(&seg->wake);
+    pthread_mutex_destroy(&seg->lock);
+    pthread_cond_destroy(&seg->cond);
+    ringbuffer_free(&seg->ring);
+    free(seg->block);
+    return seg->error ? -1 : 0;
+}
+
+static inline void segwriter_print_stats(const segwriter *seg) {
+    printf("segwriter: %ld segments of %llu frames, %llu frames total, overrun frames %ld\n",
+           seg->segments, (unsigned long long)seg->segment_frames, (unsigned long long)seg->frames,
+           (long)atomic_load(&seg->overruns));
+    printf("segwriter: longest switch %.1f us, longest open %.1f ms, late opens %ld\n",
+           seg->longest_switch_us, seg->longest_open_ms, seg->late_opens);
+}
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Shared memory audio ring between processes (memfd + futex).
+ *
+ * Producer process creates memfd, puts header and sample ring into it and
+ * passes descriptor to player (inherited over fork/exec or opened from
+ * /proc/PID/fd/N). Producer decodes straight into shared pages and player
+ * callback copies straight from them to device buffer so there is no pipe
+ * and no extra copy in between.
+ *
+ * Memory layout (native byte order, all offsets from start of memfd):
+ *
+ *   0     shmring_header (fits in SHMRING_HEADER_SIZE bytes)
+ *   4096  capacity * channels float32 samples, interleaved
+ *
+ * write_frames and read_frames are free running frame counters. Only
+ * producer stores write_frames and only consumer stores read_frames.
+ * write_seq and read_seq are futex words that are bumped after every
+ * advance. Side that has to wait sets its *_waiting flag and sleeps on
+ * other side's sequence; other side only calls FUTEX_WAKE if flag is set
+ * so audio callback normally makes no system calls at all.
+ *
+ * Player arguments: 'shm:N' is inherited descriptor N, 'shm:/path' opens
+ * path (for example /proc/1234/fd/3).
+ *
+ * Header only: just include it. Needs C11 atomics, Linux and _GNU_SOURCE
+ * (memfd_create, syscall) defined before any system header.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define SHMRING_MAGIC "LAESHM01"
+#define SHMRING_HEADER_SIZE 4096
+/* Only sample format for now */
+#define SHMRING_FORMAT_FLOAT32 1
+
+/* Counters are shared between processes so they have to be real atomics */
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shmring needs lock-free 64-bit atomics");
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "shmring needs lock-free 32-bit atomics");
+
+typedef struct shmring_header {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t samplerate;
+    uint32_t channels;
+    uint32_t format;
+    uint64_t capacity;
+    /* Producer side */
+    _Alignas(64) _Atomic uint64_t write_frames;
+    _Atomic uint32_t write_seq;
+    _Atomic uint32_t eof;
+    _Atomic uint32_t consumer_waiting;
+    /* Consumer side */
+    _Alignas(64) _Atomic uint64_t read_frames;
+    _Atomic uint32_t read_seq;
+    _Atomic uint32_t producer_waiting;
+    _Atomic uint64_t underruns;
+} shmring_header;
+
+_Static_assert(sizeof(shmring_header) <= SHMRING_HEADER_SIZE, "shmring header too big");
+
+typedef struct shmring {
+    int fd;
+    size_t map_size;
+    shmring_header *header;
+    float *data;
+    uint64_t mask;
+    /* Local statistics of this side */
+    long waits;
+    long wakeups;
+} shmring;
+
+static inline int shmring_futex_wait(_Atomic uint32_t *word, uint32_t old, int timeout_ms) {
+    struct timespec l_STimeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    return syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, old, &l_STimeout, NULL, 0);
+}
+
+static inline void shmring_futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline int shmring_map(shmring *ring) {
+    ring->header = (shmring_header *)mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+
+    if (ring->header == MAP_FAILED) {
+        ring->header = NULL;
+        return -1;
+    }
+
+    ring->data = (float *)((char *)ring->header + ring->header->header_size);
+    ring->mask = ring->header->capacity - 1;
+    return 0;
+}
+
+/* Producer: create memfd with room for at least 'frames' frames. Descriptor
+   is left inheritable so it can be given to a child process */
+static inline int shmring_create(shmring *ring, uint32_t samplerate, uint32_t channels, uint64_t frames) {
+    uint64_t l_lCapacity = 1;
+    shmring_header *l_SHeader = NULL;
+
+    memset(ring, 0x00, sizeof(shmring));
+
+    while (l_lCapacity < frames) {
+        l_lCapacity <<= 1;
+    }
+
+    ring->fd = memfd_create("shmring", 0);
+
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->map_size = SHMRING_HEADER_SIZE + l_lCapacity * channels * sizeof(float);
+
+    if (ftruncate(ring->fd, ring->map_size) < 0) {
+        close(ring->fd);
+        return -1;
+    }
+
+    l_SHeader = (shmring_header *)mmap(NULL, SHMRING_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+
+    if (l_SHeader == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    /* memfd is zero filled so only non zero fields are set */
+    memcpy(l_SHeader->magic, SHMRING_MAGIC, 8);
+    l_SHeader->header_size = SHMRING_HEADER_SIZE;
+    l_SHeader->samplerate = samplerate;
+    l_SHeader->channels = channels;
+    l_SHeader->format = SHMRING_FORMAT_FLOAT32;
+    l_SHeader->capacity = l_lCapacity;
+    munmap(l_SHeader, SHMRING_HEADER_SIZE);
+
+    if (shmring_map(ring) < 0) {
+        close(ring->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline int shmring_is_spec(const char *spec) {
+    return spec != NULL && strncmp(spec, "shm:", 4) == 0;
+}
+
+/* Consumer: attach to 'shm:N' or 'shm:/path' */
+static inline int shmring_attach(shmring *ring, const char *spec) {
+    shmring_header l_SHeader;
+    char *l_strEnd = NULL;
+    long l_lFd = 0;
+
+    memset(ring, 0x00, sizeof(shmring));
+
+    if (!shmring_is_spec(spec)) {
+        return -1;
+    }
+
+    l_lFd = strtol(spec + 4, &l_strEnd, 10);
+
+    if (*(spec + 4) != '\0' && *l_strEnd == '\0') {
+        ring->fd = dup((int)l_lFd);
+    } else {
+        ring->fd = open(spec + 4, O_RDWR | O_CLOEXEC);
+    }
+
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    if (pread(ring->fd, &l_SHeader, sizeof(shmring_header), 0) != sizeof(shmring_header)
+            || memcmp(l_SHeader.magic, SHMRING_MAGIC, 8)
+            || l_SHeader.format != SHMRING_FORMAT_FLOAT32
+            || l_SHeader.header_size < sizeof(shmring_header)
+            || l_SHeader.channels == 0
+            || l_SHeader.capacity == 0
+            || (l_SHeader.capacity & (l_SHeader.capacity - 1))) {
+        close(ring->fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->map_size = l_SHeader.header_size + l_SHeader.capacity * l_SHeader.channels * sizeof(float);
+
+    if (shmring_map(ring) < 0) {
+        close(ring->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void shmring_close(shmring *ring) {
+    if (ring->header != NULL) {
+        munmap(ring->header, ring->map_size);
+    }
+
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    ring->header = NULL;
+    ring->data = NULL;
+    ring->fd = -1;
+}
+
+/* How many frames consumer can read */
+static inline uint64_t shmring_read_space(shmring *ring) {
+    uint64_t l_lWrite = atomic_load_explicit(&ring->header->write_frames, memory_order_acquire);
+    uint64_t l_lRead = atomic_load_explicit(&ring->header->read_frames, memory_order_relaxed);
+    return l_lWrite - l_lRead;
+}
+
+/* How many frames producer can write */
+static inline uint64_t shmring_write_space(shmring *ring) {
+    uint64_t l_lWrite = atomic_load_explicit(&ring->header->write_frames, memory_order_relaxed);
+    uint64_t l_lRead = atomic_load_explicit(&ring->header->read_frames, memory_order_acquire);
+    return ring->header->capacity - (l_lWrite - l_lRead);
+}
+
+/* Producer: where next frames can be written (in shared memory). Second
+   region is non empty when free area wraps. Returns free frames */
+static inline uint64_t shmring_get_write_regions(shmring *ring, float **first, uint64_t *first_frames, float **second, uint64_t *second_frames) {
+    uint64_t l_lFree = shmring_write_space(ring);
+    uint64_t l_lPos = atomic_load_explicit(&ring->header->write_frames, memory_order_relaxed) & ring->mask;
+    uint64_t l_lToEnd = ring->header->capacity - l_lPos;
+
+    *first = ring->data + l_lPos * ring->header->channels;
+    *first_frames = l_lFree < l_lToEnd ? l_lFree : l_lToEnd;
+    *second = ring->data;
+    *second_frames = l_lFree - *first_frames;
+    return l_lFree;
+}
+
+static inline void shmring_write_advance(shmring *ring, uint64_t frames) {
+    atomic_fetch_add_explicit(&ring->header->write_frames, frames, memory_order_release);
+    atomic_fetch_add(&ring->header->write_seq, 1);
+
+    if (atomic_load(&ring->header->consumer_waiting)) {
+        shmring_futex_wake(&ring->header->write_seq);
+        ring->wakeups++;
+    }
+}
+
+/* Consumer: where readable frames are (in shared memory). Returns readable frames */
+static inline uint64_t shmring_get_read_regions(shmring *ring, const float **first, uint64_t *first_frames, const float **second, uint64_t *second_frames) {
+    uint64_t l_lUsed = shmring_read_space(ring);
+    uint64_t l_lPos = atomic_load_explicit(&ring->header->read_frames, memory_order_relaxed) & ring->mask;
+    uint64_t l_lToEnd = ring->header->capacity - l_lPos;
+
+    *first = ring->data + l_lPos * ring->header->channels;
+    *first_frames = l_lUsed < l_lToEnd ? l_lUsed : l_lToEnd;
+    *second = ring->data;
+    *second_frames = l_lUsed - *first_frames;
+    return l_lUsed;
+}
+
+static inline void shmring_read_advance(shmring *ring, uint64_t frames) {
+    atomic_fetch_add_explicit(&ring->header->read_frames, frames, memory_order_release);
+    atomic_fetch_add(&ring->header->read_seq, 1);
+
+    if (atomic_load(&ring->header->producer_waiting)) {
+        shmring_futex_wake(&ring->header->read_seq);
+        ring->wakeups++;
+    }
+}
+
+/* Consumer: copy up to 'frames' frames straight from shared memory to
+   device buffer. Missing frames are not touched. Never blocks so this can
+   be called from audio callback. Short read before EOF is an underrun */
+static inline uint64_t shmring_read_float(shmring *ring, float *out, uint64_t frames) {
+    const float *l_fFirst = NULL;
+    const float *l_fSecond = NULL;
+    uint64_t l_lFirst = 0;
+    uint64_t l_lSecond = 0;
+    uint64_t l_lChannels = ring->header->channels;
+
+    shmring_get_read_regions(ring, &l_fFirst, &l_lFirst, &l_fSecond, &l_lSecond);
+
+    if (l_lFirst > frames) {
+        l_lFirst = frames;
+    }
+
+    if (l_lSecond > frames - l_lFirst) {
+        l_lSecond = frames - l_lFirst;
+    }
+
+    memcpy(out, l_fFirst, l_lFirst * l_lChannels * sizeof(float));
+    memcpy(out + l_lFirst * l_lChannels, l_fSecond, l_lSecond * l_lChannels * sizeof(float));
+
+    if (l_lFirst + l_lSecond < frames && !atomic_load(&ring->header->eof)) {
+        atomic_fetch_add_explicit(&ring->header->underruns, 1, memory_order_relaxed);
+    }
+
+    if (l_lFirst + l_lSecond > 0) {
+        shmring_read_advance(ring, l_lFirst + l_lSecond);
+    }
+
+    return l_lFirst + l_lSecond;
+}
+
+/* Producer: no more frames are coming */
+static inline void shmring_set_eof(shmring *ring) {
+    atomic_store(&ring->header->eof, 1);
+    shmring_write_advance(ring, 0);
+}
+
+/* Consumer: producer has finished and everything is read */
+static inline int shmring_finished(shmring *ring) {
+    return atomic_load(&ring->header->eof) && shmring_read_space(ring) == 0;
+}
+
+/* Producer: sleep until at least 'frames' frames are free or timeout.
+   Returns free frames */
+static inline uint64_t shmring_wait_space(shmring *ring, uint64_t frames, int timeout_ms) {
+    uint32_t l_iSeq = 0;
+    uint64_t l_lFree = 0;
+
+    atomic_store(&ring->header->producer_waiting, 1);
+    l_iSeq = atomic_load(&ring->header->read_seq);
+    l_lFree = shmring_write_space(ring);
+
+    if (l_lFree < frames) {
+        ring->waits++;
+        shmring_futex_wait(&ring->header->read_seq, l_iSeq, timeout_ms);
+        l_lFree = shmring_write_space(ring);
+    }
+
+    atomic_store(&ring->header->producer_waiting, 0);
+    return l_lFree;
+}
+
+/* Consumer (not audio callback): sleep until at least 'frames' frames can
+   be read, EOF or timeout. Returns readable frames */
+static inline uint64_t shmring_wait_data(shmring *ring, uint64_t frames, int timeout_ms) {
+    uint32_t l_iSeq = 0;
+    uint64_t l_lUsed = 0;
+
+    atomic_store(&ring->header->consumer_waiting, 1);
+    l_iSeq = atomic_load(&ring->header->write_seq);
+    l_lUsed = shmring_read_space(ring);
+
+    if (l_lUsed < frames && !atomic_load(&ring->header->eof)) {
+        ring->waits++;
+        shmring_futex_wait(&ring->header->write_seq, l_iSeq, timeout_ms);
+        l_lUsed = shmring_read_space(ring);
+    }
+
+    atomic_store(&ring->header->consumer_waiting, 0);
+    return l_lUsed;
+}
+
+#endif
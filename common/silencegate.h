@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Silence / voice activity gate for recorders.
+ *
+ * Capture callback gives samples to silencegate_process(). They are cut to
+ * SILENCEGATE_WINDOW_MS windows and every window gets vectorized RMS and
+ * peak (see levels.h). Gate opens when RMS reaches open threshold or peak
+ * is SILENCEGATE_PEAK_CREST_DB over it (short consonants and clicks have
+ * low RMS). It closes when RMS has been SILENCEGATE_HYSTERESIS_DB under
+ * open threshold for hangover time. While gate is closed last pre-roll
+ * frames are kept so start of the word is not cut when gate opens.
+ *
+ * In SILENCEGATE_SKIP mode only kept stretches go to the sink so silence
+ * costs no disk. In SILENCEGATE_MARK mode everything goes to sink and
+ * stretches are only marked. Either way every kept stretch is written to
+ * sidecar text file (output name + ".segments") with sample accurate
+ * capture position and position in output file:
+ *
+ *   # capture_start capture_end file_start start_seconds end_seconds
+ *   44100 132300 0 1.000000 3.000000
+ *
+ * Callback never touches the sidecar. Stretches go through lock-free ring
+ * and main loop writes them with silencegate_poll().
+ *
+ * Header only: just include it. Needs C11 atomics and -lm.
+ */
+
+#ifndef SILENCEGATE_H
+#define SILENCEGATE_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "levels.h"
+#include "ringbuffer.h"
+
+#define SILENCEGATE_WINDOW_MS 10
+#define SILENCEGATE_HYSTERESIS_DB 6.0f
+#define SILENCEGATE_PEAK_CREST_DB 12.0f
+#define SILENCEGATE_PREROLL_MS 250
+#define SILENCEGATE_HANGOVER_MS 500
+#define SILENCEGATE_DEFAULT_DB -45.0f
+/* Stretches waiting for main loop */
+#define SILENCEGATE_EVENTS 256
+
+enum {
+    SILENCEGATE_SKIP = 0,
+    SILENCEGATE_MARK = 1
+};
+
+/* Where kept samples go. Return negative if write failed */
+typedef int (*silencegate_sink)(const float *pcm, long frames, void *userdata);
+
+typedef struct silencegate_event {
+    uint64_t start;
+    uint64_t end;
+    uint64_t file_start;
+} silencegate_event;
+
+typedef struct silencegate {
+    int channels;
+    int samplerate;
+    int mode;
+    int open;
+    float open_level;
+    float peak_level;
+    float close_level;
+    float *window;
+    long window_frames;
+    long window_fill;
+    float *preroll;
+    long preroll_frames;
+    long preroll_pos;
+    long preroll_fill;
+    long hangover_frames;
+    long quiet_frames;
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t kept;
+    silencegate_event current;
+    ringbuffer events;
+    atomic_long events_lost;
+    FILE *sidecar;
+    silencegate_sink sink;
+    void *userdata;
+} silencegate;
+
+/* Parse 'dB' or 'dB:preroll_ms:hangover_ms' option */
+static inline int silencegate_parse(const char *spec, float *db, long *preroll_ms, long *hangover_ms) {
+    *db = SILENCEGATE_DEFAULT_DB;
+    *preroll_ms = SILENCEGATE_PREROLL_MS;
+    *hangover_ms = SILENCEGATE_HANGOVER_MS;
+
+    if (sscanf(spec, "%f:%ld:%ld", db, preroll_ms, hangover_ms) < 1
+            || *db > 0.0f || *preroll_ms < 0 || *hangover_ms < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void silencegate_free(silencegate *gate) {
+    free(gate->window);
+    free(gate->preroll);
+    ringbuffer_free(&gate->events);
+
+    if (gate->sidecar != NULL) {
+        fclose(gate->sidecar);
+    }
+
+    gate->window = NULL;
+    gate->preroll = NULL;
+    gate->sidecar = NULL;
+}
+
+static inline int silencegate_open(silencegate *gate, const char *outpath, int samplerate, int channels,
+                                   float db, long preroll_ms, long hangover_ms, int mode,
+                                   silencegate_sink sink, void *userdata) {
+    char l_strPath[4096];
+
+    memset(gate, 0x00, sizeof(silencegate));
+    gate->channels = channels;
+    gate->samplerate = samplerate;
+    gate->mode = mode;
+    gate->open_level = levels_from_db(db);
+    gate->peak_level = levels_from_db(db + SILENCEGATE_PEAK_CREST_DB);
+    gate->close_level = levels_from_db(db - SILENCEGATE_HYSTERESIS_DB);
+    gate->window_frames = (long)samplerate * SILENCEGATE_WINDOW_MS / 1000;
+    gate->preroll_frames = (long)samplerate * preroll_ms / 1000;
+    gate->hangover_frames = (long)samplerate * hangover_ms / 1000;
+    gate->sink = sink;
+    gate->userdata = userdata;
+    atomic_init(&gate->events_lost, 0);
+
+    if (gate->window_frames < 1) {
+        gate->window_frames = 1;
+    }
+
+    snprintf(l_strPath, sizeof(l_strPath), "%s.segments", outpath);
+    gate->window = (float *)malloc(gate->window_frames * channels * sizeof(float));
+    gate->preroll = (float *)malloc((gate->preroll_frames + 1) * channels * sizeof(float));
+    gate->sidecar = fopen(l_strPath, "w");
+
+    if (gate->window == NULL || gate->preroll == NULL || gate->sidecar == NULL
+            || ringbuffer_init(&gate->events, SILENCEGATE_EVENTS * sizeof(silencegate_event)) < 0) {
+        silencegate_free(gate);
+        return -1;
+    }
+
+    fprintf(gate->sidecar, "# capture_start capture_end file_start start_seconds end_seconds\n");
+    return 0;
+}
+
+/* Remember last frames for pre-roll */
+static inline void silencegate_preroll_push(silencegate *gate, const float *pcm, long frames) {
+    long l_lPart = 0;
+
+    if (frames > gate->preroll_frames) {
+        pcm += (frames - gate->preroll_frames) * gate->channels;
+        frames = gate->preroll_frames;
+    }
+
+    while (frames > 0) {
+        l_lPart = gate->preroll_frames - gate->preroll_pos;
+        l_lPart = l_lPart < frames ? l_lPart : frames;
+        memcpy(gate->preroll + gate->preroll_pos * gate->channels, pcm, l_lPart * gate->channels * sizeof(float));
+        gate->preroll_pos = (gate->preroll_pos + l_lPart) % gate->preroll_frames;
+        gate->preroll_fill += l_lPart;
+        pcm += l_lPart * gate->channels;
+        frames -= l_lPart;
+    }
+
+    if (gate->preroll_fill > gate->preroll_frames) {
+        gate->preroll_fill = gate->preroll_frames;
+    }
+}
+
+static inline int silencegate_emit(silencegate *gate, const float *pcm, long frames) {
+    if (frames <= 0) {
+        return 0;
+    }
+
+    gate->frames_out += frames;
+    return gate->sink(pcm, frames, gate->userdata);
+}
+
+/* Oldest pre-roll frame first */
+static inline int silencegate_emit_preroll(silencegate *gate) {
+    long l_lStart = 0;
+    long l_lFirst = 0;
+    int l_iRetval = 0;
+
+    if (gate->preroll_fill == 0) {
+        return 0;
+    }
+
+    l_lStart = (gate->preroll_pos - gate->preroll_fill + gate->preroll_frames) % gate->preroll_frames;
+    l_lFirst = gate->preroll_frames - l_lStart;
+    l_lFirst = l_lFirst < gate->preroll_fill ? l_lFirst : gate->preroll_fill;
+
+    if (silencegate_emit(gate, gate->preroll + l_lStart * gate->channels, l_lFirst) < 0
+            || silencegate_emit(gate, gate->preroll, gate->preroll_fill - l_lFirst) < 0) {
+        l_iRetval = -1;
+    }
+
+    gate->preroll_fill = 0;
+    return l_iRetval;
+}
+
+static inline void silencegate_finish_event(silencegate *gate, uint64_t end) {
+    gate->current.end = end;
+    gate->kept++;
+
+    if (ringbuffer_write_space(&gate->events) < sizeof(silencegate_event)) {
+        atomic_fetch_add_explicit(&gate->events_lost, 1, memory_order_relaxed);
+        return;
+    }
+
+    ringbuffer_write(&gate->events, &gate->current, sizeof(silencegate_event));
+}
+
+/* Decide one full or last partial window */
+static inline int silencegate_window(silencegate *gate, const float *pcm, long frames) {
+    levels l_SLevels;
+    float l_fRms = 0.0f;
+    int l_iRetval = 0;
+
+    levels_scan(pcm, frames * gate->channels, &l_SLevels);
+    l_fRms = levels_rms(&l_SLevels);
+
+    if (!gate->open && (l_fRms >= gate->open_level || levels_peak(&l_SLevels) >= gate->peak_level)) {
+        gate->open = 1;
+        gate->quiet_frames = 0;
+        gate->current.start = gate->frames_in - gate->preroll_fill;
+        gate->current.file_start = gate->mode == SILENCEGATE_MARK
+                                   ? gate->current.start : gate->frames_out;
+
+        if (gate->mode == SILENCEGATE_SKIP) {
+            l_iRetval = silencegate_emit_preroll(gate);
+        }
+
+    } else if (gate->open && l_fRms < gate->close_level) {
+        gate->quiet_frames += frames;
+
+        /* Hangover was kept. This window is first one left out and
+           starts new pre-roll */
+        if (gate->quiet_frames >= gate->hangover_frames) {
+            gate->open = 0;
+            gate->preroll_fill = 0;
+            silencegate_finish_event(gate, gate->frames_in);
+        }
+
+    } else if (gate->open) {
+        gate->quiet_frames = 0;
+    }
+
+    gate->frames_in += frames;
+
+    if (gate->open || gate->mode == SILENCEGATE_MARK) {
+        if (silencegate_emit(gate, pcm, frames) < 0) {
+            l_iRetval = -1;
+        }
+    }
+
+    if (!gate->open && gate->preroll_frames > 0) {
+        silencegate_preroll_push(gate, pcm, frames);
+    }
+
+    return l_iRetval;
+}
+
+/* Call from capture callback. Returns -1 if sink failed */
+static inline int silencegate_process(silencegate *gate, const float *pcm, long frames) {
+    long l_lPart = 0;
+    int l_iRetval = 0;
+
+    while (frames > 0) {
+        /* Full windows straight from callback buffer */
+        if (gate->window_fill == 0 && frames >= gate->window_frames) {
+            if (silencegate_window(gate, pcm, gate->window_frames) < 0) {
+                l_iRetval = -1;
+            }
+
+            pcm += gate->window_frames * gate->channels;
+            frames -= gate->window_frames;
+            continue;
+        }
+
+        l_lPart = gate->window_frames - gate->window_fill;
+        l_lPart = l_lPart < frames ? l_lPart : frames;
+        memcpy(gate->window + gate->window_fill * gate->channels, pcm, l_lPart * gate->channels * sizeof(float));
+        gate->window_fill += l_lPart;
+        pcm += l_lPart * gate->channels;
+        frames -= l_lPart;
+
+        if (gate->window_fill == gate->window_frames) {
+            if (silencegate_window(gate, gate->window, gate->window_frames) < 0) {
+                l_iRetval = -1;
+            }
+
+            gate->window_fill = 0;
+        }
+    }
+
+    return l_iRetval;
+}
+
+/* Write finished stretches to sidecar. Call from main loop */
+static inline void silencegate_poll(silencegate *gate) {
+    silencegate_event l_SEvent;
+
+    while (ringbuffer_read_space(&gate->events) >= sizeof(silencegate_event)) {
+        ringbuffer_read(&gate->events, &l_SEvent, sizeof(silencegate_event));
+        fprintf(gate->sidecar, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %.6f %.6f\n",
+                l_SEvent.start, l_SEvent.end, l_SEvent.file_start,
+                (double)l_SEvent.start / gate->samplerate, (double)l_SEvent.end / gate->samplerate);
+    }
+
+    fflush(gate->sidecar);
+}
+
+/* Call after capture has stopped but before output is closed.
+   Last partial window is decided and open stretch is finished. */
+static inline int silencegate_close(silencegate *gate) {
+    int l_iRetval = 0;
+
+    if (gate->window_fill > 0) {
+        l_iRetval = silencegate_window(gate, gate->window, gate->window_fill);
+        gate->window_fill = 0;
+    }
+
+    if (gate->open) {
+        silencegate_finish_event(gate, gate->frames_in);
+        gate->open = 0;
+    }
+
+    silencegate_poll(gate);
+
+    if (fclose(gate->sidecar) != 0) {
+        l_iRetval = -1;
+    }
+
+    gate->sidecar = NULL;
+    silencegate_free(gate);
+    return l_iRetval;
+}
+
+static inline void silencegate_print_stats(const silencegate *gate) {
+    double l_dSaved = gate->frames_in > 0
+                      ? 100.0 * (gate->frames_in - gate->frames_out) / gate->frames_in : 0.0;
+
+    printf("silencegate: %" PRIu64 " frames in, %" PRIu64 " written (%.1f%% saved), %" PRIu64 " kept stretches\n",
+           gate->frames_in, gate->frames_out, gate->mode == SILENCEGATE_MARK ? 0.0 : l_dSaved, gate->kept);
+
+    if (atomic_load(&gate->events_lost) > 0) {
+        printf("silencegate: %ld stretches did not fit to sidecar queue\n", (long)atomic_load(&gate->events_lost));
+    }
+}
+
+#endif
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Simulated audio device for testing without sound server or card.
+ *
+ * Device thread runs on its own clock and every period either pulls a
+ * block from the tool (playback callback), pushes a block to it (capture
+ * callback) or drains a queue that blocking writes fill (like ao_play()
+ * or Pa_WriteStream()). Tools use it instead of the real device when
+ * SIMDEV is set in environment:
+ *
+ *   SIMDEV="period=256,buffer=2,jitter=0.2,skew=300,stall=2000:15,seed=7,seconds=10,speed=1"
+ *
+ *   period   frames per period (default 512)
+ *   buffer   periods of device buffer (default 2). Block must be ready
+ *            (buffer - 1) periods after it was asked or it is an xrun
+ *   jitter   timer wakeup is late by random 0..jitter periods
+ *   skew     device clock is this many ppm slower than system clock
+ *   stall    every A ms of device time device thread stops for B ms
+ *   seed     seed of jitter sequence so runs can be repeated
+ *   seconds  stop after this much device time (0 is until tool stops)
+ *   speed    run device clock this many times faster than real time
+ *
+ * Empty value 'SIMDEV=' is device with defaults.
+ *
+ * For tests SIMDEV_OUTPUT=path saves everything played as raw interleaved
+ * samples in stream format and SIMDEV_INPUT=path gives capture callback
+ * raw samples from file instead of tone. Device stops when input ends.
+ * At the end simdev_print_stats() tells xruns, stalls, callback times
+ * and how close to deadline blocks were (playback latency headroom) or
+ * how much was queued (blocking writes).
+ *
+ * Header only: just include it. Needs pthreads and -lm.
+ */
+
+#ifndef SIMDEV_H
+#define SIMDEV_H
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIMDEV_ENV "SIMDEV"
+#define SIMDEV_OUTPUT_ENV "SIMDEV_OUTPUT"
+#define SIMDEV_INPUT_ENV "SIMDEV_INPUT"
+#define SIMDEV_DEFAULT_PERIOD 512
+#define SIMDEV_DEFAULT_BUFFER 2
+/* Capture callback gets sine of this frequency at -20 dBFS */
+#define SIMDEV_TONE_HZ 997.0
+
+enum {
+    SIMDEV_PLAYBACK = 0,
+    SIMDEV_CAPTURE,
+    /* Playback fed with simdev_write() */
+    SIMDEV_BLOCKING
+};
+
+/* Fill (playback) or take (capture) 'frames' frames. Non zero stops device */
+typedef int (*simdev_callback)(void *buffer, long frames, void *userdata);
+/* Device has stopped. Same as PaStreamFinishedCallback */
+typedef void (*simdev_finished_callback)(void *userdata);
+
+typedef struct simdev {
+    /* Configuration */
+    int samplerate;
+    int channels;
+    int sample_bytes;
+    int mode;
+    long period;
+    int buffer_periods;
+    double jitter;
+    double skew_ppm;
+    long stall_every_ms;
+    long stall_ms;
+    unsigned long seed;
+    double seconds;
+    double speed;
+    /* Runtime */
+    simdev_callback callback;
+    simdev_finished_callback finished_callback;
+    void *userdata;
+    unsigned char *block;
+    unsigned char *queue;
+    FILE *output;
+    FILE *input;
+    long queue_frames;
+    long queue_read;
+    long queued;
+    uint64_t random;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    int stop;
+    int finished;
+    int draining;
+    /* Statistics */
+    long periods;
+    long xruns;
+    long stalls;
+    uint64_t frames;
+    double callback_total_us;
+    double callback_max_us;
+    double late_max_ms;
+    double slack_min_ms;
+    double slack_total_ms;
+    double queued_max_ms;
+    double queued_total_ms;
+    long writes;
+} simdev;
+
+static inline int simdev_wanted(void) {
+    return getenv(SIMDEV_ENV) != NULL;
+}
+
+static inline double simdev_now(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+static inline void simdev_sleep_until(double when) {
+    struct timespec l_STs;
+
+    l_STs.tv_sec = (time_t)when;
+    l_STs.tv_nsec = (long)((when - l_STs.tv_sec) * 1e9);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &l_STs, NULL) == EINTR) {
+    }
+}
+
+/* xorshift64. Same seed gives same jitter every run */
+static inline double simdev_random(simdev *dev) {
+    dev->random ^= dev->random << 13;
+    dev->random ^= dev->random >> 7;
+    dev->random ^= dev->random << 17;
+    return (dev->random >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Parse 'key=value,key=value' from SIMDEV */
+static inline int simdev_parse(simdev *dev, const char *spec) {
+    char l_strKey[16];
+    double l_dValue = 0.0;
+    double l_dSecond = 0.0;
+    int l_iUsed = 0;
+
+    while (spec != NULL && *spec != 0x00) {
+        if (*spec == ',') {
+            spec++;
+            continue;
+        }
+
+        if (sscanf(spec, "%15[a-z]=%lf%n", l_strKey, &l_dValue, &l_iUsed) != 2) {
+            return -1;
+        }
+
+        spec += l_iUsed;
+
+        if (!strcmp(l_strKey, "period") && l_dValue >= 1) {
+            dev->period = (long)l_dValue;
+        } else if (!strcmp(l_strKey, "buffer") && l_dValue >= 1) {
+            dev->buffer_periods = (int)l_dValue;
+        } else if (!strcmp(l_strKey, "jitter") && l_dValue >= 0) {
+            dev->jitter = l_dValue;
+        } else if (!strcmp(l_strKey, "skew")) {
+            dev->skew_ppm = l_dValue;
+        } else if (!strcmp(l_strKey, "stall") && l_dValue > 0 && sscanf(spec, ":%lf%n", &l_dSecond, &l_iUsed) == 1) {
+            dev->stall_every_ms = (long)l_dValue;
+            dev->stall_ms = (long)l_dSecond;
+            spec += l_iUsed;
+        } else if (!strcmp(l_strKey, "seed")) {
+            dev->seed = (unsigned long)l_dValue;
+        } else if (!strcmp(l_strKey, "seconds") && l_dValue >= 0) {
+            dev->seconds = l_dValue;
+        } else if (!strcmp(l_strKey, "speed") && l_dValue > 0) {
+            dev->speed = l_dValue;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Configure from SIMDEV. 'sample_bytes' is 2 for S16 and 4 for float.
+   'period' is used if SIMDEV does not give one (like fragment size tool
+   asks from server) */
+static inline int simdev_open_period(simdev *dev, int samplerate, int channels, int sample_bytes, int mode, long period) {
+    memset(dev, 0x00, sizeof(simdev));
+    dev->samplerate = samplerate;
+    dev->channels = channels;
+    dev->sample_bytes = sample_bytes;
+    dev->mode = mode;
+    dev->period = period > 0 ? period : SIMDEV_DEFAULT_PERIOD;
+    dev->buffer_periods = SIMDEV_DEFAULT_BUFFER;
+    dev->seed = 1;
+    dev->speed = 1.0;
+    dev->slack_min_ms = INFINITY;
+
+    if (samplerate <= 0 || channels <= 0 || simdev_parse(dev, getenv(SIMDEV_ENV)) < 0) {
+        fprintf(stderr, "simdev: Bad configuration '%s'\n", getenv(SIMDEV_ENV) ? getenv(SIMDEV_ENV) : "");
+        return -1;
+    }
+
+    dev->random = dev->seed * 0x9E3779B97F4A7C15ULL + 1;
+    dev->block = (unsigned char *)calloc(dev->period * channels, sample_bytes);
+    dev->queue_frames = dev->period * dev->buffer_periods;
+    dev->queue = (unsigned char *)calloc(dev->queue_frames * channels, sample_bytes);
+
+    if (dev->block == NULL || dev->queue == NULL) {
+        free(dev->block);
+        free(dev->queue);
+        return -1;
+    }
+
+    if (mode != SIMDEV_CAPTURE && getenv(SIMDEV_OUTPUT_ENV) != NULL
+            && (dev->output = fopen(getenv(SIMDEV_OUTPUT_ENV), "wb")) == NULL) {
+        fprintf(stderr, "simdev: Can't open output %s\n", getenv(SIMDEV_OUTPUT_ENV));
+        free(dev->block);
+        free(dev->queue);
+        return -1;
+    }
+
+    if (mode == SIMDEV_CAPTURE && getenv(SIMDEV_INPUT_ENV) != NULL
+            && (dev->input = fopen(getenv(SIMDEV_INPUT_ENV), "rb")) == NULL) {
+        fprintf(stderr, "simdev: Can't open input %s\n", getenv(SIMDEV_INPUT_ENV));
+        free(dev->block);
+        free(dev->queue);
+        return -1;
+    }
+
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->cond, NULL);
+    printf("simdev: %d Hz %d channels, period %ld frames, buffer %d periods, jitter %.2f, skew %.0f ppm, stall %ld ms every %ld ms, speed %.1fx\n",
+           samplerate, channels, dev->period, dev->buffer_periods, dev->jitter, dev->skew_ppm,
+           dev->stall_ms, dev->stall_every_ms, dev->speed);
+    return 0;
+}
+
+static inline int simdev_open(simdev *dev, int samplerate, int channels, int sample_bytes, int mode) {
+    return simdev_open_period(dev, samplerate, channels, sample_bytes, mode, SIMDEV_DEFAULT_PERIOD);
+}
+
+/* Sine for capture. Phase continues over periods */
+static inline void simdev_tone(simdev *dev) {
+    double l_dStep = 2.0 * M_PI * SIMDEV_TONE_HZ / dev->samplerate;
+    double l_dValue = 0.0;
+    long i = 0;
+    int j = 0;
+
+    for (i = 0; i < dev->period; i++) {
+        l_dValue = 0.1 * sin(l_dStep * (double)(dev->frames + i));
+
+        for (j = 0; j < dev->channels; j++) {
+            if (dev->sample_bytes == 2) {
+                ((short *)dev->block)[i * dev->channels + j] = (short)lrint(l_dValue * 32767.0);
+            } else {
+                ((float *)dev->block)[i * dev->channels + j] = (float)l_dValue;
+            }
+        }
+    }
+}
+
+/* Blocking mode period: take one period from queue. Short is xrun */
+static inline void simdev_drain_period(simdev *dev) {
+    long l_lFrameBytes = (long)dev->channels * dev->sample_bytes;
+    long l_lTake = 0;
+    long l_lPart = 0;
+    long l_lDone = 0;
+
+    pthread_mutex_lock(&dev->lock);
+    l_lTake = dev->queued < dev->period ? dev->queued : dev->period;
+
+    /* Nothing written yet or last short block is not xrun */
+    if (l_lTake < dev->period && !dev->draining && (dev->frames > 0 || l_lTake > 0)) {
+        dev->xruns++;
+    }
+
+    while (l_lTake > 0) {
+        l_lPart = dev->queue_frames - dev->queue_read;
+        l_lPart = l_lTake < l_lPart ? l_lTake : l_lPart;
+        memcpy(dev->block + l_lDone * l_lFrameBytes, dev->queue + dev->queue_read * l_lFrameBytes, l_lPart * l_lFrameBytes);
+        dev->queue_read = (dev->queue_read + l_lPart) % dev->queue_frames;
+        dev->queued -= l_lPart;
+        dev->frames += l_lPart;
+        l_lTake -= l_lPart;
+        l_lDone += l_lPart;
+    }
+
+    if (dev->output != NULL) {
+        fwrite(dev->block, l_lFrameBytes, l_lDone, dev->output);
+    }
+
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void *simdev_thread(void *userdata) {
+    simdev *l_SDev = (simdev *)userdata;
+    /* Seconds of system clock per period of device clock */
+    double l_dTick = (double)l_SDev->period / l_SDev->samplerate * (1.0 + l_SDev->skew_ppm * 1e-6) / l_SDev->speed;
+    double l_dStart = simdev_now();
+    double l_dDue = 0.0;
+    double l_dWake = 0.0;
+    double l_dBefore = 0.0;
+    double l_dDone = 0.0;
+    double l_dUs = 0.0;
+    double l_dSlack = 0.0;
+    long l_lFrameBytes = (long)l_SDev->channels * l_SDev->sample_bytes;
+    long l_lFrames = 0;
+    long l_lStallPeriods = 0;
+    long k = 0;
+    int l_iStop = 0;
+
+    if (l_SDev->stall_every_ms > 0) {
+        l_lStallPeriods = (long)((double)l_SDev->stall_every_ms * l_SDev->samplerate / 1000.0 / l_SDev->period);
+        l_lStallPeriods = l_lStallPeriods > 0 ? l_lStallPeriods : 1;
+    }
+
+    for (k = 0; !l_iStop; k++) {
+        l_dDue = l_dStart + k * l_dTick;
+        l_dWake = l_dDue + simdev_random(l_SDev) * l_SDev->jitter * l_dTick;
+
+        /* Device thread stops. Periods after it are run back to back until
+           clock has caught up like real device would do */
+        if (l_lStallPeriods > 0 && k > 0 && k % l_lStallPeriods == 0) {
+            l_dWake += l_SDev->stall_ms / 1000.0 / l_SDev->speed;
+            l_SDev->stalls++;
+        }
+
+        simdev_sleep_until(l_dWake);
+        l_dBefore = simdev_now();
+
+        if ((l_dBefore - l_dDue) * 1000.0 > l_SDev->late_max_ms) {
+            l_SDev->late_max_ms = (l_dBefore - l_dDue) * 1000.0;
+        }
+
+        if (l_SDev->mode == SIMDEV_BLOCKING) {
+            simdev_drain_period(l_SDev);
+        } else {
+            l_lFrames = l_SDev->period;
+
+            if (l_SDev->input != NULL) {
+                l_lFrames = (long)fread(l_SDev->block, l_lFrameBytes, l_SDev->period, l_SDev->input);
+                l_iStop = l_lFrames < l_SDev->period;
+            } else if (l_SDev->mode == SIMDEV_CAPTURE) {
+                simdev_tone(l_SDev);
+            }
+
+            if (l_lFrames > 0 && l_SDev->callback(l_SDev->block, l_lFrames, l_SDev->userdata) != 0) {
+                l_iStop = 1;
+            }
+
+            l_dDone = simdev_now();
+            l_dUs = (l_dDone - l_dBefore) * 1e6;
+            l_SDev->callback_total_us += l_dUs;
+            l_SDev->callback_max_us = l_dUs > l_SDev->callback_max_us ? l_dUs : l_SDev->callback_max_us;
+
+            /* Block asked at due must be ready when buffer before it is played */
+            l_dSlack = (l_dDue + (l_SDev->buffer_periods - 1) * l_dTick - l_dDone) * 1000.0;
+            l_SDev->slack_total_ms += l_dSlack;
+            l_SDev->slack_min_ms = l_dSlack < l_SDev->slack_min_ms ? l_dSlack : l_SDev->slack_min_ms;
+
+            if (l_dSlack < 0.0) {
+                l_SDev->xruns++;
+            }
+
+            l_SDev->frames += l_lFrames;
+
+            if (l_SDev->output != NULL) {
+                fwrite(l_SDev->block, l_lFrameBytes, l_lFrames, l_SDev->output);
+            }
+        }
+
+        l_SDev->periods++;
+
+        if (l_SDev->seconds > 0.0 && (double)(k + 1) * l_SDev->period >= l_SDev->seconds * l_SDev->samplerate) {
+            l_iStop = 1;
+        }
+
+        pthread_mutex_lock(&l_SDev->lock);
+        l_iStop = l_iStop || l_SDev->stop;
+        pthread_mutex_unlock(&l_SDev->lock);
+    }
+
+    pthread_mutex_lock(&l_SDev->lock);
+    l_SDev->finished = 1;
+    pthread_cond_broadcast(&l_SDev->cond);
+    pthread_mutex_unlock(&l_SDev->lock);
+
+    if (l_SDev->finished_callback != NULL) {
+        l_SDev->finished_callback(l_SDev->userdata);
+    }
+
+    return NULL;
+}
+
+/* Called from device thread when it stops. Set before simdev_start() */
+static inline void simdev_set_finished_callback(simdev *dev, simdev_finished_callback callback) {
+    dev->finished_callback = callback;
+}
+
+/* Start device clock. Callback is not used in blocking mode */
+static inline int simdev_start(simdev *dev, simdev_callback callback, void *userdata) {
+    dev->callback = callback;
+    dev->userdata = userdata;
+
+    if (pthread_create(&dev->thread, NULL, simdev_thread, dev) != 0) {
+        return -1;
+    }
+
+    dev->running = 1;
+    return 0;
+}
+
+/* Blocking mode. Waits for room like ao_play(). Returns -1 when device
+   has stopped */
+static inline int simdev_write(simdev *dev, const void *pcm, long frames) {
+    long l_lFrameBytes = (long)dev->channels * dev->sample_bytes;
+    const unsigned char *l_ptrPcm = (const unsigned char *)pcm;
+    long l_lWrite = 0;
+    long l_lPart = 0;
+    double l_dQueued = 0.0;
+
+    pthread_mutex_lock(&dev->lock);
+
+    while (frames > 0 && !dev->finished) {
+        while (dev->queued == dev->queue_frames && !dev->finished) {
+            pthread_cond_wait(&dev->cond, &dev->lock);
+        }
+
+        l_lWrite = (dev->queue_read + dev->queued) % dev->queue_frames;
+        l_lPart = dev->queue_frames - dev->queued;
+        l_lPart = l_lPart < dev->queue_frames - l_lWrite ? l_lPart : dev->queue_frames - l_lWrite;
+        l_lPart = frames < l_lPart ? frames : l_lPart;
+        memcpy(dev->queue + l_lWrite * l_lFrameBytes, l_ptrPcm, l_lPart * l_lFrameBytes);
+        dev->queued += l_lPart;
+        l_ptrPcm += l_lPart * l_lFrameBytes;
+        frames -= l_lPart;
+    }
+
+    /* Latency of last written frame */
+    l_dQueued = dev->queued * 1000.0 / dev->samplerate;
+    dev->queued_total_ms += l_dQueued;
+    dev->queued_max_ms = l_dQueued > dev->queued_max_ms ? l_dQueued : dev->queued_max_ms;
+    dev->writes++;
+    pthread_mutex_unlock(&dev->lock);
+    return frames > 0 ? -1 : 0;
+}
+
+/* Blocking mode. Wait until everything written has been played */
+static inline void simdev_drain(simdev *dev) {
+    pthread_mutex_lock(&dev->lock);
+    dev->draining = 1;
+
+    while (dev->queued > 0 && !dev->finished) {
+        pthread_cond_wait(&dev->cond, &dev->lock);
+    }
+
+    pthread_mutex_unlock(&dev->lock);
+}
+
+/* Has device stopped (callback asked or 'seconds' reached) */
+static inline int simdev_finished(simdev *dev) {
+    int l_iFinished = 0;
+
+    pthread_mutex_lock(&dev->lock);
+    l_iFinished = dev->finished;
+    pthread_mutex_unlock(&dev->lock);
+    return l_iFinished;
+}
+
+/* Wait until device stops by itself */
+static inline void simdev_wait(simdev *dev) {
+    pthread_mutex_lock(&dev->lock);
+
+    while (!dev->finished) {
+        pthread_cond_wait(&dev->cond, &dev->lock);
+    }
+
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static inline void simdev_close(simdev *dev) {
+    if (dev->running) {
+        pthread_mutex_lock(&dev->lock);
+        dev->stop = 1;
+        pthread_cond_broadcast(&dev->cond);
+        pthread_mutex_unlock(&dev->lock);
+        pthread_join(dev->thread, NULL);
+        dev->running = 0;
+    }
+
+    pthread_mutex_destroy(&dev->lock);
+    pthread_cond_destroy(&dev->cond);
+    if (dev->output != NULL) {
+        fclose(dev->output);
+        dev->output = NULL;
+    }
+
+    if (dev->input != NULL) {
+        fclose(dev->input);
+        dev->input = NULL;
+    }
+
+    free(dev->block);
+    free(dev->queue);
+    dev->block = NULL;
+    dev->queue = NULL;
+}
+
+static inline void simdev_print_stats(const simdev *dev) {
+    printf("simdev: %ld periods, %.2f s of device time, xruns %ld, stalls %ld, latest wakeup %.2f ms\n",
+           dev->periods, (double)dev->frames / dev->samplerate, dev->xruns, dev->stalls, dev->late_max_ms);
+
+    if (dev->mode == SIMDEV_BLOCKING) {
+        printf("simdev: %ld writes, queued %.2f ms on average, %.2f ms at most\n", dev->writes,
+               dev->writes > 0 ? dev->queued_total_ms / dev->writes : 0.0, dev->queued_max_ms);
+    } else if (dev->periods > 0) {
+        printf("simdev: callback %.1f us on average, %.1f us at most. Deadline headroom %.2f ms on average, %.2f ms at least\n",
+               dev->callback_total_us / dev->periods, dev->callback_max_us,
+               dev->slack_total_ms / dev->periods, dev->slack_min_ms);
+    }
+}
+
+#endif
@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Spectrum and spectrogram side-chain for players and recorders.
+ *
+ * Audio callback only copies its block to lock-free ring with
+ * spectrum_push() (samples as they are, float or integer) and posts
+ * semaphore when there is a hop worth of frames. Worker thread converts
+ * them, takes Hann windowed FFT (realfft.h) of last 'size' frames every
+ * 'hop' frames and publishes magnitude frame in dBFS per channel and bin.
+ * Full scale sine is 0 dB. No FFT is ever run on audio thread. If ring is
+ * full frames are dropped and counted.
+ *
+ * Frames are published to memfd (like meter.h) which is ring of last
+ * SPECTRUM_HISTORY frames. Every slot has its own seqlock: sequence is odd
+ * while worker writes it and readers copy and retry if it moved. Latest
+ * frame is live spectrum and frames since last read are spectrogram rows.
+ * Other processes map it read only through '/proc/PID/fd/N'. See
+ * tools/spectrum_watch.c.
+ *
+ * Players and recorders enable it with SPECTRUM in environment. Empty
+ * value is defaults (2048 point FFT with 75 % overlap). Only first
+ * SPECTRUM_MAX_CHANNELS channels are analysed:
+ *
+ *   SPECTRUM="size=4096,overlap=50" ./player some.wav
+ *
+ * Header only: just include it. Needs _GNU_SOURCE for memfd_create(),
+ * C11 atomics, pthreads and -lm.
+ */
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "realfft.h"
+#include "ringbuffer.h"
+
+#define SPECTRUM_MAGIC "LAESPC01"
+#define SPECTRUM_MAX_CHANNELS 8
+#define SPECTRUM_MIN_SIZE 64
+#define SPECTRUM_MAX_SIZE 16384
+#define SPECTRUM_DEFAULT_SIZE 2048
+#define SPECTRUM_DEFAULT_OVERLAP 75
+/* Frames kept in shared memory for spectrogram */
+#define SPECTRUM_HISTORY 64
+/* How many seconds ring from callback holds */
+#define SPECTRUM_RING_SECONDS 1
+#define SPECTRUM_FLOOR_DB -150.0f
+/* Reader gives up after this many torn reads */
+#define SPECTRUM_READ_TRIES 64
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "spectrum needs lock-free 64-bit atomics");
+
+typedef struct spectrum_header {
+    char magic[8];
+    /* Bytes of whole segment */
+    uint32_t size;
+    uint32_t pid;
+    uint32_t samplerate;
+    /* Analysed channels */
+    uint32_t channels;
+    uint32_t fft_size;
+    uint32_t hop;
+    /* size / 2 + 1 from DC to Nyquist */
+    uint32_t bins;
+    uint32_t history;
+    /* Bytes from one slot to next */
+    uint32_t slot_size;
+    uint32_t reserved;
+    /* Frames published so far. Frame n is in slot n % history */
+    _Alignas(64) _Atomic uint64_t written;
+    /* Stream frames callback could not give to worker */
+    _Atomic uint64_t dropped;
+} spectrum_header;
+
+/* Slot is followed by channels * bins floats, channel after channel */
+typedef struct spectrum_slot {
+    _Alignas(64) _Atomic uint32_t seq;
+    uint32_t reserved;
+    /* Frame number */
+    uint64_t index;
+    /* Stream frame where window ends */
+    uint64_t position;
+} spectrum_slot;
+
+typedef struct spectrum {
+    int fd;
+    size_t map_size;
+    spectrum_header *shared;
+    /* Rest is for writer only */
+    int stream_channels;
+    /* 0 is float, 2, 3 or 4 is integer */
+    int sample_bytes;
+    ringbuffer ring;
+    sem_t wake;
+    pthread_t worker;
+    int started;
+    atomic_int closing;
+    realfft fft;
+    float *window;
+    float *input;
+    float *work;
+    float *scratch;
+    float *re;
+    float *im;
+    unsigned char *raw;
+    float scale_db;
+    uint64_t position;
+} spectrum;
+
+/* Is SPECTRUM set in environment */
+static inline int spectrum_wanted(void) {
+    return getenv("SPECTRUM") != NULL;
+}
+
+static inline spectrum_slot *spectrum_slot_at(const spectrum *sp, uint64_t index) {
+    return (spectrum_slot *)((char *)sp->shared + sizeof(spectrum_header)
+                             + (index % sp->shared->history) * sp->shared->slot_size);
+}
+
+static inline float *spectrum_slot_data(spectrum_slot *slot) {
+    return (float *)(slot + 1);
+}
+
+static inline int spectrum_map(spectrum *sp, int prot) {
+    sp->shared = (spectrum_header *)mmap(NULL, sp->map_size, prot, MAP_SHARED, sp->fd, 0);
+
+    if (sp->shared == MAP_FAILED) {
+        sp->shared = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void spectrum_unmap(spectrum *sp) {
+    if (sp->shared != NULL && sp->fd >= 0) {
+        munmap(sp->shared, sp->map_size);
+    } else {
+        free(sp->shared);
+    }
+
+    if (sp->fd >= 0) {
+        close(sp->fd);
+    }
+
+    sp->shared = NULL;
+    sp->fd = -1;
+}
+
+/* Sample 'i' of raw block as float */
+static inline float spectrum_sample(const spectrum *sp, const unsigned char *raw, long i) {
+    const unsigned char *l_ptrSample = NULL;
+
+    switch (sp->sample_bytes) {
+        case 2:
+            return ((const short *)raw)[i] * (1.0f / 32768.0f);
+
+        case 3:
+            l_ptrSample = raw + i * 3;
+            return (int32_t)((uint32_t)l_ptrSample[0] << 8 | (uint32_t)l_ptrSample[1] << 16
+                             | (uint32_t)l_ptrSample[2] << 24) * (1.0f / 2147483648.0f);
+
+        case 4:
+            return ((const int32_t *)raw)[i] * (1.0f / 2147483648.0f);
+
+        default:
+            return ((const float *)raw)[i];
+    }
+}
+
+/* Window and FFT every channel and publish result to next slot */
+static inline void spectrum_analyse(spectrum *sp) {
+    spectrum_header *l_SShared = sp->shared;
+    uint64_t l_lIndex = atomic_load_explicit(&l_SShared->written, memory_order_relaxed);
+    spectrum_slot *l_SSlot = spectrum_slot_at(sp, l_lIndex);
+    uint32_t l_iSeq = atomic_load_explicit(&l_SSlot->seq, memory_order_relaxed);
+    float *l_fOut = NULL;
+    float *l_fInput = NULL;
+    float l_fPower = 0.0f;
+    float l_fDb = 0.0f;
+    uint32_t N = l_SShared->fft_size;
+    uint32_t c = 0;
+    uint32_t i = 0;
+
+    atomic_store_explicit(&l_SSlot->seq, l_iSeq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    l_SSlot->index = l_lIndex;
+    l_SSlot->position = sp->position;
+
+    for (c = 0; c < l_SShared->channels; c++) {
+        l_fInput = sp->input + c * N;
+        l_fOut = spectrum_slot_data(l_SSlot) + c * l_SShared->bins;
+
+        for (i = 0; i < N; i++) {
+            sp->work[i] = l_fInput[i] * sp->window[i];
+        }
+
+        realfft_forward(&sp->fft, sp->work, sp->re, sp->im, sp->scratch);
+
+        for (i = 0; i < l_SShared->bins; i++) {
+            l_fPower = sp->re[i] * sp->re[i] + sp->im[i] * sp->im[i];
+            l_fDb = l_fPower > 0.0f ? 10.0f * log10f(l_fPower) + sp->scale_db : SPECTRUM_FLOOR_DB;
+            l_fOut[i] = l_fDb > SPECTRUM_FLOOR_DB ? l_fDb : SPECTRUM_FLOOR_DB;
+        }
+    }
+
+    atomic_store_explicit(&l_SSlot->seq, l_iSeq + 2, memory_order_release);
+    atomic_store_explicit(&l_SShared->written, l_lIndex + 1, memory_order_release);
+}
+
+/* Take one hop of frames from ring to end of analysis windows */
+static inline void spectrum_take_hop(spectrum *sp) {
+    uint32_t N = sp->shared->fft_size;
+    uint32_t l_iHop = sp->shared->hop;
+    uint32_t l_iChannels = sp->shared->channels;
+    size_t l_lSampleBytes = sp->sample_bytes ? sp->sample_bytes : sizeof(float);
+    float *l_fInput = NULL;
+    uint32_t c = 0;
+    uint32_t i = 0;
+
+    ringbuffer_read(&sp->ring, sp->raw, l_iHop * sp->stream_channels * l_lSampleBytes);
+
+    for (c = 0; c < l_iChannels; c++) {
+        l_fInput = sp->input + c * N;
+        memmove(l_fInput, l_fInput + l_iHop, (N - l_iHop) * sizeof(float));
+
+        for (i = 0; i < l_iHop; i++) {
+            l_fInput[N - l_iHop + i] = spectrum_sample(sp, sp->raw, (long)i * sp->stream_channels + c);
+        }
+    }
+
+    sp->position += l_iHop;
+}
+
+static void *spectrum_worker_thread(void *userdata) {
+    spectrum *l_SSp = (spectrum *)userdata;
+    size_t l_lSampleBytes = l_SSp->sample_bytes ? l_SSp->sample_bytes : sizeof(float);
+    size_t l_lHopBytes = l_SSp->shared->hop * l_SSp->stream_channels * l_lSampleBytes;
+    int l_iClosing = 0;
+
+    while (!l_iClosing) {
+        sem_wait(&l_SSp->wake);
+        l_iClosing = atomic_load(&l_SSp->closing);
+
+        while (ringbuffer_read_space(&l_SSp->ring) >= l_lHopBytes) {
+            spectrum_take_hop(l_SSp);
+            spectrum_analyse(l_SSp);
+        }
+    }
+
+    return NULL;
+}
+
+/* Audio thread. Copies interleaved block in format given to
+   spectrum_open(). Never blocks or allocates */
+static inline void spectrum_push(spectrum *sp, const void *pcm, long frames) {
+    size_t l_lFrameBytes = 0;
+    size_t l_lSpace = 0;
+    long l_lTake = 0;
+
+    if (sp->shared == NULL || pcm == NULL || frames <= 0) {
+        return;
+    }
+
+    l_lFrameBytes = sp->stream_channels * (sp->sample_bytes ? sp->sample_bytes : sizeof(float));
+    l_lSpace = ringbuffer_write_space(&sp->ring) / l_lFrameBytes;
+    l_lTake = frames < (long)l_lSpace ? frames : (long)l_lSpace;
+
+    if (l_lTake < frames) {
+        atomic_fetch_add_explicit(&sp->shared->dropped, frames - l_lTake, memory_order_relaxed);
+    }
+
+    ringbuffer_write(&sp->ring, pcm, l_lTake * l_lFrameBytes);
+
+    if (ringbuffer_read_space(&sp->ring) >= sp->shared->hop * l_lFrameBytes) {
+        sem_post(&sp->wake);
+    }
+}
+
+static inline void spectrum_free(spectrum *sp) {
+    free(sp->window);
+    free(sp->input);
+    free(sp->work);
+    free(sp->scratch);
+    free(sp->re);
+    free(sp->im);
+    free(sp->raw);
+    realfft_free(&sp->fft);
+    ringbuffer_free(&sp->ring);
+    spectrum_unmap(sp);
+}
+
+/* Writer: 'sample_bytes' is 0 for float samples or 2, 3 (packed) or 4 for
+   integer. 'spec' is 'size=N,overlap=percent' */
+static inline int spectrum_open(spectrum *sp, uint32_t samplerate, int channels, int sample_bytes, const char *spec) {
+    char l_strSpec[256];
+    char *l_strItem = NULL;
+    char *l_strSave = NULL;
+    long l_lSize = SPECTRUM_DEFAULT_SIZE;
+    long l_lOverlap = SPECTRUM_DEFAULT_OVERLAP;
+    uint32_t N = SPECTRUM_MIN_SIZE;
+    uint32_t l_iChannels = 0;
+    uint32_t l_iBins = 0;
+    uint32_t l_iSlotSize = 0;
+    size_t l_lRing = 1;
+    double l_dWindowSum = 0.0;
+    uint32_t i = 0;
+
+    memset(sp, 0x00, sizeof(spectrum));
+    sp->fd = -1;
+    snprintf(l_strSpec, sizeof(l_strSpec), "%s", spec != NULL ? spec : "");
+
+    for (l_strItem = strtok_r(l_strSpec, ",", &l_strSave); l_strItem != NULL; l_strItem = strtok_r(NULL, ",", &l_strSave)) {
+        if (!strncmp(l_strItem, "size=", 5)) {
+            l_lSize = atol(l_strItem + 5);
+        } else if (!strncmp(l_strItem, "overlap=", 8)) {
+            l_lOverlap = atol(l_strItem + 8);
+        } else {
+            fprintf(stderr, "spectrum_open: Unknown '%s' in SPECTRUM\n", l_strItem);
+            return -1;
+        }
+    }
+
+    if (channels < 1 || samplerate == 0 || (sample_bytes != 0 && (sample_bytes < 2 || sample_bytes > 4))
+            || l_lOverlap < 0 || l_lOverlap > 95) {
+        fprintf(stderr, "spectrum_open: %d channels, %d byte samples and %ld %% overlap not supported\n",
+                channels, sample_bytes, l_lOverlap);
+        return -1;
+    }
+
+    while (N < l_lSize && N < SPECTRUM_MAX_SIZE) {
+        N <<= 1;
+    }
+
+    l_iChannels = channels < SPECTRUM_MAX_CHANNELS ? channels : SPECTRUM_MAX_CHANNELS;
+    l_iBins = N / 2 + 1;
+    l_iSlotSize = (sizeof(spectrum_slot) + l_iChannels * l_iBins * sizeof(float) + 63) & ~63U;
+    sp->map_size = sizeof(spectrum_header) + (size_t)SPECTRUM_HISTORY * l_iSlotSize;
+    sp->stream_channels = channels;
+    sp->sample_bytes = sample_bytes;
+
+    sp->fd = memfd_create("spectrum", MFD_CLOEXEC);
+
+    if (sp->fd >= 0 && (ftruncate(sp->fd, sp->map_size) < 0 || spectrum_map(sp, PROT_READ | PROT_WRITE) < 0)) {
+        close(sp->fd);
+        sp->fd = -1;
+    }
+
+    /* Still useful inside this process */
+    if (sp->fd < 0) {
+        sp->shared = (spectrum_header *)calloc(1, sp->map_size);
+
+        if (sp->shared == NULL) {
+            return -1;
+        }
+    }
+
+    memcpy(sp->shared->magic, SPECTRUM_MAGIC, 8);
+    sp->shared->size = sp->map_size;
+    sp->shared->pid = (uint32_t)getpid();
+    sp->shared->samplerate = samplerate;
+    sp->shared->channels = l_iChannels;
+    sp->shared->fft_size = N;
+    sp->shared->hop = N - N * l_lOverlap / 100;
+    sp->shared->bins = l_iBins;
+    sp->shared->history = SPECTRUM_HISTORY;
+    sp->shared->slot_size = l_iSlotSize;
+    atomic_init(&sp->shared->written, 0);
+    atomic_init(&sp->shared->dropped, 0);
+
+    while (l_lRing < (size_t)samplerate * SPECTRUM_RING_SECONDS * channels * 4 || l_lRing < (size_t)N * channels * 4 * 2) {
+        l_lRing <<= 1;
+    }
+
+    sp->window = (float *)malloc(N * sizeof(float));
+    sp->input = (float *)calloc(l_iChannels * N, sizeof(float));
+    sp->work = (float *)malloc(N * sizeof(float));
+    sp->scratch = (float *)malloc(N * sizeof(float));
+    sp->re = (float *)malloc(l_iBins * sizeof(float));
+    sp->im = (float *)malloc(l_iBins * sizeof(float));
+    sp->raw = (unsigned char *)malloc((size_t)N * channels * 4);
+
+    if (sp->window == NULL || sp->input == NULL || sp->work == NULL || sp->scratch == NULL || sp->re == NULL
+            || sp->im == NULL || sp->raw == NULL || realfft_init(&sp->fft, N / 2) < 0
+            || ringbuffer_init(&sp->ring, l_lRing) < 0) {
+        spectrum_free(sp);
+        return -1;
+    }
+
+    for (i = 0; i < N; i++) {
+        sp->window[i] = 0.5f - 0.5f * cos(2.0 * M_PI * i / N);
+        l_dWindowSum += sp->window[i];
+    }
+
+    /* Full scale sine has amplitude sum(window) / 2 in its bin */
+    sp->scale_db = 20.0f * log10f(2.0f / l_dWindowSum);
+
+    sem_init(&sp->wake, 0, 0);
+    atomic_init(&sp->closing, 0);
+
+    if (pthread_create(&sp->worker, NULL, spectrum_worker_thread, sp) != 0) {
+        sem_destroy(&sp->wake);
+        spectrum_free(sp);
+        return -1;
+    }
+
+    sp->started = 1;
+    return 0;
+}
+
+/* Writer: analyse whole hops still in ring and stop worker */
+static inline void spectrum_close(spectrum *sp) {
+    if (sp->started) {
+        atomic_store(&sp->closing, 1);
+        sem_post(&sp->wake);
+        pthread_join(sp->worker, NULL);
+        sem_destroy(&sp->wake);
+        sp->started = 0;
+    }
+
+    spectrum_free(sp);
+}
+
+/* Path other processes can give to spectrum_attach(). -1 if it is private */
+static inline int spectrum_path(const spectrum *sp, char *path, size_t len) {
+    if (sp->fd < 0) {
+        return -1;
+    }
+
+    snprintf(path, len, "/proc/%ld/fd/%d", (long)getpid(), sp->fd);
+    return 0;
+}
+
+/* Reader: map spectrum of other process read only */
+static inline int spectrum_attach(spectrum *sp, const char *path) {
+    spectrum_header l_SHead;
+
+    memset(sp, 0x00, sizeof(spectrum));
+    sp->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (sp->fd < 0) {
+        return -1;
+    }
+
+    if (pread(sp->fd, &l_SHead, sizeof(spectrum_header), 0) != sizeof(spectrum_header)
+            || memcmp(l_SHead.magic, SPECTRUM_MAGIC, 8)
+            || l_SHead.history == 0
+            || l_SHead.size != sizeof(spectrum_header) + (size_t)l_SHead.history * l_SHead.slot_size) {
+        close(sp->fd);
+        sp->fd = -1;
+        return -1;
+    }
+
+    sp->map_size = l_SHead.size;
+
+    if (spectrum_map(sp, PROT_READ) < 0) {
+        close(sp->fd);
+        sp->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Reader: unmap */
+static inline void spectrum_detach(spectrum *sp) {
+    spectrum_unmap(sp);
+}
+
+/* Frames published so far. Newest is written - 1 */
+static inline uint64_t spectrum_written(const spectrum *sp) {
+    return atomic_load_explicit(&sp->shared->written, memory_order_acquire);
+}
+
+/* Any thread or process. Copies channels * bins dB values of frame
+   'index' to 'db'. Returns -1 if frame is not there (yet or anymore) or
+   worker was always in middle of writing it */
+static inline int spectrum_read(const spectrum *sp, uint64_t index, uint64_t *position, float *db) {
+    spectrum_slot *l_SSlot = NULL;
+    uint32_t l_iBefore = 0;
+    int i = 0;
+
+    if (index >= spectrum_written(sp) || spectrum_written(sp) - index > sp->shared->history) {
+        return -1;
+    }
+
+    l_SSlot = spectrum_slot_at(sp, index);
+
+    for (i = 0; i < SPECTRUM_READ_TRIES; i++) {
+        l_iBefore = atomic_load_explicit(&l_SSlot->seq, memory_order_acquire);
+
+        if (l_iBefore & 1) {
+            continue;
+        }
+
+        memcpy(db, spectrum_slot_data(l_SSlot), sp->shared->channels * sp->shared->bins * sizeof(float));
+        *position = l_SSlot->index == index ? l_SSlot->position : 0;
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&l_SSlot->seq, memory_order_relaxed) == l_iBefore) {
+            return l_SSlot->index == index ? 0 : -1;
+        }
+    }
+
+    return -1;
+}
+
+/* Print where spectrum can be watched */
+static inline void spectrum_print_path(const spectrum *sp) {
+    char l_strPath[64];
+
+    if (spectrum_path(sp, l_strPath, sizeof(l_strPath)) == 0) {
+        printf("Spectrum: %s (watch with tools/spectrum_watch %s)\n", l_strPath, l_strPath);
+    }
+}
+
+static inline void spectrum_print_stats(const spectrum *sp) {
+    printf("spectrum: %u point FFT every %u frames, %llu frames analysed, %llu stream frames dropped\n",
+           sp->shared->fft_size, sp->shared->hop, (unsigned long long)spectrum_written(sp),
+           (unsigned long long)atomic_load(&sp->shared->dropped));
+}
+
+#endif
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Streaming input for libsndfile from stdin, FIFO or inherited descriptor.
+ *
+ * sf_open() wants a file it can seek. Here reader thread does blocking
+ * read() calls from pipe to a jitter buffer (lock-free ring) and libsndfile
+ * reads through sf_open_virtual(). Header parsers seek backwards a little
+ * so first STREAMINPUT_HEAD_CACHE bytes are kept and can be read again.
+ * Seeking forward just skips bytes. Headerless PCM can be read with
+ * streaminput_parse_raw() spec 'rate:channels:format' (format is
+ * s8, s16, s24, s32 or float).
+ *
+ * Jitter buffer: reads block until buffer has 'jitter' milliseconds of
+ * audio (high watermark). If it runs empty (underrun) reading blocks again
+ * until it is filled to high watermark. Falling under low watermark
+ * (quarter of high) is counted so bursty producers can be seen. Reader
+ * thread counts producer stalls: read() calls that blocked longer than
+ * STREAMINPUT_STALL_MS.
+ *
+ * Path can be '-' for stdin, 'fd:N' for inherited descriptor or name of
+ * FIFO (or any file).
+ */
+
+#ifndef STREAMINPUT_H
+#define STREAMINPUT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#include "ringbuffer.h"
+
+#define STREAMINPUT_RING_BYTES (4 * 1024 * 1024)
+#define STREAMINPUT_HEAD_CACHE (64 * 1024)
+#define STREAMINPUT_STALL_MS 50
+/* Until we know the format watermark is in bytes */
+#define STREAMINPUT_PREBUFFER_BYTES 4096
+
+typedef struct streaminput {
+    int fd;
+    ringbuffer ring;
+    pthread_t thread;
+    int thread_running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int eof;
+
+    /* Only used by reading side (libsndfile) */
+    char head[STREAMINPUT_HEAD_CACHE];
+    sf_count_t head_len;
+    sf_count_t pos;
+    sf_count_t consumed;
+    size_t high_watermark;
+    size_t low_watermark;
+    int buffering;
+    int jitter_ms;
+    /* If set and it becomes non zero waiting stops (like EOF) */
+    volatile sig_atomic_t *abort_flag;
+
+    /* Statistics */
+    atomic_long bytes_in;
+    atomic_long stalls;
+    atomic_long stall_ms;
+    atomic_long longest_stall_ms;
+    long underruns;
+    long low_events;
+} streaminput;
+
+static inline long streaminput_ms_since(const struct timespec *start) {
+    struct timespec l_SNow;
+    clock_gettime(CLOCK_MONOTONIC, &l_SNow);
+    return (l_SNow.tv_sec - start->tv_sec) * 1000L + (l_SNow.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+static void streaminput_unlock(void *mutex) {
+    pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+/* Wait at most 100 ms so abort_flag is noticed. Returns 0 if aborted */
+static inline int streaminput_wait(streaminput *in) {
+    struct timespec l_STimeout;
+
+    if (in->abort_flag != NULL && *in->abort_flag) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &l_STimeout);
+    l_STimeout.tv_nsec += 100000000L;
+
+    if (l_STimeout.tv_nsec >= 1000000000L) {
+        l_STimeout.tv_sec++;
+        l_STimeout.tv_nsec -= 1000000000L;
+    }
+
+    pthread_cond_timedwait(&in->cond, &in->lock, &l_STimeout);
+    return 1;
+}
+
+/* Reader thread: move bytes from descriptor to ring */
+static void *streaminput_thread(void *userdata) {
+    streaminput *in = (streaminput *)userdata;
+    void *l_ptrFirst = NULL;
+    void *l_ptrSecond = NULL;
+    size_t l_lFirst = 0;
+    size_t l_lSecond = 0;
+    ssize_t l_lGot = 0;
+    long l_lBlocked = 0;
+    struct timespec l_SStart;
+
+    while (1) {
+        /* Thread is cancelled in streaminput_close() so don't leave mutex locked */
+        pthread_mutex_lock(&in->lock);
+        pthread_cleanup_push(streaminput_unlock, &in->lock);
+
+        while (ringbuffer_get_write_regions(&in->ring, &l_ptrFirst, &l_lFirst, &l_ptrSecond, &l_lSecond) == 0) {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+
+        pthread_cleanup_pop(1);
+
+        clock_gettime(CLOCK_MONOTONIC, &l_SStart);
+        l_lGot = read(in->fd, l_ptrFirst, l_lFirst);
+        l_lBlocked = streaminput_ms_since(&l_SStart);
+
+        if (l_lGot < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (l_lBlocked >= STREAMINPUT_STALL_MS && l_lGot > 0) {
+            atomic_fetch_add(&in->stalls, 1);
+            atomic_fetch_add(&in->stall_ms, l_lBlocked);
+
+            if (l_lBlocked > atomic_load(&in->longest_stall_ms)) {
+                atomic_store(&in->longest_stall_ms, l_lBlocked);
+            }
+        }
+
+        pthread_mutex_lock(&in->lock);
+
+        if (l_lGot <= 0) {
+            atomic_store(&in->eof, 1);
+            pthread_cond_broadcast(&in->cond);
+            pthread_mutex_unlock(&in->lock);
+            break;
+        }
+
+        ringbuffer_write_advance(&in->ring, l_lGot);
+        atomic_fetch_add(&in->bytes_in, l_lGot);
+        pthread_cond_broadcast(&in->cond);
+        pthread_mutex_unlock(&in->lock);
+    }
+
+    return NULL;
+}
+
+/* Take bytes out of jitter buffer. Blocks while buffering */
+static inline sf_count_t streaminput_take(streaminput *in, char *dst, sf_count_t count) {
+    size_t l_lHave = 0;
+
+    pthread_mutex_lock(&in->lock);
+
+    l_lHave = ringbuffer_read_space(&in->ring);
+
+    if (l_lHave == 0 && !atomic_load(&in->eof) && !in->buffering) {
+        /* Underrun: wait until buffer is full enough again */
+        in->underruns++;
+        in->buffering = 1;
+    }
+
+    while (in->buffering && !atomic_load(&in->eof) && ringbuffer_read_space(&in->ring) < in->high_watermark) {
+        if (!streaminput_wait(in)) {
+            pthread_mutex_unlock(&in->lock);
+            return 0;
+        }
+    }
+
+    in->buffering = 0;
+
+    while (ringbuffer_read_space(&in->ring) == 0 && !atomic_load(&in->eof)) {
+        if (!streaminput_wait(in)) {
+            pthread_mutex_unlock(&in->lock);
+            return 0;
+        }
+    }
+
+    count = (sf_count_t)ringbuffer_read(&in->ring, dst, count);
+
+    if (!atomic_load(&in->eof) && l_lHave >= in->low_watermark && ringbuffer_read_space(&in->ring) < in->low_watermark) {
+        in->low_events++;
+    }
+
+    /* Reader may wait for space */
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+
+    /* Keep copy of the beginning for header parsers */
+    if (in->consumed < STREAMINPUT_HEAD_CACHE) {
+        sf_count_t l_lCopy = STREAMINPUT_HEAD_CACHE - in->consumed;
+        l_lCopy = l_lCopy < count ? l_lCopy : count;
+        memcpy(in->head + in->consumed, dst, l_lCopy);
+        in->head_len = in->consumed + l_lCopy;
+    }
+
+    in->consumed += count;
+    return count;
+}
+
+static sf_count_t streaminput_vio_read(void *ptr, sf_count_t count, void *user_data) {
+    streaminput *in = (streaminput *)user_data;
+    sf_count_t l_lDone = 0;
+    sf_count_t l_lGot = 0;
+
+    /* Backward seek has been done so serve from head cache first */
+    if (in->pos < in->consumed) {
+        l_lDone = in->consumed - in->pos;
+        l_lDone = l_lDone < count ? l_lDone : count;
+        memcpy(ptr, in->head + in->pos, l_lDone);
+        in->pos += l_lDone;
+    }
+
+    while (l_lDone < count) {
+        l_lGot = streaminput_take(in, (char *)ptr + l_lDone, count - l_lDone);
+
+        if (l_lGot <= 0) {
+            break;
+        }
+
+        l_lDone += l_lGot;
+        in->pos += l_lGot;
+    }
+
+    return l_lDone;
+}
+
+static sf_count_t streaminput_vio_seek(sf_count_t offset, int whence, void *user_data) {
+    streaminput *in = (streaminput *)user_data;
+    sf_count_t l_lTarget = 0;
+    char l_cSkip[4096];
+
+    switch (whence) {
+        case SEEK_SET:
+            l_lTarget = offset;
+            break;
+
+        case SEEK_CUR:
+            l_lTarget = in->pos + offset;
+            break;
+
+        default:
+            /* There is no end in stream */
+            return -1;
+    }
+
+    if (l_lTarget < in->pos) {
+        /* Only inside what is still in head cache */
+        if (l_lTarget < 0 || in->consumed > in->head_len) {
+            return -1;
+        }
+
+        in->pos = l_lTarget;
+        return in->pos;
+    }
+
+    while (in->pos < l_lTarget) {
+        sf_count_t l_lStep = l_lTarget - in->pos;
+        l_lStep = l_lStep < (sf_count_t)sizeof(l_cSkip) ? l_lStep : (sf_count_t)sizeof(l_cSkip);
+
+        if (streaminput_vio_read(l_cSkip, l_lStep, in) <= 0) {
+            return -1;
+        }
+    }
+
+    return in->pos;
+}
+
+/* There is no length. Tell something big so headers are believed */
+static sf_count_t streaminput_vio_get_filelen(void *user_data) {
+    return INT64_MAX / 4;
+}
+
+static sf_count_t streaminput_vio_tell(void *user_data) {
+    return ((streaminput *)user_data)->pos;
+}
+
+/* 'rate:channels:format' to SF_INFO for headerless input */
+static inline int streaminput_parse_raw(const char *spec, SF_INFO *info) {
+    char l_strFormat[16];
+
+    memset(info, 0x00, sizeof(SF_INFO));
+
+    if (sscanf(spec, "%d:%d:%15s", &info->samplerate, &info->channels, l_strFormat) != 3) {
+        return -1;
+    }
+
+    info->format = SF_FORMAT_RAW | SF_ENDIAN_LITTLE;
+
+    if (!strcmp(l_strFormat, "s8")) {
+        info->format |= SF_FORMAT_PCM_S8;
+    } else if (!strcmp(l_strFormat, "s16")) {
+        info->format |= SF_FORMAT_PCM_16;
+    } else if (!strcmp(l_strFormat, "s24")) {
+        info->format |= SF_FORMAT_PCM_24;
+    } else if (!strcmp(l_strFormat, "s32")) {
+        info->format |= SF_FORMAT_PCM_32;
+    } else if (!strcmp(l_strFormat, "float")) {
+        info->format |= SF_FORMAT_FLOAT;
+    } else {
+        return -1;
+    }
+
+    return sf_format_check(info) ? 0 : -1;
+}
+
+/* Bytes per second of PCM in file. Compressed files are guessed as 16-bit */
+static inline size_t streaminput_bytes_per_second(const SF_INFO *info) {
+    size_t l_lBytes = 2;
+
+    switch (info->format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_PCM_U8:
+            l_lBytes = 1;
+            break;
+
+        case SF_FORMAT_PCM_24:
+            l_lBytes = 3;
+            break;
+
+        case SF_FORMAT_PCM_32:
+        case SF_FORMAT_FLOAT:
+            l_lBytes = 4;
+            break;
+
+        case SF_FORMAT_DOUBLE:
+            l_lBytes = 8;
+            break;
+    }
+
+    return l_lBytes * info->channels * info->samplerate;
+}
+
+/* Open stream. If info->format is set (see streaminput_parse_raw) it is
+   used as headerless format. Returns NULL on error */
+static inline SNDFILE *streaminput_open(streaminput *in, const char *path, SF_INFO *info, int jitter_ms,
+                                        volatile sig_atomic_t *abort_flag) {
+    static SF_VIRTUAL_IO l_SVio = {
+        streaminput_vio_get_filelen,
+        streaminput_vio_seek,
+        streaminput_vio_read,
+        NULL,
+        streaminput_vio_tell
+    };
+    SNDFILE *l_SFile = NULL;
+    size_t l_lHigh = 0;
+
+    memset(in, 0x00, sizeof(streaminput));
+    /* First so streaminput_close() is safe after any failure below */
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+
+    if (!strcmp(path, "-")) {
+        in->fd = STDIN_FILENO;
+    } else if (!strncmp(path, "fd:", 3)) {
+        in->fd = atoi(path + 3);
+    } else {
+        in->fd = open(path, O_RDONLY);
+    }
+
+    if (in->fd < 0 || ringbuffer_init(&in->ring, STREAMINPUT_RING_BYTES) < 0) {
+        return NULL;
+    }
+
+    atomic_init(&in->eof, 0);
+    atomic_init(&in->bytes_in, 0);
+    atomic_init(&in->stalls, 0);
+    atomic_init(&in->stall_ms, 0);
+    atomic_init(&in->longest_stall_ms, 0);
+    in->jitter_ms = jitter_ms;
+    in->abort_flag = abort_flag;
+    in->high_watermark = STREAMINPUT_PREBUFFER_BYTES;
+    in->low_watermark = 0;
+    in->buffering = 1;
+
+    if (pthread_create(&in->thread, NULL, streaminput_thread, in) != 0) {
+        return NULL;
+    }
+
+    in->thread_running = 1;
+
+    l_SFile = sf_open_virtual(&l_SVio, SFM_READ, info, in);
+
+    if (l_SFile == NULL) {
+        return NULL;
+    }
+
+    /* Now we know how many bytes is jitter_ms */
+    l_lHigh = streaminput_bytes_per_second(info) / 1000 * jitter_ms;
+
+    if (l_lHigh > in->ring.size / 2) {
+        l_lHigh = in->ring.size / 2;
+    }
+
+    pthread_mutex_lock(&in->lock);
+    in->high_watermark = l_lHigh;
+    in->low_watermark = l_lHigh / 4;
+    in->buffering = 1;
+    pthread_mutex_unlock(&in->lock);
+
+    return l_SFile;
+}
+
+static inline void streaminput_print_stats(streaminput *in) {
+    printf("streaminput: %ld bytes in, jitter buffer %d ms, underruns %ld, under low watermark %ld times\n",
+           atomic_load(&in->bytes_in), in->jitter_ms, in->underruns, in->low_events);
+    printf("streaminput: producer stalls (>= %d ms) %ld, total %ld ms, longest %ld ms\n",
+           STREAMINPUT_STALL_MS, atomic_load(&in->stalls), atomic_load(&in->stall_ms),
+           atomic_load(&in->longest_stall_ms));
+}
+
+/* Call after sf_close(). Also when streaminput_open() fails */
+static inline void streaminput_close(streaminput *in) {
+    if (in->thread_running) {
+        pthread_cancel(in->thread);
+        pthread_join(in->thread, NULL);
+        in->thread_running = 0;
+    }
+
+    if (in->fd > STDIN_FILENO) {
+        close(in->fd);
+    }
+
+    in->fd = -1;
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->cond);
+    ringbuffer_free(&in->ring);
+}
+
+#endif
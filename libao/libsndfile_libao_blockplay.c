@@ -24,27 +24,51 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with
- * gcc -g $(pkg-config --cflags --libs ao) -lm -lsndfile libsndfile_libao_blockplay.c -std=c99 -Wall -o libsndfile_libao_blockplay
+ * gcc -g -I../common $(pkg-config --cflags --libs ao) -lm -lsndfile -lpthread libsndfile_libao_blockplay.c -std=c99 -Wall -o libsndfile_libao_blockplay
  *
- * Run with ./libsndfile_libao_blockplay some.[wav/.flac/.aiff] (Warning! Will overwrite without warning!)
+ * Run with ./libsndfile_libao_blockplay [-b frames] [-n buffers] some.[wav/.flac/.aiff] (Warning! Will overwrite without warning!)
+ *
+ * Decoding runs in own thread into pool of -n buffers (default 4) of -b
+ * frames (default 4096) while ao_play() is playing previous one (see
+ * common/blockpool.h). Only first block has to be decoded before sound so
+ * smaller block starts and stops faster. At the end time to first audio
+ * and CPU time used per second of audio are printed.
+ *
+ * With SIMDEV set in environment blocks are written to simulated device
+ * instead of ao_play() (see common/simdev.h). It drains one period per tick
+ * of its own clock so underruns of decoder can be counted without sound card.
  */
 
 #define _XOPEN_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200112L
 
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <ao/ao.h>
 #include <sndfile.h>
 #include <signal.h>
+#include <sys/resource.h>
+
+#include "blockpool.h"
+#include "simdev.h"
 
 SNDFILE *m_SInfile;
 SF_INFO m_SSfinfo ;
 
-int m_iLoop = 0;
+volatile sig_atomic_t m_iLoop = 0;
+blockpool m_SPool;
+/* CPU time of decoder thread in seconds */
+double m_dDecodeCpu = 0.0;
+simdev m_SSim;
+int m_iSim = 0;
 
-#define PLAY_FRAMES_PER_BUFFER 44100
+#define PLAY_FRAMES_PER_BUFFER 4096
+#define PLAY_BUFFERS 4
 
 /* Handle termination with CTRL-C */
 static void handler(int sig, siginfo_t *si, void *unused) {
@@ -52,27 +76,100 @@ static void handler(int sig, siginfo_t *si, void *unused) {
     m_iLoop = 1;
 }
 
-int main(int argc, char *argv[]) {
+static double now_seconds(clockid_t clock) {
+    struct timespec l_STs;
+    clock_gettime(clock, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+/* Write block to libao or simulated device. Zero is error like ao_play() */
+static int play_block(ao_device *dev, char *block, size_t bytes) {
+    if (m_iSim) {
+        return simdev_write(&m_SSim, block, bytes / sizeof(short) / m_SSfinfo.channels) == 0;
+    }
+
+    return ao_play(dev, block, bytes);
+}
+
+/* Decode to free blocks until file ends or player stops */
+static void *decode_thread(void *userdata) {
+    short *l_iBlock = NULL;
+    long l_lSamples = m_SPool.block_bytes / sizeof(short);
     long l_lReadcount = 0;
+
+    while ((l_iBlock = (short *)blockpool_get_free(&m_SPool)) != NULL) {
+        l_lReadcount = sf_read_short(m_SInfile, l_iBlock, l_lSamples);
+
+        if (l_lReadcount <= 0) {
+            break;
+        }
+
+        blockpool_put_full(&m_SPool, l_lReadcount * sizeof(short));
+    }
+
+    blockpool_finish(&m_SPool);
+    m_dDecodeCpu = now_seconds(CLOCK_THREAD_CPUTIME_ID);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
     int l_iDriverNum;
     ao_device *l_SAODev = NULL;
     ao_sample_format l_SAOFormat;
-    long l_lSizeonesec = (PLAY_FRAMES_PER_BUFFER * 2) * sizeof(short);
-
-    /* Alloc size for one block */
-    short *l_iSampleBlock = (short *)malloc(l_lSizeonesec);
     struct sigaction l_SSa;
+    pthread_t l_SDecoder;
+    struct rusage l_SUsage;
+    long l_lBlockFrames = PLAY_FRAMES_PER_BUFFER;
+    int l_iBuffers = PLAY_BUFFERS;
+    int l_iOpt = 0;
+    int l_iDecoder = 0;
+    char *l_ptrBlock = NULL;
+    size_t l_lBytes = 0;
+    long l_lFrames = 0;
+    double l_dStart = now_seconds(CLOCK_MONOTONIC);
+    double l_dFirst = 0.0;
+    double l_dSeconds = 0.0;
+    double l_dCpu = 0.0;
+
+    while ((l_iOpt = getopt(argc, argv, "b:n:")) != -1) {
+        switch (l_iOpt) {
+            case 'b':
+                l_lBlockFrames = atol(optarg);
+                break;
+
+            case 'n':
+                l_iBuffers = atoi(optarg);
+                break;
 
-    printf("Playing file: '%s'\n", argv[1]);
+            default:
+                printf("Usage: %s [-b frames] [-n buffers] file\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || l_lBlockFrames <= 0 || l_iBuffers < 2) {
+        printf("Usage: %s [-b frames] [-n buffers] file\n", argv[0]);
+        return 1;
+    }
+
+    printf("Playing file: '%s'\n", argv[optind]);
 
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (m_SInfile = sf_open(argv[1], SFM_READ, &m_SSfinfo))) {
-        printf ("Not able to open input file %s.\n", argv[1]) ;
+    if (! (m_SInfile = sf_open(argv[optind], SFM_READ, &m_SSfinfo))) {
+        printf ("Not able to open input file %s.\n", argv[optind]) ;
         sf_perror (NULL) ;
         return  1 ;
     }
 
+    if (blockpool_init(&m_SPool, l_iBuffers, l_lBlockFrames * m_SSfinfo.channels * sizeof(short)) < 0) {
+        printf("Can't allocate %d buffers of %ld frames\n", l_iBuffers, l_lBlockFrames);
+        sf_close(m_SInfile);
+        return 1;
+    }
+
+    printf("%d buffers of %ld frames (%.1f ms)\n", l_iBuffers, l_lBlockFrames, l_lBlockFrames * 1000.0 / m_SSfinfo.samplerate);
+
     l_SSa.sa_flags = SA_SIGINFO;
     sigemptyset(&l_SSa.sa_mask);
     l_SSa.sa_sigaction = handler;
@@ -99,9 +196,18 @@ int main(int argc, char *argv[]) {
     l_SAOFormat.byte_format = AO_FMT_NATIVE;
     l_SAOFormat.matrix = 0;
 
-    l_SAODev = ao_open_live(l_iDriverNum, &l_SAOFormat, NULL);
+    if (simdev_wanted()) {
+        if (simdev_open(&m_SSim, m_SSfinfo.samplerate, m_SSfinfo.channels, sizeof(short), SIMDEV_BLOCKING) < 0) {
+            goto exit;
+        }
 
-    if(l_SAODev == NULL)
+        m_iSim = 1;
+
+        if (simdev_start(&m_SSim, NULL, NULL) < 0) {
+            fprintf(stderr, "Can't start simulated device\n");
+            goto exit;
+        }
+    } else if ((l_SAODev = ao_open_live(l_iDriverNum, &l_SAOFormat, NULL)) == NULL)
     {
       fprintf(stderr,"Can't open audio output %d (errno: %d)\n", l_iDriverNum, errno);
       goto exit;
@@ -109,27 +215,67 @@ int main(int argc, char *argv[]) {
 
     fflush(stdout);
 
-    while(1) {
-        l_lReadcount = sf_read_short(m_SInfile, l_iSampleBlock, l_lSizeonesec / 4);
+    if (pthread_create(&l_SDecoder, NULL, decode_thread, NULL) != 0) {
+        printf("Can't start decoder thread!\n");
+        goto exit;
+    }
+
+    l_iDecoder = 1;
+
+    /* Play filled blocks while decoder fills next ones */
+    while(!m_iLoop && (l_ptrBlock = (char *)blockpool_get_full(&m_SPool, &l_lBytes)) != NULL) {
+        if (l_lFrames == 0) {
+            l_dFirst = now_seconds(CLOCK_MONOTONIC);
+        }
 
-        if(l_lReadcount <= 0) {
-            printf("** File has ended (readcount: %ld/%ld)!\n", l_lReadcount, (l_lSizeonesec / 4));
+        if (!play_block(l_SAODev, l_ptrBlock, l_lBytes)) {
+            printf("** Can't play to output!\n");
             break;
         }
 
-        ao_play(l_SAODev, (char *)l_iSampleBlock, (l_lSizeonesec / 2));
+        l_lFrames += l_lBytes / sizeof(short) / m_SSfinfo.channels;
+        blockpool_put_free(&m_SPool);
+    }
 
-        if(m_iLoop) {
-           break;
-        }
+    if (!m_iLoop && l_ptrBlock == NULL) {
+        printf("** File has ended!\n");
     }
 
 exit:
+    if (l_iDecoder) {
+        blockpool_stop(&m_SPool);
+        pthread_join(l_SDecoder, NULL);
+    }
+
     sf_close(m_SInfile);
     if(l_SAODev != NULL)
     {
       ao_close(l_SAODev);
     }
     ao_shutdown();
+
+    if (m_iSim) {
+        if (!m_iLoop) {
+            simdev_drain(&m_SSim);
+        }
+
+        simdev_close(&m_SSim);
+        simdev_print_stats(&m_SSim);
+    }
+
+    /* CPU per second of audio. Played seconds, not wall clock */
+    l_dSeconds = (double)l_lFrames / m_SSfinfo.samplerate;
+    getrusage(RUSAGE_SELF, &l_SUsage);
+    l_dCpu = l_SUsage.ru_utime.tv_sec + l_SUsage.ru_utime.tv_usec / 1e6 + l_SUsage.ru_stime.tv_sec + l_SUsage.ru_stime.tv_usec / 1e6;
+
+    if (l_lFrames > 0) {
+        printf("Time to first audio %.1f ms\n", (l_dFirst - l_dStart) * 1000.0);
+        printf("Played %.2f s. CPU %.2f ms/s (decoder %.2f ms/s)\n", l_dSeconds,
+               l_dCpu * 1000.0 / l_dSeconds, m_dDecodeCpu * 1000.0 / l_dSeconds);
+        printf("Decoder waited for free buffer %ld times, player waited for decoder %ld times\n",
+               m_SPool.decoder_waits, m_SPool.player_waits);
+    }
+
+    blockpool_free(&m_SPool);
     return 0;
 }
@@ -28,56 +28,254 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with
- * gcc -g $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile libsndfile_port_blockplay.c -ansi -Wall -o libsndfile_port_blockplay
+ * gcc -g -I../common $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile -lpthread libsndfile_port_blockplay.c -std=c11 -Wall -o libsndfile_port_blockplay
  *
- * Run with ./libsndfile_port_blockplay some.[wav/.flac/.aiff] (Warning! Will overwrite without warning!)
+ * Run with ./libsndfile_port_blockplay [-w] [-l latency_ms] some.[wav/.flac/.aiff]
+ *
+ * Without -w one second is decoded and written with blocking
+ * Pa_WriteStream() in turns. With -w decoder thread keeps ring of
+ * RING_SECONDS full and main loop writes exactly what
+ * Pa_GetStreamWriteAvailable() says fits, so writes are small and never
+ * block. -l asks for output latency (default is device's low latency).
+ * Both play to the end of file.
+ *
+ * 16, 24 and 32-bit PCM files are written as paInt16, paInt24 or paInt32
+ * without float conversion (see common/nativefmt.h).
  */
 
-#define _BSD_SOURCE
-#define _XOPEN_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <portaudio.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sndfile.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "nativefmt.h"
+#include "ringbuffer.h"
+
 SNDFILE *infile;
 SF_INFO sfinfo ;
+nativefmt stream_format;
+ringbuffer ring;
+sem_t refill;
+atomic_int decoder_eof;
+volatile sig_atomic_t stop_playing = 0;
 
 #define PLAY_FRAMES_PER_BUFFER 44100
+/* Write available mode: how much decoder runs ahead */
+#define RING_SECONDS 2
+/* Frames decoded with one read */
+#define DECODE_FRAMES 1024
+/* Most frames given to one Pa_WriteStream() */
+#define WRITE_MAX_FRAMES 4096
 
 /* Handle termination with CTRL-C */
 static void handler(int sig, siginfo_t *si, void *unused) {
-    printf("Got SIGSEGV at address: 0x%lx\n", (long) si->si_addr);
+    stop_playing = 1;
+    sem_post(&refill);
 }
 
-int main(int argc, char *argv[]) {
-    long i = 0;
+/* Keep ring full until file ends */
+static void *decode_thread(void *userdata) {
+    long frame_bytes = nativefmt_frame_bytes(&stream_format);
+    char *block = (char *)malloc(DECODE_FRAMES * frame_bytes);
     long readcount = 0;
+
+    while (block != NULL && !stop_playing && !atomic_load(&decoder_eof)) {
+        while (ringbuffer_write_space(&ring) >= (size_t)(DECODE_FRAMES * frame_bytes)) {
+            readcount = nativefmt_read(&stream_format, infile, block, DECODE_FRAMES * sfinfo.channels);
+
+            if (readcount > 0) {
+                ringbuffer_write(&ring, block, readcount * stream_format.sample_bytes);
+            }
+
+            if (readcount < DECODE_FRAMES * sfinfo.channels) {
+                atomic_store(&decoder_eof, 1);
+                break;
+            }
+        }
+
+        /* Player posts when it has eaten half of ring */
+        if (!atomic_load(&decoder_eof)) {
+            sem_wait(&refill);
+        }
+    }
+
+    atomic_store(&decoder_eof, 1);
+    free(block);
+    return NULL;
+}
+
+/* Write available mode. Returns -1 if stream fails */
+static int play_write_available(PaStream *stream) {
+    long frame_bytes = nativefmt_frame_bytes(&stream_format);
+    char *block = (char *)malloc(WRITE_MAX_FRAMES * frame_bytes);
+    const PaStreamInfo *info = Pa_GetStreamInfo(stream);
+    long sleep_ms = 1;
+    long available = 0;
+    long frames = 0;
+    long writes = 0;
+    long written = 0;
+    long ring_underruns = 0;
+    long output_underflows = 0;
+    PaError retval = paNoError;
+
+    if (block == NULL) {
+        return -1;
+    }
+
+    /* Sleep quarter of output latency when there is no room */
+    if (info != NULL && info->outputLatency * 250.0 > 1.0) {
+        sleep_ms = (long)(info->outputLatency * 250.0);
+    }
+
+    printf("Output latency %.1f ms, polling every %ld ms\n", info != NULL ? info->outputLatency * 1000.0 : 0.0, sleep_ms);
+
+    while (!stop_playing) {
+        available = Pa_GetStreamWriteAvailable(stream);
+
+        if (available < 0) {
+            printf("** Can't get write available: %s\n", Pa_GetErrorText((PaError)available));
+            free(block);
+            return -1;
+        }
+
+        frames = ringbuffer_read_space(&ring) / frame_bytes;
+
+        /* Everything is given to PortAudio */
+        if (frames == 0 && atomic_load(&decoder_eof)) {
+            break;
+        }
+
+        frames = frames < available ? frames : available;
+        frames = frames < WRITE_MAX_FRAMES ? frames : WRITE_MAX_FRAMES;
+
+        if (frames == 0) {
+            /* Device had room but decoder was behind */
+            if (available > 0) {
+                ring_underruns++;
+                sem_post(&refill);
+            }
+
+            Pa_Sleep(sleep_ms);
+            continue;
+        }
+
+        ringbuffer_read(&ring, block, frames * frame_bytes);
+
+        if (ringbuffer_read_space(&ring) < ring.size / 2) {
+            sem_post(&refill);
+        }
+
+        /* Fits so this does not block */
+        retval = Pa_WriteStream(stream, block, frames);
+
+        if (retval == paOutputUnderflowed) {
+            output_underflows++;
+        } else if (retval != paNoError) {
+            printf("** Can't write file to output: %s\n", Pa_GetErrorText(retval));
+            free(block);
+            return -1;
+        }
+
+        writes++;
+        written += frames;
+    }
+
+    printf("%ld writes of %.1f frames on average, ring underruns %ld, output underflows %ld\n",
+           writes, writes > 0 ? (double)written / writes : 0.0, ring_underruns, output_underflows);
+    free(block);
+    return 0;
+}
+
+/* Blocking mode. One second per write */
+static int play_blocking(PaStream *stream) {
+    long samples = PLAY_FRAMES_PER_BUFFER * sfinfo.channels;
+    /* Alloc size for one block. Native formats are never bigger than float */
+    float *sampleBlock = (float *)malloc(samples * sizeof(float));
+    long readcount = 0;
+    PaError retval = paNoError;
+
+    if (sampleBlock == NULL) {
+        return -1;
+    }
+
+    /* -- Here's the loop where we pass data from input to output -- */
+    while (!stop_playing) {
+        readcount = nativefmt_read(&stream_format, infile, sampleBlock, samples);
+
+        if(readcount <= 0) {
+            printf("** File has ended!\n");
+            break;
+        }
+
+        retval = Pa_WriteStream(stream, (void *)sampleBlock, readcount / sfinfo.channels);
+
+        if(retval != paNoError && retval != paOutputUnderflowed) {
+            printf("** Can't write file to output!\n");
+            free(sampleBlock);
+            return -1;
+        }
+    }
+
+    free(sampleBlock);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
     PaStreamParameters outputParameters;
     PaStream *stream = NULL;
-    long sizeonesec = (PLAY_FRAMES_PER_BUFFER * 2) * sizeof(float);
-
-    /* Alloc size for one block */
-    float *sampleBlock = (float *)malloc(sizeonesec);
     PaError retval = 0;
     struct sigaction sa;
+    pthread_t decoder;
+    int use_decoder = 0;
+    int write_available = 0;
+    double latency_ms = 0.0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "wl:")) != -1) {
+        switch (opt) {
+            case 'w':
+                write_available = 1;
+                break;
+
+            case 'l':
+                latency_ms = atof(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-w] [-l latency_ms] file\n", argv[0]);
+                return 1;
+        }
+    }
 
-    printf("Playing file: '%s'\n", argv[1]);
+    if (optind >= argc) {
+        printf("Usage: %s [-w] [-l latency_ms] file\n", argv[0]);
+        return 1;
+    }
+
+    printf("Playing file: '%s'\n", argv[optind]);
 
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (infile = sf_open(argv[1], SFM_READ, &sfinfo))) {
-        printf ("Not able to open input file %s.\n", argv[1]) ;
+    if (! (infile = sf_open(argv[optind], SFM_READ, &sfinfo))) {
+        printf ("Not able to open input file %s.\n", argv[optind]) ;
         sf_perror (NULL) ;
         return  1 ;
     }
 
+    nativefmt_pick(&stream_format, infile, &sfinfo, 0);
+    nativefmt_print(&stream_format);
+    sem_init(&refill, 0, 0);
+    atomic_init(&decoder_eof, 0);
+
     sa.sa_flags = SA_SIGINFO;
     sigemptyset(&sa.sa_mask);
     sa.sa_sigaction = handler;
@@ -94,6 +292,21 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    if (write_available) {
+        if (ringbuffer_init(&ring, (size_t)sfinfo.samplerate * nativefmt_frame_bytes(&stream_format) * RING_SECONDS) < 0) {
+            printf("Can't allocate ring!\n");
+            sf_close(infile);
+            return -1;
+        }
+
+        /* Decoder starts right away so ring is full when stream starts */
+        use_decoder = pthread_create(&decoder, NULL, decode_thread, NULL) == 0;
+
+        if (!use_decoder) {
+            printf("Can't start decoder thread!\n");
+            goto exit;
+        }
+    }
 
     /* -- initialize PortAudio -- */
     retval = Pa_Initialize();
@@ -110,17 +323,36 @@ int main(int argc, char *argv[]) {
     }
 
     /* -- setup stream -- */
-    outputParameters.channelCount = 2;       /* stereo output */
-    outputParameters.sampleFormat = paFloat32; /* 32 bit floating point output */
-    outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
+    outputParameters.channelCount = sfinfo.channels;
+
+    switch (stream_format.kind) {
+        case NATIVEFMT_S16:
+            outputParameters.sampleFormat = paInt16;
+            break;
+
+        case NATIVEFMT_S24:
+            outputParameters.sampleFormat = paInt24; /* packed 3 bytes */
+            break;
+
+        case NATIVEFMT_S32:
+            outputParameters.sampleFormat = paInt32;
+            break;
+
+        default:
+            outputParameters.sampleFormat = paFloat32; /* 32 bit floating point output */
+            break;
+    }
+
+    outputParameters.suggestedLatency = latency_ms > 0.0 ? latency_ms / 1000.0
+                                        : Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
     outputParameters.hostApiSpecificStreamInfo = NULL;
 
     retval = Pa_OpenStream(
                  &stream,
                  NULL, /* no input */
                  &outputParameters,
-                 44100,
-                 PLAY_FRAMES_PER_BUFFER,
+                 sfinfo.samplerate,
+                 write_available ? paFramesPerBufferUnspecified : PLAY_FRAMES_PER_BUFFER,
                  paClipOff,      /* we won't output out of range samples so don't bother clipping them */
                  NULL,
                  infile);
@@ -129,6 +361,12 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
+    /* Wait until decoder has filled ring */
+    while (write_available && !atomic_load(&decoder_eof)
+            && ringbuffer_write_space(&ring) >= (size_t)(DECODE_FRAMES * nativefmt_frame_bytes(&stream_format))) {
+        Pa_Sleep(1);
+    }
+
     /* -- start stream -- */
     retval = Pa_StartStream(stream);
 
@@ -136,32 +374,31 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
-    printf("Wire on. Will run one minute.\n");
+    printf("Wire on. Will play to the end of file.\n");
     fflush(stdout);
 
-    /* -- Here's the loop where we pass data from input to output -- */
-    for(i = 0; i < ((60 * sizeonesec) / (44100 * 2)); ++i) {
-        readcount = sf_read_float(infile, sampleBlock, sizeonesec / 4);
+    if (write_available) {
+        play_write_available(stream);
+    } else {
+        play_blocking(stream);
+    }
 
-        if(readcount <= 0) {
-            printf("** File has ended!\n");
-            goto exit;
-        }
+    /* Waits until everything written is played */
+    retval = Pa_StopStream(stream);
 
-        /* retval = Pa_WriteStream(stream, (void *)sampleBlock, sizeonesec / 8); */
-        retval = Pa_WriteStream(stream, (void *)sampleBlock, sizeonesec / 8);
+exit:
+    stop_playing = 1;
 
-        if(retval != paNoError) {
-            printf("** Can't write file to output!\n");
-            goto exit;
-        }
+    if (use_decoder) {
+        sem_post(&refill);
+        pthread_join(decoder, NULL);
+        ringbuffer_free(&ring);
     }
 
-exit:
     sf_close(infile);
-    retval = Pa_StopStream(stream);
     retval = Pa_CloseStream(stream);
     Pa_Terminate();
+    sem_destroy(&refill);
     return 0;
 
 }
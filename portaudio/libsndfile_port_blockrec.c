@@ -28,13 +28,24 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with
- * gcc -g $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile libsndfile_port_blockrec.c -ansi -Wall -o libsndfile_port_blockrec
+ * gcc -g -I../common $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile -lpthread libsndfile_port_blockrec.c -std=c11 -Wall -o libsndfile_port_blockrec
  *
- * Run with ./libsndfile_port_blockrec some.[wav/.flac/.aiff] (Warning! Will overwrite without warning!)
+ * Run with ./libsndfile_port_blockrec [-s seconds | -b bytes] [-t seconds] some.[wav/.flac/.aiff] (Warning! Will overwrite without warning!)
+ * or       ./libsndfile_port_blockrec -m minutes [-a seconds] [-l dB] [-f fifo] some.wav
+ *
+ * With -s or -b recording is split to some-000000.wav, some-000001.wav ...
+ * every N seconds or N bytes without losing samples (see common/segwriter.h).
+ * Files are written in own thread so Pa_ReadStream() is called again right
+ * away. -t is how long to record, 0 is until CTRL-C. Default is 10 seconds.
+ *
+ * With -m last N minutes are only kept in memory and dumped to
+ * some-000000-YYYYmmdd-HHMMSS.wav with -a seconds (default 60) after
+ * trigger. Trigger is SIGUSR1, 'dump' line in fifo given with -f or peak
+ * over -l dB (see common/capturering.h). It runs until CTRL-C if -t is
+ * not given.
  */
 
-#define _DEFAULT_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
@@ -45,8 +56,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "capturering.h"
+#include "segwriter.h"
+
 SNDFILE *outfile;
 SF_INFO sfinfo ;
+segwriter seg;
+int use_seg = 0;
+capturering ring;
+int use_ring = 0;
+volatile sig_atomic_t stop_recording = 0;
 
 // Read one sec
 #define READ_FRAMES_PER_BUFFER 44100
@@ -57,6 +76,12 @@ SF_INFO sfinfo ;
 /* Handle termination with CTRL-C */
 static void handler(int sig, siginfo_t *si, void *unused) {
     printf("Got SIGSEGV at address: 0x%lx\n", (long) si->si_addr);
+    stop_recording = 1;
+}
+
+/* SIGUSR1 dumps capture ring */
+static void trigger_handler(int sig) {
+    capturering_trigger(&ring);
 }
 
 int main(int argc, char *argv[]) {
@@ -77,8 +102,61 @@ int main(int argc, char *argv[]) {
     float *sampleBlock = (float *)malloc(sizeonesec);
     PaError retval = 0;
     struct sigaction sa;
+    int opt = 0;
+    long seconds = 10;
+    double segment_seconds = 0.0;
+    long long segment_bytes = 0;
+    const char *path = NULL;
+    double ring_minutes = 0.0;
+    double post_seconds = 60.0;
+    float trigger_db = 1.0f;
+    const char *fifo = NULL;
+    int seconds_given = 0;
+
+    while ((opt = getopt(argc, argv, "s:b:t:m:a:l:f:")) != -1) {
+        switch (opt) {
+            case 's':
+                segment_seconds = atof(optarg);
+                break;
+
+            case 'b':
+                segment_bytes = atoll(optarg);
+                break;
+
+            case 't':
+                seconds = atol(optarg);
+                seconds_given = 1;
+                break;
+
+            case 'm':
+                ring_minutes = atof(optarg);
+                break;
+
+            case 'a':
+                post_seconds = atof(optarg);
+                break;
+
+            case 'l':
+                trigger_db = atof(optarg);
+                break;
+
+            case 'f':
+                fifo = optarg;
+                break;
+
+            default:
+                printf("Usage: %s [-s segment_seconds | -b segment_bytes | -m minutes [-a seconds] [-l dB] [-f fifo]] [-t seconds] file\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || (ring_minutes > 0.0 && (segment_seconds > 0.0 || segment_bytes > 0))) {
+        printf("Usage: %s [-s segment_seconds | -b segment_bytes | -m minutes [-a seconds] [-l dB] [-f fifo]] [-t seconds] file\n", argv[0]);
+        return 1;
+    }
 
-    printf("Record to file: '%s'\n", argv[1]);
+    path = argv[optind];
+    printf("Record to file: '%s'\n", path);
 
     /*
       We use two channels
@@ -89,10 +167,41 @@ int main(int argc, char *argv[]) {
     sfinfo.samplerate = 44100;
     sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
 
+    if (ring_minutes > 0.0) {
+        if (capturering_open(&ring, path, &sfinfo, ring_minutes * 60.0, post_seconds, trigger_db) < 0) {
+            printf("Not able to allocate %.1f minute capture ring.\n", ring_minutes);
+            return 1;
+        }
+
+        use_ring = 1;
+        capturering_print_info(&ring);
+
+        if (fifo != NULL && capturering_fifo(&ring, fifo) < 0) {
+            printf("Can't open command FIFO %s.\n", fifo);
+            capturering_close(&ring);
+            return 1;
+        }
+
+        if (!seconds_given) {
+            seconds = 0;
+        }
+
+        signal(SIGUSR1, trigger_handler);
+
+    } else if (segment_seconds > 0.0 || segment_bytes > 0) {
+        if (segwriter_open(&seg, path, &sfinfo, segment_seconds > 0.0
+                           ? (uint64_t)(segment_seconds * sfinfo.samplerate)
+                           : segwriter_frames_for_bytes(&sfinfo, segment_bytes)) < 0) {
+            printf("Not able to open segment files %s.\n", path);
+            return 1;
+        }
+
+        use_seg = 1;
+
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (outfile = sf_open(argv[1], SFM_WRITE, &sfinfo))) {
-        printf ("Not able to open output file %s.\n", argv[1]) ;
+    } else if (! (outfile = sf_open(path, SFM_WRITE, &sfinfo))) {
+        printf ("Not able to open output file %s.\n", path) ;
         sf_perror (NULL) ;
         return  1 ;
     }
@@ -205,11 +314,16 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
-    printf("Wire on. Will run 10 secs.\n");
+    if (seconds > 0) {
+        printf("Wire on. Will run %ld secs.\n", seconds);
+    } else {
+        printf("Wire on. Will run until CTRL-C.\n");
+    }
+
     fflush(stdout);
 
-    /* -- Here's the loop where we pass data from input to output -- */
-    for(i = 0; i < ((10 * sizeonesec) / (44100 * 2)); ++i) {
+    /* -- Here's the loop where we pass data from input to output. One second per round -- */
+    for(i = 0; !stop_recording && (seconds <= 0 || i < seconds); ++i) {
         retval = Pa_ReadStream(stream, (void *)sampleBlock, sizeonesec / 8);
 
         if(retval != paNoError) {
@@ -217,7 +331,17 @@ int main(int argc, char *argv[]) {
             goto exit;
         }
 
-        readcount = sf_write_float(outfile, sampleBlock, sizeonesec / 4);
+        /* Capture ring keeps it in memory until dump is triggered */
+        if (use_ring) {
+            capturering_write(&ring, sampleBlock, READ_FRAMES_PER_BUFFER);
+            readcount = READ_FRAMES_PER_BUFFER;
+
+        /* Segment writer only copies to ring. Thread writes and rotates files */
+        } else if (use_seg) {
+            readcount = segwriter_write(&seg, sampleBlock, READ_FRAMES_PER_BUFFER);
+        } else {
+            readcount = sf_write_float(outfile, sampleBlock, sizeonesec / 4);
+        }
 
         if(readcount <= 0) {
             printf("** Can't write to file!\n");
@@ -228,7 +352,22 @@ int main(int argc, char *argv[]) {
     }
 
 exit:
-    sf_close(outfile);
+    if (use_ring) {
+        if (capturering_close(&ring) < 0) {
+            printf("Can't write dump!\n");
+        }
+
+        capturering_print_stats(&ring);
+    } else if (use_seg) {
+        if (segwriter_close(&seg) < 0) {
+            printf("Can't write segment files!\n");
+        }
+
+        segwriter_print_stats(&seg);
+    } else {
+        sf_close(outfile);
+    }
+
     retval = Pa_StopStream(stream);
     retval = Pa_CloseStream(stream);
     Pa_Terminate();
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * Resident player daemon. Keeps Portaudio stream running (silence when
+ * idle) so playing sound does not pay for Pa_Initialize(), opening device
+ * and starting stream every time. Commands come from local UNIX socket
+ * (see common/playdaemon.h and tools/playctl).
+ *
+ * You need:
+ * Portaudio development file (headers and libraries) http://www.portaudio.com
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile -lpthread libsndfile_port_daemon.c -std=c11 -Wall -o libsndfile_port_daemon
+ *
+ * Run with ./libsndfile_port_daemon [-s socket] [-r rate] [-c channels] [-b frames]
+ * and     ../tools/playctl play some.[wav/.flac/.aiff]
+ *
+ * Files must have same sample rate as stream. Startup time of stream is
+ * printed: that is what every play used to wait before first sample. Time
+ * from command to first sample in callback is printed at exit.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <portaudio.h>
+#include <sndfile.h>
+
+#include "ctlloop.h"
+#include "playdaemon.h"
+
+ctlloop control;
+playdaemon daemon_state;
+
+/* Always continue. Silence when there is nothing to play */
+static int paDaemonCb(const void *inputBuffer, void *outputBuffer,
+                      unsigned long framesPerBuffer,
+                      const PaStreamCallbackTimeInfo* timeInfo,
+                      PaStreamCallbackFlags statusFlags,
+                      void *userData) {
+    playdaemon_fill(&daemon_state, (float *)outputBuffer, framesPerBuffer);
+    return paContinue;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    PaStreamParameters outputParameters;
+    PaStream *stream = NULL;
+    PaError retval = 0;
+    const char *path = NULL;
+    int samplerate = 48000;
+    int channels = 2;
+    long frames = 256;
+    double started = 0.0;
+    int what = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "s:r:c:b:")) != -1) {
+        switch (opt) {
+            case 's':
+                path = optarg;
+                break;
+
+            case 'r':
+                samplerate = atoi(optarg);
+                break;
+
+            case 'c':
+                channels = atoi(optarg);
+                break;
+
+            case 'b':
+                frames = atol(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-s socket] [-r rate] [-c channels] [-b frames]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (samplerate < 1 || channels < 1 || frames < 1) {
+        printf("Usage: %s [-s socket] [-r rate] [-c channels] [-b frames]\n", argv[0]);
+        return 1;
+    }
+
+    /* Before Portaudio threads so signals come only to control loop */
+    if (ctlloop_open(&control) < 0) {
+        return -1;
+    }
+
+    if (playdaemon_open(&daemon_state, &control, samplerate, channels, path) < 0) {
+        ctlloop_close(&control);
+        return 1;
+    }
+
+    started = now_ms();
+    retval = Pa_Initialize();
+
+    if(retval != paNoError) {
+        goto exit;
+    }
+
+    outputParameters.device = Pa_GetDefaultOutputDevice(); /* default output device */
+
+    if (outputParameters.device == paNoDevice) {
+        fprintf(stderr, "Error: No default output device.\n");
+        goto exit;
+    }
+
+    outputParameters.channelCount = channels;
+    outputParameters.sampleFormat = paFloat32; /* 32 bit floating point output */
+    outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
+    outputParameters.hostApiSpecificStreamInfo = NULL;
+
+    retval = Pa_OpenStream(
+                 &stream,
+                 NULL, /* no input */
+                 &outputParameters,
+                 samplerate,
+                 frames,
+                 paClipOff,      /* we won't output out of range samples so don't bother clipping them */
+                 paDaemonCb,
+                 NULL);
+
+    if(retval != paNoError) {
+        goto exit;
+    }
+
+    retval = Pa_StartStream(stream);
+
+    if(retval != paNoError) {
+        goto exit;
+    }
+
+    printf("Stream started in %.1f ms (output latency %.1f ms)\n", now_ms() - started,
+           Pa_GetStreamInfo(stream) ? Pa_GetStreamInfo(stream)->outputLatency * 1000.0 : 0.0);
+    playdaemon_print_path(&daemon_state);
+    printf("Serve until CTRL-C.\n");
+
+    while (!(what & CTLLOOP_SIGNAL)) {
+        if ((what = ctlloop_wait(&control)) < 0) {
+            break;
+        }
+
+        playdaemon_handle(&daemon_state, what);
+    }
+
+    if (what > 0) {
+        printf("Got signal %d\n", control.signal);
+    }
+
+    retval = Pa_AbortStream(stream);
+
+    if(retval != paNoError) {
+        goto exit;
+    }
+
+    retval = Pa_CloseStream(stream);
+
+exit:
+    /* clean up and disconnect */
+    if (retval != paNoError) {
+        fprintf(stderr, "Portaudio error: %s\n", Pa_GetErrorText(retval));
+    }
+
+    printf("\nExit and clean\n");
+    playdaemon_print_stats(&daemon_state);
+    playdaemon_close(&daemon_state);
+    Pa_Terminate();
+    ctlloop_close(&control);
+
+    return retval;
+}
@@ -28,13 +28,44 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with
- * gcc -g $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile libsndfile_port_play.c -ansi -Wall -o libsndfile_port_play
+ * gcc -g -I../common $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile -lpthread libsndfile_port_play.c -std=c11 -Wall -o libsndfile_port_play
  *
  * Run with ./libsndfile_port_read some.[wav/.flac/.aiff] (Warning! Will overwrite without warning!)
+ * or      ../tools/shmring_producer some.[wav/.flac/.aiff] ./libsndfile_port_play
+ *
+ * With 'shm:FD' or 'shm:/path' argument samples are taken from shared memory
+ * ring of producer process (see common/shmring.h) instead of libsndfile.
+ *
+ * Levels of every played block can be watched with tools/meter_watch
+ * (see common/meter.h). With SPECTRUM set in environment spectrum is
+ * computed on worker thread and can be watched with tools/spectrum_watch
+ * (see common/spectrum.h).
+ *
+ * If file has been measured with tools/r128scan its loudness gain (from
+ * 'file.r128') is applied to output (see common/loudness.h).
+ *
+ * Without gain 16, 24 and 32-bit PCM files are played as paInt16,
+ * paInt24 or paInt32 so there is no float conversion (see common/nativefmt.h).
+ *
+ * With SIMDEV set in environment there is no Portaudio stream. Simulated
+ * device calls same callback on its own timer (see common/simdev.h):
+ * SIMDEV="period=256,jitter=0.3,stall=1000:20" ./libsndfile_port_play some.wav
+ *
+ * Main thread sleeps in control loop (see common/ctlloop.h) until stream
+ * has played to end of file or CTRL-C comes.
+ *
+ * With DSPCHAIN set in environment output goes through gain, EQ and
+ * limiter in callback. Lines from stdin change them while playing
+ * (see common/dspchain.h):
+ * DSPCHAIN="eq=100:4:0.7,limit=-1" ./libsndfile_port_play some.wav
+ *
+ * With FIRFILTER set long room correction filter is convolved with output
+ * before DSP chain. Filter spectra are made in background while playback
+ * starts (see common/fftconv.h):
+ * FIRFILTER="room.wav:256" ./libsndfile_port_play some.wav
  */
 
-#define _XOPEN_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
@@ -42,9 +73,33 @@
 #include <portaudio.h>
 #include <sndfile.h>
 #include <signal.h>
+#include <unistd.h>
+
+#include "asynclog.h"
+#include "ctlloop.h"
+#include "dspchain.h"
+#include "fftconv.h"
+#include "loudness.h"
+#include "meter.h"
+#include "nativefmt.h"
+#include "shmring.h"
+#include "simdev.h"
+#include "spectrum.h"
 
 SNDFILE *infile;
 SF_INFO sfinfo ;
+shmring shm;
+int use_shm = 0;
+meter levels_meter;
+float file_gain = 1.0f;
+nativefmt stream_format;
+ctlloop control;
+dspchain chain;
+int use_chain = 0;
+fftconv conv;
+int use_conv = 0;
+spectrum analyser;
+int use_spectrum = 0;
 
 /* Reques for writing length data */
 static int paLibsndfileCb(const void *inputBuffer, void *outputBuffer,
@@ -55,53 +110,238 @@ static int paLibsndfileCb(const void *inputBuffer, void *outputBuffer,
     float *out = (float*)outputBuffer;
     long readcount = 0;
 
-    memset(out, 0x00, framesPerBuffer);
+    memset(out, 0x00, framesPerBuffer * nativefmt_frame_bytes(&stream_format));
+
+    if (use_shm) {
+        /* Copy straight from producer's shared memory */
+        readcount = shmring_read_float(&shm, out, framesPerBuffer);
+        memset(out + readcount * sfinfo.channels, 0x00, (framesPerBuffer - readcount) * sfinfo.channels * sizeof(float));
+
+        if (use_conv) {
+            fftconv_process(&conv, out, framesPerBuffer);
+        }
+
+        if (use_chain) {
+            dspchain_process(&chain, out, readcount, framesPerBuffer);
+        }
+
+        meter_update(&levels_meter, out, framesPerBuffer);
+
+        if (use_spectrum) {
+            spectrum_push(&analyser, out, framesPerBuffer);
+        }
 
-    /* Read with libsndfile */
-    readcount = sf_read_float(infile, out, framesPerBuffer * 2);
+        if (shmring_finished(&shm)) {
+            asynclog_printf("paLibsndfileCb: Producer has ended!\n");
+            return paComplete;
+        }
+
+        return paContinue;
+    }
+
+    /* Read with libsndfile in stream format */
+    readcount = nativefmt_read(&stream_format, infile, outputBuffer, framesPerBuffer * sfinfo.channels);
+
+    if (stream_format.kind == NATIVEFMT_FLOAT) {
+        loudness_apply(out, readcount, file_gain);
+
+        if (use_conv) {
+            fftconv_process(&conv, out, readcount / sfinfo.channels);
+        }
+
+        /* Delay line of limiter still has frames after file end */
+        if (use_chain) {
+            readcount = dspchain_process(&chain, out, readcount / sfinfo.channels, framesPerBuffer) * sfinfo.channels;
+        }
+
+        meter_update(&levels_meter, out, readcount / sfinfo.channels);
+    } else {
+        meter_update_int(&levels_meter, outputBuffer, stream_format.sample_bytes, readcount / sfinfo.channels);
+    }
+
+    if (use_spectrum) {
+        spectrum_push(&analyser, outputBuffer, readcount / sfinfo.channels);
+    }
 
     /* File end if we read -1 */
     if(readcount <= 0) {
-        printf("File has ended!\n");
+        asynclog_printf("paLibsndfileCb: File has ended!\n");
         return paComplete;
     }
 
     return paContinue;
 }
 
-/* Handle termination with CTRL-C */
-static void handler(int sig, siginfo_t *si, void *unused) {
-    printf("Got SIGSEGV at address: 0x%lx\n", (long) si->si_addr);
+/* Limiter look-ahead is read before start so it adds no latency. Frames
+   go through loudness gain and FIR filter like in callback */
+static void prime_chain(void) {
+    float prime[1024];
+    long want = 1024 / sfinfo.channels;
+    long left = chain.lookahead;
+    long got = 0;
+
+    if (!use_conv) {
+        dspchain_prime_sndfile(&chain, infile, file_gain);
+        return;
+    }
+
+    while (left > 0 && (got = sf_readf_float(infile, prime, left < want ? left : want)) > 0) {
+        loudness_apply(prime, got * sfinfo.channels, file_gain);
+        fftconv_process(&conv, prime, got);
+        dspchain_prime(&chain, prime, got);
+        left -= got;
+    }
+}
+
+/* Last buffer has been played. Wake up main thread */
+static void stream_finished(void *userData) {
+    ctlloop_notify(&control);
+}
+
+/* Sleep until stream has ended. Returns 1 if stopped with signal.
+   Commands for DSP chain are read from stdin meanwhile */
+static int wait_for_end(void) {
+    int what = 0;
+
+    while (!(what & (CTLLOOP_SIGNAL | CTLLOOP_DONE))) {
+        if ((what = ctlloop_wait(&control)) < 0) {
+            return -1;
+        }
+
+        if ((what & CTLLOOP_INPUT) && dspchain_read_commands(&chain, STDIN_FILENO) < 0) {
+            ctlloop_input(&control, -1);
+        }
+    }
+
+    if (what & CTLLOOP_SIGNAL) {
+        printf("Got signal %d\n", control.signal);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Simulated device asks blocks like Portaudio would */
+static int simdevCb(void *buffer, long frames, void *userdata) {
+    return paLibsndfileCb(NULL, buffer, frames, NULL, 0, userdata) == paComplete;
+}
+
+/* Play whole file with simulated device */
+static int play_simulated(void) {
+    simdev sim;
+
+    if (simdev_open(&sim, sfinfo.samplerate, sfinfo.channels, stream_format.sample_bytes, SIMDEV_PLAYBACK) < 0) {
+        return -1;
+    }
+
+    simdev_set_finished_callback(&sim, stream_finished);
+
+    if (simdev_start(&sim, simdevCb, infile) < 0) {
+        printf("Can't start simulated device!\n");
+        simdev_close(&sim);
+        return -1;
+    }
+
+    wait_for_end();
+    simdev_close(&sim);
+    simdev_print_stats(&sim);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     PaStreamParameters outputParameters;
     PaStream *stream = NULL;
     PaError retval = 0;
-    struct sigaction sa;
+
+    if (shmring_is_spec(argv[1])) {
+        if (shmring_attach(&shm, argv[1]) < 0) {
+            printf("Not able to attach shared memory ring %s.\n", argv[1]);
+            return 1;
+        }
+
+        use_shm = 1;
+        sfinfo.samplerate = shm.header->samplerate;
+        sfinfo.channels = shm.header->channels;
 
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (infile = sf_open(argv[1], SFM_READ, &sfinfo))) {
+    } else if (! (infile = sf_open(argv[1], SFM_READ, &sfinfo))) {
         printf ("Not able to open input file %s.\n", argv[1]) ;
         sf_perror (NULL) ;
         return  1 ;
     }
 
-    sa.sa_flags = SA_SIGINFO;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_sigaction = handler;
+    if (!use_shm) {
+        file_gain = loudness_gain_load(argv[1]);
+    }
+
+    /* Gain and DSP need float. Shared memory ring is always float */
+    nativefmt_pick(&stream_format, infile, &sfinfo, use_shm || file_gain != 1.0f || dspchain_wanted() || fftconv_wanted());
+    nativefmt_print(&stream_format);
+    /* Failures before meter_open() go through same cleanup */
+    levels_meter.fd = -1;
 
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        printf("Can't set SIGINT handler!\n");
+    /* Before any thread is started, filter and spectrum workers too, so
+       signals come only to control loop */
+    if (ctlloop_open(&control) < 0) {
         sf_close(infile);
         return -1;
     }
 
-    if (sigaction(SIGHUP, &sa, NULL) == -1) {
-        printf("Can't set SIGHUP handler!\n");
-        sf_close(infile);
-        return -1;
+    if (fftconv_wanted()) {
+        if (fftconv_open(&conv, sfinfo.samplerate, sfinfo.channels, getenv("FIRFILTER")) < 0) {
+            retval = 1;
+            goto exit;
+        }
+
+        use_conv = 1;
+        fftconv_print(&conv);
+    }
+
+    if (dspchain_wanted()) {
+        if (dspchain_open(&chain, sfinfo.samplerate, sfinfo.channels, getenv("DSPCHAIN")) < 0) {
+            retval = 1;
+            goto exit;
+        }
+
+        if (!use_shm) {
+            prime_chain();
+        }
+
+        use_chain = 1;
+        dspchain_print(&chain);
+    }
+
+    if (meter_open(&levels_meter, sfinfo.samplerate, sfinfo.channels) < 0) {
+        printf("Can't make level meter. Playing without it.\n");
+    }
+
+    meter_print_path(&levels_meter);
+
+    /* Integer stream is given as it is and worker converts it */
+    if (spectrum_wanted()) {
+        if (spectrum_open(&analyser, sfinfo.samplerate, sfinfo.channels,
+                          stream_format.kind == NATIVEFMT_FLOAT ? 0 : stream_format.sample_bytes, getenv("SPECTRUM")) < 0) {
+            printf("Can't make spectrum. Playing without it.\n");
+        } else {
+            use_spectrum = 1;
+            spectrum_print_path(&analyser);
+        }
+    }
+
+    if (use_chain && ctlloop_input(&control, STDIN_FILENO) < 0) {
+        printf("Can't read DSP commands from stdin. Playing with DSPCHAIN settings.\n");
+    }
+
+    if (asynclog_start() < 0) {
+        printf("Can't start log thread!\n");
+        retval = -1;
+        goto exit;
+    }
+
+    if (simdev_wanted()) {
+        retval = play_simulated();
+        goto exit;
     }
 
     retval = Pa_Initialize();
@@ -117,8 +357,26 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
-    outputParameters.channelCount = 2;       /* stereo output */
-    outputParameters.sampleFormat = paFloat32; /* 32 bit floating point output */
+    outputParameters.channelCount = sfinfo.channels;
+
+    switch (stream_format.kind) {
+        case NATIVEFMT_S16:
+            outputParameters.sampleFormat = paInt16;
+            break;
+
+        case NATIVEFMT_S24:
+            outputParameters.sampleFormat = paInt24; /* packed 3 bytes */
+            break;
+
+        case NATIVEFMT_S32:
+            outputParameters.sampleFormat = paInt32;
+            break;
+
+        default:
+            outputParameters.sampleFormat = paFloat32; /* 32 bit floating point output */
+            break;
+    }
+
     outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowOutputLatency;
     outputParameters.hostApiSpecificStreamInfo = NULL;
 
@@ -126,7 +384,7 @@ int main(int argc, char *argv[]) {
                  &stream,
                  NULL, /* no input */
                  &outputParameters,
-                 44100,
+                 sfinfo.samplerate,
                  4096,
                  paClipOff,      /* we won't output out of range samples so don't bother clipping them */
                  paLibsndfileCb,
@@ -136,34 +394,77 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
+    /* Callback returned paComplete and last buffer is played */
+    retval = Pa_SetStreamFinishedCallback(stream, stream_finished);
+
+    if(retval != paNoError) {
+        goto exit;
+    }
+
     retval = Pa_StartStream(stream);
 
     if(retval != paNoError) {
         goto exit;
     }
 
-    printf("Play maximum 360 seconds.\n");
-    Pa_Sleep(1000 * 360);
+    printf("Play until end of file or CTRL-C.\n");
 
-    retval = Pa_StopStream(stream);
+    /* Signal drops what is queued. End of file plays it out */
+    if (wait_for_end() == 1) {
+        retval = Pa_AbortStream(stream);
+    } else {
+        retval = Pa_StopStream(stream);
+    }
 
     if(retval != paNoError) {
         goto exit;
     }
 
     retval = Pa_CloseStream(stream);
+    stream = NULL;
 
     if(retval != paNoError) {
         goto exit;
     }
 
-    Pa_Terminate();
-
 exit:
-    /* clean up and disconnect */
+    /* clean up and disconnect. Callback must not run while log rings,
+       filters and meters are freed */
+    if (stream != NULL) {
+        Pa_AbortStream(stream);
+        Pa_CloseStream(stream);
+    }
+
+    asynclog_stop();
     printf("\nExit and clean\n");
-    sf_close(infile);
+
+    meter_print_stats(&levels_meter);
+    meter_close(&levels_meter);
+
+    if (use_spectrum) {
+        spectrum_print_stats(&analyser);
+        spectrum_close(&analyser);
+    }
+
+    if (use_chain) {
+        dspchain_print_stats(&chain);
+        dspchain_free(&chain);
+    }
+
+    if (use_conv) {
+        fftconv_print_stats(&conv);
+        fftconv_close(&conv);
+    }
+
+    if (use_shm) {
+        printf("Shared memory underruns %ld\n", (long)atomic_load(&shm.header->underruns));
+        shmring_close(&shm);
+    } else {
+        sf_close(infile);
+    }
+
     Pa_Terminate();
+    ctlloop_close(&control);
 
     return retval;
 }
@@ -28,13 +28,42 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with
- * gcc -g $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile libsndfile_port_rec.c -ansi -Wall -o libsndfile_port_rec
+ * gcc -g -I../common $(pkg-config --cflags --libs portaudio-2.0) -lm -lsndfile -lpthread libsndfile_port_rec.c -std=c11 -Wall -o libsndfile_port_rec
  *
- * Run with ./libsndfile_port_write some.wav (Warning! Will overwrite without warning!)
+ * Run with ./libsndfile_port_write [-c channels] [-x group] [-s seconds | -b bytes] [-t seconds] [-g dB[:preroll_ms:hangover_ms] [-k]] some.wav (Warning! Will overwrite without warning!)
+ *
+ * If file name ends with '.flac' samples are encoded to FLAC on a thread
+ * pool (see common/flacpool.h) so callback never waits for compression.
+ *
+ * With -s or -b recording is split to some-000000.wav, some-000001.wav ...
+ * every N seconds or N bytes without losing samples (see common/segwriter.h).
+ * -t is how long to record, 0 is until CTRL-C. Default is 20 seconds.
+ *
+ * -c records that many channels (default 2, up to 256). With -x every
+ * 'group' channels go to their own file: -x 1 gives some-ch01.wav,
+ * some-ch02.wav ... and -x 8 some-ch01-08.wav, some-ch09-16.wav ...
+ * Worker pool deinterleaves and writes files in parallel (see
+ * common/chansplit.h). With '.flac' name every file is FLAC. Level meter
+ * shows at most 64 channels so with more there is no meter.
+ *
+ * With -g silence under dB (RMS, like -45) is left out and kept stretches
+ * are listed in some.wav.segments with their capture positions. -k keeps
+ * silence in file and only lists stretches (see common/silencegate.h).
+ *
+ * Input levels can be watched with tools/meter_watch (see common/meter.h).
+ * With SPECTRUM set in environment input spectrum is computed on worker
+ * thread and can be watched with tools/spectrum_watch (see
+ * common/spectrum.h).
+ *
+ * With SIMDEV set in environment simulated device gives -20 dB tone to
+ * same callback instead of Portaudio (see common/simdev.h). Then -t is
+ * device time so 'speed' makes recording faster than real time.
+ *
+ * Main thread sleeps in control loop (see common/ctlloop.h) until time is
+ * up, CTRL-C comes or stream stops because file can't be written.
  */
 
-#define _XOPEN_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
@@ -42,15 +71,63 @@
 #include <portaudio.h>
 #include <sndfile.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "asynclog.h"
+#include "chansplit.h"
+#include "ctlloop.h"
+#include "flacpool.h"
+#include "meter.h"
+#include "segwriter.h"
+#include "silencegate.h"
+#include "simdev.h"
+#include "spectrum.h"
 
 SNDFILE *outfile;
 SF_INFO sfinfo ;
+flacpool flac;
+int use_flac = 0;
+segwriter seg;
+int use_seg = 0;
+chansplit split;
+int use_split = 0;
+silencegate gate;
+int use_gate = 0;
+meter levels_meter;
+spectrum analyser;
+int use_spectrum = 0;
+ctlloop control;
 
 // Read one sec
 #define READ_FRAMES_PER_BUFFER 44100
 #define READ_WANTED_HOSTAPI "PulseAudio"
 #define READ_DEVICE_NUM 5
 
+/* Give frames to encoder, segment writer or WAV file */
+static int write_output(const float *in, long frames, void *userdata) {
+    /* Only copies to encoder ring. Dropped frames are counted there */
+    if (use_flac) {
+        flacpool_write(&flac, in, frames);
+        return 0;
+    }
+
+    /* Same for segments. Writer thread does rotation */
+    if (use_seg) {
+        segwriter_write(&seg, in, frames);
+        return 0;
+    }
+
+    /* And for channel files. Workers split and write */
+    if (use_split) {
+        chansplit_write(&split, in, frames);
+        return 0;
+    }
+
+    /* Write with libsndfile */
+    return sf_write_float(outfile, in, frames * sfinfo.channels) > 0 ? 0 : -1;
+}
+
 /* Reques for writing length data */
 static int paLibsndfileCb(const void *inputBuffer, void *outputBuffer,
                           unsigned long framesPerBuffer,
@@ -58,31 +135,141 @@ static int paLibsndfileCb(const void *inputBuffer, void *outputBuffer,
                           PaStreamCallbackFlags statusFlags,
                           void *userData) {
     float *in = (float*)inputBuffer;
-    long writecount = 0;
+    int writeretval = 0;
 
-    printf("Get frames Per Buffer: %ld\n", framesPerBuffer);
+    asynclog_printf("paLibsndfileCb: Get frames Per Buffer: %ld\n", (long)framesPerBuffer);
+    meter_update(&levels_meter, in, framesPerBuffer);
 
-    /* Read with libsndfile */
-    writecount = sf_write_float(outfile, in, framesPerBuffer * 2);
+    if (use_spectrum) {
+        spectrum_push(&analyser, in, framesPerBuffer);
+    }
+
+    /* Gate calls write_output() only for kept samples */
+    if (use_gate) {
+        writeretval = silencegate_process(&gate, in, framesPerBuffer);
+    } else {
+        writeretval = write_output(in, framesPerBuffer, NULL);
+    }
 
-    /* File end if we read -1 */
-    if(writecount <= 0) {
-        printf("Can't write to file!\n");
+    /* File end if we can't write */
+    if(writeretval < 0) {
+        asynclog_printf("paLibsndfileCb: Can't write to file!\n");
         return paComplete;
     }
 
     return paContinue;
 }
 
-/* Handle termination with CTRL-C */
-static void handler(int sig, siginfo_t *si, void *unused) {
-    printf("Got SIGSEGV at address: 0x%lx\n", (long) si->si_addr);
+/* Stream has stopped. Wake up main thread */
+static void stream_finished(void *userData) {
+    ctlloop_notify(&control);
+}
+
+/* Sleep until 'seconds' (0 is forever) are up, stream stops or signal
+   comes. Silence gate is polled ten times a second */
+static void wait_for_end(long seconds) {
+    int what = 0;
+
+    if (seconds > 0) {
+        ctlloop_deadline(&control, seconds * 1000);
+    }
+
+    if (use_gate) {
+        ctlloop_tick(&control, 100);
+    }
+
+    while (!(what & (CTLLOOP_SIGNAL | CTLLOOP_DONE | CTLLOOP_DEADLINE))) {
+        if ((what = ctlloop_wait(&control)) < 0) {
+            break;
+        }
+
+        if ((what & CTLLOOP_TICK) && use_gate) {
+            silencegate_poll(&gate);
+        }
+    }
+
+    if (what > 0 && (what & CTLLOOP_SIGNAL)) {
+        printf("Got signal %d\n", control.signal);
+    }
+
+    ctlloop_tick(&control, 0);
+}
+
+/* Simulated device gives blocks like Portaudio would */
+static int simdevCb(void *buffer, long frames, void *userdata) {
+    return paLibsndfileCb(buffer, NULL, frames, NULL, 0, userdata) == paComplete;
+}
+
+/* Record with simulated device until CTRL-C or 'seconds' of device time */
+static int record_simulated(long seconds) {
+    simdev sim;
+
+    if (simdev_open(&sim, sfinfo.samplerate, sfinfo.channels, sizeof(float), SIMDEV_CAPTURE) < 0) {
+        return -1;
+    }
+
+    if (sim.seconds <= 0.0) {
+        sim.seconds = seconds;
+    }
+
+    simdev_set_finished_callback(&sim, stream_finished);
+
+    if (simdev_start(&sim, simdevCb, outfile) < 0) {
+        printf("Can't start simulated device!\n");
+        simdev_close(&sim);
+        return -1;
+    }
+
+    /* Device stops itself after 'seconds' of device time */
+    wait_for_end(0);
+    simdev_close(&sim);
+    simdev_print_stats(&sim);
+    return 0;
+}
+
+/* Close WAV or finish FLAC encoding */
+static void close_output(void) {
+    /* Gate still has last window to give */
+    if (use_gate) {
+        if (silencegate_close(&gate) < 0) {
+            printf("Can't write segment list!\n");
+        }
+
+        silencegate_print_stats(&gate);
+        use_gate = 0;
+    }
+
+    if (use_flac) {
+        if (flacpool_close(&flac) < 0) {
+            printf("Can't write FLAC file!\n");
+        }
+
+        flacpool_print_stats(&flac);
+        use_flac = 0;
+    } else if (use_seg) {
+        if (segwriter_close(&seg) < 0) {
+            printf("Can't write segment files!\n");
+        }
+
+        segwriter_print_stats(&seg);
+        use_seg = 0;
+    } else if (use_split) {
+        if (chansplit_close(&split) < 0) {
+            printf("Can't write channel files!\n");
+        }
+
+        chansplit_print_stats(&split);
+        use_split = 0;
+    } else if (outfile != NULL) {
+        sf_close(outfile);
+        outfile = NULL;
+    }
 }
 
 int main(int argc, char *argv[]) {
     int i = 0;
     PaStreamParameters inputParameters;
-    PaStream *stream;
+    PaStream *stream = NULL;
     const PaHostApiInfo* hostApiInfo = NULL;
     const PaDeviceInfo* deviceInfo = NULL;
     PaHostApiIndex hostApiIndex = 0;
@@ -91,41 +278,171 @@ int main(int argc, char *argv[]) {
     PaDeviceIndex deviceIndex = 0;
     unsigned int hostApiCount = 0;
     PaError retval = 0;
-    struct sigaction sa;
+    int opt = 0;
+    long seconds = 20;
+    double segment_seconds = 0.0;
+    long long segment_bytes = 0;
+    const char *path = NULL;
+    const char *gatespec = NULL;
+    int gatemode = SILENCEGATE_SKIP;
+    float gatedb = 0.0f;
+    long preroll_ms = 0;
+    long hangover_ms = 0;
+    int channels = 2;
+    int group_size = 0;
+
+    while ((opt = getopt(argc, argv, "c:x:s:b:t:g:k")) != -1) {
+        switch (opt) {
+            case 'c':
+                channels = atoi(optarg);
+                break;
+
+            case 'x':
+                group_size = atoi(optarg);
+                break;
+
+            case 's':
+                segment_seconds = atof(optarg);
+                break;
+
+            case 'b':
+                segment_bytes = atoll(optarg);
+                break;
+
+            case 't':
+                seconds = atol(optarg);
+                break;
+
+            case 'g':
+                gatespec = optarg;
+                break;
+
+            case 'k':
+                gatemode = SILENCEGATE_MARK;
+                break;
+
+            default:
+                printf("Usage: %s [-c channels] [-x group] [-s segment_seconds | -b segment_bytes] [-t seconds] [-g dB[:preroll_ms:hangover_ms] [-k]] file\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || (gatespec != NULL && silencegate_parse(gatespec, &gatedb, &preroll_ms, &hangover_ms) < 0)
+            || channels < 1 || channels > CHANSPLIT_MAX_CHANNELS || group_size < 0
+            || (group_size > 0 && (segment_seconds > 0.0 || segment_bytes > 0))) {
+        printf("Usage: %s [-c channels] [-x group] [-s segment_seconds | -b segment_bytes] [-t seconds] [-g dB[:preroll_ms:hangover_ms] [-k]] file\n", argv[0]);
+        return 1;
+    }
+
+    path = argv[optind];
+    /* Failures before meter_open() go through same cleanup */
+    levels_meter.fd = -1;
+
+    /* Before encoder and writer threads so signals come only to control loop */
+    if (ctlloop_open(&control) < 0) {
+        return -1;
+    }
 
     /*
-      We use two channels
+      We use two channels (or -c)
       Samplerate is 44100
       Wave 16 bit output format
     */
-    sfinfo.channels = 2;
+    sfinfo.channels = channels;
     sfinfo.samplerate = 44100;
     sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
 
+    if (group_size > 0) {
+        /* Every worker has its own FLAC encoders in libsndfile */
+        if (flacpool_wanted(path)) {
+            sfinfo.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+        }
+
+        if (chansplit_open(&split, path, &sfinfo, group_size, 0) < 0) {
+            printf("Not able to open channel files of %s.\n", path);
+            retval = 1;
+            goto exit;
+        }
+
+        use_split = 1;
+
+    } else if ((segment_seconds > 0.0 || segment_bytes > 0) && flacpool_wanted(path)) {
+        printf("Segments are written as WAV. Use .wav name with -s or -b\n");
+        retval = 1;
+        goto exit;
+
+    } else if (segment_seconds > 0.0 || segment_bytes > 0) {
+        if (segwriter_open(&seg, path, &sfinfo, segment_seconds > 0.0
+                           ? (uint64_t)(segment_seconds * sfinfo.samplerate)
+                           : segwriter_frames_for_bytes(&sfinfo, segment_bytes)) < 0) {
+            printf("Not able to open segment files %s.\n", path);
+            retval = 1;
+            goto exit;
+        }
+
+        use_seg = 1;
+
+    } else if (flacpool_wanted(path)) {
+        if (flacpool_open(&flac, path, sfinfo.samplerate, sfinfo.channels, 0) < 0) {
+            printf("Not able to open FLAC output file %s.\n", path);
+            retval = 1;
+            goto exit;
+        }
+
+        use_flac = 1;
+
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (outfile = sf_open(argv[1], SFM_WRITE, &sfinfo))) {
+    } else if (! (outfile = sf_open(path, SFM_WRITE, &sfinfo))) {
         printf ("Not able to open output file %s.\n", "input.wav") ;
         sf_perror (NULL) ;
-        return  1 ;
+        retval = 1;
+        goto exit;
     }
 
-    printf("Opened file: (%s)\n", argv[1]);
+    printf("Opened file: (%s)\n", path);
 
-    sa.sa_flags = SA_SIGINFO;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_sigaction = handler;
+    if (gatespec != NULL) {
+        if (silencegate_open(&gate, path, sfinfo.samplerate, sfinfo.channels, gatedb,
+                             preroll_ms, hangover_ms, gatemode, write_output, NULL) < 0) {
+            printf("Can't open segment list %s.segments!\n", path);
+            retval = 1;
+            goto exit;
+        }
 
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        printf("Can't set SIGINT handler!\n");
-        sf_close(outfile);
-        return -1;
+        use_gate = 1;
+        printf("Silence gate at %.1f dB (pre-roll %ld ms, hangover %ld ms)\n", gatedb, preroll_ms, hangover_ms);
     }
 
-    if (sigaction(SIGHUP, &sa, NULL) == -1) {
-        printf("Can't set SIGHUP handler!\n");
-        sf_close(outfile);
-        return -1;
+    if (meter_open(&levels_meter, sfinfo.samplerate, sfinfo.channels) < 0) {
+        if (sfinfo.channels > METER_MAX_CHANNELS) {
+            printf("Level meter shows at most %d channels. Recording %d channels without it.\n",
+                   METER_MAX_CHANNELS, sfinfo.channels);
+        } else {
+            printf("Can't make level meter. Recording without it.\n");
+        }
+    }
+
+    meter_print_path(&levels_meter);
+
+    if (spectrum_wanted()) {
+        if (spectrum_open(&analyser, sfinfo.samplerate, sfinfo.channels, 0, getenv("SPECTRUM")) < 0) {
+            printf("Can't make spectrum. Recording without it.\n");
+        } else {
+            use_spectrum = 1;
+            spectrum_print_path(&analyser);
+        }
+    }
+
+    if (asynclog_start() < 0) {
+        printf("Can't start log thread!\n");
+        retval = -1;
+        goto exit;
+    }
+
+    if (simdev_wanted()) {
+        retval = record_simulated(seconds);
+        goto exit;
     }
 
     retval = Pa_Initialize();
@@ -185,7 +502,7 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
-    inputParameters.channelCount = 2;       /* stereo output */
+    inputParameters.channelCount = sfinfo.channels; /* stereo or -c */
     inputParameters.sampleFormat = paFloat32; /* 32 bit floating point output */
     inputParameters.suggestedLatency = Pa_GetDeviceInfo(inputParameters.device)->defaultLowOutputLatency;
     inputParameters.hostApiSpecificStreamInfo = NULL;
@@ -205,6 +522,13 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
+    retval = Pa_SetStreamFinishedCallback(stream, stream_finished);
+
+    if(retval != paNoError) {
+        fprintf(stderr, "Error: Cant set finished callback.\n");
+        goto exit;
+    }
+
     retval = Pa_StartStream(stream);
 
     if(retval != paNoError) {
@@ -213,8 +537,13 @@ int main(int argc, char *argv[]) {
         goto exit;
     }
 
-    printf("Record 20 seconds.\n");
-    Pa_Sleep(20 * 1000);
+    if (seconds > 0) {
+        printf("Record %ld seconds.\n", seconds);
+    } else {
+        printf("Record until CTRL-C.\n");
+    }
+
+    wait_for_end(seconds);
 
     retval = Pa_StopStream(stream);
 
@@ -224,19 +553,34 @@ int main(int argc, char *argv[]) {
     }
 
     retval = Pa_CloseStream(stream);
+    stream = NULL;
 
     if(retval != paNoError) {
         fprintf(stderr, "Error: Cant close stream.\n");
         goto exit;
     }
 
-    Pa_Terminate();
-
 exit:
-    /* clean up and disconnect */
+    /* clean up and disconnect. Callback must not run while log rings
+       and writers are freed */
+    if (stream != NULL) {
+        Pa_AbortStream(stream);
+        Pa_CloseStream(stream);
+    }
+
+    asynclog_stop();
     printf("\nExit and clean\n");
-    sf_close(outfile);
+    meter_print_stats(&levels_meter);
+    meter_close(&levels_meter);
+
+    if (use_spectrum) {
+        spectrum_print_stats(&analyser);
+        spectrum_close(&analyser);
+    }
+
+    close_output();
     Pa_Terminate();
+    ctlloop_close(&control);
 
     return retval;
 }
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * Resident player daemon with pa_threaded_mainloop. Same as
+ * portaudio/libsndfile_port_daemon.c: stream is connected once and plays
+ * silence when idle so playing sound does not pay for connecting to
+ * server and creating stream every time. Commands come from local UNIX
+ * socket (see common/playdaemon.h and tools/playctl).
+ *
+ * Write callback runs in Pulseaudio thread and only copies from rings of
+ * items. Server buffer is kept small (-l ms, default 20) because new sound
+ * is heard only after what is already written to server.
+ *
+ * You need:
+ * Pulseaudio development file (headers and libraries) http://www.freedesktop.org/wiki/Software/PulseAudio/ at least version 3.0
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs libpulse) -lm -lsndfile -lpthread libsndfile_pulse_daemon.c -std=c11 -Wall -o libsndfile_pulse_daemon
+ *
+ * Run with ./libsndfile_pulse_daemon [-s socket] [-r rate] [-c channels] [-l latency_ms]
+ * and     ../tools/playctl play some.[wav/flac/aiff]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pulse/pulseaudio.h>
+#include <sndfile.h>
+
+#include "ctlloop.h"
+#include "playdaemon.h"
+
+static pa_threaded_mainloop *m_SPaml = NULL;
+static ctlloop m_SControl;
+static playdaemon m_SDaemon;
+static long m_lUnderflows = 0;
+
+/* When context change state this called */
+void pa_state_cb(pa_context *c, void *userdata) {
+    pa_context_state_t l_iState;
+    int *l_iPaReady = userdata;
+    l_iState = pa_context_get_state(c);
+
+    switch  (l_iState) {
+        case PA_CONTEXT_FAILED:
+            printf("pa_state_cb: PA_CONTEXT_FAILED\n");
+            *l_iPaReady = 2;
+            break;
+
+        case PA_CONTEXT_TERMINATED:
+            printf("pa_state_cb: PA_CONTEXT_TERMINATED\n");
+            *l_iPaReady = 2;
+            break;
+
+        case PA_CONTEXT_READY:
+            printf("pa_state_cb: PA_CONTEXT_READY\n");
+            *l_iPaReady = 1;
+            break;
+
+        default:
+            break;
+    }
+
+    /* Wake up main thread which is waiting in pa_threaded_mainloop_wait() */
+    pa_threaded_mainloop_signal(m_SPaml, 0);
+}
+
+/* Stream is ready or failed */
+static void stream_state_cb(pa_stream *s, void *userdata) {
+    pa_threaded_mainloop_signal(m_SPaml, 0);
+}
+
+/* Request for writing length data. Run in Pulseaudio thread so only
+   copying from rings of items here */
+static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
+    size_t l_lFrameSize = sizeof(float) * m_SDaemon.channels;
+    void *l_ptrBuffer = NULL;
+    size_t l_lBytes = length;
+
+    /* Let Pulseaudio give us memory so there is no extra copy */
+    if (pa_stream_begin_write(s, &l_ptrBuffer, &l_lBytes) < 0 || l_ptrBuffer == NULL) {
+        return;
+    }
+
+    if (l_lBytes > length) {
+        l_lBytes = length;
+    }
+
+    l_lBytes -= l_lBytes % l_lFrameSize;
+    playdaemon_fill(&m_SDaemon, (float *)l_ptrBuffer, l_lBytes / l_lFrameSize);
+
+    if (pa_stream_write(s, l_ptrBuffer, l_lBytes, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+        pa_stream_cancel_write(s);
+    }
+}
+
+/* There is not enough bytes to flow so we call underflow */
+static void stream_underflow_cb(pa_stream *s, void *userdata) {
+    m_lUnderflows++;
+}
+
+static double now_ms(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec * 1000.0 + l_STs.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    pa_mainloop_api *l_SPamlapi = NULL;
+    pa_context *l_SPactx = NULL;
+    pa_stream *l_SPlaystream = NULL;
+    pa_buffer_attr l_SBufAttr;
+    pa_sample_spec l_SSs;
+    pa_stream_state_t l_iState = PA_STREAM_UNCONNECTED;
+    const char *l_strSocket = NULL;
+    double l_dStart = 0.0;
+    int l_iRate = 48000;
+    int l_iChannels = 2;
+    int l_iLatencyMs = 20;
+    int l_iPaReady = 0;
+    int l_iRetval = 0;
+    int l_iWhat = 0;
+    int l_iOpt = 0;
+    int r = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "s:r:c:l:")) != -1) {
+        switch (l_iOpt) {
+            case 's':
+                l_strSocket = optarg;
+                break;
+
+            case 'r':
+                l_iRate = atoi(optarg);
+                break;
+
+            case 'c':
+                l_iChannels = atoi(optarg);
+                break;
+
+            case 'l':
+                l_iLatencyMs = atoi(optarg);
+                break;
+
+            default:
+                l_iRate = 0;
+                break;
+        }
+    }
+
+    if (l_iRate < 1 || l_iChannels < 1 || l_iChannels > (int)PA_CHANNELS_MAX || l_iLatencyMs < 1) {
+        fprintf(stderr, "Usage: %s [-s socket] [-r rate] [-c channels] [-l latency_ms]\n", argv[0]);
+        return 1;
+    }
+
+    /* Before Pulseaudio thread so signals come only to control loop */
+    if (ctlloop_open(&m_SControl) < 0) {
+        return -1;
+    }
+
+    if (playdaemon_open(&m_SDaemon, &m_SControl, l_iRate, l_iChannels, l_strSocket) < 0) {
+        ctlloop_close(&m_SControl);
+        return 1;
+    }
+
+    l_dStart = now_ms();
+
+    /* Create a threaded mainloop API and connection to the default server */
+    m_SPaml = pa_threaded_mainloop_new();
+    l_SPamlapi = pa_threaded_mainloop_get_api(m_SPaml);
+
+    l_SPactx = pa_context_new(l_SPamlapi, "Simple example Pulseaudio player daemon");
+
+    /* Define what callback is called in state change */
+    pa_context_set_state_callback(l_SPactx, pa_state_cb, &l_iPaReady);
+
+    /* Everything that touches Pulseaudio objects must hold the mainloop lock */
+    pa_threaded_mainloop_lock(m_SPaml);
+
+    if (pa_threaded_mainloop_start(m_SPaml) < 0) {
+        fprintf(stderr, "main: pa_threaded_mainloop_start failed\n");
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    pa_context_connect(l_SPactx, NULL, 0, NULL);
+
+    /* We can't do anything until PA is ready, so just wait for signal from
+      pa_state_cb */
+    while (l_iPaReady == 0) {
+        pa_threaded_mainloop_wait(m_SPaml);
+    }
+
+    if (l_iPaReady == 2) {
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    l_SSs.rate = l_iRate;
+    l_SSs.channels = l_iChannels;
+    l_SSs.format = PA_SAMPLE_FLOAT32LE;
+
+    l_SPlaystream = pa_stream_new(l_SPactx, "Player daemon", &l_SSs, NULL);
+
+    if (!l_SPlaystream) {
+        fprintf(stderr, "main: pa_stream_new failed\n");
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    pa_stream_set_state_callback(l_SPlaystream, stream_state_cb, NULL);
+    /* Callback for writing */
+    pa_stream_set_write_callback(l_SPlaystream, stream_request_cb, NULL);
+    /* Callback for underflow */
+    pa_stream_set_underflow_callback(l_SPlaystream, stream_underflow_cb, NULL);
+
+    /* Small target length: command waits behind what server already has */
+    l_SBufAttr.fragsize = (uint32_t) - 1;
+    l_SBufAttr.maxlength = (uint32_t) - 1;
+    l_SBufAttr.minreq = (uint32_t) - 1;
+    l_SBufAttr.prebuf = (uint32_t) - 1;
+    l_SBufAttr.tlength = pa_usec_to_bytes(l_iLatencyMs * 1000, &l_SSs);
+
+    /* Connect playback to default output */
+    r = pa_stream_connect_playback(l_SPlaystream, NULL, &l_SBufAttr,
+                                   PA_STREAM_INTERPOLATE_TIMING
+                                   | PA_STREAM_ADJUST_LATENCY
+                                   | PA_STREAM_AUTO_TIMING_UPDATE, NULL, NULL);
+
+    if (r < 0) {
+        printf("main: Can't connect to server. Trying with another parameters\n");
+        /* Old pulse audio servers don't like the ADJUST_LATENCY flag, so retry without that */
+        r = pa_stream_connect_playback(l_SPlaystream, NULL, &l_SBufAttr,
+                                       PA_STREAM_INTERPOLATE_TIMING |
+                                       PA_STREAM_AUTO_TIMING_UPDATE, NULL, NULL);
+    }
+
+    while (r == 0 && (l_iState = pa_stream_get_state(l_SPlaystream)) != PA_STREAM_READY
+            && PA_STREAM_IS_GOOD(l_iState)) {
+        pa_threaded_mainloop_wait(m_SPaml);
+    }
+
+    pa_threaded_mainloop_unlock(m_SPaml);
+
+    if (r < 0 || l_iState != PA_STREAM_READY) {
+        printf("main: pa_stream_connect_playback failed\n");
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    printf("main: Stream ready in %.1f ms (server buffer %d ms)\n", now_ms() - l_dStart, l_iLatencyMs);
+    playdaemon_print_path(&m_SDaemon);
+    printf("main: Serve until CTRL-C.\n");
+
+    while (!(l_iWhat & CTLLOOP_SIGNAL)) {
+        if ((l_iWhat = ctlloop_wait(&m_SControl)) < 0) {
+            break;
+        }
+
+        playdaemon_handle(&m_SDaemon, l_iWhat);
+    }
+
+    if (l_iWhat > 0) {
+        printf("main: Got signal %d\n", m_SControl.signal);
+    }
+
+exit:
+    /* clean up and disconnect */
+    printf("\nExit and clean\n");
+
+    pa_threaded_mainloop_lock(m_SPaml);
+
+    if (l_SPlaystream) {
+        pa_stream_disconnect(l_SPlaystream);
+        pa_stream_unref(l_SPlaystream);
+    }
+
+    pa_context_disconnect(l_SPactx);
+    pa_context_unref(l_SPactx);
+    pa_threaded_mainloop_unlock(m_SPaml);
+    pa_threaded_mainloop_stop(m_SPaml);
+    pa_threaded_mainloop_free(m_SPaml);
+
+    printf("main: Server underflows %ld\n", m_lUnderflows);
+    playdaemon_print_stats(&m_SDaemon);
+    playdaemon_close(&m_SDaemon);
+    ctlloop_close(&m_SControl);
+    return l_iRetval;
+}
@@ -29,20 +29,58 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with
- * gcc -g $(pkg-config --cflags --libs libpulse) -lm -lsndfile libsndfile_pulse_play.c -std=c99 -Wall -o libsndfile_pulse_play
+ * gcc -g -I../common $(pkg-config --cflags --libs libpulse) -lm -lsndfile -lpthread libsndfile_pulse_play.c -std=c11 -Wall -o libsndfile_pulse_play
  *
  * Run with ./libsndfile_pulse_play some.[wav/flac/aiff]
+ * or      ../tools/shmring_producer some.[wav/flac/aiff] ./libsndfile_pulse_play
+ *
+ * With 'shm:FD' or 'shm:/path' argument samples are taken from shared memory
+ * ring of producer process (see common/shmring.h) instead of libsndfile.
+ *
+ * Levels of every played block can be watched with tools/meter_watch
+ * (see common/meter.h). With SPECTRUM set in environment spectrum is
+ * computed on worker thread and can be watched with tools/spectrum_watch
+ * (see common/spectrum.h).
+ *
+ * If file has been measured with tools/r128scan its loudness gain (from
+ * 'file.r128') is applied to output (see common/loudness.h).
+ *
+ * Without gain 16, 24 and 32-bit PCM files are played as S16LE, S24LE or
+ * S32LE stream so samples are not converted to float and back
+ * (see common/nativefmt.h).
+ *
+ * With SIMDEV set in environment there is no server connection. Simulated
+ * device asks blocks on its own timer (see common/simdev.h):
+ * SIMDEV="period=441,buffer=3,jitter=0.2,skew=100" ./libsndfile_pulse_play some.wav
+ *
+ * With DSPCHAIN set in environment output goes through gain, EQ and
+ * limiter in write callback. Lines from stdin change them while playing
+ * (see common/dspchain.h).
+ *
+ * With FIRFILTER set long room correction filter is convolved with file
+ * before DSP chain (see common/fftconv.h).
  */
 
-#define _XOPEN_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <pulse/pulseaudio.h>
 #include <sndfile.h>
 
+#include "asynclog.h"
+#include "dspchain.h"
+#include "fftconv.h"
+#include "loudness.h"
+#include "meter.h"
+#include "nativefmt.h"
+#include "shmring.h"
+#include "simdev.h"
+#include "spectrum.h"
+
 typedef struct pulseinfo {
   char name[512];
   uint32_t card;
@@ -54,10 +92,23 @@ static int m_iLatency = 20000; /* start latency in micro seconds */
 float m_fSampledata[88100 * sizeof(float) * 2];
 static pa_buffer_attr m_SBufAttr;
 static int m_iUnderflows = 0;
+static long m_lUnderflowsTotal = 0;
+static long m_lWakeups = 0;
 static pa_sample_spec m_SSs;
 SNDFILE *m_SInfile = NULL;
 SF_INFO m_SSfinfo;
 int m_iLoop = 0;
+static shmring m_SShm;
+static int m_iShm = 0;
+static meter m_SMeter;
+static float m_fGain = 1.0f;
+static nativefmt m_SFmt;
+static dspchain m_SChain;
+static int m_iChain = 0;
+static fftconv m_SConv;
+static int m_iConv = 0;
+static spectrum m_SSpectrum;
+static int m_iSpectrum = 0;
 pulseinfo m_SSinkList[1024];
 pulseinfo m_SSourceList[1024];
 int m_iSinkCount = -1;
@@ -216,23 +267,138 @@ static void stream_notify_cb(pa_stream *s, void *userdata) {
            pa_stream_is_suspended(s) ? "" : "not");
 }
 
+/* Write straight from producer's shared memory. Pulseaudio copies it
+   to its own memblock so there is no buffer of ours in between.
+   Returns frames written */
+static long shm_write(pa_stream *s, size_t length) {
+    const float *l_fFirst = NULL;
+    const float *l_fSecond = NULL;
+    uint64_t l_lFirst = 0;
+    uint64_t l_lSecond = 0;
+    size_t l_lFrameBytes = m_SShm.header->channels * sizeof(float);
+    uint64_t l_lWant = length / l_lFrameBytes;
+
+    shmring_get_read_regions(&m_SShm, &l_fFirst, &l_lFirst, &l_fSecond, &l_lSecond);
+
+    if (l_lFirst > l_lWant) {
+        l_lFirst = l_lWant;
+    }
+
+    if (l_lSecond > l_lWant - l_lFirst) {
+        l_lSecond = l_lWant - l_lFirst;
+    }
+
+    /* Meter before regions are given back to producer */
+    meter_update2(&m_SMeter, l_fFirst, l_lFirst, l_fSecond, l_lSecond);
+
+    if (m_iSpectrum) {
+        spectrum_push(&m_SSpectrum, l_fFirst, l_lFirst);
+        spectrum_push(&m_SSpectrum, l_fSecond, l_lSecond);
+    }
+
+    if (l_lFirst > 0) {
+        pa_stream_write(s, l_fFirst, l_lFirst * l_lFrameBytes, NULL, 0, PA_SEEK_RELATIVE);
+    }
+
+    if (l_lSecond > 0) {
+        pa_stream_write(s, l_fSecond, l_lSecond * l_lFrameBytes, NULL, 0, PA_SEEK_RELATIVE);
+    }
+
+    shmring_read_advance(&m_SShm, l_lFirst + l_lSecond);
+
+    /* Producer is late. Keep stream running with silence */
+    if (l_lFirst + l_lSecond < l_lWant && !atomic_load(&m_SShm.header->eof)) {
+        atomic_fetch_add(&m_SShm.header->underruns, 1);
+        memset(m_fSampledata, 0x00, (l_lWant - l_lFirst - l_lSecond) * l_lFrameBytes);
+        pa_stream_write(s, m_fSampledata, (l_lWant - l_lFirst - l_lSecond) * l_lFrameBytes, NULL, 0, PA_SEEK_RELATIVE);
+    }
+
+    return l_lFirst + l_lSecond;
+}
+
+/* Limiter look-ahead is read before start so it adds no latency. Frames
+   go through loudness gain and FIR filter like in read_block() */
+static void prime_chain(void) {
+    float l_fPrime[1024];
+    long l_lWant = 1024 / m_SSfinfo.channels;
+    long l_lLeft = m_SChain.lookahead;
+    long l_lGot = 0;
+
+    if (!m_iConv) {
+        dspchain_prime_sndfile(&m_SChain, m_SInfile, m_fGain);
+        return;
+    }
+
+    while (l_lLeft > 0 && (l_lGot = sf_readf_float(m_SInfile, l_fPrime, l_lLeft < l_lWant ? l_lLeft : l_lWant)) > 0) {
+        loudness_apply(l_fPrime, l_lGot * m_SSfinfo.channels, m_fGain);
+        fftconv_process(&m_SConv, l_fPrime, l_lGot);
+        dspchain_prime(&m_SChain, l_fPrime, l_lGot);
+        l_lLeft -= l_lGot;
+    }
+}
+
+/* Read length bytes from file in stream format. Returns samples read */
+static long read_block(void *buffer, size_t length) {
+    long readcount = 0;
+
+    /* Just null readed area */
+    memset(buffer, 0x00, length);
+
+    /* Read with libsndfile in stream format */
+    readcount = nativefmt_read(&m_SFmt, m_SInfile, buffer, length / m_SFmt.sample_bytes);
+
+    if (m_SFmt.kind == NATIVEFMT_FLOAT) {
+        loudness_apply((float *)buffer, readcount, m_fGain);
+
+        if (m_iConv) {
+            fftconv_process(&m_SConv, (float *)buffer, readcount / m_SSfinfo.channels);
+        }
+
+        /* Delay line of limiter still has frames after file end */
+        if (m_iChain) {
+            readcount = dspchain_process(&m_SChain, (float *)buffer, readcount / m_SSfinfo.channels, length / sizeof(float) / m_SSfinfo.channels) * m_SSfinfo.channels;
+        }
+
+        meter_update(&m_SMeter, (float *)buffer, length / sizeof(float) / m_SSfinfo.channels);
+    } else {
+        meter_update_int(&m_SMeter, buffer, m_SFmt.sample_bytes, length / nativefmt_frame_bytes(&m_SFmt));
+    }
+
+    if (m_iSpectrum) {
+        spectrum_push(&m_SSpectrum, buffer, length / nativefmt_frame_bytes(&m_SFmt));
+    }
+
+    return readcount;
+}
+
 /* Reques for writing length data */
 static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
     pa_usec_t usec = 0;
     int neg = 0;
     int readcount = 0;
 
-    /* Just null readed area */
-    memset(m_fSampledata, 0x00, length * 4);
+    m_lWakeups++;
+
+    if (m_iShm) {
+        readcount = shm_write(s, length);
+        asynclog_printf("stream_request_cb: request: %8ld from shared memory %8ld\r", (long)length, (long)readcount);
+
+        if (shmring_finished(&m_SShm)) {
+            m_iLoop = 1;
+        }
+
+        return;
+    }
 
-    /* Read with libsndfile */
-    readcount = sf_read_float(m_SInfile, m_fSampledata, length / 4);
+    /* Only whole frames */
+    length -= length % nativefmt_frame_bytes(&m_SFmt);
+    readcount = read_block(m_fSampledata, length);
 
     /* Measure latency */
     pa_stream_get_latency(s, &usec, &neg);
 
-    /* Print some statistics */
-    printf("stream_request_cb: latency %8d us request: %8ld readed %8d\r", (int)usec, length, readcount);
+    /* Print some statistics (printed later by log thread) */
+    asynclog_printf("stream_request_cb: latency %8ld us request: %8ld readed %8ld\r", (long)usec, (long)length, (long)readcount);
 
     /* File end if we read -1 */
     if( readcount <= 0 ) {
@@ -241,7 +407,7 @@ static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
 
     /* After that write to the Pulseaudio sink */
     if( pa_stream_write(s, m_fSampledata, length, NULL, 0, PA_SEEK_RELATIVE) ) {
-        fprintf(stderr, "stream_request_cb: Something wrong!\n");
+        asynclog_printf("stream_request_cb: Something wrong!\n");
     }
 
 }
@@ -250,8 +416,9 @@ static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
 static void stream_underflow_cb(pa_stream *s, void *userdata) {
     /* We increase the latency by 50% if we get 6 m_iUnderflows and latency is under 2s
      This is very useful for over the network playback that can't handle low latencies */
-    printf("stream_underflow_cb: underflow\n");
+    asynclog_printf("stream_underflow_cb: underflow\n");
     m_iUnderflows++;
+    m_lUnderflowsTotal++;
 
     if (m_iUnderflows >= 6 && m_iLatency < 2000000) {
         m_iLatency = (m_iLatency * 3) / 2;
@@ -259,13 +426,69 @@ static void stream_underflow_cb(pa_stream *s, void *userdata) {
         m_SBufAttr.tlength = pa_usec_to_bytes(m_iLatency, &m_SSs);
         pa_stream_set_buffer_attr(s, &m_SBufAttr, NULL, NULL);
         m_iUnderflows = 0;
-        printf("stream_underflow_cb: latency increased to %d\n", m_iLatency);
+        asynclog_printf("stream_underflow_cb: latency increased to %ld\n", (long)m_iLatency);
+    }
+}
+
+/* Simulated device asks block like write callback of stream */
+static int simdevCb(void *buffer, long frames, void *userdata) {
+    long l_lGot = 0;
+
+    m_lWakeups++;
+
+    if (m_iShm) {
+        /* Short ring leaves previous block in buffer. It must not play again */
+        l_lGot = (long)shmring_read_float(&m_SShm, (float *)buffer, frames);
+        memset((float *)buffer + l_lGot * m_SSfinfo.channels, 0x00, (frames - l_lGot) * m_SSfinfo.channels * sizeof(float));
+        meter_update(&m_SMeter, (float *)buffer, frames);
+
+        if (m_iSpectrum) {
+            spectrum_push(&m_SSpectrum, buffer, frames);
+        }
+
+        return m_iLoop || shmring_finished(&m_SShm);
+    }
+
+    return m_iLoop || read_block(buffer, frames * nativefmt_frame_bytes(&m_SFmt)) <= 0;
+}
+
+/* Play with simulated device until end or CTRL-C */
+static int play_simulated(void) {
+    simdev l_SSim;
+
+    if (simdev_open(&l_SSim, m_SSfinfo.samplerate, m_SSfinfo.channels, m_SFmt.sample_bytes, SIMDEV_PLAYBACK) < 0) {
+        return -1;
+    }
+
+    if (simdev_start(&l_SSim, simdevCb, NULL) < 0) {
+        fprintf(stderr, "play_simulated: Can't start simulated device\n");
+        simdev_close(&l_SSim);
+        return -1;
+    }
+
+    simdev_wait(&l_SSim);
+    simdev_close(&l_SSim);
+    simdev_print_stats(&l_SSim);
+
+    if (m_iShm) {
+        printf("play_simulated: Shared memory underruns %ld\n", (long)atomic_load(&m_SShm.header->underruns));
+    }
+
+    meter_print_stats(&m_SMeter);
+    return 0;
+}
+
+/* Commands for DSP chain. Runs in main loop like write callback but
+   goes through same queue as from any other thread */
+static void stdin_cb(pa_mainloop_api *api, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    if (dspchain_read_commands(&m_SChain, fd) < 0) {
+        api->io_free(e);
     }
 }
 
 /* Handle termination with CTRL-C */
 static void handler(int sig, siginfo_t *si, void *unused) {
-    printf("Got SIGSEGV at address: 0x%lx\n", (long) si->si_addr);
+    asynclog_signal_printf("handler: Got signal %ld\n", (long)sig);
     m_iLoop = 1;
 }
 
@@ -280,19 +503,88 @@ int main(int argc, char *argv[]) {
     int l_iRetval = 0;
     struct sigaction l_SSa;
     pa_channel_map l_SChannelMap;
+    struct timespec l_SStart;
+    struct timespec l_SEnd;
+    double l_dSeconds = 0.0;
+
+    if (shmring_is_spec(argv[1])) {
+        if (shmring_attach(&m_SShm, argv[1]) < 0) {
+            fprintf(stderr, "main: Not able to attach shared memory ring %s.\n", argv[1]);
+            return 1;
+        }
+
+        m_iShm = 1;
+        m_SSfinfo.samplerate = m_SShm.header->samplerate;
+        m_SSfinfo.channels = m_SShm.header->channels;
 
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (m_SInfile = sf_open(argv[1], SFM_READ, &m_SSfinfo))) {
+    } else if (! (m_SInfile = sf_open(argv[1], SFM_READ, &m_SSfinfo))) {
         fprintf(stderr, "main: Not able to open input file %s.\n", argv[1]) ;
         sf_perror (NULL) ;
         return  1 ;
     }
 
-    printf("main: Opened file: (%s)\n", argv[1]);
+    printf("main: Opened %s: (%s)\n", m_iShm ? "shared memory ring" : "file", argv[1]);
+
+    if (!m_iShm) {
+        m_fGain = loudness_gain_load(argv[1]);
+    }
+
+    /* Gain and DSP need float. Shared memory ring is always float */
+    nativefmt_pick(&m_SFmt, m_SInfile, &m_SSfinfo, m_iShm || m_fGain != 1.0f || dspchain_wanted() || fftconv_wanted());
+
+    /* Shared memory ring has its own producer, filter and chain are only
+       for files */
+    if (!m_iShm && fftconv_wanted()) {
+        if (fftconv_open(&m_SConv, m_SSfinfo.samplerate, m_SSfinfo.channels, getenv("FIRFILTER")) < 0) {
+            sf_close(m_SInfile);
+            return 1;
+        }
+
+        m_iConv = 1;
+        fftconv_print(&m_SConv);
+    }
+
+    if (!m_iShm && dspchain_wanted()) {
+        if (dspchain_open(&m_SChain, m_SSfinfo.samplerate, m_SSfinfo.channels, getenv("DSPCHAIN")) < 0) {
+            sf_close(m_SInfile);
+            return 1;
+        }
+
+        prime_chain();
+        m_iChain = 1;
+        dspchain_print(&m_SChain);
+    }
+
+    if (meter_open(&m_SMeter, m_SSfinfo.samplerate, m_SSfinfo.channels) < 0) {
+        fprintf(stderr, "main: Can't make level meter. Playing without it.\n");
+    }
+
+    meter_print_path(&m_SMeter);
+
+    /* Integer stream is given as it is and worker converts it */
+    if (spectrum_wanted()) {
+        if (spectrum_open(&m_SSpectrum, m_SSfinfo.samplerate, m_SSfinfo.channels,
+                          m_SFmt.kind == NATIVEFMT_FLOAT ? 0 : m_SFmt.sample_bytes, getenv("SPECTRUM")) < 0) {
+            fprintf(stderr, "main: Can't make spectrum. Playing without it.\n");
+        } else {
+            m_iSpectrum = 1;
+            spectrum_print_path(&m_SSpectrum);
+        }
+    }
+
+    if (asynclog_start() < 0) {
+        fprintf(stderr, "main: Can't start log thread!\n");
+        sf_close(m_SInfile);
+        return -1;
+    }
 
     l_SSa.sa_flags = SA_SIGINFO;
     sigemptyset(&l_SSa.sa_mask);
+    /* Handlers log to same signal ring so they must not interrupt each other */
+    sigaddset(&l_SSa.sa_mask, SIGINT);
+    sigaddset(&l_SSa.sa_mask, SIGHUP);
     l_SSa.sa_sigaction = handler;
 
     if (sigaction(SIGINT, &l_SSa, NULL) == -1) {
@@ -307,10 +599,20 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    if (simdev_wanted()) {
+        l_iRetval = play_simulated();
+        goto exit;
+    }
+
     /* Create a mainloop API and connection to the default server */
     l_SPaml = pa_mainloop_new();
     l_SPamlapi = pa_mainloop_get_api(l_SPaml);
 
+    if (m_iChain) {
+        l_SPamlapi->io_new(l_SPamlapi, STDIN_FILENO, PA_IO_EVENT_INPUT, stdin_cb, NULL);
+    }
+
+
     l_SPactx = pa_context_new(l_SPamlapi, "Simple example Pulseaudio playback application");
 
     pa_context_connect(l_SPactx, NULL, 0, NULL);
@@ -374,28 +676,47 @@ int main(int argc, char *argv[]) {
 
     printf("main: We have samplerate: %5d and channels %2d\n", m_SSfinfo.samplerate, m_SSfinfo.channels);
 
-    if( m_SSfinfo.format & SF_FORMAT_PCM_S8 ) {
+    if( (m_SSfinfo.format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_S8 ) {
         printf("main: Subformat: 8-bit!\n");
 
-    } else if( m_SSfinfo.format & SF_FORMAT_PCM_16 ) {
+    } else if( (m_SSfinfo.format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_16 ) {
         printf("main: Subformat: 16-bit!\n");
 
-    } else if( m_SSfinfo.format & SF_FORMAT_PCM_24 ) {
+    } else if( (m_SSfinfo.format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_24 ) {
         printf("main: Subformat: 24-bit!\n");
 
-    } else if( m_SSfinfo.format & SF_FORMAT_PCM_32 ) {
+    } else if( (m_SSfinfo.format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_32 ) {
         printf("main: Subformat: 32-bit!\n");
 
-    } else if( m_SSfinfo.format & SF_FORMAT_FLOAT ) {
+    } else if( (m_SSfinfo.format & SF_FORMAT_SUBMASK) == SF_FORMAT_FLOAT ) {
         printf("main: Subformat: FLOAT!\n");
 
-    } else if( m_SSfinfo.format & SF_FORMAT_DOUBLE ) {
+    } else if( (m_SSfinfo.format & SF_FORMAT_SUBMASK) == SF_FORMAT_DOUBLE ) {
         printf("main: Subformat: DOUBLE!\n");
     }
 
     m_SSs.rate = m_SSfinfo.samplerate;
     m_SSs.channels = m_SSfinfo.channels;
-    m_SSs.format = PA_SAMPLE_FLOAT32LE;
+
+    switch (m_SFmt.kind) {
+        case NATIVEFMT_S16:
+            m_SSs.format = PA_SAMPLE_S16NE;
+            break;
+
+        case NATIVEFMT_S24:
+            m_SSs.format = PA_SAMPLE_S24NE;
+            break;
+
+        case NATIVEFMT_S32:
+            m_SSs.format = PA_SAMPLE_S32NE;
+            break;
+
+        default:
+            m_SSs.format = PA_SAMPLE_FLOAT32LE;
+            break;
+    }
+
+    nativefmt_print(&m_SFmt);
 
     l_SChannelMap.channels = 2;
     l_SChannelMap.map[0] = m_SSinkList[1].channel_map.map[2];
@@ -445,18 +766,63 @@ int main(int argc, char *argv[]) {
     /* Iterate the main m_iLoop and go again.  The second argument is whether
       or not the iteration should block until something is ready to be
       done.  Set it to zero for non-blocking. */
+    clock_gettime(CLOCK_MONOTONIC, &l_SStart);
+
     while (!m_iLoop) {
         pa_mainloop_iterate(l_SPaml, 1, NULL);
     }
 
+    /* Same statistics as libsndfile_pulse_threaded_play prints */
+    clock_gettime(CLOCK_MONOTONIC, &l_SEnd);
+    l_dSeconds = (l_SEnd.tv_sec - l_SStart.tv_sec) + (l_SEnd.tv_nsec - l_SStart.tv_nsec) / 1e9;
+    printf("\nmain: Played %.2f seconds\n", l_dSeconds);
+    printf("main: Pulseaudio callbacks %ld (%.1f/s)\n", m_lWakeups, m_lWakeups / l_dSeconds);
+    printf("main: Server underflows %ld\n", m_lUnderflowsTotal);
+
+    if (m_iShm) {
+        printf("main: Shared memory underruns %ld\n", (long)atomic_load(&m_SShm.header->underruns));
+    }
+
+    meter_print_stats(&m_SMeter);
+
 exit:
     /* clean up and disconnect */
+    asynclog_stop();
     printf("\nExit and clean\n");
-    sf_close(m_SInfile);
+
+    if (m_iShm) {
+        shmring_close(&m_SShm);
+    } else {
+        sf_close(m_SInfile);
+    }
+
     m_SInfile = NULL;
-    pa_context_disconnect(l_SPactx);
-    pa_context_unref(l_SPactx);
-    pa_mainloop_free(l_SPaml);
+    meter_close(&m_SMeter);
+
+    if (m_iSpectrum) {
+        spectrum_print_stats(&m_SSpectrum);
+        spectrum_close(&m_SSpectrum);
+    }
+
+    if (m_iChain) {
+        dspchain_print_stats(&m_SChain);
+        dspchain_free(&m_SChain);
+    }
+
+    if (m_iConv) {
+        fftconv_print_stats(&m_SConv);
+        fftconv_close(&m_SConv);
+    }
+
+    if (l_SPactx != NULL) {
+        pa_context_disconnect(l_SPactx);
+        pa_context_unref(l_SPactx);
+    }
+
+    if (l_SPaml != NULL) {
+        pa_mainloop_free(l_SPaml);
+    }
+
     return l_iRetval;
 }
 
@@ -29,20 +29,69 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with
- * gcc -g $(pkg-config --cflags --libs libpulse) -lm -lsndfile libsndfile_pulse_rec.c -std=c99 -Wall -o libsndfile_pulse_rec
+ * gcc -g -I../common $(pkg-config --cflags --libs libpulse) -lm -lsndfile -lpthread libsndfile_pulse_rec.c -std=c11 -Wall -o libsndfile_pulse_rec
  *
- * Run with ./libsndfile_pulse_rec some.wav (Warning! Will overwrite without warning!)
+ * Run with ./libsndfile_pulse_rec [-p profile] [-g dB[:preroll_ms:hangover_ms] [-k]] some.wav (Warning! Will overwrite without warning!)
+ * or       ./libsndfile_pulse_rec [-p profile] -m minutes [-a seconds] [-l dB] [-f fifo] some.wav
+ *
+ * For recording stream only fragsize matters: server sends data when
+ * there is one fragment (tlength, prebuf and minreq are for playback).
+ * -p selects how big fragment is asked with PA_STREAM_ADJUST_LATENCY:
+ *
+ *   low          5 ms fragments, 200 wakeups a second
+ *   balanced    20 ms fragments (default)
+ *   throughput 500 ms fragments, 2 wakeups a second
+ *
+ * If server overflows (we did not read in time and maxlength was full)
+ * samples are lost. After 6 overflows maxlength is made 50% bigger (up to
+ * 10 s) so server can hold more while we are late. Fragment stays at
+ * profile latency target. At the end fragment size server
+ * gave, wakeups per second, latency and overflows are printed.
+ *
+ * If file name ends with '.flac' samples are encoded to FLAC on a thread
+ * pool (see common/flacpool.h) so callback never waits for compression.
+ *
+ * With -g silence under dB (RMS, like -45) is left out and kept stretches
+ * are listed in some.wav.segments with their capture positions. -k keeps
+ * silence in file and only lists stretches (see common/silencegate.h).
+ *
+ * Input levels can be watched with tools/meter_watch (see common/meter.h).
+ * With SPECTRUM set in environment input spectrum is computed on worker
+ * thread and can be watched with tools/spectrum_watch (see
+ * common/spectrum.h).
+ *
+ * With -m nothing is written until trigger. Last 'minutes' are kept in
+ * memory and on SIGUSR1, 'dump' line in fifo (-f) or peak over dB (-l)
+ * they are dumped with 'seconds' (-a, default 60) after trigger to
+ * some-000000-YYYYmmdd-HHMMSS.wav (see common/capturering.h):
+ *
+ *   kill -USR1 $(pidof libsndfile_pulse_rec)
+ *
+ * With SIMDEV set in environment there is no server connection. Simulated
+ * device gives fragments of profile size (if SIMDEV has no period) on its
+ * own timer and SIMDEV_INPUT can feed it from raw float file (see
+ * common/simdev.h):
+ * SIMDEV="period=882,jitter=0.5" SIMDEV_INPUT=in.raw ./libsndfile_pulse_rec some.wav
  */
 
-#define _XOPEN_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <pulse/pulseaudio.h>
 #include <sndfile.h>
 
+#include "asynclog.h"
+#include "capturering.h"
+#include "flacpool.h"
+#include "meter.h"
+#include "silencegate.h"
+#include "simdev.h"
+#include "spectrum.h"
+
 typedef struct pulseinfo {
   char name[512];
   uint32_t card;
@@ -50,14 +99,43 @@ typedef struct pulseinfo {
   pa_channel_map channel_map;
 } pulseinfo;
 
-static int m_iLatency = 20000;
+typedef struct capture_profile {
+  const char *name;
+  long fragsize_us;
+  long maxlength_us;
+} capture_profile;
+
+static const capture_profile m_SProfiles[] = {
+  { "low", 5000, 200000 },
+  { "balanced", 20000, 2000000 },
+  { "throughput", 500000, 4000000 },
+  { NULL, 0, 0 }
+};
+
+static long m_lFragsize = 20000;
+static long m_lMaxlength = 2000000;
 const void *m_ptrSampleData;
 static pa_buffer_attr m_SBufAttr;
-static int m_SUnderflows = 0;
+static int m_SOverflows = 0;
+static long m_lOverflowsTotal = 0;
+static long m_lWakeups = 0;
+static long m_lHoles = 0;
+static long m_lLatencyCount = 0;
+static double m_dLatencySum = 0.0;
+static long m_lLatencyMax = 0;
 static pa_sample_spec m_iSs;
 SNDFILE *m_SOutFile = NULL;
 SF_INFO m_SSfinfo;
 int m_iLoop = 0;
+static flacpool m_SFlac;
+static int m_iFlac = 0;
+static silencegate m_SGate;
+static int m_iGate = 0;
+static meter m_SMeter;
+static spectrum m_SSpectrum;
+static int m_iSpectrum = 0;
+static capturering m_SRing;
+static int m_iRing = 0;
 pulseinfo m_SSinkList[1024];
 pulseinfo m_SSourceList[1024];
 int m_iSinkCount = -1;
@@ -216,63 +294,270 @@ static void stream_notify_cb(pa_stream *s, void *userdata) {
            pa_stream_is_suspended(s) ? "" : "not");
 }
 
+/* Give frames to FLAC encoder or WAV file. Returns samples written */
+static int write_output(const float *pcm, long frames, void *userdata) {
+    /* FLAC only copies to encoder ring. Dropped frames are counted there */
+    if (m_iFlac) {
+        flacpool_write(&m_SFlac, pcm, frames);
+        return 0;
+    }
+
+    /* Short write is full disk or broken file */
+    return sf_write_float(m_SOutFile, pcm, frames * m_SSfinfo.channels) == frames * m_SSfinfo.channels ? 0 : -1;
+}
+
+/* Meter and store one fragment. Returns -1 if it can't be written */
+static int process_block(const float *pcm, long frames) {
+    meter_update(&m_SMeter, pcm, frames);
+
+    if (m_iSpectrum) {
+        spectrum_push(&m_SSpectrum, pcm, frames);
+    }
+
+    /* Ring only copies. Dumper thread writes when triggered */
+    if (m_iRing) {
+        capturering_write(&m_SRing, pcm, frames);
+        return 0;
+    }
+
+    /* Gate calls write_output() only for kept samples */
+    if (m_iGate) {
+        return silencegate_process(&m_SGate, pcm, frames);
+    }
+
+    return write_output(pcm, frames, NULL);
+}
+
+/* Hole in stream is silence so positions in file stay right */
+static int process_hole(long frames) {
+    static const float l_fSilence[4096] = { 0.0f };
+    long l_lMax = 4096 / m_SSfinfo.channels;
+    long l_lNow = 0;
+    int l_iRetval = 0;
+
+    while (frames > 0) {
+        l_lNow = frames < l_lMax ? frames : l_lMax;
+
+        if (process_block(l_fSilence, l_lNow) < 0) {
+            l_iRetval = -1;
+        }
+
+        frames -= l_lNow;
+    }
+
+    return l_iRetval;
+}
+
+/* What server really gave. It can be other than we asked.
+   Log takes only longs so this is in microseconds */
+static void print_buffer_attr(pa_stream *s) {
+    const pa_buffer_attr *l_SAttr = pa_stream_get_buffer_attr(s);
+
+    if (l_SAttr != NULL) {
+        asynclog_printf("print_buffer_attr: fragsize %ld us maxlength %ld us\n",
+                        (long)pa_bytes_to_usec(l_SAttr->fragsize, &m_iSs),
+                        (long)pa_bytes_to_usec(l_SAttr->maxlength, &m_iSs));
+    }
+}
+
 /* Reques for writing length data */
 static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
     pa_usec_t usec = 0;
     int neg = 0;
     int writecount = 0;
-    size_t readed;
+    int writeretval = 0;
+    size_t readed = 0;
+
+    if (m_lWakeups++ == 0) {
+        print_buffer_attr(s);
+    }
 
     /* Pulseaudio recording idea is like this:
            1# You peek datas pointer
-           2# Yoy get how much data there is (it should be as much length is
+           2# Yoy get how much data there is (there can be more than one fragment)
            3# After you have done what you want you drop package (There is no pointer anymore after drop)
     */
-    if (pa_stream_peek(s, &m_ptrSampleData, &readed) < 0) {
-        fprintf(stderr, "stream_request_cb: Reading from device failed!");
-        m_iLoop = 1;
-        return;
-    }
+    while (pa_stream_readable_size(s) > 0) {
+        if (pa_stream_peek(s, &m_ptrSampleData, &readed) < 0) {
+            asynclog_printf("stream_request_cb: Reading from device failed!\n");
+            m_iLoop = 1;
+            return;
+        }
 
-    /* Read with libsndfile */
-    writecount = sf_write_float(m_SOutFile, m_ptrSampleData, readed / 4);
+        /* Nothing after all. Nothing to drop either */
+        if (readed == 0) {
+            break;
+        }
 
-    pa_stream_drop(s);
+        if (m_ptrSampleData == NULL) {
+            m_lHoles++;
+            writeretval = process_hole(readed / sizeof(float) / m_SSfinfo.channels);
+        } else {
+            writeretval = process_block(m_ptrSampleData, readed / sizeof(float) / m_SSfinfo.channels);
+        }
 
-    m_ptrSampleData = NULL;
+        writecount += readed / sizeof(float);
+        pa_stream_drop(s);
+        m_ptrSampleData = NULL;
 
-    /* Measure m_iLatency */
-    pa_stream_get_latency(s, &usec, &neg);
+        /* Stop recording if we can't write */
+        if (writeretval < 0) {
+            asynclog_printf("stream_request_cb: Can't write to file!\n");
+            m_iLoop = 1;
+            return;
+        }
+    }
 
-    /* Print some statistics */
-    printf("stream_request_cb: Latency %8d us request: %8ld/%8ld readed %8d\r", (int)usec, length, readed, writecount);
+    /* Measure latency. There is no timing info before first update */
+    if (pa_stream_get_latency(s, &usec, &neg) == 0 && !neg) {
+        m_dLatencySum += usec;
+        m_lLatencyCount++;
 
-    pa_stream_drop(s);
+        if ((long)usec > m_lLatencyMax) {
+            m_lLatencyMax = usec;
+        }
+    }
+
+    /* Print some statistics (printed later by log thread) */
+    asynclog_printf("stream_request_cb: Latency %8ld us request: %8ld written %8ld\r", (long)usec, (long)length, (long)writecount);
 }
 
-/* There is not enough bytes to flow so we call underflow */
-static void stream_underflow_cb(pa_stream *s, void *userdata) {
-    /* We increase the m_iLatency by 50% if we get 6 m_SUnderflows and m_iLatency is under 2s
-     This is very useful for over the network record that can't handle low latencies */
-    printf("stream_underflow_cb: underflow\n");
-    m_SUnderflows++;
-
-    if (m_SUnderflows >= 6 && m_iLatency < 2000000) {
-        m_iLatency = (m_iLatency * 3) / 2;
-        m_SBufAttr.maxlength = pa_usec_to_bytes(m_iLatency, &m_iSs);
-        m_SBufAttr.tlength = pa_usec_to_bytes(m_iLatency, &m_iSs);
+/* Server buffer was full and samples were thrown away */
+static void stream_overflow_cb(pa_stream *s, void *userdata) {
+    /* We make server buffer 50% bigger if we get 6 overflows and it is
+       under 10s. Fragment is latency target so it is not touched: bigger
+       maxlength only gives more room when reading is late. This is very
+       useful for over the network record */
+    asynclog_printf("stream_overflow_cb: overflow\n");
+    m_SOverflows++;
+    m_lOverflowsTotal++;
+
+    if (m_SOverflows >= 6 && m_lMaxlength < 10000000) {
+        m_lMaxlength = (m_lMaxlength * 3) / 2;
+        m_SBufAttr.maxlength = pa_usec_to_bytes(m_lMaxlength, &m_iSs);
+
+        /* Server must have room for at least two fragments */
+        if (m_SBufAttr.maxlength < 2 * m_SBufAttr.fragsize) {
+            m_SBufAttr.maxlength = 2 * m_SBufAttr.fragsize;
+        }
+
         pa_stream_set_buffer_attr(s, &m_SBufAttr, NULL, NULL);
-        m_SUnderflows = 0;
-        printf("stream_underflow_cb: Latency increased to %d\n", m_iLatency);
+        m_SOverflows = 0;
+        asynclog_printf("stream_overflow_cb: Server buffer increased to %ld us\n", m_lMaxlength);
+    }
+}
+
+/* Server changed buffer (moved to other source or after our request) */
+static void stream_buffer_attr_cb(pa_stream *s, void *userdata) {
+    print_buffer_attr(s);
+}
+
+/* Find profile by name. NULL if there is none */
+static const capture_profile *find_profile(const char *name) {
+    int i = 0;
+
+    for (i = 0; m_SProfiles[i].name != NULL; i++) {
+        if (!strcmp(m_SProfiles[i].name, name)) {
+            return &m_SProfiles[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Close WAV or finish FLAC encoding */
+static void close_output(void) {
+    /* Running dump gets what was captured */
+    if (m_iRing) {
+        if (capturering_close(&m_SRing) < 0) {
+            fprintf(stderr, "close_output: Can't write dump!\n");
+        }
+
+        capturering_print_stats(&m_SRing);
+        m_iRing = 0;
     }
+
+    /* Gate still has last window to give */
+    if (m_iGate) {
+        if (silencegate_close(&m_SGate) < 0) {
+            fprintf(stderr, "close_output: Can't write segment list!\n");
+        }
+
+        silencegate_print_stats(&m_SGate);
+        m_iGate = 0;
+    }
+
+    if (m_iFlac) {
+        if (flacpool_close(&m_SFlac) < 0) {
+            fprintf(stderr, "close_output: Can't write FLAC file!\n");
+        }
+
+        flacpool_print_stats(&m_SFlac);
+        m_iFlac = 0;
+    } else if (m_SOutFile != NULL) {
+        sf_close(m_SOutFile);
+    }
+
+    m_SOutFile = NULL;
 }
 
 /* Handle termination with CTRL-C */
 static void handler(int sig, siginfo_t *si, void *unused) {
-    printf("Got SIGSEGV at address: 0x%lx\n", (long) si->si_addr);
+    asynclog_signal_printf("handler: Got signal %ld\n", (long)sig);
     m_iLoop = 1;
 }
 
+/* Simulated device gives fragment like read callback of stream */
+static int simdevCb(void *buffer, long frames, void *userdata) {
+    m_lWakeups++;
+
+    if (process_block((const float *)buffer, frames) < 0) {
+        asynclog_printf("simdevCb: Can't write to file!\n");
+        m_iLoop = 1;
+    }
+
+    return m_iLoop;
+}
+
+/* Record with simulated device until CTRL-C or end of input */
+static int record_simulated(void) {
+    simdev l_SSim;
+    struct timespec l_STick = { 0, 20000000 };
+
+    /* Fragment of profile is period of device */
+    if (simdev_open_period(&l_SSim, m_SSfinfo.samplerate, m_SSfinfo.channels, sizeof(float), SIMDEV_CAPTURE,
+                           (long)((double)m_lFragsize * m_SSfinfo.samplerate / 1000000.0)) < 0) {
+        return -1;
+    }
+
+    if (simdev_start(&l_SSim, simdevCb, NULL) < 0) {
+        fprintf(stderr, "record_simulated: Can't start simulated device\n");
+        simdev_close(&l_SSim);
+        return -1;
+    }
+
+    /* Callback runs in device thread. Gate events go through its ring */
+    while (!simdev_finished(&l_SSim)) {
+        nanosleep(&l_STick, NULL);
+
+        if (m_iGate) {
+            silencegate_poll(&m_SGate);
+        }
+    }
+
+    simdev_close(&l_SSim);
+    simdev_print_stats(&l_SSim);
+    printf("record_simulated: Callbacks %ld (%.1f/s)\n", m_lWakeups,
+           l_SSim.frames > 0 ? m_lWakeups / ((double)l_SSim.frames / m_SSfinfo.samplerate) : 0.0);
+    return 0;
+}
+
+/* SIGUSR1 dumps capture ring */
+static void trigger_handler(int sig, siginfo_t *si, void *unused) {
+    asynclog_signal_printf("trigger_handler: Dump triggered\n");
+    capturering_trigger(&m_SRing);
+}
+
 int main(int argc, char *argv[]) {
     pa_mainloop *l_SPaml = NULL;
     pa_mainloop_api *l_SPamlapi = NULL;
@@ -284,6 +569,70 @@ int main(int argc, char *argv[]) {
     int l_iRetval = 0;
     struct sigaction l_Ssa;
     pa_channel_map l_SChannelMap;
+    struct timespec l_SStart;
+    struct timespec l_SEnd;
+    double l_dSeconds = 0.0;
+    int l_iOpt = 0;
+    int l_iGateMode = SILENCEGATE_SKIP;
+    const char *l_strGate = NULL;
+    const char *l_strPath = NULL;
+    float l_fGateDb = 0.0f;
+    long l_lPrerollMs = 0;
+    long l_lHangoverMs = 0;
+    double l_dRingMinutes = 0.0;
+    double l_dPostSeconds = 60.0;
+    float l_fTriggerDb = 1.0f;
+    const char *l_strFifo = NULL;
+    const capture_profile *l_SProfile = find_profile("balanced");
+    const pa_buffer_attr *l_SGot = NULL;
+
+    while ((l_iOpt = getopt(argc, argv, "p:g:km:a:l:f:")) != -1) {
+        switch (l_iOpt) {
+            case 'p':
+                if ((l_SProfile = find_profile(optarg)) == NULL) {
+                    fprintf(stderr, "main: Unknown profile %s (low, balanced or throughput)\n", optarg);
+                    return 1;
+                }
+
+                break;
+
+            case 'g':
+                l_strGate = optarg;
+                break;
+
+            case 'k':
+                l_iGateMode = SILENCEGATE_MARK;
+                break;
+
+            case 'm':
+                l_dRingMinutes = atof(optarg);
+                break;
+
+            case 'a':
+                l_dPostSeconds = atof(optarg);
+                break;
+
+            case 'l':
+                l_fTriggerDb = atof(optarg);
+                break;
+
+            case 'f':
+                l_strFifo = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-p low|balanced|throughput] [-g dB[:preroll_ms:hangover_ms] [-k] | -m minutes [-a seconds] [-l dB] [-f fifo]] file\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || (l_strGate != NULL && silencegate_parse(l_strGate, &l_fGateDb, &l_lPrerollMs, &l_lHangoverMs) < 0)
+            || (l_strGate != NULL && l_dRingMinutes > 0.0)) {
+        fprintf(stderr, "Usage: %s [-p low|balanced|throughput] [-g dB[:preroll_ms:hangover_ms] [-k] | -m minutes [-a seconds] [-l dB] [-f fifo]] file\n", argv[0]);
+        return 1;
+    }
+
+    l_strPath = argv[optind];
 
     /*
       We use two channels
@@ -294,32 +643,111 @@ int main(int argc, char *argv[]) {
     m_SSfinfo.samplerate = 44100;
     m_SSfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
 
+    if (l_dRingMinutes > 0.0) {
+        /* Dumps are not in audio path so libsndfile can encode FLAC itself */
+        if (flacpool_wanted(l_strPath)) {
+            m_SSfinfo.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+        }
+
+        if (capturering_open(&m_SRing, l_strPath, &m_SSfinfo, l_dRingMinutes * 60.0, l_dPostSeconds, l_fTriggerDb) < 0) {
+            fprintf(stderr, "main: Not able to allocate %.1f minute capture ring.\n", l_dRingMinutes);
+            return 1;
+        }
+
+        m_iRing = 1;
+        capturering_print_info(&m_SRing);
+
+        if (l_strFifo != NULL && capturering_fifo(&m_SRing, l_strFifo) < 0) {
+            fprintf(stderr, "main: Can't open command FIFO %s.\n", l_strFifo);
+            close_output();
+            return 1;
+        }
+
+    } else if (flacpool_wanted(l_strPath)) {
+        if (flacpool_open(&m_SFlac, l_strPath, m_SSfinfo.samplerate, m_SSfinfo.channels, 0) < 0) {
+            fprintf(stderr, "main: Not able to open FLAC output file %s.\n", l_strPath);
+            return 1;
+        }
+
+        m_iFlac = 1;
+
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (m_SOutFile = sf_open(argv[1], SFM_WRITE, &m_SSfinfo))) {
-        fprintf (stderr, "main: Not able to open output file %s.\n", argv[1]) ;
+    } else if (! (m_SOutFile = sf_open(l_strPath, SFM_WRITE, &m_SSfinfo))) {
+        fprintf (stderr, "main: Not able to open output file %s.\n", l_strPath) ;
         sf_perror (NULL) ;
         return  1 ;
     }
 
-    printf("main: Opened file: (%s)\n", argv[1]);
+    printf(m_iRing ? "main: Dumps go to: (%s)\n" : "main: Opened file: (%s)\n", l_strPath);
+
+    if (l_strGate != NULL) {
+        if (silencegate_open(&m_SGate, l_strPath, m_SSfinfo.samplerate, m_SSfinfo.channels, l_fGateDb,
+                             l_lPrerollMs, l_lHangoverMs, l_iGateMode, write_output, NULL) < 0) {
+            fprintf(stderr, "main: Can't open segment list %s.segments!\n", l_strPath);
+            close_output();
+            return 1;
+        }
+
+        m_iGate = 1;
+        printf("main: Silence gate at %.1f dB (pre-roll %ld ms, hangover %ld ms)\n", l_fGateDb, l_lPrerollMs, l_lHangoverMs);
+    }
+
+    if (meter_open(&m_SMeter, m_SSfinfo.samplerate, m_SSfinfo.channels) < 0) {
+        fprintf(stderr, "main: Can't make level meter. Recording without it.\n");
+    }
+
+    meter_print_path(&m_SMeter);
+
+    if (spectrum_wanted()) {
+        if (spectrum_open(&m_SSpectrum, m_SSfinfo.samplerate, m_SSfinfo.channels, 0, getenv("SPECTRUM")) < 0) {
+            fprintf(stderr, "main: Can't make spectrum. Recording without it.\n");
+        } else {
+            m_iSpectrum = 1;
+            spectrum_print_path(&m_SSpectrum);
+        }
+    }
+
+    if (asynclog_start() < 0) {
+        fprintf(stderr, "main: Can't start log thread!\n");
+        close_output();
+        return -1;
+    }
 
     l_Ssa.sa_flags = SA_SIGINFO;
     sigemptyset(&l_Ssa.sa_mask);
+    /* Handlers log to same signal ring so they must not interrupt each other */
+    sigaddset(&l_Ssa.sa_mask, SIGINT);
+    sigaddset(&l_Ssa.sa_mask, SIGHUP);
+    sigaddset(&l_Ssa.sa_mask, SIGUSR1);
     l_Ssa.sa_sigaction = handler;
 
     if (sigaction(SIGINT, &l_Ssa, NULL) == -1) {
         fprintf(stderr, "main: Can't set SIGINT handler!\n");
-        sf_close(m_SOutFile);
+        close_output();
         return -1;
     }
 
     if (sigaction(SIGHUP, &l_Ssa, NULL) == -1) {
         fprintf(stderr, "main: Can't set SIGHUP handler!\n");
-        sf_close(m_SOutFile);
+        close_output();
         return -1;
     }
 
+    l_Ssa.sa_sigaction = trigger_handler;
+
+    if (m_iRing && sigaction(SIGUSR1, &l_Ssa, NULL) == -1) {
+        fprintf(stderr, "main: Can't set SIGUSR1 handler!\n");
+        close_output();
+        return -1;
+    }
+
+    if (simdev_wanted()) {
+        m_lFragsize = l_SProfile->fragsize_us;
+        l_iRetval = record_simulated();
+        goto exit;
+    }
+
     /* Create a mainloop API and connection to the default server */
     l_SPaml = pa_mainloop_new();
     l_SPamlapi = pa_mainloop_get_api(l_SPaml);
@@ -417,16 +845,22 @@ int main(int argc, char *argv[]) {
 
     /* Callback for writing */
     pa_stream_set_read_callback(l_SRecordstream, stream_request_cb, m_SOutFile);
-    /* Callback for underflow */
-    pa_stream_set_underflow_callback(l_SRecordstream, stream_underflow_cb, NULL);
+    /* Callback for overflow. Underflow never happens in recording */
+    pa_stream_set_overflow_callback(l_SRecordstream, stream_overflow_cb, NULL);
+    pa_stream_set_buffer_attr_callback(l_SRecordstream, stream_buffer_attr_cb, NULL);
     /* Stream has started */
     pa_stream_set_started_callback(l_SRecordstream, stream_notify_cb, NULL);
 
-    m_SBufAttr.fragsize = (uint32_t) - 1;
-    m_SBufAttr.maxlength = pa_usec_to_bytes(m_iLatency, &m_iSs);
-    m_SBufAttr.minreq = pa_usec_to_bytes(0, &m_iSs);
+    /* Only fragsize and maxlength are used with recording */
+    m_lFragsize = l_SProfile->fragsize_us;
+    m_lMaxlength = l_SProfile->maxlength_us;
+    m_SBufAttr.fragsize = pa_usec_to_bytes(m_lFragsize, &m_iSs);
+    m_SBufAttr.maxlength = pa_usec_to_bytes(m_lMaxlength, &m_iSs);
+    m_SBufAttr.minreq = (uint32_t) - 1;
     m_SBufAttr.prebuf = (uint32_t) - 1;
-    m_SBufAttr.tlength = pa_usec_to_bytes(m_iLatency, &m_iSs);
+    m_SBufAttr.tlength = (uint32_t) - 1;
+    printf("main: Profile %s: asking fragsize %.1f ms maxlength %.1f ms\n", l_SProfile->name,
+           l_SProfile->fragsize_us / 1000.0, l_SProfile->maxlength_us / 1000.0);
 
     /* Connect record to default input */
     r = pa_stream_connect_record(l_SRecordstream, NULL, &m_SBufAttr,
@@ -450,18 +884,57 @@ int main(int argc, char *argv[]) {
     /* Iterate the main m_iLoop and go again.  The second argument is whether
       or not the iteration should block until something is ready to be
       done.  Set it to zero for non-blocking. */
+    clock_gettime(CLOCK_MONOTONIC, &l_SStart);
+
     while (!m_iLoop) {
         pa_mainloop_iterate(l_SPaml, 1, NULL);
+
+        /* Callback runs in this thread too so this is always safe */
+        if (m_iGate) {
+            silencegate_poll(&m_SGate);
+        }
+    }
+
+    /* Same statistics as libsndfile_pulse_threaded_rec prints */
+    clock_gettime(CLOCK_MONOTONIC, &l_SEnd);
+    l_dSeconds = (l_SEnd.tv_sec - l_SStart.tv_sec) + (l_SEnd.tv_nsec - l_SStart.tv_nsec) / 1e9;
+    printf("\nmain: Recorded %.2f seconds\n", l_dSeconds);
+    printf("main: Pulseaudio callbacks %ld (%.1f/s)\n", m_lWakeups, m_lWakeups / l_dSeconds);
+
+    if ((l_SGot = pa_stream_get_buffer_attr(l_SRecordstream)) != NULL) {
+        printf("main: Profile %s got fragsize %.1f ms (asked %.1f ms)\n", l_SProfile->name,
+               pa_bytes_to_usec(l_SGot->fragsize, &m_iSs) / 1000.0, l_SProfile->fragsize_us / 1000.0);
     }
 
+    if (m_lLatencyCount > 0) {
+        printf("main: Latency average %.1f ms max %.1f ms\n", m_dLatencySum / m_lLatencyCount / 1000.0, m_lLatencyMax / 1000.0);
+    }
+
+    printf("main: Overflows %ld holes %ld\n", m_lOverflowsTotal, m_lHoles);
+
 exit:
     /* clean up and disconnect */
+    asynclog_stop();
     printf("\nExit and clean\n");
-    sf_close(m_SOutFile);
-    m_SOutFile = NULL;
-    pa_context_disconnect(l_SPactx);
-    pa_context_unref(l_SPactx);
-    pa_mainloop_free(l_SPaml);
+    meter_print_stats(&m_SMeter);
+    meter_close(&m_SMeter);
+
+    if (m_iSpectrum) {
+        spectrum_print_stats(&m_SSpectrum);
+        spectrum_close(&m_SSpectrum);
+    }
+
+    close_output();
+
+    if (l_SPactx != NULL) {
+        pa_context_disconnect(l_SPactx);
+        pa_context_unref(l_SPactx);
+    }
+
+    if (l_SPaml != NULL) {
+        pa_mainloop_free(l_SPaml);
+    }
+
     return l_iRetval;
 }
 
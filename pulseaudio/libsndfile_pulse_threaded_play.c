@@ -0,0 +1,726 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Same as libsndfile_pulse_play.c but with pa_threaded_mainloop.
+ *
+ * Pulseaudio runs its own I/O thread. That thread only copies samples out
+ * of a lock-free ring buffer in the write callback. All libsndfile reading
+ * is done in main thread which sleeps on a semaphore until the callback
+ * tells that ring has drained under half. In the end some statistics are
+ * printed so this can be compared to the libsndfile_pulse_play.
+ *
+ * Player can be controlled by typing commands to stdin:
+ *   s 12.5   seek to 12.5 seconds
+ *   f 10     forward 10 seconds
+ *   b 10     backward 10 seconds
+ *   n / p    next / previous cue point (every 10 seconds)
+ *   q        quit
+ * Seek throws away what is in ring and in server buffer (pa_stream_flush)
+ * and refills from new position. For compressed files first samples of
+ * every cue point come from seek index (see common/seekindex.h) which is
+ * built in background on first open. Time from command to first write and
+ * to audible output is logged after every seek.
+ *
+ * Input can also be a stream: '-' is stdin, 'fd:N' inherited descriptor
+ * and FIFO is noticed automatically. Stream is read through
+ * sf_open_virtual() and jitter buffer (see common/streaminput.h). Options:
+ *   -j ms                    jitter buffer size in milliseconds (default 200)
+ *   -r rate:channels:format  headerless PCM (format s8, s16, s24, s32 or float)
+ * Streams can't seek so commands are not read then.
+ *
+ * If file has been measured with tools/r128scan its loudness gain (from
+ * 'file.r128') is applied to output (see common/loudness.h).
+ *
+ * Resources used as study for this example are
+ * http://www.freedesktop.org/wiki/Software/PulseAudio/Documentation/Developer/Clients/Samples/AsyncPlayback/
+ * https://freedesktop.org/software/pulseaudio/doxygen/threaded_mainloop.html
+ *
+ * You need:
+ * Pulseaudio development file (headers and libraries) http://www.freedesktop.org/wiki/Software/PulseAudio/ at least version 3.0
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs libpulse) -lm -lsndfile -lpthread libsndfile_pulse_threaded_play.c -std=c11 -Wall -o libsndfile_pulse_threaded_play
+ *
+ * Run with ./libsndfile_pulse_threaded_play some.[wav/flac/aiff]
+ * or      producer | ./libsndfile_pulse_threaded_play -j 300 -r 44100:2:s16 -
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pulse/pulseaudio.h>
+#include <sndfile.h>
+
+#include "ringbuffer.h"
+#include "asynclog.h"
+#include "loudness.h"
+#include "seekindex.h"
+#include "streaminput.h"
+
+/* How many frames main thread reads from file at once */
+#define FILE_FRAMES_PER_READ 4096
+/* How many seconds of audio ring can hold */
+#define RING_SECONDS 2
+/* How many commands can wait */
+#define COMMAND_QUEUE 16
+/* Default jitter buffer for streams in milliseconds */
+#define STREAM_JITTER_MS 200
+
+typedef struct player_command {
+    char type;
+    double seconds;
+} player_command;
+
+static int m_iLatency = 20000; /* start latency in micro seconds */
+static pa_buffer_attr m_SBufAttr;
+static pa_sample_spec m_SSs;
+static pa_threaded_mainloop *m_SPaml = NULL;
+static ringbuffer m_SRing;
+static sem_t m_SRefill;
+static float m_fFileBlock[FILE_FRAMES_PER_READ * PA_CHANNELS_MAX];
+SNDFILE *m_SInfile = NULL;
+SF_INFO m_SSfinfo;
+volatile sig_atomic_t m_iLoop = 0;
+
+static atomic_int m_iEof;
+static atomic_int m_iDraining;
+static atomic_long m_lWakeups;
+static atomic_long m_lUnderflows;
+static atomic_long m_lRingUnderruns;
+static long m_lFileWakeups = 0;
+
+static ringbuffer m_SCommands;
+static seekindex m_SIndex;
+static char m_strIndexPath[4096];
+static const char *m_strPath = NULL;
+static atomic_int m_iIndexReady;
+static atomic_int m_iSeekPending;
+static struct timespec m_SSeekStart;
+static streaminput m_SStream;
+static int m_iStream = 0;
+static float m_fGain = 1.0f;
+
+/* When context change state this called */
+void pa_state_cb(pa_context *c, void *userdata) {
+    pa_context_state_t l_iState;
+    int *l_iPaReady = userdata;
+    l_iState = pa_context_get_state(c);
+
+    switch  (l_iState) {
+        case PA_CONTEXT_FAILED:
+            printf("pa_state_cb: PA_CONTEXT_FAILED\n");
+            *l_iPaReady = 2;
+            break;
+
+        case PA_CONTEXT_TERMINATED:
+            printf("pa_state_cb: PA_CONTEXT_TERMINATED\n");
+            *l_iPaReady = 2;
+            break;
+
+        case PA_CONTEXT_READY:
+            printf("pa_state_cb: PA_CONTEXT_READY\n");
+            *l_iPaReady = 1;
+            break;
+
+        default:
+            break;
+    }
+
+    /* Wake up main thread which is waiting in pa_threaded_mainloop_wait() */
+    pa_threaded_mainloop_signal(m_SPaml, 0);
+}
+
+/* Anything happens call this */
+static void stream_notify_cb(pa_stream *s, void *userdata) {
+    char m_iSst[PA_SAMPLE_SPEC_SNPRINT_MAX];
+    char m_SCmt[PA_CHANNEL_MAP_SNPRINT_MAX];
+    printf("stream_notify_cb: Using sample spec '%s', channel map '%s'.\n",
+           pa_sample_spec_snprint(m_iSst, sizeof(m_iSst), pa_stream_get_sample_spec(s)),
+           pa_channel_map_snprint(m_SCmt, sizeof(m_SCmt), pa_stream_get_channel_map(s)));
+}
+
+/* Drain has been completed so every sample is played */
+static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
+    m_iLoop = 1;
+    sem_post(&m_SRefill);
+}
+
+/* Request for writing length data. This is run in Pulseaudio thread so
+   no file reading or printing here. Just copy from ring and ask more */
+static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
+    void *l_ptrBuffer = NULL;
+    size_t l_lBytes = length;
+    size_t l_lGot = 0;
+    pa_operation *l_SPaop = NULL;
+
+    atomic_fetch_add_explicit(&m_lWakeups, 1, memory_order_relaxed);
+
+    if (atomic_load(&m_iDraining)) {
+        return;
+    }
+
+    if (atomic_load(&m_iEof) && ringbuffer_read_space(&m_SRing) == 0) {
+        /* Everything is written. Let server play it out */
+        atomic_store(&m_iDraining, 1);
+        l_SPaop = pa_stream_drain(s, stream_drain_cb, NULL);
+
+        if (l_SPaop) {
+            pa_operation_unref(l_SPaop);
+        }
+
+        return;
+    }
+
+    /* Let Pulseaudio give us memory so there is no extra copy */
+    if (pa_stream_begin_write(s, &l_ptrBuffer, &l_lBytes) < 0 || l_ptrBuffer == NULL) {
+        return;
+    }
+
+    if (l_lBytes > length) {
+        l_lBytes = length;
+    }
+
+    l_lGot = ringbuffer_read(&m_SRing, l_ptrBuffer, l_lBytes);
+    loudness_apply((float *)l_ptrBuffer, l_lGot / sizeof(float), m_fGain);
+
+    if (l_lGot < l_lBytes) {
+        if (atomic_load(&m_iEof)) {
+            /* Last bytes of file */
+            l_lBytes = l_lGot;
+        } else {
+            /* Main thread did not keep up: fill with silence */
+            memset((char *)l_ptrBuffer + l_lGot, 0x00, l_lBytes - l_lGot);
+            atomic_fetch_add_explicit(&m_lRingUnderruns, 1, memory_order_relaxed);
+        }
+    }
+
+    if (pa_stream_write(s, l_ptrBuffer, l_lBytes, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+        pa_stream_cancel_write(s);
+    } else if (atomic_exchange(&m_iSeekPending, 0)) {
+        /* First samples from new position are now in server. They are
+           audible after stream latency */
+        struct timespec l_SNow;
+        pa_usec_t l_lLatency = 0;
+        int l_iNeg = 0;
+        long l_lWriteUs = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &l_SNow);
+        l_lWriteUs = (l_SNow.tv_sec - m_SSeekStart.tv_sec) * 1000000L + (l_SNow.tv_nsec - m_SSeekStart.tv_nsec) / 1000;
+
+        if (pa_stream_get_latency(s, &l_lLatency, &l_iNeg) < 0 || l_iNeg) {
+            l_lLatency = 0;
+        }
+
+        asynclog_printf("seek: first write after %ld us, audible after about %ld us\n",
+                        l_lWriteUs, l_lWriteUs + (long)l_lLatency);
+    }
+
+    /* Under half of the ring left so wake up file reader */
+    if (ringbuffer_read_space(&m_SRing) < m_SRing.size / 2) {
+        sem_post(&m_SRefill);
+    }
+}
+
+/* There is not enough bytes to flow so we call underflow */
+static void stream_underflow_cb(pa_stream *s, void *userdata) {
+    atomic_fetch_add_explicit(&m_lUnderflows, 1, memory_order_relaxed);
+}
+
+/* Load seek index or build it if there isn't one. Run in own thread
+   because building decodes a bit of every cue point */
+static void *index_thread(void *userdata) {
+    if (seekindex_load(&m_SIndex, m_strPath, m_strIndexPath, &m_SSfinfo) == 0) {
+        asynclog_printf("index_thread: Loaded seek index with %ld cue points\n", (long)m_SIndex.header.count);
+    } else if (seekindex_build(&m_SIndex, m_strPath) == 0) {
+        asynclog_printf("index_thread: Built seek index with %ld cue points\n", (long)m_SIndex.header.count);
+
+        if (seekindex_save(&m_SIndex, m_strIndexPath) < 0) {
+            asynclog_printf("index_thread: Can't save seek index (only in memory)\n");
+        }
+    } else {
+        return NULL;
+    }
+
+    atomic_store(&m_iIndexReady, 1);
+    return NULL;
+}
+
+/* Read commands from stdin and give them to main thread */
+static void *control_thread(void *userdata) {
+    char l_strLine[256];
+    player_command l_SCmd;
+
+    while (!m_iLoop && fgets(l_strLine, sizeof(l_strLine), stdin) != NULL) {
+        memset(&l_SCmd, 0x00, sizeof(player_command));
+
+        if (sscanf(l_strLine, " %c %lf", &l_SCmd.type, &l_SCmd.seconds) < 1) {
+            continue;
+        }
+
+        if (l_SCmd.type == 'q') {
+            m_iLoop = 1;
+        } else if (ringbuffer_write_space(&m_SCommands) >= sizeof(player_command)) {
+            ringbuffer_write(&m_SCommands, &l_SCmd, sizeof(player_command));
+        }
+
+        sem_post(&m_SRefill);
+    }
+
+    return NULL;
+}
+
+/* Handle termination with CTRL-C. Only async-signal-safe calls here */
+static void handler(int sig, siginfo_t *si, void *unused) {
+    m_iLoop = 1;
+    sem_post(&m_SRefill);
+}
+
+/* Read from file as long as there is space in ring */
+static void fill_ring(void) {
+    size_t l_lFrameSize = sizeof(float) * m_SSfinfo.channels;
+    sf_count_t l_lReadcount = 0;
+
+    while (!atomic_load(&m_iEof) && ringbuffer_write_space(&m_SRing) >= FILE_FRAMES_PER_READ * l_lFrameSize) {
+        l_lReadcount = sf_readf_float(m_SInfile, m_fFileBlock, FILE_FRAMES_PER_READ);
+
+        if (l_lReadcount > 0) {
+            ringbuffer_write(&m_SRing, m_fFileBlock, l_lReadcount * l_lFrameSize);
+        }
+
+        if (l_lReadcount < FILE_FRAMES_PER_READ) {
+            atomic_store(&m_iEof, 1);
+        }
+    }
+}
+
+/* Flush ring and server buffer and continue from frame */
+static void seek_to(pa_stream *s, sf_count_t frame) {
+    size_t l_lFrameSize = sizeof(float) * m_SSfinfo.channels;
+    sf_count_t l_lFrames = 0;
+    sf_count_t l_lNext = frame;
+    long l_lPoint = -1;
+    pa_operation *l_SPaop = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &m_SSeekStart);
+
+    if (atomic_load(&m_iDraining)) {
+        printf("seek_to: Already draining, can't seek\n");
+        return;
+    }
+
+    if (frame < 0) {
+        frame = 0;
+    }
+
+    if (m_SSfinfo.frames > 0 && frame >= m_SSfinfo.frames) {
+        frame = m_SSfinfo.frames - 1;
+    }
+
+    if (atomic_load(&m_iIndexReady)) {
+        l_lPoint = seekindex_find(&m_SIndex, frame);
+    }
+
+    if (l_lPoint >= 0) {
+        /* Cue point is cached so decoder seek can happen after these */
+        sf_count_t l_lOffset = frame - (sf_count_t)(l_lPoint * m_SIndex.header.interval);
+        l_lFrames = m_SIndex.header.head_frames - l_lOffset;
+        memcpy(m_fFileBlock, seekindex_head(&m_SIndex, l_lPoint) + l_lOffset * m_SSfinfo.channels, l_lFrames * l_lFrameSize);
+        l_lNext = frame + l_lFrames;
+    } else {
+        if (sf_seek(m_SInfile, frame, SEEK_SET) < 0) {
+            printf("seek_to: sf_seek to %ld failed\n", (long)frame);
+            return;
+        }
+
+        l_lFrames = sf_readf_float(m_SInfile, m_fFileBlock, FILE_FRAMES_PER_READ);
+
+        if (l_lFrames < 0) {
+            l_lFrames = 0;
+        }
+    }
+
+    /* Callback runs only when mainloop lock is held so while we hold it
+       we can act as consumer and throw away old samples */
+    pa_threaded_mainloop_lock(m_SPaml);
+    ringbuffer_flush(&m_SRing);
+    ringbuffer_write(&m_SRing, m_fFileBlock, l_lFrames * l_lFrameSize);
+    atomic_store(&m_iEof, 0);
+    atomic_store(&m_iSeekPending, 1);
+    l_SPaop = pa_stream_flush(s, NULL, NULL);
+
+    if (l_SPaop) {
+        pa_operation_unref(l_SPaop);
+    }
+
+    pa_threaded_mainloop_unlock(m_SPaml);
+
+    /* Cached head is already queued so slow decoder seek happens while
+       it plays. If seek fails only head is played */
+    if (l_lPoint >= 0 && sf_seek(m_SInfile, l_lNext, SEEK_SET) < 0) {
+        printf("seek_to: sf_seek to %ld failed\n", (long)l_lNext);
+        atomic_store(&m_iEof, 1);
+    }
+
+    printf("seek_to: %.3f seconds%s\n", (double)frame / m_SSfinfo.samplerate, l_lPoint >= 0 ? " (cached cue point)" : "");
+}
+
+/* Where playback is now: file position minus what is still in ring */
+static sf_count_t play_position(void) {
+    sf_count_t l_lFilePos = sf_seek(m_SInfile, 0, SEEK_CUR);
+    return l_lFilePos - (sf_count_t)(ringbuffer_read_space(&m_SRing) / (sizeof(float) * m_SSfinfo.channels));
+}
+
+static void handle_commands(pa_stream *s) {
+    player_command l_SCmd;
+    sf_count_t l_lNow = 0;
+    sf_count_t l_lInterval = (sf_count_t)m_SSfinfo.samplerate * SEEKINDEX_INTERVAL_SECONDS;
+    sf_count_t l_lRate = m_SSfinfo.samplerate;
+
+    while (ringbuffer_read_space(&m_SCommands) >= sizeof(player_command)) {
+        ringbuffer_read(&m_SCommands, &l_SCmd, sizeof(player_command));
+        l_lNow = play_position();
+
+        switch (l_SCmd.type) {
+            case 's':
+                seek_to(s, (sf_count_t)(l_SCmd.seconds * l_lRate));
+                break;
+
+            case 'f':
+                seek_to(s, l_lNow + (sf_count_t)(l_SCmd.seconds * l_lRate));
+                break;
+
+            case 'b':
+                seek_to(s, l_lNow - (sf_count_t)(l_SCmd.seconds * l_lRate));
+                break;
+
+            case 'n':
+                seek_to(s, (l_lNow / l_lInterval + 1) * l_lInterval);
+                break;
+
+            case 'p':
+                /* Go to start of current cue point if we are over one second in it */
+                if (l_lNow % l_lInterval > l_lRate || l_lNow < l_lInterval) {
+                    seek_to(s, l_lNow / l_lInterval * l_lInterval);
+                } else {
+                    seek_to(s, (l_lNow / l_lInterval - 1) * l_lInterval);
+                }
+                break;
+
+            default:
+                printf("handle_commands: Unknown command '%c'\n", l_SCmd.type);
+                break;
+        }
+    }
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec l_SNow;
+    clock_gettime(CLOCK_MONOTONIC, &l_SNow);
+    return (l_SNow.tv_sec - start->tv_sec) + (l_SNow.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    pa_mainloop_api *l_SPamlapi = NULL;
+    pa_context *l_SPactx = NULL;
+    pa_stream *l_SPlaystream = NULL;
+    int r = 0;
+    int l_iPaReady = 0;
+    int l_iRetval = 0;
+    double l_dSeconds = 0.0;
+    struct sigaction l_SSa;
+    struct timespec l_SStart;
+    pthread_t l_SIndexThread;
+    pthread_t l_SControlThread;
+    int l_iIndexThread = 0;
+    int l_iOpt = 0;
+    int l_iJitterMs = STREAM_JITTER_MS;
+    const char *l_strRaw = NULL;
+    const char *l_strPath = NULL;
+    struct stat l_SStat;
+
+    while ((l_iOpt = getopt(argc, argv, "j:r:")) != -1) {
+        switch (l_iOpt) {
+            case 'j':
+                l_iJitterMs = atoi(optarg);
+                break;
+
+            case 'r':
+                l_strRaw = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-j jitter_ms] [-r rate:channels:format] file|-|fd:N|fifo\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-j jitter_ms] [-r rate:channels:format] file|-|fd:N|fifo\n", argv[0]);
+        return 1;
+    }
+
+    l_strPath = argv[optind];
+    memset(&m_SSfinfo, 0x00, sizeof(SF_INFO));
+
+    if (l_strRaw != NULL && streaminput_parse_raw(l_strRaw, &m_SSfinfo) < 0) {
+        fprintf(stderr, "main: Bad raw format '%s'\n", l_strRaw);
+        return 1;
+    }
+
+    m_iStream = !strcmp(l_strPath, "-") || !strncmp(l_strPath, "fd:", 3)
+                || (stat(l_strPath, &l_SStat) == 0 && S_ISFIFO(l_SStat.st_mode)) || l_strRaw != NULL;
+
+    /* Open file. Because this is just a example we asume
+      What you are doing and give file first argument */
+    if (m_iStream) {
+        m_SInfile = streaminput_open(&m_SStream, l_strPath, &m_SSfinfo, l_iJitterMs, &m_iLoop);
+    } else {
+        m_SInfile = sf_open(l_strPath, SFM_READ, &m_SSfinfo);
+    }
+
+    if (! m_SInfile) {
+        fprintf(stderr, "main: Not able to open input %s.\n", l_strPath) ;
+        sf_perror (NULL) ;
+
+        if (m_iStream) {
+            streaminput_close(&m_SStream);
+        }
+
+        return  1 ;
+    }
+
+    printf("main: Opened %s: (%s)\n", m_iStream ? "stream" : "file", l_strPath);
+    printf("main: We have samplerate: %5d and channels %2d\n", m_SSfinfo.samplerate, m_SSfinfo.channels);
+
+    if (!m_iStream) {
+        m_fGain = loudness_gain_load(l_strPath);
+    }
+
+    if (m_SSfinfo.channels > (int)PA_CHANNELS_MAX) {
+        fprintf(stderr, "main: Too many channels (%d)\n", m_SSfinfo.channels);
+        sf_close(m_SInfile);
+        return 1;
+    }
+
+    if (ringbuffer_init(&m_SRing, (size_t)m_SSfinfo.samplerate * m_SSfinfo.channels * sizeof(float) * RING_SECONDS) < 0) {
+        fprintf(stderr, "main: Can't allocate ring buffer\n");
+        sf_close(m_SInfile);
+        return 1;
+    }
+
+    if (ringbuffer_init(&m_SCommands, COMMAND_QUEUE * sizeof(player_command)) < 0 || asynclog_start() < 0) {
+        fprintf(stderr, "main: Can't allocate command queue or start log thread\n");
+        sf_close(m_SInfile);
+        return 1;
+    }
+
+    sem_init(&m_SRefill, 0, 0);
+    atomic_init(&m_iIndexReady, 0);
+    atomic_init(&m_iSeekPending, 0);
+    atomic_init(&m_iEof, 0);
+    atomic_init(&m_iDraining, 0);
+    atomic_init(&m_lWakeups, 0);
+    atomic_init(&m_lUnderflows, 0);
+    atomic_init(&m_lRingUnderruns, 0);
+
+    l_SSa.sa_flags = SA_SIGINFO;
+    sigemptyset(&l_SSa.sa_mask);
+    l_SSa.sa_sigaction = handler;
+
+    if (sigaction(SIGINT, &l_SSa, NULL) == -1) {
+        fprintf(stderr, "main: Can't set SIGINT handler!\n");
+        sf_close(m_SInfile);
+        return -1;
+    }
+
+    if (sigaction(SIGHUP, &l_SSa, NULL) == -1) {
+        fprintf(stderr, "main: Can't set SIGHUP handler!\n");
+        sf_close(m_SInfile);
+        return -1;
+    }
+
+    /* Compressed files get seek index in background */
+    m_strPath = l_strPath;
+    snprintf(m_strIndexPath, sizeof(m_strIndexPath), "%s.seekidx", l_strPath);
+
+    if (!m_iStream && seekindex_needed(&m_SSfinfo) && m_SSfinfo.seekable) {
+        l_iIndexThread = pthread_create(&l_SIndexThread, NULL, index_thread, NULL) == 0;
+    }
+
+    /* Fill whole ring before anything is connected */
+    fill_ring();
+
+    /* Create a threaded mainloop API and connection to the default server */
+    m_SPaml = pa_threaded_mainloop_new();
+    l_SPamlapi = pa_threaded_mainloop_get_api(m_SPaml);
+
+    l_SPactx = pa_context_new(l_SPamlapi, "Simple example Pulseaudio threaded playback application");
+
+    /* Define what callback is called in state change */
+    pa_context_set_state_callback(l_SPactx, pa_state_cb, &l_iPaReady);
+
+    /* Everything that touches Pulseaudio objects must hold the mainloop lock */
+    pa_threaded_mainloop_lock(m_SPaml);
+
+    if (pa_threaded_mainloop_start(m_SPaml) < 0) {
+        fprintf(stderr, "main: pa_threaded_mainloop_start failed\n");
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    pa_context_connect(l_SPactx, NULL, 0, NULL);
+
+    /* We can't do anything until PA is ready, so just wait for signal from
+      pa_state_cb */
+    while (l_iPaReady == 0) {
+        pa_threaded_mainloop_wait(m_SPaml);
+    }
+
+    if (l_iPaReady == 2) {
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    m_SSs.rate = m_SSfinfo.samplerate;
+    m_SSs.channels = m_SSfinfo.channels;
+    m_SSs.format = PA_SAMPLE_FLOAT32LE;
+
+    l_SPlaystream = pa_stream_new(l_SPactx, "Playback", &m_SSs, NULL);
+
+    if (!l_SPlaystream) {
+        fprintf(stderr, "main: pa_stream_new failed\n");
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    /* Callback for writing */
+    pa_stream_set_write_callback(l_SPlaystream, stream_request_cb, NULL);
+    /* Callback for underflow */
+    pa_stream_set_underflow_callback(l_SPlaystream, stream_underflow_cb, NULL);
+    /* Stream has started */
+    pa_stream_set_started_callback(l_SPlaystream, stream_notify_cb, NULL);
+
+    m_SBufAttr.fragsize = (uint32_t) - 1;
+    m_SBufAttr.maxlength = pa_usec_to_bytes(m_iLatency, &m_SSs);
+    m_SBufAttr.minreq = pa_usec_to_bytes(0, &m_SSs);
+    m_SBufAttr.prebuf = (uint32_t) - 1;
+    m_SBufAttr.tlength = pa_usec_to_bytes(m_iLatency, &m_SSs);
+
+    /* Connect playback to default output */
+    r = pa_stream_connect_playback(l_SPlaystream, NULL, &m_SBufAttr,
+                                   PA_STREAM_INTERPOLATE_TIMING
+                                   | PA_STREAM_ADJUST_LATENCY
+                                   | PA_STREAM_AUTO_TIMING_UPDATE, NULL, NULL);
+
+    if (r < 0) {
+        printf("main: Can't connect to server. Trying with another parameters\n");
+        /* Old pulse audio servers don't like the ADJUST_LATENCY flag, so retry without that */
+        r = pa_stream_connect_playback(l_SPlaystream, NULL, &m_SBufAttr,
+                                       PA_STREAM_INTERPOLATE_TIMING |
+                                       PA_STREAM_AUTO_TIMING_UPDATE, NULL, NULL);
+    }
+
+    pa_threaded_mainloop_unlock(m_SPaml);
+
+    if (r < 0) {
+        printf("main: pa_stream_connect_playback failed\n");
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &l_SStart);
+
+    if (!m_iStream && m_SSfinfo.seekable && pthread_create(&l_SControlThread, NULL, control_thread, NULL) == 0) {
+        /* It sits in fgets() so it's not joined */
+        pthread_detach(l_SControlThread);
+        printf("main: Commands: s <sec> (seek), f <sec> (forward), b <sec> (backward), n/p (next/previous cue), q (quit)\n");
+    }
+
+    /* Main thread is the file reader. Sleep until Pulseaudio thread
+      has eaten half of the ring and then fill it again */
+    while (!m_iLoop) {
+        if (sem_wait(&m_SRefill) < 0 && errno != EINTR) {
+            break;
+        }
+
+        m_lFileWakeups++;
+        handle_commands(l_SPlaystream);
+        fill_ring();
+    }
+
+    l_dSeconds = elapsed_seconds(&l_SStart);
+
+    printf("\nmain: Played %.2f seconds\n", l_dSeconds);
+    printf("main: Pulseaudio callbacks %ld (%.1f/s) file reader wakeups %ld (%.1f/s)\n",
+           atomic_load(&m_lWakeups), atomic_load(&m_lWakeups) / l_dSeconds,
+           m_lFileWakeups, m_lFileWakeups / l_dSeconds);
+    printf("main: Server underflows %ld ring underruns %ld\n",
+           atomic_load(&m_lUnderflows), atomic_load(&m_lRingUnderruns));
+
+exit:
+    /* clean up and disconnect */
+    printf("\nExit and clean\n");
+
+    pa_threaded_mainloop_lock(m_SPaml);
+
+    if (l_SPlaystream) {
+        pa_stream_disconnect(l_SPlaystream);
+        pa_stream_unref(l_SPlaystream);
+    }
+
+    pa_context_disconnect(l_SPactx);
+    pa_context_unref(l_SPactx);
+    pa_threaded_mainloop_unlock(m_SPaml);
+    pa_threaded_mainloop_stop(m_SPaml);
+    pa_threaded_mainloop_free(m_SPaml);
+
+    if (l_iIndexThread) {
+        pthread_join(l_SIndexThread, NULL);
+    }
+
+    asynclog_stop();
+    seekindex_free(&m_SIndex);
+    sf_close(m_SInfile);
+    m_SInfile = NULL;
+
+    if (m_iStream) {
+        streaminput_print_stats(&m_SStream);
+        streaminput_close(&m_SStream);
+    }
+    ringbuffer_free(&m_SRing);
+    sem_destroy(&m_SRefill);
+    return l_iRetval;
+}
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Same as libsndfile_pulse_rec.c but with pa_threaded_mainloop.
+ *
+ * Read callback runs in Pulseaudio thread and only copies captured samples
+ * to a lock-free ring buffer. Main thread sleeps on a semaphore and writes
+ * full blocks to the file with libsndfile. When stopped with CTRL-C whatever
+ * is left in the ring is written before file is closed.
+ *
+ * Resources used as study for this example are
+ * http://www.freedesktop.org/wiki/Software/PulseAudio/Documentation/Developer/Clients/Samples/AsyncPlayback/
+ * https://freedesktop.org/software/pulseaudio/doxygen/threaded_mainloop.html
+ *
+ * You need:
+ * Pulseaudio development file (headers and libraries) http://www.freedesktop.org/wiki/Software/PulseAudio/ at least version 3.0
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs libpulse) -lm -lsndfile -lpthread libsndfile_pulse_threaded_rec.c -std=c11 -Wall -o libsndfile_pulse_threaded_rec
+ *
+ * Run with ./libsndfile_pulse_threaded_rec some.wav (Warning! Will overwrite without warning!)
+ *
+ * If file name ends with '.flac' blocks are encoded to FLAC on a thread
+ * pool (see common/flacpool.h) so writer thread never waits for compression.
+ *
+ * With SIMDEV set in environment there is no server connection. Simulated
+ * device thread fills the ring instead of Pulseaudio thread and
+ * SIMDEV_INPUT can feed it from raw float file (see common/simdev.h).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pulse/pulseaudio.h>
+#include <sndfile.h>
+
+#include "flacpool.h"
+#include "ringbuffer.h"
+#include "simdev.h"
+
+/* How many frames main thread writes to file at once */
+#define FILE_FRAMES_PER_WRITE 4096
+/* How many seconds of audio ring can hold */
+#define RING_SECONDS 2
+
+static int m_iLatency = 20000;
+static pa_buffer_attr m_SBufAttr;
+static pa_sample_spec m_SSs;
+static pa_threaded_mainloop *m_SPaml = NULL;
+static ringbuffer m_SRing;
+static sem_t m_SDrain;
+static float m_fFileBlock[FILE_FRAMES_PER_WRITE * 2];
+SNDFILE *m_SOutFile = NULL;
+SF_INFO m_SSfinfo;
+static flacpool m_SFlac;
+static int m_iFlac = 0;
+volatile sig_atomic_t m_iLoop = 0;
+
+static atomic_long m_lWakeups;
+static atomic_long m_lRingOverruns;
+static long m_lFileWakeups = 0;
+
+/* When context change state this called */
+void pa_state_cb(pa_context *c, void *userdata) {
+    pa_context_state_t l_iState;
+    int *l_iPaReady = userdata;
+    l_iState = pa_context_get_state(c);
+
+    switch  (l_iState) {
+        case PA_CONTEXT_FAILED:
+            printf("pa_state_cb: PA_CONTEXT_FAILED\n");
+            *l_iPaReady = 2;
+            break;
+
+        case PA_CONTEXT_TERMINATED:
+            printf("pa_state_cb: PA_CONTEXT_TERMINATED\n");
+            *l_iPaReady = 2;
+            break;
+
+        case PA_CONTEXT_READY:
+            printf("pa_state_cb: PA_CONTEXT_READY\n");
+            *l_iPaReady = 1;
+            break;
+
+        default:
+            break;
+    }
+
+    /* Wake up main thread which is waiting in pa_threaded_mainloop_wait() */
+    pa_threaded_mainloop_signal(m_SPaml, 0);
+}
+
+/* Copy captured bytes to ring. Only whole frames go in */
+static void push_ring(const void *data, size_t bytes) {
+    size_t l_lFrameSize = pa_frame_size(&m_SSs);
+    size_t l_lFits = ringbuffer_write_space(&m_SRing) / l_lFrameSize * l_lFrameSize;
+
+    if (l_lFits < bytes) {
+        atomic_fetch_add_explicit(&m_lRingOverruns, 1, memory_order_relaxed);
+    }
+
+    ringbuffer_write(&m_SRing, data, l_lFits < bytes ? l_lFits : bytes);
+}
+
+/* Enough for one file block so wake up writer */
+static void wake_writer(void) {
+    if (ringbuffer_read_space(&m_SRing) >= FILE_FRAMES_PER_WRITE * pa_frame_size(&m_SSs)) {
+        sem_post(&m_SDrain);
+    }
+}
+
+/* Data is available. This is run in Pulseaudio thread so no
+   file writing or printing here. Just copy to ring */
+static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
+    const void *l_ptrData = NULL;
+    size_t l_lReaded = 0;
+
+    atomic_fetch_add_explicit(&m_lWakeups, 1, memory_order_relaxed);
+
+    while (pa_stream_readable_size(s) > 0) {
+        if (pa_stream_peek(s, &l_ptrData, &l_lReaded) < 0) {
+            m_iLoop = 1;
+            sem_post(&m_SDrain);
+            return;
+        }
+
+        if (l_lReaded == 0) {
+            break;
+        }
+
+        /* NULL data means there is a hole in stream. Just skip it */
+        if (l_ptrData != NULL) {
+            push_ring(l_ptrData, l_lReaded);
+        }
+
+        pa_stream_drop(s);
+    }
+
+    wake_writer();
+}
+
+/* Simulated device gives block like Pulseaudio thread would */
+static int simdevCb(void *buffer, long frames, void *userdata) {
+    atomic_fetch_add_explicit(&m_lWakeups, 1, memory_order_relaxed);
+    push_ring(buffer, frames * pa_frame_size(&m_SSs));
+    wake_writer();
+    return m_iLoop;
+}
+
+/* Device stopped by itself (end of input). Let writer flush */
+static void simdev_stopped(void *userdata) {
+    m_iLoop = 1;
+    sem_post(&m_SDrain);
+}
+
+/* Handle termination with CTRL-C. Only async-signal-safe calls here */
+static void handler(int sig, siginfo_t *si, void *unused) {
+    m_iLoop = 1;
+    sem_post(&m_SDrain);
+}
+
+/* Write full blocks from ring to file. If flush is set write also the last partial block */
+static void drain_ring(int flush) {
+    size_t l_lFrameSize = pa_frame_size(&m_SSs);
+    size_t l_lBlock = FILE_FRAMES_PER_WRITE * l_lFrameSize;
+    size_t l_lGot = 0;
+
+    while (ringbuffer_read_space(&m_SRing) >= l_lBlock || (flush && ringbuffer_read_space(&m_SRing) > 0)) {
+        l_lGot = ringbuffer_read(&m_SRing, m_fFileBlock, l_lBlock);
+
+        if (m_iFlac) {
+            flacpool_write(&m_SFlac, m_fFileBlock, l_lGot / l_lFrameSize);
+            continue;
+        }
+
+        if (sf_writef_float(m_SOutFile, m_fFileBlock, l_lGot / l_lFrameSize) <= 0) {
+            fprintf(stderr, "drain_ring: Can't write to file!\n");
+            m_iLoop = 1;
+            return;
+        }
+    }
+}
+
+/* Close WAV or finish FLAC encoding */
+static void close_output(void) {
+    if (m_iFlac) {
+        if (flacpool_close(&m_SFlac) < 0) {
+            fprintf(stderr, "close_output: Can't write FLAC file!\n");
+        }
+
+        flacpool_print_stats(&m_SFlac);
+        m_iFlac = 0;
+    } else if (m_SOutFile != NULL) {
+        sf_close(m_SOutFile);
+    }
+
+    m_SOutFile = NULL;
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec l_SNow;
+    clock_gettime(CLOCK_MONOTONIC, &l_SNow);
+    return (l_SNow.tv_sec - start->tv_sec) + (l_SNow.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Main thread writes what simulated device captured until CTRL-C or end of input */
+static int record_simulated(void) {
+    simdev l_SSim;
+
+    if (simdev_open(&l_SSim, m_SSfinfo.samplerate, m_SSfinfo.channels, sizeof(float), SIMDEV_CAPTURE) < 0) {
+        return -1;
+    }
+
+    simdev_set_finished_callback(&l_SSim, simdev_stopped);
+
+    if (simdev_start(&l_SSim, simdevCb, NULL) < 0) {
+        fprintf(stderr, "record_simulated: Can't start simulated device\n");
+        simdev_close(&l_SSim);
+        return -1;
+    }
+
+    while (!m_iLoop) {
+        if (sem_wait(&m_SDrain) < 0 && errno != EINTR) {
+            break;
+        }
+
+        m_lFileWakeups++;
+        drain_ring(0);
+    }
+
+    /* Stop capture before writing last samples */
+    simdev_close(&l_SSim);
+    drain_ring(1);
+    simdev_print_stats(&l_SSim);
+    printf("record_simulated: Callbacks %ld file writer wakeups %ld ring overruns %ld\n",
+           atomic_load(&m_lWakeups), m_lFileWakeups, atomic_load(&m_lRingOverruns));
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    pa_mainloop_api *l_SPamlapi = NULL;
+    pa_context *l_SPactx = NULL;
+    pa_stream *l_SRecordstream = NULL;
+    int r = 0;
+    int l_iPaReady = 0;
+    int l_iRetval = 0;
+    double l_dSeconds = 0.0;
+    struct sigaction l_Ssa;
+    struct timespec l_SStart;
+
+    /*
+      We use two channels
+      Samplerate is 44100
+      Wave 16 bit output format
+    */
+    m_SSfinfo.channels = 2;
+    m_SSfinfo.samplerate = 44100;
+    m_SSfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+
+    if (flacpool_wanted(argv[1])) {
+        if (flacpool_open(&m_SFlac, argv[1], m_SSfinfo.samplerate, m_SSfinfo.channels, 0) < 0) {
+            fprintf(stderr, "main: Not able to open FLAC output file %s.\n", argv[1]);
+            return 1;
+        }
+
+        m_iFlac = 1;
+
+    /* Open file. Because this is just a example we asume
+      What you are doing and give file first argument */
+    } else if (! (m_SOutFile = sf_open(argv[1], SFM_WRITE, &m_SSfinfo))) {
+        fprintf (stderr, "main: Not able to open output file %s.\n", argv[1]) ;
+        sf_perror (NULL) ;
+        return  1 ;
+    }
+
+    printf("main: Opened file: (%s)\n", argv[1]);
+
+    m_SSs.rate = m_SSfinfo.samplerate;
+    m_SSs.channels = m_SSfinfo.channels;
+    m_SSs.format = PA_SAMPLE_FLOAT32LE;
+
+    if (ringbuffer_init(&m_SRing, (size_t)m_SSfinfo.samplerate * m_SSfinfo.channels * sizeof(float) * RING_SECONDS) < 0) {
+        fprintf(stderr, "main: Can't allocate ring buffer\n");
+        close_output();
+        return 1;
+    }
+
+    sem_init(&m_SDrain, 0, 0);
+    atomic_init(&m_lWakeups, 0);
+    atomic_init(&m_lRingOverruns, 0);
+
+    l_Ssa.sa_flags = SA_SIGINFO;
+    sigemptyset(&l_Ssa.sa_mask);
+    l_Ssa.sa_sigaction = handler;
+
+    if (sigaction(SIGINT, &l_Ssa, NULL) == -1) {
+        fprintf(stderr, "main: Can't set SIGINT handler!\n");
+        close_output();
+        return -1;
+    }
+
+    if (sigaction(SIGHUP, &l_Ssa, NULL) == -1) {
+        fprintf(stderr, "main: Can't set SIGHUP handler!\n");
+        close_output();
+        return -1;
+    }
+
+    if (simdev_wanted()) {
+        l_iRetval = record_simulated();
+        close_output();
+        ringbuffer_free(&m_SRing);
+        sem_destroy(&m_SDrain);
+        return l_iRetval;
+    }
+
+    /* Create a threaded mainloop API and connection to the default server */
+    m_SPaml = pa_threaded_mainloop_new();
+    l_SPamlapi = pa_threaded_mainloop_get_api(m_SPaml);
+    l_SPactx = pa_context_new(l_SPamlapi, "Simple example Pulseaudio threaded record application");
+
+    /* Define what callback is called in state change */
+    pa_context_set_state_callback(l_SPactx, pa_state_cb, &l_iPaReady);
+
+    /* Everything that touches Pulseaudio objects must hold the mainloop lock */
+    pa_threaded_mainloop_lock(m_SPaml);
+
+    if (pa_threaded_mainloop_start(m_SPaml) < 0) {
+        fprintf(stderr, "main: pa_threaded_mainloop_start failed\n");
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    pa_context_connect(l_SPactx, NULL, 0, NULL);
+
+    while (l_iPaReady == 0) {
+        pa_threaded_mainloop_wait(m_SPaml);
+    }
+
+    if (l_iPaReady == 2) {
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    l_SRecordstream = pa_stream_new(l_SPactx, "Record", &m_SSs, NULL);
+
+    if (!l_SRecordstream) {
+        fprintf(stderr, "main: pa_stream_new failed\n");
+        pa_threaded_mainloop_unlock(m_SPaml);
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    /* Callback for reading */
+    pa_stream_set_read_callback(l_SRecordstream, stream_request_cb, NULL);
+
+    m_SBufAttr.fragsize = (uint32_t) - 1;
+    m_SBufAttr.maxlength = (uint32_t) - 1;
+    m_SBufAttr.minreq = (uint32_t) - 1;
+    m_SBufAttr.prebuf = (uint32_t) - 1;
+    m_SBufAttr.tlength = pa_usec_to_bytes(m_iLatency, &m_SSs);
+
+    /* Connect record to default input */
+    r = pa_stream_connect_record(l_SRecordstream, NULL, &m_SBufAttr,
+                                 PA_STREAM_INTERPOLATE_TIMING
+                                 | PA_STREAM_ADJUST_LATENCY
+                                 | PA_STREAM_AUTO_TIMING_UPDATE);
+
+    if (r < 0) {
+        /* Old pulse audio servers don't like the ADJUST_LATENCY flag, so retry without that */
+        r = pa_stream_connect_record(l_SRecordstream, NULL, &m_SBufAttr,
+                                     PA_STREAM_INTERPOLATE_TIMING |
+                                     PA_STREAM_AUTO_TIMING_UPDATE);
+    }
+
+    pa_threaded_mainloop_unlock(m_SPaml);
+
+    if (r < 0) {
+        fprintf(stderr, "main: pa_stream_connect_record failed\n");
+        l_iRetval = -1;
+        goto exit;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &l_SStart);
+
+    /* Main thread is the file writer. Sleep until there is
+      at least one full block in ring */
+    while (!m_iLoop) {
+        if (sem_wait(&m_SDrain) < 0 && errno != EINTR) {
+            break;
+        }
+
+        m_lFileWakeups++;
+        drain_ring(0);
+    }
+
+    l_dSeconds = elapsed_seconds(&l_SStart);
+
+    /* Stop capture before writing last samples */
+    pa_threaded_mainloop_lock(m_SPaml);
+    pa_stream_disconnect(l_SRecordstream);
+    pa_threaded_mainloop_unlock(m_SPaml);
+    drain_ring(1);
+
+    printf("\nmain: Recorded %.2f seconds\n", l_dSeconds);
+    printf("main: Pulseaudio callbacks %ld (%.1f/s) file writer wakeups %ld (%.1f/s)\n",
+           atomic_load(&m_lWakeups), atomic_load(&m_lWakeups) / l_dSeconds,
+           m_lFileWakeups, m_lFileWakeups / l_dSeconds);
+    printf("main: Ring overruns %ld\n", atomic_load(&m_lRingOverruns));
+
+exit:
+    /* clean up and disconnect */
+    printf("\nExit and clean\n");
+
+    pa_threaded_mainloop_lock(m_SPaml);
+
+    if (l_SRecordstream) {
+        pa_stream_unref(l_SRecordstream);
+    }
+
+    pa_context_disconnect(l_SPactx);
+    pa_context_unref(l_SPactx);
+    pa_threaded_mainloop_unlock(m_SPaml);
+    pa_threaded_mainloop_stop(m_SPaml);
+    pa_threaded_mainloop_free(m_SPaml);
+
+    close_output();
+    ringbuffer_free(&m_SRing);
+    sem_destroy(&m_SDrain);
+    return l_iRetval;
+}
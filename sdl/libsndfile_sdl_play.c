@@ -25,16 +25,42 @@
  * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
  *
  * Compile with libSDL1
- * gcc -g $(pkg-config --cflags --libs sdl) -lm -lsndfile libsndfile_sdl_play.c -std=c99 -Wall -o libsndfile_sdl_play
+ * gcc -g -I../common $(pkg-config --cflags --libs sdl) -lm -lsndfile -lpthread libsndfile_sdl_play.c -std=c11 -Wall -o libsndfile_sdl_play
  *
  * Compile with libSDL2
- * gcc -g $(pkg-config --cflags --libs sdl2) -lm -lsndfile libsndfile_sdl_play.c -std=c99 -Wall -o libsndfile_sdl_play2
+ * gcc -g -I../common $(pkg-config --cflags --libs sdl2) -lm -lsndfile -lpthread libsndfile_sdl_play.c -std=c11 -Wall -o libsndfile_sdl_play2
 
  * Run with ./libsndfile_sdl_play some.[wav/flac/aiff]
+ * or      ../tools/shmring_producer some.[wav/flac/aiff] ./libsndfile_sdl_play2
+ *
+ * With 'shm:FD' or 'shm:/path' argument samples are taken from shared memory
+ * ring of producer process (see common/shmring.h) instead of libsndfile.
+ * Ring has float samples so it works only with libSDL2.
+ *
+ * Levels of every played block can be watched with tools/meter_watch
+ * (see common/meter.h). With SPECTRUM set in environment spectrum is
+ * computed on worker thread and can be watched with tools/spectrum_watch
+ * (see common/spectrum.h).
+ *
+ * With libSDL2 loudness gain of file measured with tools/r128scan (from
+ * 'file.r128') is applied to output (see common/loudness.h).
+ *
+ * With SIMDEV set in environment SDL audio is not opened. Simulated device
+ * calls same callback on its own timer (see common/simdev.h):
+ * SIMDEV="period=1024,jitter=0.5,skew=200" ./libsndfile_sdl_play2 some.wav
+ *
+ * Main thread sleeps in control loop (see common/ctlloop.h) until file has
+ * been played or CTRL-C comes. It does not poll SDL events.
+ *
+ * With libSDL2 and DSPCHAIN set in environment output goes through gain,
+ * EQ and limiter in callback. Lines from stdin change them while playing
+ * (see common/dspchain.h).
+ *
+ * With libSDL2 and FIRFILTER set long room correction filter is convolved
+ * with file before DSP chain (see common/fftconv.h).
  */
 
-#define _XOPEN_SOURCE
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
@@ -43,6 +69,16 @@
 #include <SDL_thread.h>
 #include <sndfile.h>
 #include <signal.h>
+#include <unistd.h>
+
+#include "ctlloop.h"
+#include "dspchain.h"
+#include "fftconv.h"
+#include "loudness.h"
+#include "meter.h"
+#include "shmring.h"
+#include "simdev.h"
+#include "spectrum.h"
 
 SDL_AudioSpec m_SWantedSpec;
 SDL_AudioSpec m_SSDLspec;
@@ -50,60 +86,255 @@ SNDFILE *m_SInfile = NULL;
 SF_INFO m_SSinfo;
 int l_iLoop = 0;
 long m_iReadcount = 0;
+shmring m_SShm;
+int m_iShm = 0;
+meter m_SMeter;
+float m_fGain = 1.0f;
+ctlloop m_SControl;
+dspchain m_SChain;
+int m_iChain = 0;
+fftconv m_SConv;
+int m_iConv = 0;
+spectrum m_SSpectrum;
+int m_iSpectrum = 0;
+
+
+#if SDL_MAJOR_VERSION == 2
+/* Limiter look-ahead is read before start so it adds no latency. Frames
+   go through loudness gain and FIR filter like in callback */
+static void prime_chain(void) {
+    float l_fPrime[1024];
+    long l_lWant = 1024 / m_SSinfo.channels;
+    long l_lLeft = m_SChain.lookahead;
+    long l_lGot = 0;
+
+    if (!m_iConv) {
+        dspchain_prime_sndfile(&m_SChain, m_SInfile, m_fGain);
+        return;
+    }
 
+    while (l_lLeft > 0 && (l_lGot = sf_readf_float(m_SInfile, l_fPrime, l_lLeft < l_lWant ? l_lLeft : l_lWant)) > 0) {
+        loudness_apply(l_fPrime, l_lGot * m_SSinfo.channels, m_fGain);
+        fftconv_process(&m_SConv, l_fPrime, l_lGot);
+        dspchain_prime(&m_SChain, l_fPrime, l_lGot);
+        l_lLeft -= l_lGot;
+    }
+}
+#endif
+
+/* No more samples. Last block has been played when device asks for
+   second block of silence after it */
+static void end_of_stream(void) {
+    if (l_iLoop++ == 1) {
+        ctlloop_notify(&m_SControl);
+    }
+}
 
 /* Reques for writing length data */
 static void sdlLibsndfileCb(void *userdata, Uint8 *stream, int len) {
     /* Just empty buffer for no reason.. fun yea */
     memset( stream, 0x00, len);
 
-    /* Read with libsndfile */
 #if SDL_MAJOR_VERSION == 2
+    /* Copy straight from producer's shared memory */
+    if (m_iShm) {
+        m_iReadcount = shmring_read_float(&m_SShm, (float *)stream, len / 4 / m_SShm.header->channels);
+        meter_update(&m_SMeter, (float *)stream, len / 4 / m_SShm.header->channels);
+
+        if (m_iSpectrum) {
+            spectrum_push(&m_SSpectrum, stream, len / 4 / m_SShm.header->channels);
+        }
+
+        if (shmring_finished(&m_SShm)) {
+            end_of_stream();
+        }
+
+        return;
+    }
+
+    /* Read with libsndfile */
     m_iReadcount = sf_read_float(m_SInfile, (float *)stream, len / 4);
+    loudness_apply((float *)stream, m_iReadcount, m_fGain);
+
+    if (m_iConv) {
+        fftconv_process(&m_SConv, (float *)stream, m_iReadcount / m_SSinfo.channels);
+    }
+
+    /* Delay line of limiter still has frames after file end */
+    if (m_iChain) {
+        m_iReadcount = dspchain_process(&m_SChain, (float *)stream, m_iReadcount / m_SSinfo.channels, len / 4 / m_SSinfo.channels) * m_SSinfo.channels;
+    }
+
+    meter_update(&m_SMeter, (float *)stream, len / 4 / m_SSinfo.channels);
+
+    if (m_iSpectrum) {
+        spectrum_push(&m_SSpectrum, stream, len / 4 / m_SSinfo.channels);
+    }
 #else
+    /* Read with libsndfile */
     m_iReadcount = sf_read_short(m_SInfile, (short int *)stream, len / 2);
+    meter_update_s16(&m_SMeter, (short int *)stream, len / 2 / m_SSinfo.channels);
+
+    if (m_iSpectrum) {
+        spectrum_push(&m_SSpectrum, stream, len / 2 / m_SSinfo.channels);
+    }
 #endif
 
     if( m_iReadcount <= 0 ) {
-        l_iLoop = 1;
+        end_of_stream();
     }
 
 }
 
-/* Handle termination with CTRL-C */
-static void handler(int sig, siginfo_t *si, void *unused) {
-    printf("Got SIGSEGV at address: 0x%lx\n", (long) si->si_addr);
-    l_iLoop = 1;
+/* Simulated device asks bytes like SDL would */
+static int simdevCb(void *buffer, long frames, void *userdata) {
+#if SDL_MAJOR_VERSION == 2
+    sdlLibsndfileCb(userdata, (Uint8 *)buffer, frames * m_SSinfo.channels * sizeof(float));
+#else
+    sdlLibsndfileCb(userdata, (Uint8 *)buffer, frames * m_SSinfo.channels * sizeof(short));
+#endif
+    return l_iLoop;
+}
+
+/* Device has stopped */
+static void stream_finished(void *userdata) {
+    ctlloop_notify(&m_SControl);
+}
+
+/* Sleep until end of stream or signal */
+static void wait_for_end(void) {
+    int l_iWhat = 0;
+
+    while (!(l_iWhat & (CTLLOOP_SIGNAL | CTLLOOP_DONE))) {
+        if ((l_iWhat = ctlloop_wait(&m_SControl)) < 0) {
+            return;
+        }
+
+        /* Commands for DSP chain */
+        if ((l_iWhat & CTLLOOP_INPUT) && dspchain_read_commands(&m_SChain, STDIN_FILENO) < 0) {
+            ctlloop_input(&m_SControl, -1);
+        }
+    }
+
+    if (l_iWhat & CTLLOOP_SIGNAL) {
+        printf("wait_for_end: Got signal %d\n", m_SControl.signal);
+    }
+}
+
+/* Play with simulated device until file ends or CTRL-C */
+static int play_simulated(void) {
+    simdev l_SSim;
+
+#if SDL_MAJOR_VERSION == 2
+    if (simdev_open(&l_SSim, m_SSinfo.samplerate, m_SSinfo.channels, sizeof(float), SIMDEV_PLAYBACK) < 0) {
+#else
+    if (simdev_open(&l_SSim, m_SSinfo.samplerate, m_SSinfo.channels, sizeof(short), SIMDEV_PLAYBACK) < 0) {
+#endif
+        return -1;
+    }
+
+    simdev_set_finished_callback(&l_SSim, stream_finished);
+
+    if (simdev_start(&l_SSim, simdevCb, m_SInfile) < 0) {
+        fprintf(stderr, "play_simulated: Can't start simulated device\n");
+        simdev_close(&l_SSim);
+        return -1;
+    }
+
+    wait_for_end();
+    simdev_close(&l_SSim);
+    simdev_print_stats(&l_SSim);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     int retval = 0;
-    struct sigaction l_SSa;
-    SDL_Event       l_SEvent;
+
+    if (shmring_is_spec(argv[1])) {
+#if SDL_MAJOR_VERSION == 2
+        if (shmring_attach(&m_SShm, argv[1]) < 0) {
+            fprintf(stderr, "main: Not able to attach shared memory ring %s.\n", argv[1]);
+            return 1;
+        }
+
+        m_iShm = 1;
+        m_SSinfo.samplerate = m_SShm.header->samplerate;
+        m_SSinfo.channels = m_SShm.header->channels;
+#else
+        fprintf(stderr, "main: Shared memory ring needs libSDL2\n");
+        return 1;
+#endif
 
     /* Open file. Because this is just a example we asume
       What you are doing and give file first argument */
-    if (! (m_SInfile = sf_open(argv[1], SFM_READ, &m_SSinfo))) {
+    } else if (! (m_SInfile = sf_open(argv[1], SFM_READ, &m_SSinfo))) {
         fprintf (stderr, "main: Not able to open input file %s.\n", argv[1]) ;
         sf_perror (NULL) ;
         return  1 ;
     }
 
-    printf("Opened file: (%s)\n", argv[1]);
-
-    l_SSa.sa_flags = SA_SIGINFO;
-    sigemptyset(&l_SSa.sa_mask);
-    l_SSa.sa_sigaction = handler;
+    printf("Opened %s: (%s)\n", m_iShm ? "shared memory ring" : "file", argv[1]);
 
-    if (sigaction(SIGINT, &l_SSa, NULL) == -1) {
-        fprintf(stderr, "main: Can't set SIGINT handler!\n");
+    /* Before filter and spectrum workers and SDL start their threads so
+       signals come only to control loop */
+    if (ctlloop_open(&m_SControl) < 0) {
         sf_close(m_SInfile);
         return -1;
     }
 
-    if (sigaction(SIGHUP, &l_SSa, NULL) == -1) {
-        fprintf(stderr, "main: Can't set SIGHUP handler!\n");
-        sf_close(m_SInfile);
+#if SDL_MAJOR_VERSION == 2
+    if (!m_iShm) {
+        m_fGain = loudness_gain_load(argv[1]);
+    }
+
+    /* Shared memory ring has its own producer, filter and chain are only
+       for files */
+    if (!m_iShm && fftconv_wanted()) {
+        if (fftconv_open(&m_SConv, m_SSinfo.samplerate, m_SSinfo.channels, getenv("FIRFILTER")) < 0) {
+            ctlloop_close(&m_SControl);
+            sf_close(m_SInfile);
+            return 1;
+        }
+
+        m_iConv = 1;
+        fftconv_print(&m_SConv);
+    }
+
+    if (!m_iShm && dspchain_wanted()) {
+        if (dspchain_open(&m_SChain, m_SSinfo.samplerate, m_SSinfo.channels, getenv("DSPCHAIN")) < 0) {
+            ctlloop_close(&m_SControl);
+            sf_close(m_SInfile);
+            return 1;
+        }
+
+        prime_chain();
+        m_iChain = 1;
+        dspchain_print(&m_SChain);
+    }
+#endif
+
+    if (meter_open(&m_SMeter, m_SSinfo.samplerate, m_SSinfo.channels) < 0) {
+        fprintf(stderr, "main: Can't make level meter. Playing without it.\n");
+    }
+
+    meter_print_path(&m_SMeter);
+
+    /* libSDL2 plays float and libSDL 1.2 16-bit samples */
+    if (spectrum_wanted()) {
+        if (spectrum_open(&m_SSpectrum, m_SSinfo.samplerate, m_SSinfo.channels, SDL_MAJOR_VERSION == 2 ? 0 : 2, getenv("SPECTRUM")) < 0) {
+            fprintf(stderr, "main: Can't make spectrum. Playing without it.\n");
+        } else {
+            m_iSpectrum = 1;
+            spectrum_print_path(&m_SSpectrum);
+        }
+    }
+
+    if (m_iChain && ctlloop_input(&m_SControl, STDIN_FILENO) < 0) {
+        printf("main: Can't read DSP commands from stdin. Playing with DSPCHAIN settings.\n");
+    }
+
+    if (simdev_wanted()) {
+        retval = play_simulated();
         goto exit;
     }
 
@@ -157,16 +388,39 @@ int main(int argc, char *argv[]) {
     SDL_PauseAudio(0);
     atexit(SDL_Quit);
 
-    /* Loop until we exit */
-    while(!l_iLoop) {
-        SDL_PollEvent(&l_SEvent);
-    }
+    wait_for_end();
+    SDL_CloseAudio();
 
 exit:
     /* clean up and disconnect */
     printf("\nExit and clean\n");
-    sf_close(m_SInfile);
+    meter_print_stats(&m_SMeter);
+    meter_close(&m_SMeter);
+
+    if (m_iSpectrum) {
+        spectrum_print_stats(&m_SSpectrum);
+        spectrum_close(&m_SSpectrum);
+    }
+
+    if (m_iChain) {
+        dspchain_print_stats(&m_SChain);
+        dspchain_free(&m_SChain);
+    }
+
+    if (m_iConv) {
+        fftconv_print_stats(&m_SConv);
+        fftconv_close(&m_SConv);
+    }
+
+    if (m_iShm) {
+        printf("Shared memory underruns %ld\n", (long)atomic_load(&m_SShm.header->underruns));
+        shmring_close(&m_SShm);
+    } else {
+        sf_close(m_SInfile);
+    }
+
     m_SInfile = NULL;
+    ctlloop_close(&m_SControl);
 
     return retval;
 }
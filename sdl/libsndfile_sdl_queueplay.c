@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * SDL2 push mode player. There is no audio callback: decoder thread
+ * pushes big batches with SDL_QueueAudio() and sleeps until queue of
+ * device has played down near target fill (SDL_GetQueuedAudioSize()).
+ * Same samples can be pushed to several output devices at once.
+ *
+ * You need:
+ * SDL2 (headers and libraries) http://www.libsdl.org/
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs sdl2) -lm -lsndfile -lpthread libsndfile_sdl_queueplay.c -std=c11 -Wall -o libsndfile_sdl_queueplay
+ *
+ * Run with ./libsndfile_sdl_queueplay [-l] [-a | -d device ...] [-q target_ms] [-b batch_ms] some.[wav/flac/aiff]
+ *
+ * -l lists output devices. -d opens device by name or number (can be given
+ * many times) and -a opens all of them. Default is default device. All
+ * devices are started together after first target fill is queued. Every
+ * device has its own clock so queues drift apart in long play. Largest
+ * difference is printed at the end.
+ *
+ * -q is queue fill decoder keeps (default 200 ms) and -b how much is
+ * decoded and pushed at once (default 50 ms). At the end wakeups of
+ * decoder, underruns (queue seen empty before end of file) and CPU
+ * time per second of audio are printed. Compare with callback mode of
+ * libsndfile_sdl_play using sdl_queue_bench.
+ *
+ * Levels can be watched with tools/meter_watch (see common/meter.h) and
+ * loudness gain of tools/r128scan is applied (see common/loudness.h).
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <SDL.h>
+#include <sndfile.h>
+#include <sys/resource.h>
+
+#include "ctlloop.h"
+#include "loudness.h"
+#include "meter.h"
+
+#define QUEUE_MAX_DEVICES 8
+#define QUEUE_TARGET_MS 200
+#define QUEUE_BATCH_MS 50
+
+typedef struct queuedev {
+    SDL_AudioDeviceID id;
+    char name[256];
+    long underruns;
+} queuedev;
+
+queuedev m_SDevices[QUEUE_MAX_DEVICES];
+int m_iDevices = 0;
+SNDFILE *m_SInfile = NULL;
+SF_INFO m_SSinfo;
+meter m_SMeter;
+float m_fGain = 1.0f;
+ctlloop m_SControl;
+atomic_int m_iStop;
+long m_lTargetMs = QUEUE_TARGET_MS;
+long m_lBatchMs = QUEUE_BATCH_MS;
+/* Statistics of decoder thread */
+long m_lWakeups = 0;
+long m_lBatches = 0;
+long m_lFrames = 0;
+double m_dDriftMs = 0.0;
+double m_dFirst = 0.0;
+double m_dDecodeCpu = 0.0;
+
+static double now_seconds(clockid_t clock) {
+    struct timespec l_STs;
+    clock_gettime(clock, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+static void sleep_ms(double ms) {
+    struct timespec l_STs;
+
+    l_STs.tv_sec = (time_t)(ms / 1000.0);
+    l_STs.tv_nsec = (long)((ms - l_STs.tv_sec * 1000.0) * 1e6);
+    nanosleep(&l_STs, NULL);
+}
+
+/* Smallest and largest queue of devices in bytes */
+static void queued_range(Uint32 *smallest, Uint32 *largest) {
+    Uint32 l_iQueued = 0;
+    int i = 0;
+
+    *smallest = 0xFFFFFFFF;
+    *largest = 0;
+
+    for (i = 0; i < m_iDevices; i++) {
+        l_iQueued = SDL_GetQueuedAudioSize(m_SDevices[i].id);
+        *smallest = l_iQueued < *smallest ? l_iQueued : *smallest;
+        *largest = l_iQueued > *largest ? l_iQueued : *largest;
+    }
+}
+
+/* Decode batches until every queue is at target, then sleep until
+   smallest queue has played down to it */
+static void *decode_thread(void *userdata) {
+    long l_lFrameBytes = m_SSinfo.channels * sizeof(float);
+    long l_lBatchFrames = m_lBatchMs * m_SSinfo.samplerate / 1000;
+    double l_dBytesPerMs = l_lFrameBytes * m_SSinfo.samplerate / 1000.0;
+    Uint32 l_iTarget = (Uint32)(m_lTargetMs * l_dBytesPerMs);
+    Uint32 l_iSmallest = 0;
+    Uint32 l_iLargest = 0;
+    float *l_fBatch = (float *)malloc(l_lBatchFrames * l_lFrameBytes);
+    long l_lGot = 0;
+    int l_iStarted = 0;
+    int l_iEof = 0;
+    int i = 0;
+
+    while (l_fBatch != NULL && !atomic_load(&m_iStop)) {
+        queued_range(&l_iSmallest, &l_iLargest);
+
+        if (l_iStarted && !l_iEof) {
+            for (i = 0; i < m_iDevices; i++) {
+                if (SDL_GetQueuedAudioSize(m_SDevices[i].id) == 0) {
+                    m_SDevices[i].underruns++;
+                }
+            }
+
+            if ((l_iLargest - l_iSmallest) / l_dBytesPerMs > m_dDriftMs) {
+                m_dDriftMs = (l_iLargest - l_iSmallest) / l_dBytesPerMs;
+            }
+        }
+
+        /* Fill up to target */
+        if (!l_iEof && l_iSmallest < l_iTarget) {
+            l_lGot = sf_readf_float(m_SInfile, l_fBatch, l_lBatchFrames);
+
+            if (l_lGot <= 0) {
+                l_iEof = 1;
+            } else {
+                loudness_apply(l_fBatch, l_lGot * m_SSinfo.channels, m_fGain);
+                meter_update(&m_SMeter, l_fBatch, l_lGot);
+
+                for (i = 0; i < m_iDevices; i++) {
+                    if (SDL_QueueAudio(m_SDevices[i].id, l_fBatch, l_lGot * l_lFrameBytes) < 0) {
+                        fprintf(stderr, "decode_thread: Can't queue to %s: %s\n", m_SDevices[i].name, SDL_GetError());
+                    }
+                }
+
+                m_lBatches++;
+                m_lFrames += l_lGot;
+
+                if (l_iSmallest + l_lGot * l_lFrameBytes < l_iTarget) {
+                    continue;
+                }
+            }
+
+            /* Start all together when first target fill is there */
+            if (!l_iStarted) {
+                for (i = 0; i < m_iDevices; i++) {
+                    SDL_PauseAudioDevice(m_SDevices[i].id, 0);
+                }
+
+                m_dFirst = now_seconds(CLOCK_MONOTONIC);
+                l_iStarted = 1;
+            }
+
+            continue;
+        }
+
+        /* Everything played */
+        if (l_iEof && l_iLargest == 0) {
+            break;
+        }
+
+        /* Sleep until smallest queue is at target again. At end until
+           largest queue has played */
+        if (l_iEof) {
+            sleep_ms(l_iLargest / l_dBytesPerMs + 1.0);
+        } else {
+            sleep_ms((l_iSmallest - l_iTarget) / l_dBytesPerMs + 1.0);
+        }
+
+        m_lWakeups++;
+    }
+
+    free(l_fBatch);
+    m_dDecodeCpu = now_seconds(CLOCK_THREAD_CPUTIME_ID);
+    ctlloop_notify(&m_SControl);
+    return NULL;
+}
+
+static void list_devices(void) {
+    int i = 0;
+
+    printf("Output devices (driver %s):\n", SDL_GetCurrentAudioDriver());
+
+    for (i = 0; i < SDL_GetNumAudioDevices(0); i++) {
+        printf(" - %d: %s\n", i, SDL_GetAudioDeviceName(i, 0));
+    }
+}
+
+/* Open device by name, number or NULL for default */
+static int open_device(const char *which) {
+    SDL_AudioSpec l_SWanted;
+    SDL_AudioSpec l_SHave;
+    const char *l_strName = which;
+    char *l_strEnd = NULL;
+    long l_lIndex = 0;
+
+    if (m_iDevices >= QUEUE_MAX_DEVICES) {
+        fprintf(stderr, "open_device: At most %d devices\n", QUEUE_MAX_DEVICES);
+        return -1;
+    }
+
+    if (which != NULL) {
+        l_lIndex = strtol(which, &l_strEnd, 10);
+
+        if (*l_strEnd == 0x00 && (l_strName = SDL_GetAudioDeviceName((int)l_lIndex, 0)) == NULL) {
+            fprintf(stderr, "open_device: There is no device %s\n", which);
+            return -1;
+        }
+    }
+
+    SDL_zero(l_SWanted);
+    l_SWanted.freq = m_SSinfo.samplerate;
+    l_SWanted.format = AUDIO_F32LSB;
+    l_SWanted.channels = m_SSinfo.channels;
+    l_SWanted.samples = 1024;
+    /* No callback is queue mode */
+    l_SWanted.callback = NULL;
+
+    m_SDevices[m_iDevices].id = SDL_OpenAudioDevice(l_strName, 0, &l_SWanted, &l_SHave, 0);
+
+    if (m_SDevices[m_iDevices].id == 0) {
+        fprintf(stderr, "open_device: Can't open %s: %s\n", l_strName ? l_strName : "default device", SDL_GetError());
+        return -1;
+    }
+
+    snprintf(m_SDevices[m_iDevices].name, sizeof(m_SDevices[m_iDevices].name), "%s", l_strName ? l_strName : "default device");
+    printf("Opened %s (%d Hz, %d channels, %d frames device buffer)\n", m_SDevices[m_iDevices].name,
+           l_SHave.freq, l_SHave.channels, l_SHave.samples);
+    m_iDevices++;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *l_strWanted[QUEUE_MAX_DEVICES];
+    pthread_t l_SDecoder;
+    struct rusage l_SUsage;
+    int l_iWanted = 0;
+    int l_iAll = 0;
+    int l_iList = 0;
+    int l_iOpt = 0;
+    int l_iDecoder = 0;
+    int l_iWhat = 0;
+    int l_iRetval = 0;
+    int i = 0;
+    double l_dStart = now_seconds(CLOCK_MONOTONIC);
+    double l_dSeconds = 0.0;
+    double l_dCpu = 0.0;
+    long l_lUnderruns = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "lad:q:b:")) != -1) {
+        switch (l_iOpt) {
+            case 'l':
+                l_iList = 1;
+                break;
+
+            case 'a':
+                l_iAll = 1;
+                break;
+
+            case 'd':
+                if (l_iWanted < QUEUE_MAX_DEVICES) {
+                    l_strWanted[l_iWanted++] = optarg;
+                }
+
+                break;
+
+            case 'q':
+                m_lTargetMs = atol(optarg);
+                break;
+
+            case 'b':
+                m_lBatchMs = atol(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-l] [-a | -d device ...] [-q target_ms] [-b batch_ms] file\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if ((optind >= argc && !l_iList) || m_lTargetMs <= 0 || m_lBatchMs <= 0) {
+        printf("Usage: %s [-l] [-a | -d device ...] [-q target_ms] [-b batch_ms] file\n", argv[0]);
+        return 1;
+    }
+
+    /* Before SDL starts its threads so signals come only to control loop */
+    if (ctlloop_open(&m_SControl) < 0) {
+        return 1;
+    }
+
+    if (SDL_Init(SDL_INIT_AUDIO)) {
+        fprintf(stderr, "main: Could not initialize SDL - %s\n", SDL_GetError());
+        return 1;
+    }
+
+    if (l_iList) {
+        list_devices();
+        SDL_Quit();
+        return 0;
+    }
+
+    if (! (m_SInfile = sf_open(argv[optind], SFM_READ, &m_SSinfo))) {
+        fprintf(stderr, "main: Not able to open input file %s.\n", argv[optind]);
+        sf_perror(NULL);
+        SDL_Quit();
+        return 1;
+    }
+
+    printf("Opened file: (%s) %d Hz %d channels. Queue target %ld ms, batch %ld ms\n", argv[optind],
+           m_SSinfo.samplerate, m_SSinfo.channels, m_lTargetMs, m_lBatchMs);
+
+    m_fGain = loudness_gain_load(argv[optind]);
+
+    if (meter_open(&m_SMeter, m_SSinfo.samplerate, m_SSinfo.channels) < 0) {
+        fprintf(stderr, "main: Can't make level meter. Playing without it.\n");
+    }
+
+    meter_print_path(&m_SMeter);
+
+    if (l_iAll) {
+        for (i = 0; i < SDL_GetNumAudioDevices(0) && i < QUEUE_MAX_DEVICES; i++) {
+            open_device(SDL_GetAudioDeviceName(i, 0));
+        }
+    } else if (l_iWanted == 0) {
+        open_device(NULL);
+    }
+
+    for (i = 0; i < l_iWanted; i++) {
+        open_device(l_strWanted[i]);
+    }
+
+    if (m_iDevices == 0) {
+        fprintf(stderr, "main: No output device\n");
+        l_iRetval = 1;
+        goto exit;
+    }
+
+    if (pthread_create(&l_SDecoder, NULL, decode_thread, NULL) != 0) {
+        fprintf(stderr, "main: Can't start decoder thread\n");
+        l_iRetval = 1;
+        goto exit;
+    }
+
+    l_iDecoder = 1;
+
+    /* Decoder tells when everything has been played */
+    while (!(l_iWhat & (CTLLOOP_SIGNAL | CTLLOOP_DONE))) {
+        if ((l_iWhat = ctlloop_wait(&m_SControl)) < 0) {
+            break;
+        }
+    }
+
+    if (l_iWhat > 0 && (l_iWhat & CTLLOOP_SIGNAL)) {
+        printf("main: Got signal %d\n", m_SControl.signal);
+    }
+
+exit:
+    atomic_store(&m_iStop, 1);
+
+    if (l_iDecoder) {
+        pthread_join(l_SDecoder, NULL);
+    }
+
+    for (i = 0; i < m_iDevices; i++) {
+        SDL_ClearQueuedAudio(m_SDevices[i].id);
+        SDL_CloseAudioDevice(m_SDevices[i].id);
+        printf("main: %s underruns %ld\n", m_SDevices[i].name, m_SDevices[i].underruns);
+        l_lUnderruns += m_SDevices[i].underruns;
+    }
+
+    /* CPU per second of audio. Played seconds, not wall clock */
+    l_dSeconds = (double)m_lFrames / (m_SSinfo.samplerate > 0 ? m_SSinfo.samplerate : 1);
+    getrusage(RUSAGE_SELF, &l_SUsage);
+    l_dCpu = l_SUsage.ru_utime.tv_sec + l_SUsage.ru_utime.tv_usec / 1e6 + l_SUsage.ru_stime.tv_sec + l_SUsage.ru_stime.tv_usec / 1e6;
+
+    if (m_lFrames > 0) {
+        printf("main: Time to first audio %.1f ms\n", (m_dFirst - l_dStart) * 1000.0);
+        printf("main: Pushed %.2f s in %ld batches, %ld decoder wakeups (%.1f/s), %ld underruns, drift %.1f ms\n",
+               l_dSeconds, m_lBatches, m_lWakeups, m_lWakeups / l_dSeconds, l_lUnderruns, m_dDriftMs);
+        printf("main: CPU %.2f ms/s (decoder %.2f ms/s)\n", l_dCpu * 1000.0 / l_dSeconds, m_dDecodeCpu * 1000.0 / l_dSeconds);
+    }
+
+    meter_print_stats(&m_SMeter);
+    meter_close(&m_SMeter);
+    sf_close(m_SInfile);
+    ctlloop_close(&m_SControl);
+    SDL_Quit();
+    return l_iRetval;
+}
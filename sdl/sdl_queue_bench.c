@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Callback mode against queue mode of SDL2 playback.
+ *
+ * Plays sine for -s seconds (default 10) first with audio callback asking
+ * -p frames at a time (like libsndfile_sdl_play) and then with thread
+ * pushing -b ms batches to keep -q ms queued (like
+ * libsndfile_sdl_queueplay). SDL dummy driver is used unless
+ * SDL_AUDIODRIVER is set so it can be run without sound card. For both
+ * modes it prints:
+ *
+ *   CPU        user + system time of process per second of audio
+ *   wakeups    callbacks or decoder thread wakeups per second
+ *   switches   voluntary + involuntary context switches per second
+ *   underruns  callback later than 1.5 device buffers after previous or
+ *              queue seen empty
+ *
+ * You need:
+ * SDL2 (headers and libraries) http://www.libsdl.org/
+ *
+ * Compile with
+ * gcc -g $(pkg-config --cflags --libs sdl2) -lm sdl_queue_bench.c -std=c11 -Wall -o sdl_queue_bench
+ *
+ * Run with ./sdl_queue_bench [-s seconds] [-p callback_frames] [-q target_ms] [-b batch_ms]
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <SDL.h>
+#include <sys/resource.h>
+
+#define BENCH_RATE 48000
+#define BENCH_CHANNELS 2
+
+typedef struct bench_result {
+    double cpu_ms;
+    long wakeups;
+    long switches;
+    long underruns;
+    double seconds;
+} bench_result;
+
+/* Callback mode state. Written only by audio thread */
+static double m_dPhase = 0.0;
+static long m_lCallbacks = 0;
+static long m_lLate = 0;
+static double m_dLast = 0.0;
+static double m_dBufferSeconds = 0.0;
+static atomic_long m_lCallbackFrames;
+
+static double now_seconds(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+static void sine(float *buf, long frames) {
+    long i = 0;
+    int j = 0;
+
+    for (i = 0; i < frames; i++) {
+        for (j = 0; j < BENCH_CHANNELS; j++) {
+            buf[i * BENCH_CHANNELS + j] = (float)(0.25 * sin(m_dPhase));
+        }
+
+        m_dPhase += 2.0 * M_PI * 440.0 / BENCH_RATE;
+    }
+
+    m_dPhase = fmod(m_dPhase, 2.0 * M_PI);
+}
+
+static void usage_now(struct rusage *usage) {
+    getrusage(RUSAGE_SELF, usage);
+}
+
+static void usage_diff(const struct rusage *before, const struct rusage *after, bench_result *res) {
+    res->cpu_ms = (after->ru_utime.tv_sec - before->ru_utime.tv_sec) * 1000.0 + (after->ru_utime.tv_usec - before->ru_utime.tv_usec) / 1000.0
+                  + (after->ru_stime.tv_sec - before->ru_stime.tv_sec) * 1000.0 + (after->ru_stime.tv_usec - before->ru_stime.tv_usec) / 1000.0;
+    res->switches = (after->ru_nvcsw - before->ru_nvcsw) + (after->ru_nivcsw - before->ru_nivcsw);
+}
+
+static void bench_callback(void *userdata, Uint8 *stream, int len) {
+    double l_dNow = now_seconds();
+
+    if (m_lCallbacks > 0 && l_dNow - m_dLast > m_dBufferSeconds * 1.5) {
+        m_lLate++;
+    }
+
+    m_dLast = l_dNow;
+    m_lCallbacks++;
+    sine((float *)stream, len / sizeof(float) / BENCH_CHANNELS);
+    atomic_fetch_add(&m_lCallbackFrames, len / sizeof(float) / BENCH_CHANNELS);
+}
+
+static int open_device(SDL_AudioCallback callback, int frames, SDL_AudioDeviceID *id) {
+    SDL_AudioSpec l_SWanted;
+    SDL_AudioSpec l_SHave;
+
+    SDL_zero(l_SWanted);
+    l_SWanted.freq = BENCH_RATE;
+    l_SWanted.format = AUDIO_F32LSB;
+    l_SWanted.channels = BENCH_CHANNELS;
+    l_SWanted.samples = frames;
+    l_SWanted.callback = callback;
+
+    if ((*id = SDL_OpenAudioDevice(NULL, 0, &l_SWanted, &l_SHave, 0)) == 0) {
+        fprintf(stderr, "open_device: %s\n", SDL_GetError());
+        return -1;
+    }
+
+    m_dBufferSeconds = (double)l_SHave.samples / BENCH_RATE;
+    return 0;
+}
+
+static int run_callback(double seconds, int frames, bench_result *res) {
+    SDL_AudioDeviceID l_iDev = 0;
+    struct rusage l_SBefore;
+    struct rusage l_SAfter;
+
+    if (open_device(bench_callback, frames, &l_iDev) < 0) {
+        return -1;
+    }
+
+    usage_now(&l_SBefore);
+    SDL_PauseAudioDevice(l_iDev, 0);
+
+    while (atomic_load(&m_lCallbackFrames) < seconds * BENCH_RATE) {
+        SDL_Delay(100);
+    }
+
+    SDL_PauseAudioDevice(l_iDev, 1);
+    usage_now(&l_SAfter);
+    SDL_CloseAudioDevice(l_iDev);
+
+    usage_diff(&l_SBefore, &l_SAfter, res);
+    res->wakeups = m_lCallbacks;
+    res->underruns = m_lLate;
+    res->seconds = (double)atomic_load(&m_lCallbackFrames) / BENCH_RATE;
+    return 0;
+}
+
+/* Same loop as decode_thread of libsndfile_sdl_queueplay on this thread */
+static int run_queue(double seconds, long target_ms, long batch_ms, bench_result *res) {
+    SDL_AudioDeviceID l_iDev = 0;
+    struct rusage l_SBefore;
+    struct rusage l_SAfter;
+    struct timespec l_STs;
+    long l_lBatchFrames = batch_ms * BENCH_RATE / 1000;
+    double l_dBytesPerMs = BENCH_CHANNELS * sizeof(float) * BENCH_RATE / 1000.0;
+    Uint32 l_iTarget = (Uint32)(target_ms * l_dBytesPerMs);
+    Uint32 l_iQueued = 0;
+    float *l_fBatch = (float *)malloc(l_lBatchFrames * BENCH_CHANNELS * sizeof(float));
+    double l_dSleep = 0.0;
+    long l_lPushed = 0;
+    int l_iStarted = 0;
+
+    if (l_fBatch == NULL || open_device(NULL, 1024, &l_iDev) < 0) {
+        free(l_fBatch);
+        return -1;
+    }
+
+    memset(res, 0x00, sizeof(bench_result));
+    usage_now(&l_SBefore);
+
+    while (l_lPushed < seconds * BENCH_RATE) {
+        l_iQueued = SDL_GetQueuedAudioSize(l_iDev);
+
+        if (l_iStarted && l_iQueued == 0) {
+            res->underruns++;
+        }
+
+        if (l_iQueued < l_iTarget) {
+            sine(l_fBatch, l_lBatchFrames);
+            SDL_QueueAudio(l_iDev, l_fBatch, l_lBatchFrames * BENCH_CHANNELS * sizeof(float));
+            l_lPushed += l_lBatchFrames;
+            continue;
+        }
+
+        if (!l_iStarted) {
+            SDL_PauseAudioDevice(l_iDev, 0);
+            l_iStarted = 1;
+        }
+
+        l_dSleep = (l_iQueued - l_iTarget) / l_dBytesPerMs + 1.0;
+        l_STs.tv_sec = (time_t)(l_dSleep / 1000.0);
+        l_STs.tv_nsec = (long)((l_dSleep - l_STs.tv_sec * 1000.0) * 1e6);
+        nanosleep(&l_STs, NULL);
+        res->wakeups++;
+    }
+
+    /* Let queue play out so time is same as in callback mode */
+    while ((l_iQueued = SDL_GetQueuedAudioSize(l_iDev)) > 0) {
+        SDL_Delay((Uint32)(l_iQueued / l_dBytesPerMs) + 1);
+        res->wakeups++;
+    }
+
+    usage_now(&l_SAfter);
+    SDL_CloseAudioDevice(l_iDev);
+    free(l_fBatch);
+
+    usage_diff(&l_SBefore, &l_SAfter, res);
+    res->seconds = (double)l_lPushed / BENCH_RATE;
+    return 0;
+}
+
+static void print_result(const char *mode, const bench_result *res) {
+    printf("%-30s %8.2f %10.1f %10.1f %10ld\n", mode, res->cpu_ms / res->seconds,
+           res->wakeups / res->seconds, res->switches / res->seconds, res->underruns);
+}
+
+int main(int argc, char *argv[]) {
+    bench_result l_SCallback;
+    bench_result l_SQueue;
+    char l_strMode[64];
+    double l_dSeconds = 10.0;
+    long l_lTargetMs = 200;
+    long l_lBatchMs = 50;
+    int l_iFrames = 512;
+    int l_iOpt = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "s:p:q:b:")) != -1) {
+        switch (l_iOpt) {
+            case 's':
+                l_dSeconds = atof(optarg);
+                break;
+
+            case 'p':
+                l_iFrames = atoi(optarg);
+                break;
+
+            case 'q':
+                l_lTargetMs = atol(optarg);
+                break;
+
+            case 'b':
+                l_lBatchMs = atol(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds] [-p callback_frames] [-q target_ms] [-b batch_ms]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (l_dSeconds <= 0.0 || l_iFrames <= 0 || l_lTargetMs <= 0 || l_lBatchMs <= 0) {
+        printf("Usage: %s [-s seconds] [-p callback_frames] [-q target_ms] [-b batch_ms]\n", argv[0]);
+        return 1;
+    }
+
+    /* Don't replace driver user asked */
+    setenv("SDL_AUDIODRIVER", "dummy", 0);
+
+    if (SDL_Init(SDL_INIT_AUDIO)) {
+        fprintf(stderr, "main: Could not initialize SDL - %s\n", SDL_GetError());
+        return 1;
+    }
+
+    printf("Driver %s, %.0f seconds of %d Hz stereo float\n", SDL_GetCurrentAudioDriver(), l_dSeconds, BENCH_RATE);
+
+    memset(&l_SCallback, 0x00, sizeof(bench_result));
+
+    if (run_callback(l_dSeconds, l_iFrames, &l_SCallback) < 0 || run_queue(l_dSeconds, l_lTargetMs, l_lBatchMs, &l_SQueue) < 0) {
+        SDL_Quit();
+        return 1;
+    }
+
+    printf("%-30s %8s %10s %10s %10s\n", "mode", "CPU ms/s", "wakeups/s", "switches/s", "underruns");
+    snprintf(l_strMode, sizeof(l_strMode), "callback %d frames", l_iFrames);
+    print_result(l_strMode, &l_SCallback);
+    snprintf(l_strMode, sizeof(l_strMode), "queue %ld ms, batch %ld ms", l_lTargetMs, l_lBatchMs);
+    print_result(l_strMode, &l_SQueue);
+
+    SDL_Quit();
+    return 0;
+}
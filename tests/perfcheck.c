@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Throughput and latency baselines for tests (see tests/CMakeLists.txt)
+ *
+ * Measures decoding speed of WAV and FLAC file in stream format picked by
+ * common/nativefmt.h and R128 loudness measurement speed
+ * (common/loudness.h). Then real players (-p) and recorders (-r) are run
+ * on simulated device (common/simdev.h) and their CPU time per second of
+ * audio and average callback time from simdev statistics are taken.
+ * Players given with -d are run also with DSPCHAIN and, if -f gives
+ * filter file, with FIRFILTER. Recorders get first file decoded to raw
+ * float as SIMDEV_INPUT. Best of rounds is taken so short noise of
+ * loaded machine does not count.
+ *
+ * Without -b results are only printed and exit code is 77 (skipped in
+ * CTest). With -b results are compared to baseline file and run fails if
+ * anything is more than -t percent (default 25) worse. Missing baseline
+ * is failure too: -u saves results as new baseline. Keep baseline of
+ * machine that runs tests:
+ *
+ *   name value higher|lower
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common -lsndfile -lm -lpthread perfcheck.c -std=c11 -Wall -o perfcheck
+ *
+ * Run with ./perfcheck [-b baseline [-u]] [-t percent] [-p player] [-d player] [-r recorder] [-f filter.wav] some.wav some.flac
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sndfile.h>
+
+#include "loudness.h"
+#include "nativefmt.h"
+
+#define PERF_ROUNDS 5
+#define PERF_TOOL_ROUNDS 3
+#define PERF_FRAMES_PER_READ 4096
+#define PERF_MAX_METRICS 64
+#define PERF_MAX_TOOLS 8
+#define PERF_DEFAULT_THRESHOLD 25.0
+/* 'Skipped' for CTest when there is no baseline to compare */
+#define PERF_SKIPPED 77
+/* Simulated device tools run on */
+#define PERF_SIMDEV "period=256,buffer=2,seconds=4,speed=5"
+/* Every DSP chain stage is on */
+#define PERF_DSPCHAIN "gain=-3,eq=100:4:0.7,limit=-1,lookahead=5"
+
+typedef struct perf_metric {
+    char name[64];
+    double value;
+    int higher_better;
+} perf_metric;
+
+/* What one run of tool told */
+typedef struct perf_run {
+    double cpu_ms_per_s;
+    double callback_us;
+} perf_run;
+
+static perf_metric m_SMetrics[PERF_MAX_METRICS];
+static int m_iMetrics = 0;
+
+static double now_seconds(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+static void add_metric(const char *name, double value, int higher_better) {
+    if (m_iMetrics < PERF_MAX_METRICS) {
+        snprintf(m_SMetrics[m_iMetrics].name, sizeof(m_SMetrics[m_iMetrics].name), "%s", name);
+        m_SMetrics[m_iMetrics].value = value;
+        m_SMetrics[m_iMetrics].higher_better = higher_better;
+        m_iMetrics++;
+    }
+}
+
+/* Decode whole file in stream format. Returns million frames per second */
+static double decode_speed(const char *path) {
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    nativefmt l_SFmt;
+    float *l_fBuffer = NULL;
+    double l_dStart = 0.0;
+    double l_dBest = 0.0;
+    long l_lFrames = 0;
+    long l_lGot = 0;
+    int i = 0;
+
+    for (i = 0; i < PERF_ROUNDS; i++) {
+        memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+        if (!(l_SFile = sf_open(path, SFM_READ, &l_SInfo))) {
+            printf("decode_speed: Not able to open %s\n", path);
+            return 0.0;
+        }
+
+        nativefmt_pick(&l_SFmt, l_SFile, &l_SInfo, 0);
+        l_fBuffer = (float *)realloc(l_fBuffer, PERF_FRAMES_PER_READ * nativefmt_frame_bytes(&l_SFmt));
+        l_lFrames = 0;
+        l_dStart = now_seconds();
+
+        while ((l_lGot = nativefmt_read(&l_SFmt, l_SFile, l_fBuffer, PERF_FRAMES_PER_READ * l_SInfo.channels)) > 0) {
+            l_lFrames += l_lGot / l_SInfo.channels;
+        }
+
+        l_dStart = now_seconds() - l_dStart;
+        sf_close(l_SFile);
+
+        if (l_dStart > 0.0 && l_lFrames / l_dStart / 1e6 > l_dBest) {
+            l_dBest = l_lFrames / l_dStart / 1e6;
+        }
+    }
+
+    free(l_fBuffer);
+    return l_dBest;
+}
+
+/* R128 measurement of file. Returns nanoseconds per frame */
+static double loudness_speed(const char *path) {
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    loudness l_SLoudness;
+    float *l_fBuffer = NULL;
+    double l_dStart = 0.0;
+    double l_dTime = 0.0;
+    double l_dBest = INFINITY;
+    long l_lFrames = 0;
+    long l_lGot = 0;
+    int i = 0;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if (!(l_SFile = sf_open(path, SFM_READ, &l_SInfo))) {
+        printf("loudness_speed: Not able to open %s\n", path);
+        return 0.0;
+    }
+
+    /* Decode once. Only measurement is timed */
+    l_fBuffer = (float *)malloc(l_SInfo.frames * l_SInfo.channels * sizeof(float) + 1);
+    l_lFrames = l_fBuffer != NULL ? sf_readf_float(l_SFile, l_fBuffer, l_SInfo.frames) : 0;
+    sf_close(l_SFile);
+
+    for (i = 0; i < PERF_ROUNDS && l_lFrames > 0; i++) {
+        if (loudness_init(&l_SLoudness, l_SInfo.samplerate, l_SInfo.channels) < 0) {
+            break;
+        }
+
+        l_dStart = now_seconds();
+
+        for (l_lGot = 0; l_lGot < l_lFrames; l_lGot += PERF_FRAMES_PER_READ) {
+            loudness_process(&l_SLoudness, l_fBuffer + l_lGot * l_SInfo.channels,
+                             l_lFrames - l_lGot < PERF_FRAMES_PER_READ ? l_lFrames - l_lGot : PERF_FRAMES_PER_READ);
+        }
+
+        l_dTime = (now_seconds() - l_dStart) * 1e9 / l_lFrames;
+        l_dBest = l_dTime < l_dBest ? l_dTime : l_dBest;
+        loudness_free(&l_SLoudness);
+    }
+
+    free(l_fBuffer);
+    return isinf(l_dBest) ? 0.0 : l_dBest;
+}
+
+/* Decode file to raw float for SIMDEV_INPUT of recorders */
+static int make_raw_input(const char *path, const char *raw) {
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    FILE *l_SRaw = NULL;
+    float l_fBuffer[PERF_FRAMES_PER_READ * 2];
+    long l_lGot = 0;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if (!(l_SFile = sf_open(path, SFM_READ, &l_SInfo)) || l_SInfo.channels != 2) {
+        printf("make_raw_input: Not able to open %s as stereo\n", path);
+
+        if (l_SFile != NULL) {
+            sf_close(l_SFile);
+        }
+
+        return -1;
+    }
+
+    if (!(l_SRaw = fopen(raw, "wb"))) {
+        printf("make_raw_input: Can't write %s\n", raw);
+        sf_close(l_SFile);
+        return -1;
+    }
+
+    while ((l_lGot = sf_readf_float(l_SFile, l_fBuffer, PERF_FRAMES_PER_READ)) > 0) {
+        fwrite(l_fBuffer, sizeof(float) * 2, l_lGot, l_SRaw);
+    }
+
+    sf_close(l_SFile);
+    return fclose(l_SRaw) == 0 ? 0 : -1;
+}
+
+/* Run tool once on simulated device. Environment values that are NULL
+   are removed. Stdin is pipe that stays open so control loops keep
+   watching it. Returns -1 if tool failed or did not print statistics */
+static int run_tool(const char *tool, const char *file, const char *dspchain,
+                    const char *firfilter, const char *input, perf_run *run) {
+    int l_iOut[2];
+    int l_iIn[2];
+    int l_iStatus = 0;
+    pid_t l_iPid = 0;
+    FILE *l_SOut = NULL;
+    char *l_strLine = NULL;
+    char *l_strAt = NULL;
+    size_t l_lLine = 0;
+    double l_dDevice = 0.0;
+    struct rusage l_SUsage;
+
+    run->cpu_ms_per_s = 0.0;
+    run->callback_us = 0.0;
+
+    if (pipe(l_iOut) < 0 || pipe(l_iIn) < 0) {
+        printf("run_tool: Can't make pipes\n");
+        return -1;
+    }
+
+    if ((l_iPid = fork()) < 0) {
+        printf("run_tool: Can't fork\n");
+        return -1;
+    }
+
+    if (l_iPid == 0) {
+        dup2(l_iIn[0], STDIN_FILENO);
+        dup2(l_iOut[1], STDOUT_FILENO);
+        close(l_iIn[0]);
+        close(l_iIn[1]);
+        close(l_iOut[0]);
+        close(l_iOut[1]);
+
+        setenv("SIMDEV", PERF_SIMDEV, 1);
+        unsetenv("SIMDEV_OUTPUT");
+        input != NULL ? setenv("SIMDEV_INPUT", input, 1) : unsetenv("SIMDEV_INPUT");
+        dspchain != NULL ? setenv("DSPCHAIN", dspchain, 1) : unsetenv("DSPCHAIN");
+        firfilter != NULL ? setenv("FIRFILTER", firfilter, 1) : unsetenv("FIRFILTER");
+        execl(tool, tool, file, (char *)NULL);
+        _exit(127);
+    }
+
+    close(l_iIn[0]);
+    close(l_iOut[1]);
+    l_SOut = fdopen(l_iOut[0], "r");
+
+    /* Players with log thread end lines with '\r' so look anywhere in line */
+    while (l_SOut != NULL && getline(&l_strLine, &l_lLine, l_SOut) > 0) {
+        if ((l_strAt = strstr(l_strLine, "simdev: callback ")) != NULL) {
+            sscanf(l_strAt, "simdev: callback %lf", &run->callback_us);
+        } else if ((l_strAt = strstr(l_strLine, "simdev: ")) != NULL && strstr(l_strAt, "s of device time") != NULL) {
+            sscanf(strchr(l_strAt, ',') + 1, "%lf", &l_dDevice);
+        }
+    }
+
+    free(l_strLine);
+
+    if (l_SOut != NULL) {
+        fclose(l_SOut);
+    }
+
+    wait4(l_iPid, &l_iStatus, 0, &l_SUsage);
+    close(l_iIn[1]);
+
+    if (!WIFEXITED(l_iStatus) || WEXITSTATUS(l_iStatus) != 0 || l_dDevice <= 0.0) {
+        printf("run_tool: %s %s did not finish on simulated device\n", tool, file);
+        return -1;
+    }
+
+    run->cpu_ms_per_s = (l_SUsage.ru_utime.tv_sec + l_SUsage.ru_stime.tv_sec) * 1e3
+                        + (l_SUsage.ru_utime.tv_usec + l_SUsage.ru_stime.tv_usec) / 1e3;
+    run->cpu_ms_per_s /= l_dDevice;
+    return 0;
+}
+
+/* Best of rounds as metrics 'name_cpu_ms_s' and 'name_callback_us'.
+   Blocking writers have no callback so only CPU time is there */
+static void tool_metrics(const char *tool, const char *variant, const char *file, const char *dspchain,
+                         const char *firfilter, const char *input) {
+    const char *l_strBase = strrchr(tool, '/') != NULL ? strrchr(tool, '/') + 1 : tool;
+    char l_strName[64];
+    perf_run l_SRun;
+    double l_dCpu = INFINITY;
+    double l_dCallback = INFINITY;
+    int i = 0;
+
+    for (i = 0; i < PERF_TOOL_ROUNDS; i++) {
+        if (run_tool(tool, file, dspchain, firfilter, input, &l_SRun) < 0) {
+            l_dCpu = l_dCallback = INFINITY;
+            break;
+        }
+
+        l_dCpu = l_SRun.cpu_ms_per_s < l_dCpu ? l_SRun.cpu_ms_per_s : l_dCpu;
+        l_dCallback = l_SRun.callback_us > 0.0 && l_SRun.callback_us < l_dCallback ? l_SRun.callback_us : l_dCallback;
+    }
+
+    snprintf(l_strName, sizeof(l_strName), "%s%s_cpu_ms_s", l_strBase, variant);
+    add_metric(l_strName, isinf(l_dCpu) ? 0.0 : l_dCpu, 0);
+
+    if (!isinf(l_dCallback) || isinf(l_dCpu)) {
+        snprintf(l_strName, sizeof(l_strName), "%s%s_callback_us", l_strBase, variant);
+        add_metric(l_strName, isinf(l_dCallback) ? 0.0 : l_dCallback, 0);
+    }
+}
+
+static int save_baseline(const char *path) {
+    FILE *l_SFile = fopen(path, "w");
+    int i = 0;
+
+    if (l_SFile == NULL) {
+        printf("save_baseline: Can't write %s\n", path);
+        return -1;
+    }
+
+    for (i = 0; i < m_iMetrics; i++) {
+        fprintf(l_SFile, "%s %.6g %s\n", m_SMetrics[i].name, m_SMetrics[i].value,
+                m_SMetrics[i].higher_better ? "higher" : "lower");
+    }
+
+    fclose(l_SFile);
+    printf("perfcheck: Baseline saved to %s\n", path);
+    return 0;
+}
+
+/* Returns number of metrics worse than threshold or missing from baseline */
+static int check_baseline(FILE *baseline, double threshold) {
+    char l_strName[64];
+    char l_strBetter[16];
+    int l_iCompared[PERF_MAX_METRICS] = { 0 };
+    double l_dBase = 0.0;
+    double l_dChange = 0.0;
+    int l_iFailed = 0;
+    int i = 0;
+
+    while (fscanf(baseline, "%63s %lf %15s", l_strName, &l_dBase, l_strBetter) == 3) {
+        for (i = 0; i < m_iMetrics; i++) {
+            if (strcmp(l_strName, m_SMetrics[i].name) || l_dBase <= 0.0) {
+                continue;
+            }
+
+            /* Positive change is worse */
+            l_dChange = (m_SMetrics[i].value - l_dBase) / l_dBase * 100.0;
+            l_dChange = m_SMetrics[i].higher_better ? -l_dChange : l_dChange;
+
+            printf("perfcheck: %-40s baseline %10.3f now %10.3f %+6.1f%% %s\n", l_strName, l_dBase,
+                   m_SMetrics[i].value, -l_dChange, l_dChange > threshold ? "REGRESSION" : "ok");
+
+            if (l_dChange > threshold) {
+                l_iFailed++;
+            }
+
+            l_iCompared[i] = 1;
+        }
+    }
+
+    for (i = 0; i < m_iMetrics; i++) {
+        if (!l_iCompared[i]) {
+            printf("perfcheck: %-40s not in baseline\n", m_SMetrics[i].name);
+            l_iFailed++;
+        }
+    }
+
+    return l_iFailed;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *l_SBaseline = NULL;
+    const char *l_strBaseline = NULL;
+    const char *l_strFilter = NULL;
+    const char *l_strPlayers[PERF_MAX_TOOLS];
+    const char *l_strDspPlayers[PERF_MAX_TOOLS];
+    const char *l_strRecorders[PERF_MAX_TOOLS];
+    char l_strRaw[1024];
+    char l_strRec[1024];
+    double l_dThreshold = PERF_DEFAULT_THRESHOLD;
+    int l_iPlayers = 0;
+    int l_iDspPlayers = 0;
+    int l_iRecorders = 0;
+    int l_iUpdate = 0;
+    int l_iFailed = 0;
+    int l_iOpt = 0;
+    int i = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "b:t:up:d:r:f:")) != -1) {
+        switch (l_iOpt) {
+            case 'b':
+                l_strBaseline = optarg;
+                break;
+
+            case 't':
+                l_dThreshold = atof(optarg);
+                break;
+
+            case 'u':
+                l_iUpdate = 1;
+                break;
+
+            case 'p':
+                if (l_iPlayers < PERF_MAX_TOOLS) {
+                    l_strPlayers[l_iPlayers++] = optarg;
+                }
+
+                break;
+
+            case 'd':
+                if (l_iDspPlayers < PERF_MAX_TOOLS) {
+                    l_strDspPlayers[l_iDspPlayers++] = optarg;
+                }
+
+                break;
+
+            case 'r':
+                if (l_iRecorders < PERF_MAX_TOOLS) {
+                    l_strRecorders[l_iRecorders++] = optarg;
+                }
+
+                break;
+
+            case 'f':
+                l_strFilter = optarg;
+                break;
+
+            default:
+                printf("Usage: %s [-b baseline [-u]] [-t percent] [-p player] [-d player] [-r recorder] [-f filter.wav] file.wav file.flac\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind + 2 > argc || (l_iUpdate && l_strBaseline == NULL)) {
+        printf("Usage: %s [-b baseline [-u]] [-t percent] [-p player] [-d player] [-r recorder] [-f filter.wav] file.wav file.flac\n", argv[0]);
+        return 2;
+    }
+
+    add_metric("decode_wav_mframes_s", decode_speed(argv[optind]), 1);
+    add_metric("decode_flac_mframes_s", decode_speed(argv[optind + 1]), 1);
+    add_metric("loudness_ns_frame", loudness_speed(argv[optind]), 0);
+
+    for (i = 0; i < l_iPlayers; i++) {
+        tool_metrics(l_strPlayers[i], "", argv[optind], NULL, NULL, NULL);
+    }
+
+    /* Same players with DSP paths in callback */
+    for (i = 0; i < l_iDspPlayers; i++) {
+        tool_metrics(l_strDspPlayers[i], "", argv[optind], NULL, NULL, NULL);
+        tool_metrics(l_strDspPlayers[i], "_dspchain", argv[optind], PERF_DSPCHAIN, NULL, NULL);
+
+        if (l_strFilter != NULL) {
+            tool_metrics(l_strDspPlayers[i], "_firfilter", argv[optind], NULL, l_strFilter, NULL);
+        }
+    }
+
+    if (l_iRecorders > 0) {
+        snprintf(l_strRaw, sizeof(l_strRaw), "%s.in.raw", argv[optind]);
+        snprintf(l_strRec, sizeof(l_strRec), "%s.rec.wav", argv[optind]);
+
+        if (make_raw_input(argv[optind], l_strRaw) < 0) {
+            return 2;
+        }
+
+        for (i = 0; i < l_iRecorders; i++) {
+            tool_metrics(l_strRecorders[i], "", l_strRec, NULL, NULL, l_strRaw);
+        }
+
+        unlink(l_strRaw);
+        unlink(l_strRec);
+    }
+
+    for (i = 0; i < m_iMetrics; i++) {
+        if (m_SMetrics[i].value <= 0.0) {
+            printf("perfcheck: Can't measure %s\n", m_SMetrics[i].name);
+            return 2;
+        }
+    }
+
+    if (l_strBaseline == NULL || l_iUpdate) {
+        for (i = 0; i < m_iMetrics; i++) {
+            printf("perfcheck: %-40s %10.3f\n", m_SMetrics[i].name, m_SMetrics[i].value);
+        }
+
+        if (l_strBaseline == NULL) {
+            printf("perfcheck: No baseline given. Nothing compared\n");
+            return PERF_SKIPPED;
+        }
+
+        return save_baseline(l_strBaseline) < 0 ? 2 : 0;
+    }
+
+    if (!(l_SBaseline = fopen(l_strBaseline, "r"))) {
+        printf("perfcheck: Can't read baseline %s. Save one with -u\n", l_strBaseline);
+        return 2;
+    }
+
+    l_iFailed = check_baseline(l_SBaseline, l_dThreshold);
+    fclose(l_SBaseline);
+
+    if (l_iFailed > 0) {
+        printf("perfcheck: %d results more than %.0f%% worse than baseline or not in it\n", l_iFailed, l_dThreshold);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+# Run by CTest (see CMakeLists.txt). Makes synthetic file with testgen, runs
+# player or recorder on simulated device (common/simdev.h) and checks with
+# testcompare that samples came through unchanged.
+#
+# MODE play: FILE is generated with RATE, CHANNELS and BITS, played with
+#            TOOL and what device got is compared as FORMAT.
+# MODE rec:  raw float input is generated, TOOL records it to FILE and
+#            file is compared against input.
+#
+# ARGS are given to TOOL before FILE (like "-t 0").
+#
+# With SDLDISK set player does not use simulated device but plays to SDL
+# disk audio driver, which writes what device got to the same output file.
+
+FILE(REMOVE ${FILE} ${FILE}.in.raw ${FILE}.out.raw)
+SET(ENV{SIMDEV} "${SIMDEV}")
+SEPARATE_ARGUMENTS(l_strArgs UNIX_COMMAND "${ARGS}")
+
+IF(MODE STREQUAL "rec")
+    EXECUTE_PROCESS(COMMAND ${GEN} -r ${RATE} -c ${CHANNELS} -b float ${FILE}.in.raw RESULT_VARIABLE l_iResult)
+    IF(NOT l_iResult EQUAL 0)
+        MESSAGE(FATAL_ERROR "testgen failed: ${l_iResult}")
+    ENDIF()
+
+    SET(ENV{SIMDEV_INPUT} "${FILE}.in.raw")
+    EXECUTE_PROCESS(COMMAND ${TOOL} ${l_strArgs} ${FILE} RESULT_VARIABLE l_iResult)
+    SET(l_strOutput ${FILE}.in.raw)
+ELSE()
+    EXECUTE_PROCESS(COMMAND ${GEN} -r ${RATE} -c ${CHANNELS} -b ${BITS} ${FILE} RESULT_VARIABLE l_iResult)
+    IF(NOT l_iResult EQUAL 0)
+        MESSAGE(FATAL_ERROR "testgen failed: ${l_iResult}")
+    ENDIF()
+
+    SET(ENV{SIMDEV_OUTPUT} "${FILE}.out.raw")
+
+    # Disk driver writes silence while device is paused
+    IF(SDLDISK)
+        SET(ENV{SDL_AUDIODRIVER} "disk")
+        SET(ENV{SDL_DISKAUDIOFILE} "${FILE}.out.raw")
+        SET(l_strCompareArgs -s)
+    ENDIF()
+
+    EXECUTE_PROCESS(COMMAND ${TOOL} ${l_strArgs} ${FILE} RESULT_VARIABLE l_iResult)
+    SET(l_strOutput ${FILE}.out.raw)
+ENDIF()
+
+IF(NOT l_iResult EQUAL 0)
+    MESSAGE(FATAL_ERROR "${TOOL} failed: ${l_iResult}")
+ENDIF()
+
+EXECUTE_PROCESS(COMMAND ${COMPARE} -f ${FORMAT} -t ${TOLERANCE} ${l_strCompareArgs} ${FILE} ${l_strOutput} RESULT_VARIABLE l_iResult)
+
+IF(NOT l_iResult EQUAL 0)
+    MESSAGE(FATAL_ERROR "Output differs from input")
+ENDIF()
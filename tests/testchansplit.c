@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Checks of channel splitter (common/chansplit.h) for tests (see tests/CMakeLists.txt)
+ *
+ * Vector deinterleave must give same planes as plain loop for any
+ * channel count, first channel and frame count, also when they are not
+ * multiples of four. Whole open, write, close must give files that read
+ * back as channels of input, and if some file can't be created none of
+ * them may be left behind.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs sndfile) -lpthread testchansplit.c -std=gnu11 -Wall -o testchansplit
+ *
+ * Run with ./testchansplit /some/dir/split.wav
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "chansplit.h"
+
+#define TESTCHECK_NAME "testchansplit"
+#include "testcheck.h"
+
+#define TEST_MAX_FRAMES 37
+#define TEST_RATE 8000
+
+/* Every sample tells its frame and channel */
+static float sample_of(long frame, int channel) {
+    return (float)(frame * 1000 + channel) / 1048576.0f;
+}
+
+static void fill(float *pcm, long frames, int channels) {
+    long i = 0;
+    int c = 0;
+
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < channels; c++) {
+            pcm[i * channels + c] = sample_of(i, c);
+        }
+    }
+}
+
+static int deinterleave_matches(int channels, int first, int count, long frames) {
+    float l_fPcm[TEST_MAX_FRAMES * 16];
+    float l_fPlane[16][TEST_MAX_FRAMES + 1];
+    float *l_ptrPlanes[16];
+    long i = 0;
+    int c = 0;
+
+    fill(l_fPcm, frames, channels);
+
+    for (c = 0; c < count; c++) {
+        l_ptrPlanes[c] = l_fPlane[c];
+        /* Guard after plane must stay untouched */
+        for (i = 0; i <= TEST_MAX_FRAMES; i++) {
+            l_fPlane[c][i] = -1.0f;
+        }
+    }
+
+    chansplit_deinterleave(l_fPcm, frames, channels, first, count, l_ptrPlanes);
+
+    for (c = 0; c < count; c++) {
+        for (i = 0; i < frames; i++) {
+            if (l_fPlane[c][i] != l_fPcm[i * channels + first + c]) {
+                return 0;
+            }
+        }
+
+        if (l_fPlane[c][frames] != -1.0f) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int copy_group_matches(int channels, int first, int count, long frames) {
+    float l_fPcm[TEST_MAX_FRAMES * 16];
+    float l_fOut[TEST_MAX_FRAMES * 16];
+    long i = 0;
+    int c = 0;
+
+    fill(l_fPcm, frames, channels);
+    chansplit_copy_group(l_fPcm, frames, channels, first, count, l_fOut);
+
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < count; c++) {
+            if (l_fOut[i * count + c] != sample_of(i, first + c)) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* Writes 'frames' of 'channels' in uneven blocks and reads every file back */
+static int split_reads_back(const char *template, int channels, int group, int workers, long frames) {
+    chansplit l_SSplit;
+    SF_INFO l_SInfo;
+    SNDFILE *l_SFile = NULL;
+    char l_strPath[PATH_MAX + 32];
+    float *l_fPcm = (float *)malloc(frames * channels * sizeof(float));
+    float *l_fRead = (float *)malloc(frames * group * sizeof(float));
+    long l_lDone = 0;
+    long l_lNow = 0;
+    long i = 0;
+    int l_iOk = l_fPcm != NULL && l_fRead != NULL;
+    int l_iCount = 0;
+    int g = 0;
+    int c = 0;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+    l_SInfo.channels = channels;
+    l_SInfo.samplerate = TEST_RATE;
+    l_SInfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+    if (!l_iOk || chansplit_open(&l_SSplit, template, &l_SInfo, group, workers) < 0) {
+        free(l_fPcm);
+        free(l_fRead);
+        return 0;
+    }
+
+    fill(l_fPcm, frames, channels);
+
+    /* Blocks of odd size so they don't line up with jobs. Full ring is
+       waited out, so frames left out count as overrun but are given again */
+    for (l_lDone = 0; l_lDone < frames; l_lDone += l_lNow) {
+        l_lNow = frames - l_lDone < 333 ? frames - l_lDone : 333;
+
+        if ((l_lNow = chansplit_write(&l_SSplit, l_fPcm + l_lDone * channels, l_lNow)) == 0) {
+            usleep(1000);
+        }
+    }
+
+    l_iOk = chansplit_close(&l_SSplit) == 0;
+
+    for (g = 0; g < channels; g += group) {
+        l_iCount = channels - g < group ? channels - g : group;
+        chansplit_name(template, g, l_iCount, l_strPath, sizeof(l_strPath));
+        memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+        if ((l_SFile = sf_open(l_strPath, SFM_READ, &l_SInfo)) == NULL) {
+            l_iOk = 0;
+            continue;
+        }
+
+        l_iOk = l_iOk && l_SInfo.channels == l_iCount && l_SInfo.frames == frames
+                && sf_readf_float(l_SFile, l_fRead, frames) == frames;
+
+        for (i = 0; l_iOk && i < frames; i++) {
+            for (c = 0; c < l_iCount; c++) {
+                l_iOk = l_iOk && l_fRead[i * l_iCount + c] == l_fPcm[i * channels + g + c];
+            }
+        }
+
+        sf_close(l_SFile);
+        unlink(l_strPath);
+    }
+
+    free(l_fPcm);
+    free(l_fRead);
+    return l_iOk;
+}
+
+/* Third file can't be made because directory has its name */
+static int failed_open_cleans(const char *template) {
+    chansplit l_SSplit;
+    SF_INFO l_SInfo;
+    char l_strPath[PATH_MAX + 32];
+    char l_strBlocker[PATH_MAX + 32];
+    int l_iOk = 1;
+    int i = 0;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+    l_SInfo.channels = 4;
+    l_SInfo.samplerate = TEST_RATE;
+    l_SInfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+    chansplit_name(template, 2, 1, l_strBlocker, sizeof(l_strBlocker));
+    rmdir(l_strBlocker);
+
+    if (mkdir(l_strBlocker, 0700) < 0) {
+        return 0;
+    }
+
+    l_iOk = chansplit_open(&l_SSplit, template, &l_SInfo, 1, 2) < 0;
+
+    for (i = 0; i < 4; i++) {
+        chansplit_name(template, i, 1, l_strPath, sizeof(l_strPath));
+
+        if (i != 2 && access(l_strPath, F_OK) == 0) {
+            l_iOk = 0;
+            unlink(l_strPath);
+        }
+    }
+
+    rmdir(l_strBlocker);
+    return l_iOk;
+}
+
+int main(int argc, char *argv[]) {
+    char l_strName[PATH_MAX + 32];
+    int l_iOk = 1;
+    int l_iChannels = 0;
+    int l_iFirst = 0;
+    int l_iCount = 0;
+    long l_lFrames = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s /some/dir/split.wav\n", argv[0]);
+        return 1;
+    }
+
+    for (l_iChannels = 1; l_iChannels <= 16; l_iChannels++) {
+        for (l_iFirst = 0; l_iFirst < l_iChannels; l_iFirst++) {
+            for (l_iCount = 1; l_iFirst + l_iCount <= l_iChannels; l_iCount++) {
+                for (l_lFrames = 0; l_lFrames <= TEST_MAX_FRAMES; l_lFrames += 3) {
+                    l_iOk = l_iOk && deinterleave_matches(l_iChannels, l_iFirst, l_iCount, l_lFrames);
+                }
+            }
+        }
+    }
+
+    check(l_iOk, "deinterleave same as scalar");
+
+    l_iOk = 1;
+
+    for (l_iChannels = 1; l_iChannels <= 16; l_iChannels += 3) {
+        for (l_iFirst = 0; l_iFirst < l_iChannels; l_iFirst++) {
+            for (l_iCount = 1; l_iFirst + l_iCount <= l_iChannels; l_iCount++) {
+                l_iOk = l_iOk && copy_group_matches(l_iChannels, l_iFirst, l_iCount, TEST_MAX_FRAMES);
+            }
+        }
+    }
+
+    check(l_iOk, "copy group");
+
+    chansplit_name("dir/rec.wav", 0, 1, l_strName, sizeof(l_strName));
+    l_iOk = !strcmp(l_strName, "dir/rec-ch01.wav");
+    chansplit_name("dir/rec.wav", 8, 8, l_strName, sizeof(l_strName));
+    l_iOk = l_iOk && !strcmp(l_strName, "dir/rec-ch09-16.wav");
+    chansplit_name("dir.d/rec", 63, 1, l_strName, sizeof(l_strName));
+    l_iOk = l_iOk && !strcmp(l_strName, "dir.d/rec-ch64");
+    check(l_iOk, "file names");
+
+    check(split_reads_back(argv[1], 10, 1, 3, 3 * CHANSPLIT_BLOCKSIZE + 77), "mono files read back");
+    check(split_reads_back(argv[1], 10, 4, 2, 3 * CHANSPLIT_BLOCKSIZE + 77), "groups of 4 of 10 channels read back");
+    check(split_reads_back(argv[1], 3, 8, 0, 100), "group larger than channels");
+    check(failed_open_cleans(argv[1]), "failed open removes made files");
+
+    return m_iFailed ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Check counter shared by tests of header only helpers.
+ *
+ * Define TESTCHECK_NAME (name of test program) before including. Every
+ * check() prints one 'ok' or 'FAILED' line and failures are counted in
+ * m_iFailed so main() can return non zero for CTest.
+ */
+
+#ifndef TESTCHECK_H
+#define TESTCHECK_H
+
+#include <stdio.h>
+
+#ifndef TESTCHECK_NAME
+#error "Define TESTCHECK_NAME before including testcheck.h"
+#endif
+
+static int m_iFailed = 0;
+
+static void check(int ok, const char *what) {
+    printf(TESTCHECK_NAME ": %-44s %s\n", what, ok ? "ok" : "FAILED");
+
+    if (!ok) {
+        m_iFailed++;
+    }
+}
+
+#endif
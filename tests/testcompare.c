@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Compare what tool played against file it played (see tests/CMakeLists.txt)
+ *
+ * Output is raw interleaved samples saved by simulated device
+ * (SIMDEV_OUTPUT, see common/simdev.h). Reference file is read in same
+ * sample format with libsndfile and every sample must be within tolerance
+ * (0 is bit-exact). Output may have silence after reference ends because
+ * devices play whole periods but missing or extra sound is error.
+ *
+ * -f is format of output: 'native' is what players pick without gain
+ * (see common/nativefmt.h), others are s16, s32 and float. Tolerance is
+ * in integer steps for integer formats and absolute for float.
+ *
+ * With -s output may start with silence too (device that runs while
+ * paused, like SDL disk audio driver). It is skipped so that first sound
+ * of output is compared against first sound of reference.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common -lsndfile -lm testcompare.c -std=c11 -Wall -o testcompare
+ *
+ * Run with ./testcompare [-f native|s16|s32|float] [-t tolerance] [-s] reference.[wav/flac/aiff] output.raw
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#include "nativefmt.h"
+
+#define COMPARE_FRAMES_PER_READ 4096
+
+/* One sample of stream format as number */
+static double sample_value(const nativefmt *nf, const unsigned char *buf, long i) {
+    const unsigned char *l_ptrSample = buf + i * nf->sample_bytes;
+    int16_t l_iS16 = 0;
+    int32_t l_iS32 = 0;
+    float l_fValue = 0.0f;
+
+    switch (nf->kind) {
+        case NATIVEFMT_S16:
+            memcpy(&l_iS16, l_ptrSample, sizeof(int16_t));
+            return l_iS16;
+
+        case NATIVEFMT_S24:
+            /* Packed little endian */
+            return (int32_t)((uint32_t)l_ptrSample[0] | ((uint32_t)l_ptrSample[1] << 8) | ((uint32_t)(int8_t)l_ptrSample[2] << 16));
+
+        case NATIVEFMT_S32:
+            memcpy(&l_iS32, l_ptrSample, sizeof(int32_t));
+            return l_iS32;
+
+        default:
+            memcpy(&l_fValue, l_ptrSample, sizeof(float));
+            return l_fValue;
+    }
+}
+
+static int pick_format(nativefmt *nf, SNDFILE *file, const SF_INFO *info, const char *name) {
+    nativefmt_pick(nf, file, info, strcmp(name, "native") != 0);
+
+    if (!strcmp(name, "s16")) {
+        nf->kind = NATIVEFMT_S16;
+        nf->sample_bytes = sizeof(short);
+    } else if (!strcmp(name, "s32")) {
+        nf->kind = NATIVEFMT_S32;
+        nf->sample_bytes = sizeof(int);
+    } else if (strcmp(name, "float") && strcmp(name, "native")) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int frame_is_silent(const unsigned char *frame, long frame_bytes) {
+    long i = 0;
+
+    for (i = 0; i < frame_bytes; i++) {
+        if (frame[i] != 0x00) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Frames of silence at start of reference. File is left at start */
+static long reference_silence(nativefmt *nf, SNDFILE *file, unsigned char *buf, int channels) {
+    long l_lFrameBytes = nativefmt_frame_bytes(nf);
+    long l_lSilent = 0;
+    long l_lGot = 0;
+    long i = 0;
+
+    while ((l_lGot = nativefmt_read(nf, file, buf, COMPARE_FRAMES_PER_READ * channels) / channels) > 0) {
+        for (i = 0; i < l_lGot && frame_is_silent(buf + i * l_lFrameBytes, l_lFrameBytes); i++) {
+            l_lSilent++;
+        }
+
+        if (i < l_lGot) {
+            break;
+        }
+    }
+
+    sf_seek(file, 0, SEEK_SET);
+    return l_lSilent;
+}
+
+/* Frames of silence at start of output. File is left at first sound */
+static long output_silence(FILE *output, unsigned char *buf, long frame_bytes) {
+    long l_lSilent = 0;
+
+    while (fread(buf, frame_bytes, 1, output) == 1) {
+        if (!frame_is_silent(buf, frame_bytes)) {
+            fseek(output, -frame_bytes, SEEK_CUR);
+            break;
+        }
+
+        l_lSilent++;
+    }
+
+    return l_lSilent;
+}
+
+int main(int argc, char *argv[]) {
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    FILE *l_SOutput = NULL;
+    nativefmt l_SFmt;
+    unsigned char *l_ptrReference = NULL;
+    unsigned char *l_ptrOutput = NULL;
+    const char *l_strFormat = "native";
+    double l_dTolerance = 0.0;
+    double l_dDiff = 0.0;
+    double l_dMaxDiff = 0.0;
+    long l_lFrameBytes = 0;
+    long l_lSamples = 0;
+    long l_lGot = 0;
+    long l_lFrames = 0;
+    long l_lOver = 0;
+    long l_lFirstOver = -1;
+    long l_lPadding = 0;
+    long l_lNoise = 0;
+    long l_lLeadIn = 0;
+    long i = 0;
+    int l_iSkipSilence = 0;
+    int l_iOpt = 0;
+    int l_iRetval = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "f:t:s")) != -1) {
+        switch (l_iOpt) {
+            case 'f':
+                l_strFormat = optarg;
+                break;
+
+            case 't':
+                l_dTolerance = atof(optarg);
+                break;
+
+            case 's':
+                l_iSkipSilence = 1;
+                break;
+
+            default:
+                printf("Usage: %s [-f native|s16|s32|float] [-t tolerance] [-s] reference output.raw\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind + 2 > argc) {
+        printf("Usage: %s [-f native|s16|s32|float] [-t tolerance] [-s] reference output.raw\n", argv[0]);
+        return 2;
+    }
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if (!(l_SFile = sf_open(argv[optind], SFM_READ, &l_SInfo))) {
+        printf("main: Not able to open reference %s.\n", argv[optind]);
+        return 2;
+    }
+
+    if (pick_format(&l_SFmt, l_SFile, &l_SInfo, l_strFormat) < 0) {
+        printf("main: Unknown format %s\n", l_strFormat);
+        sf_close(l_SFile);
+        return 2;
+    }
+
+    if (!(l_SOutput = fopen(argv[optind + 1], "rb"))) {
+        printf("main: Not able to open output %s.\n", argv[optind + 1]);
+        sf_close(l_SFile);
+        return 2;
+    }
+
+    l_lFrameBytes = nativefmt_frame_bytes(&l_SFmt);
+    l_ptrReference = (unsigned char *)malloc(COMPARE_FRAMES_PER_READ * l_lFrameBytes);
+    l_ptrOutput = (unsigned char *)malloc(COMPARE_FRAMES_PER_READ * l_lFrameBytes);
+
+    if (l_ptrReference == NULL || l_ptrOutput == NULL) {
+        l_iRetval = 2;
+        goto exit;
+    }
+
+    l_lSamples = COMPARE_FRAMES_PER_READ * l_SInfo.channels;
+
+    /* Reference may start with silence too. Only extra is lead-in */
+    if (l_iSkipSilence) {
+        l_lLeadIn = output_silence(l_SOutput, l_ptrOutput, l_lFrameBytes)
+                    - reference_silence(&l_SFmt, l_SFile, l_ptrReference, l_SInfo.channels);
+        l_lLeadIn = l_lLeadIn > 0 ? l_lLeadIn : 0;
+        fseek(l_SOutput, l_lLeadIn * l_lFrameBytes, SEEK_SET);
+    }
+
+    while ((l_lGot = nativefmt_read(&l_SFmt, l_SFile, l_ptrReference, l_lSamples)) > 0) {
+        if (fread(l_ptrOutput, l_SFmt.sample_bytes, l_lGot, l_SOutput) != (size_t)l_lGot) {
+            printf("main: Output ends at frame %ld of %ld\n", l_lFrames, (long)l_SInfo.frames);
+            l_iRetval = 1;
+            goto exit;
+        }
+
+        for (i = 0; i < l_lGot; i++) {
+            l_dDiff = fabs(sample_value(&l_SFmt, l_ptrReference, i) - sample_value(&l_SFmt, l_ptrOutput, i));
+            l_dMaxDiff = l_dDiff > l_dMaxDiff ? l_dDiff : l_dMaxDiff;
+
+            if (l_dDiff > l_dTolerance) {
+                l_lFirstOver = l_lFirstOver < 0 ? l_lFrames + i / l_SInfo.channels : l_lFirstOver;
+                l_lOver++;
+            }
+        }
+
+        l_lFrames += l_lGot / l_SInfo.channels;
+    }
+
+    /* Rest of output must be silence */
+    while ((l_lGot = (long)fread(l_ptrOutput, 1, COMPARE_FRAMES_PER_READ * l_lFrameBytes, l_SOutput)) > 0) {
+        for (i = 0; i < l_lGot; i++) {
+            l_lNoise += l_ptrOutput[i] != 0x00;
+        }
+
+        l_lPadding += l_lGot / l_lFrameBytes;
+    }
+
+    printf("testcompare: %ld frames as %s, max difference %g (tolerance %g), %ld samples over, %ld frames padding\n",
+           l_lFrames, nativefmt_name(&l_SFmt), l_dMaxDiff, l_dTolerance, l_lOver, l_lPadding);
+
+    if (l_iSkipSilence) {
+        printf("testcompare: %ld frames of silence before output\n", l_lLeadIn);
+    }
+
+    if (l_lFrames != l_SInfo.frames) {
+        printf("testcompare: Reference has %ld frames but only %ld could be read\n", (long)l_SInfo.frames, l_lFrames);
+        l_iRetval = 1;
+    }
+
+    if (l_lOver > 0) {
+        printf("testcompare: First difference at frame %ld\n", l_lFirstOver);
+        l_iRetval = 1;
+    }
+
+    if (l_lNoise > 0) {
+        printf("testcompare: %ld non zero bytes after end of reference\n", l_lNoise);
+        l_iRetval = 1;
+    }
+
+exit:
+    free(l_ptrReference);
+    free(l_ptrOutput);
+    fclose(l_SOutput);
+    sf_close(l_SFile);
+    return l_iRetval;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Checks of control loop (common/ctlloop.h) for tests (see tests/CMakeLists.txt)
+ *
+ * Every wakeup source is made to fire once and ctlloop_wait() must tell
+ * it and nothing else. Threads made after ctlloop_open() must have
+ * signals blocked so signal comes to signalfd and not to handler.
+ *
+ * Compile with
+ * gcc -g -I../common -lpthread testctlloop.c -std=c11 -Wall -o testctlloop
+ *
+ * Run with ./testctlloop
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ctlloop.h"
+
+#define TESTCHECK_NAME "testctlloop"
+#include "testcheck.h"
+
+static double now_ms(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec * 1e3 + l_STs.tv_nsec / 1e6;
+}
+
+/* Like audio thread: tells if SIGINT is blocked and notifies at end */
+static void *notify_thread(void *userdata) {
+    ctlloop *l_SControl = (ctlloop *)userdata;
+    sigset_t l_SMask;
+    static int l_iBlocked = 0;
+
+    pthread_sigmask(SIG_BLOCK, NULL, &l_SMask);
+    l_iBlocked = sigismember(&l_SMask, SIGINT) == 1;
+    usleep(20000);
+    ctlloop_notify(l_SControl);
+    return &l_iBlocked;
+}
+
+int main(int argc, char *argv[]) {
+    ctlloop l_SControl;
+    pthread_t l_SThread;
+    void *l_ptrBlocked = NULL;
+    int l_iPipe[2];
+    int l_iPair[2];
+    int l_iWhat = 0;
+    int l_iTicks = 0;
+    double l_dStart = 0.0;
+    char l_cByte = 0;
+
+    if (ctlloop_open(&l_SControl) < 0) {
+        printf("testctlloop: Can't open control loop\n");
+        return 1;
+    }
+
+    /* Done from other thread */
+    pthread_create(&l_SThread, NULL, notify_thread, &l_SControl);
+    l_iWhat = ctlloop_wait(&l_SControl);
+    pthread_join(l_SThread, &l_ptrBlocked);
+    check(l_iWhat == CTLLOOP_DONE, "notify from thread wakes with DONE");
+    check(*(int *)l_ptrBlocked, "signals blocked in thread made after open");
+
+    /* Deadline once and not early */
+    l_dStart = now_ms();
+    ctlloop_deadline(&l_SControl, 50);
+    l_iWhat = ctlloop_wait(&l_SControl);
+    check(l_iWhat == CTLLOOP_DEADLINE && now_ms() - l_dStart >= 49.0, "deadline after 50 ms");
+
+    /* Tick repeats until stopped */
+    ctlloop_tick(&l_SControl, 10);
+
+    while (l_iTicks < 3 && (l_iWhat = ctlloop_wait(&l_SControl)) == CTLLOOP_TICK) {
+        l_iTicks++;
+    }
+
+    ctlloop_tick(&l_SControl, 0);
+    check(l_iTicks == 3, "tick three times");
+
+    /* Blocked signal comes through signalfd */
+    kill(getpid(), SIGTERM);
+    l_iWhat = ctlloop_wait(&l_SControl);
+    check(l_iWhat == CTLLOOP_SIGNAL && l_SControl.signal == SIGTERM, "SIGTERM through signalfd");
+
+    /* Input descriptor. Caller reads it */
+    if (pipe(l_iPipe) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, l_iPair) < 0) {
+        printf("testctlloop: Can't make pipes\n");
+        return 1;
+    }
+
+    ctlloop_input(&l_SControl, l_iPipe[0]);
+    check(write(l_iPipe[1], "x", 1) == 1, "write to input pipe");
+    l_iWhat = ctlloop_wait(&l_SControl);
+    check(l_iWhat == CTLLOOP_INPUT && read(l_iPipe[0], &l_cByte, 1) == 1 && l_cByte == 'x', "input readable");
+    ctlloop_input(&l_SControl, -1);
+
+    /* Watched socket is in ready array. Unwatched one is not */
+    ctlloop_watch(&l_SControl, l_iPair[0]);
+    check(write(l_iPair[1], "y", 1) == 1, "write to watched socket");
+    l_iWhat = ctlloop_wait(&l_SControl);
+    check(l_iWhat == CTLLOOP_FD && l_SControl.ready_count == 1 && l_SControl.ready[0] == l_iPair[0],
+          "watched socket in ready array");
+    ctlloop_unwatch(&l_SControl, l_iPair[0]);
+    check(l_SControl.ready[0] == -1, "unwatch clears ready array");
+
+    /* Nothing left: only deadline may wake up now */
+    check(write(l_iPipe[1], "z", 1) == 1, "write to unwatched input");
+    ctlloop_deadline(&l_SControl, 20);
+    l_iWhat = ctlloop_wait(&l_SControl);
+    check(l_iWhat == CTLLOOP_DEADLINE, "unwatched descriptors stay quiet");
+
+    close(l_iPipe[0]);
+    close(l_iPipe[1]);
+    close(l_iPair[0]);
+    close(l_iPair[1]);
+    ctlloop_close(&l_SControl);
+
+    if (m_iFailed > 0) {
+        printf("testctlloop: %d checks failed\n", m_iFailed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Checks of realtime insert chain (common/dspchain.h) for tests (see tests/CMakeLists.txt)
+ *
+ * Limiter must hold ceiling on every sample. Slow 20 Hz sine rises for
+ * thousands of frames, so sliding minimum window is full of increasing
+ * gains and any mistake in how it drops old frames lets peak through.
+ * Signal under ceiling must come out untouched, lookahead frames late.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs sndfile) testdspchain.c -std=gnu11 -Wall -lm -o testdspchain
+ *
+ * Run with ./testdspchain
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dspchain.h"
+
+#define TESTCHECK_NAME "testdspchain"
+#include "testcheck.h"
+
+#define TEST_RATE 48000
+#define TEST_CHANNELS 2
+#define TEST_BLOCK 512
+#define TEST_SECONDS 2
+
+static float sine(long frame, double hz, double amplitude) {
+    return (float)(amplitude * sin(2.0 * M_PI * hz * frame / TEST_RATE));
+}
+
+/* Runs 'hz' sine of 'amplitude' through chain in player sized blocks.
+   Returns highest output peak and largest difference to input delayed
+   by lookahead */
+static int run_sine(const char *spec, double hz, double amplitude, float *peak, float *diff) {
+    dspchain l_SChain;
+    float l_fPcm[TEST_BLOCK * TEST_CHANNELS];
+    float l_fAbs = 0.0f;
+    long l_lFrames = (long)TEST_SECONDS * TEST_RATE;
+    long l_lDone = 0;
+    long l_lFrame = 0;
+    long l_lValid = 0;
+    long l_lOut = 0;
+    long i = 0;
+    int c = 0;
+
+    if (dspchain_open(&l_SChain, TEST_RATE, TEST_CHANNELS, spec) < 0) {
+        return -1;
+    }
+
+    *peak = 0.0f;
+    *diff = 0.0f;
+
+    for (l_lDone = 0; l_lDone < l_lFrames; l_lDone += TEST_BLOCK) {
+        for (i = 0; i < TEST_BLOCK; i++) {
+            for (c = 0; c < TEST_CHANNELS; c++) {
+                l_fPcm[i * TEST_CHANNELS + c] = sine(l_lDone + i, hz, amplitude);
+            }
+        }
+
+        l_lValid = dspchain_process(&l_SChain, l_fPcm, TEST_BLOCK, TEST_BLOCK);
+
+        for (i = 0; i < l_lValid * TEST_CHANNELS; i++) {
+            l_fAbs = fabsf(l_fPcm[i]);
+            *peak = l_fAbs > *peak ? l_fAbs : *peak;
+
+            /* Not primed: first lookahead frames out are silence */
+            l_lFrame = l_lOut + i / TEST_CHANNELS - l_SChain.lookahead;
+            l_fAbs = fabsf(l_fPcm[i] - (l_lFrame < 0 ? 0.0f : sine(l_lFrame, hz, amplitude)));
+            *diff = l_fAbs > *diff ? l_fAbs : *diff;
+        }
+
+        l_lOut += l_lValid;
+    }
+
+    dspchain_free(&l_SChain);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    float l_fCeiling = (float)dspchain_db_to_gain(-1.0);
+    float l_fPeak = 0.0f;
+    float l_fDiff = 0.0f;
+    char l_strWhat[64];
+
+    if (run_sine("limit=-1,lookahead=5", 20.0, 3.0, &l_fPeak, &l_fDiff) < 0) {
+        fprintf(stderr, "main: Can't open chain\n");
+        return 1;
+    }
+
+    snprintf(l_strWhat, sizeof(l_strWhat), "20 Hz 3x full scale peak %.4f", l_fPeak);
+    check(l_fPeak <= l_fCeiling * 1.0001f, l_strWhat);
+    check(l_fPeak >= l_fCeiling * 0.99f, "limited sine reaches ceiling");
+
+    run_sine("limit=-1,lookahead=1", 20.0, 3.0, &l_fPeak, &l_fDiff);
+    snprintf(l_strWhat, sizeof(l_strWhat), "1 ms lookahead peak %.4f", l_fPeak);
+    check(l_fPeak <= l_fCeiling * 1.0001f, l_strWhat);
+
+    run_sine("limit=-1,lookahead=5", 1000.0, 2.0, &l_fPeak, &l_fDiff);
+    snprintf(l_strWhat, sizeof(l_strWhat), "1 kHz 2x full scale peak %.4f", l_fPeak);
+    check(l_fPeak <= l_fCeiling * 1.0001f, l_strWhat);
+
+    run_sine("limit=-1,lookahead=5", 20.0, 0.5, &l_fPeak, &l_fDiff);
+    check(l_fDiff < 1e-5f, "quiet sine passes unchanged and in step");
+
+    return m_iFailed ? 1 : 0;
+}
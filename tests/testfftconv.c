@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Checks of partitioned convolution (common/fftconv.h) for tests (see tests/CMakeLists.txt)
+ *
+ * Output must be same as plain direct convolution sum for filters
+ * shorter than, equal to and longer than one partition, partition sizes
+ * from smallest up, shared and per-channel filters and blocks that don't
+ * line up with partitions. Filter that becomes ready while audio runs
+ * must be exact once its crossfade block is over.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs sndfile) -lpthread testfftconv.c -std=gnu11 -Wall -lm -o testfftconv
+ *
+ * Run with ./testfftconv
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fftconv.h"
+
+#define TESTCHECK_NAME "testfftconv"
+#include "testcheck.h"
+
+#define TEST_FRAMES 6000
+/* Odd callback size so blocks don't line up with partitions */
+#define TEST_BLOCK 333
+
+static float *noise(long samples, unsigned int seed) {
+    float *l_fOut = (float *)malloc(samples * sizeof(float));
+    long i = 0;
+
+    for (i = 0; l_fOut != NULL && i < samples; i++) {
+        seed = seed * 1103515245 + 12345;
+        l_fOut[i] = ((seed >> 8) & 0xffff) / 65536.0f - 0.5f;
+    }
+
+    return l_fOut;
+}
+
+/* Largest difference to direct convolution from frame 'from' on, relative
+   to largest output. 'late' frames are run dry before filter is ready */
+static double compare(long partition, long taps, int channels, int filter_channels, long late, long from) {
+    fftconv l_SConv;
+    float *l_fIn = noise(TEST_FRAMES * channels, 1);
+    float *l_fTaps = noise(taps * filter_channels, 2);
+    float *l_fOut = (float *)malloc(TEST_FRAMES * channels * sizeof(float));
+    double l_dSum = 0.0;
+    double l_dMax = 0.0;
+    double l_dDiff = 0.0;
+    long l_lDone = 0;
+    long l_lNow = 0;
+    long i = 0;
+    long j = 0;
+    int f = 0;
+    int c = 0;
+
+    if (l_fIn == NULL || l_fTaps == NULL || l_fOut == NULL
+            || fftconv_init(&l_SConv, channels, partition, taps, filter_channels) < 0) {
+        free(l_fIn);
+        free(l_fTaps);
+        free(l_fOut);
+        return 1.0;
+    }
+
+    memcpy(l_fOut, l_fIn, TEST_FRAMES * channels * sizeof(float));
+
+    if (late == 0) {
+        fftconv_prepare(&l_SConv, l_fTaps);
+    }
+
+    for (l_lDone = 0; l_lDone < TEST_FRAMES; l_lDone += l_lNow) {
+        l_lNow = TEST_FRAMES - l_lDone < TEST_BLOCK ? TEST_FRAMES - l_lDone : TEST_BLOCK;
+        l_lNow = late > l_lDone && late - l_lDone < l_lNow ? late - l_lDone : l_lNow;
+        fftconv_process(&l_SConv, l_fOut + l_lDone * channels, l_lNow);
+
+        if (late > 0 && l_lDone + l_lNow == late) {
+            fftconv_prepare(&l_SConv, l_fTaps);
+        }
+    }
+
+    for (i = from; i < TEST_FRAMES; i++) {
+        for (c = 0; c < channels; c++) {
+            f = filter_channels == 1 ? 0 : c;
+            l_dSum = 0.0;
+
+            for (j = 0; j < taps && j <= i; j++) {
+                l_dSum += (double)l_fTaps[j * filter_channels + f] * l_fIn[(i - j) * channels + c];
+            }
+
+            l_dMax = fabs(l_dSum) > l_dMax ? fabs(l_dSum) : l_dMax;
+            l_dDiff = fabs(l_dSum - l_fOut[i * channels + c]) > l_dDiff ? fabs(l_dSum - l_fOut[i * channels + c]) : l_dDiff;
+        }
+    }
+
+    fftconv_close(&l_SConv);
+    free(l_fIn);
+    free(l_fTaps);
+    free(l_fOut);
+    return l_dMax > 0.0 ? l_dDiff / l_dMax : 1.0;
+}
+
+int main(int argc, char *argv[]) {
+    char l_strWhat[64];
+    static const long l_lCases[][4] = {
+        /* partition, taps, channels, filter channels */
+        { 16, 1, 1, 1 },
+        { 16, 16, 1, 1 },
+        { 16, 17, 1, 1 },
+        { 64, 40, 2, 1 },
+        { 64, 64 * 5 + 13, 2, 2 },
+        { 256, 256 * 3, 3, 1 },
+        { 256, 2000, 3, 3 },
+        { 1024, 4097, 1, 1 },
+    };
+    double l_dError = 0.0;
+    unsigned int i = 0;
+
+    for (i = 0; i < sizeof(l_lCases) / sizeof(l_lCases[0]); i++) {
+        l_dError = compare(l_lCases[i][0], l_lCases[i][1], (int)l_lCases[i][2], (int)l_lCases[i][3], 0, 0);
+        snprintf(l_strWhat, sizeof(l_strWhat), "P %4ld taps %4ld ch %ld/%ld error %.1e",
+                 l_lCases[i][0], l_lCases[i][1], l_lCases[i][2], l_lCases[i][3], l_dError);
+        check(l_dError < 1e-5, l_strWhat);
+    }
+
+    /* Ready after 1000 frames: block at 1024 fades in, exact from 1088 */
+    l_dError = compare(64, 64 * 7 + 5, 2, 1, 1000, 1024 + 64);
+    snprintf(l_strWhat, sizeof(l_strWhat), "late filter after crossfade error %.1e", l_dError);
+    check(l_dError < 1e-5, l_strWhat);
+
+    return m_iFailed ? 1 : 0;
+}
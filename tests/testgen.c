@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Synthetic test file generator for tests (see tests/CMakeLists.txt)
+ *
+ * Writes sine of different frequency to every channel with a little
+ * pseudo random noise so all bits of samples change. Same arguments
+ * give same file every time. Container comes from file name: .wav,
+ * .flac, .aiff or .raw (headerless, native byte order).
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -lsndfile -lm testgen.c -std=c11 -Wall -o testgen
+ *
+ * Run with ./testgen [-r rate] [-c channels] [-b 8|16|24|32|float] [-s seconds] some.[wav/flac/aiff/raw]
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#define GEN_FRAMES_PER_WRITE 4096
+
+/* Container from file name extension */
+static int container_for(const char *path) {
+    const char *l_strDot = strrchr(path, '.');
+
+    if (l_strDot == NULL) {
+        return 0;
+    } else if (!strcasecmp(l_strDot, ".wav")) {
+        return SF_FORMAT_WAV;
+    } else if (!strcasecmp(l_strDot, ".flac")) {
+        return SF_FORMAT_FLAC;
+    } else if (!strcasecmp(l_strDot, ".aiff") || !strcasecmp(l_strDot, ".aif")) {
+        return SF_FORMAT_AIFF;
+    } else if (!strcasecmp(l_strDot, ".raw")) {
+        return SF_FORMAT_RAW | SF_ENDIAN_CPU;
+    }
+
+    return 0;
+}
+
+static int subformat_for(const char *bits, int container) {
+    /* WAV has only unsigned 8-bit */
+    if (!strcmp(bits, "8")) {
+        return container == SF_FORMAT_WAV ? SF_FORMAT_PCM_U8 : SF_FORMAT_PCM_S8;
+    } else if (!strcmp(bits, "16")) {
+        return SF_FORMAT_PCM_16;
+    } else if (!strcmp(bits, "24")) {
+        return SF_FORMAT_PCM_24;
+    } else if (!strcmp(bits, "32")) {
+        return SF_FORMAT_PCM_32;
+    } else if (!strcmp(bits, "float")) {
+        return SF_FORMAT_FLOAT;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    float *l_fBuffer = NULL;
+    const char *l_strBits = "16";
+    double l_dSeconds = 2.0;
+    uint32_t l_iNoise = 0x12345678;
+    long l_lFrames = 0;
+    long l_lDone = 0;
+    long l_lCount = 0;
+    long i = 0;
+    int j = 0;
+    int l_iOpt = 0;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+    l_SInfo.samplerate = 44100;
+    l_SInfo.channels = 2;
+
+    while ((l_iOpt = getopt(argc, argv, "r:c:b:s:")) != -1) {
+        switch (l_iOpt) {
+            case 'r':
+                l_SInfo.samplerate = atoi(optarg);
+                break;
+
+            case 'c':
+                l_SInfo.channels = atoi(optarg);
+                break;
+
+            case 'b':
+                l_strBits = optarg;
+                break;
+
+            case 's':
+                l_dSeconds = atof(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-r rate] [-c channels] [-b 8|16|24|32|float] [-s seconds] file\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || container_for(argv[optind]) == 0 || subformat_for(l_strBits, 0) == 0
+            || l_SInfo.samplerate <= 0 || l_SInfo.channels <= 0 || l_dSeconds <= 0.0) {
+        printf("Usage: %s [-r rate] [-c channels] [-b 8|16|24|32|float] [-s seconds] file\n", argv[0]);
+        return 1;
+    }
+
+    l_SInfo.format = container_for(argv[optind]) | subformat_for(l_strBits, container_for(argv[optind]));
+
+    if (!sf_format_check(&l_SInfo)) {
+        printf("main: %s can't have %s bit samples\n", argv[optind], l_strBits);
+        return 1;
+    }
+
+    if (!(l_SFile = sf_open(argv[optind], SFM_WRITE, &l_SInfo))) {
+        printf("main: Not able to open output file %s.\n", argv[optind]);
+        sf_perror(NULL);
+        return 1;
+    }
+
+    l_fBuffer = (float *)malloc(GEN_FRAMES_PER_WRITE * l_SInfo.channels * sizeof(float));
+
+    if (l_fBuffer == NULL) {
+        sf_close(l_SFile);
+        return 1;
+    }
+
+    l_lFrames = (long)(l_dSeconds * l_SInfo.samplerate);
+
+    while (l_lDone < l_lFrames) {
+        l_lCount = l_lFrames - l_lDone < GEN_FRAMES_PER_WRITE ? l_lFrames - l_lDone : GEN_FRAMES_PER_WRITE;
+
+        for (i = 0; i < l_lCount; i++) {
+            for (j = 0; j < l_SInfo.channels; j++) {
+                /* Numerical Recipes LCG */
+                l_iNoise = l_iNoise * 1664525u + 1013904223u;
+                l_fBuffer[i * l_SInfo.channels + j] = (float)(0.5 * sin(2.0 * M_PI * (220.0 * (j + 1) + 17.0) * (l_lDone + i) / l_SInfo.samplerate)
+                                                      + ((int32_t)l_iNoise / 2147483648.0) * 0.001);
+            }
+        }
+
+        if (sf_writef_float(l_SFile, l_fBuffer, l_lCount) != l_lCount) {
+            printf("main: Can't write %s\n", argv[optind]);
+            break;
+        }
+
+        l_lDone += l_lCount;
+    }
+
+    free(l_fBuffer);
+    sf_close(l_SFile);
+
+    if (l_lDone < l_lFrames) {
+        return 1;
+    }
+
+    printf("Wrote %s: %ld frames, %d Hz, %d channels, %s bit\n", argv[optind], l_lFrames,
+           l_SInfo.samplerate, l_SInfo.channels, l_strBits);
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Checks of resident player engine (common/playdaemon.h) for tests (see tests/CMakeLists.txt)
+ *
+ * Test is client and audio thread of daemon at same time: it sends lines
+ * to socket, runs control loop of daemon until answer comes and calls
+ * playdaemon_fill() like audio callback would. Socket must be private,
+ * every command must get its answer, played frames must be frames of
+ * file and too long line must get one error and nothing else.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common $(pkg-config --cflags --libs sndfile) -lm testplaydaemon.c -std=gnu11 -Wall -o testplaydaemon
+ *
+ * Run with ./testplaydaemon [/some/dir]
+ *
+ * Without directory one is made under /tmp and removed at end. Socket
+ * path must fit to sockaddr_un so deep build directory is not used.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "playdaemon.h"
+
+#define TESTCHECK_NAME "testplaydaemon"
+#include "testcheck.h"
+
+#define TEST_RATE 8000
+#define TEST_CHANNELS 2
+#define TEST_FRAMES 3000
+#define TEST_BLOCK 256
+
+static ctlloop m_SControl;
+static playdaemon m_SDaemon;
+static char m_strBuffer[PLAYDAEMON_LINE];
+static size_t m_lUsed = 0;
+
+static float sample_of(long frame, int channel) {
+    return (float)((frame % 1000) - 500 + channel * 0.25) / 1024.0f;
+}
+
+/* Runs daemon until client has whole answer line. Returns -1 if it
+   doesn't come */
+static int answer(int fd, char *line, size_t len) {
+    char *l_strEnd = NULL;
+    ssize_t l_lGot = 0;
+    int l_iTries = 0;
+
+    while ((l_strEnd = memchr(m_strBuffer, '\n', m_lUsed)) == NULL) {
+        l_lGot = recv(fd, m_strBuffer + m_lUsed, sizeof(m_strBuffer) - m_lUsed, MSG_DONTWAIT);
+
+        if (l_lGot > 0) {
+            m_lUsed += l_lGot;
+            continue;
+        }
+
+        if (l_lGot == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || l_iTries++ > 100) {
+            return -1;
+        }
+
+        ctlloop_deadline(&m_SControl, 20);
+        playdaemon_handle(&m_SDaemon, ctlloop_wait(&m_SControl));
+    }
+
+    *l_strEnd = '\0';
+    snprintf(line, len, "%s", m_strBuffer);
+    m_lUsed -= l_strEnd + 1 - m_strBuffer;
+    memmove(m_strBuffer, l_strEnd + 1, m_lUsed);
+    return 0;
+}
+
+static int ask(int fd, const char *command, char *line, size_t len) {
+    if (send(fd, command, strlen(command), MSG_NOSIGNAL) != (ssize_t)strlen(command)) {
+        return -1;
+    }
+
+    return answer(fd, line, len);
+}
+
+static int write_tone(const char *path) {
+    float l_fPcm[TEST_FRAMES * TEST_CHANNELS];
+    SF_INFO l_SInfo;
+    SNDFILE *l_SFile = NULL;
+    long i = 0;
+    int c = 0;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+    l_SInfo.samplerate = TEST_RATE;
+    l_SInfo.channels = TEST_CHANNELS;
+    l_SInfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+    for (i = 0; i < TEST_FRAMES; i++) {
+        for (c = 0; c < TEST_CHANNELS; c++) {
+            l_fPcm[i * TEST_CHANNELS + c] = sample_of(i, c);
+        }
+    }
+
+    if ((l_SFile = sf_open(path, SFM_WRITE, &l_SInfo)) == NULL) {
+        return -1;
+    }
+
+    c = sf_writef_float(l_SFile, l_fPcm, TEST_FRAMES) == TEST_FRAMES ? 0 : -1;
+    sf_close(l_SFile);
+    return c;
+}
+
+/* Audio thread until item is done. Returns frames that were not file */
+static long play_through(int fd, char *started, char *done, size_t len) {
+    float l_fOut[TEST_BLOCK * TEST_CHANNELS];
+    long l_lFrame = 0;
+    long l_lWrong = 0;
+    long i = 0;
+    int c = 0;
+
+    started[0] = '\0';
+    done[0] = '\0';
+
+    while (l_lFrame < TEST_FRAMES + TEST_BLOCK) {
+        playdaemon_fill(&m_SDaemon, l_fOut, TEST_BLOCK);
+
+        for (i = 0; i < TEST_BLOCK; i++, l_lFrame++) {
+            for (c = 0; c < TEST_CHANNELS; c++) {
+                l_lWrong += l_fOut[i * TEST_CHANNELS + c] != (l_lFrame < TEST_FRAMES ? sample_of(l_lFrame, c) : 0.0f);
+            }
+        }
+    }
+
+    if (answer(fd, started, len) < 0 || answer(fd, done, len) < 0) {
+        return -1;
+    }
+
+    return l_lWrong;
+}
+
+int main(int argc, char *argv[]) {
+    char l_strPath[PATH_MAX];
+    char l_strTemp[] = "/tmp/testplaydaemon-XXXXXX";
+    char l_strSocket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char l_strWant[PATH_MAX + 32];
+    char l_strCommand[PATH_MAX + 64];
+    char l_strLine[PLAYDAEMON_LINE];
+    char l_strDone[PLAYDAEMON_LINE];
+    char *l_strLong = NULL;
+    struct sockaddr_un l_SAddr;
+    struct stat l_SStat;
+    long l_lWrong = 0;
+    int l_iFd = -1;
+
+    if (argc < 2 && mkdtemp(l_strTemp) != NULL) {
+        snprintf(l_strPath, sizeof(l_strPath), "%s", l_strTemp);
+    } else if (argc < 2 || realpath(argv[1], l_strPath) == NULL) {
+        fprintf(stderr, "Usage: %s [/some/dir]\n", argv[0]);
+        return 1;
+    }
+
+    unsetenv("XDG_RUNTIME_DIR");
+    playdaemon_default_socket(l_strSocket, sizeof(l_strSocket));
+    snprintf(l_strWant, sizeof(l_strWant), "/tmp/playdaemon-%u.sock", (unsigned int)getuid());
+    check(!strcmp(l_strSocket, l_strWant), "default socket without runtime dir");
+
+    setenv("XDG_RUNTIME_DIR", l_strPath, 1);
+    playdaemon_default_socket(l_strSocket, sizeof(l_strSocket));
+    snprintf(l_strWant, sizeof(l_strWant), "%s/playdaemon.sock", l_strPath);
+    check(!strcmp(l_strSocket, l_strWant), "default socket in runtime dir");
+
+    if (ctlloop_open(&m_SControl) < 0 || playdaemon_open(&m_SDaemon, &m_SControl, TEST_RATE, TEST_CHANNELS, NULL) < 0) {
+        fprintf(stderr, "main: Can't start daemon in %s\n", l_strPath);
+        return 1;
+    }
+
+    check(stat(l_strSocket, &l_SStat) == 0 && S_ISSOCK(l_SStat.st_mode) && (l_SStat.st_mode & 0777) == 0600,
+          "socket only for owner");
+
+    memset(&l_SAddr, 0x00, sizeof(l_SAddr));
+    l_SAddr.sun_family = AF_UNIX;
+    snprintf(l_SAddr.sun_path, sizeof(l_SAddr.sun_path), "%s", l_strSocket);
+    l_iFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (l_iFd < 0 || connect(l_iFd, (struct sockaddr *)&l_SAddr, sizeof(l_SAddr)) < 0) {
+        fprintf(stderr, "main: Can't connect %s: %s\n", l_strSocket, strerror(errno));
+        return 1;
+    }
+
+    check(ask(l_iFd, "status\n", l_strLine, sizeof(l_strLine)) == 0
+          && !strcmp(l_strLine, "status idle queued 0 played 0"), "status when idle");
+    check(ask(l_iFd, "bogus\r\n", l_strLine, sizeof(l_strLine)) == 0
+          && !strcmp(l_strLine, "error unknown command 'bogus'"), "unknown command");
+
+    /* Three buffers full and some more, then a good line */
+    l_strLong = (char *)malloc(PLAYDAEMON_LINE * 3 + 128);
+    memset(l_strLong, 'x', PLAYDAEMON_LINE * 3 + 100);
+    strcpy(l_strLong + PLAYDAEMON_LINE * 3 + 100, "\nstatus\n");
+    check(ask(l_iFd, l_strLong, l_strLine, sizeof(l_strLine)) == 0
+          && !strcmp(l_strLine, "error line too long"), "too long line is error");
+    check(answer(l_iFd, l_strLine, sizeof(l_strLine)) == 0 && !strncmp(l_strLine, "status idle", 11),
+          "rest of too long line is ignored");
+    free(l_strLong);
+
+    snprintf(l_strWant, sizeof(l_strWant), "%s/playdaemon-tone.wav", l_strPath);
+
+    if (write_tone(l_strWant) < 0) {
+        fprintf(stderr, "main: Can't write %s\n", l_strWant);
+        return 1;
+    }
+
+    snprintf(l_strCommand, sizeof(l_strCommand), "play %s\n", l_strWant);
+    check(ask(l_iFd, l_strCommand, l_strLine, sizeof(l_strLine)) == 0 && !strcmp(l_strLine, "ok 1"), "play answers ok");
+    l_lWrong = play_through(l_iFd, l_strLine, l_strDone, sizeof(l_strLine));
+    check(!strncmp(l_strLine, "started 1 ", 10) && !strcmp(l_strDone, "done 1"), "started and done");
+    check(l_lWrong == 0, "played frames are frames of file");
+    check(ask(l_iFd, "status\n", l_strLine, sizeof(l_strLine)) == 0
+          && !strcmp(l_strLine, "status idle queued 0 played 1"), "status after play");
+
+    snprintf(l_strCommand, sizeof(l_strCommand), "queue %s/no-such-file.wav\n", l_strPath);
+    check(ask(l_iFd, l_strCommand, l_strLine, sizeof(l_strLine)) == 0 && !strncmp(l_strLine, "error can't open", 16),
+          "missing file is error");
+
+    close(l_iFd);
+    unlink(l_strWant);
+    playdaemon_close(&m_SDaemon);
+    ctlloop_close(&m_SControl);
+    check(access(l_strSocket, F_OK) < 0, "socket removed at close");
+
+    if (argc < 2) {
+        rmdir(l_strPath);
+    }
+
+    return m_iFailed ? 1 : 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Checks of real FFT (common/realfft.h) and spectrum side-chain
+ * (common/spectrum.h) for tests (see tests/CMakeLists.txt)
+ *
+ * Every bin of real FFT must match plain DFT and inverse must give input
+ * back 'size' times too big. Spectrum worker must put full scale sine at
+ * 0 dB in its own bin for float and integer samples, keep channels apart
+ * and leave bins away from sine near floor.
+ *
+ * Compile with
+ * gcc -g -I../common -lpthread testspectrum.c -std=gnu11 -Wall -lm -o testspectrum
+ *
+ * Run with ./testspectrum
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "realfft.h"
+#include "spectrum.h"
+
+#define TESTCHECK_NAME "testspectrum"
+#include "testcheck.h"
+
+#define TEST_RATE 48000
+#define TEST_FFT 1024
+#define TEST_MAX_SIZE 1024
+
+/* Largest bin error against DFT of 2 * size samples relative to largest
+   bin, and largest round trip error relative to largest sample */
+static void realfft_errors(int size, double *forward, double *inverse) {
+    realfft l_SFft;
+    float l_fIn[TEST_MAX_SIZE * 2];
+    float l_fOut[TEST_MAX_SIZE * 2];
+    float l_fScratch[TEST_MAX_SIZE * 2];
+    float l_fRe[TEST_MAX_SIZE + 1];
+    float l_fIm[TEST_MAX_SIZE + 1];
+    unsigned int l_iSeed = (unsigned int)size;
+    double l_dRe = 0.0;
+    double l_dIm = 0.0;
+    double l_dMax = 0.0;
+    double l_dErr = 0.0;
+    int N = size * 2;
+    int k = 0;
+    int n = 0;
+
+    *forward = 1.0;
+    *inverse = 1.0;
+
+    if (realfft_init(&l_SFft, size) < 0) {
+        return;
+    }
+
+    for (n = 0; n < N; n++) {
+        l_iSeed = l_iSeed * 1103515245 + 12345;
+        l_fIn[n] = ((l_iSeed >> 8) & 0xffff) / 65536.0f - 0.5f;
+    }
+
+    realfft_forward(&l_SFft, l_fIn, l_fRe, l_fIm, l_fScratch);
+
+    for (k = 0; k <= size; k++) {
+        l_dRe = 0.0;
+        l_dIm = 0.0;
+
+        for (n = 0; n < N; n++) {
+            l_dRe += l_fIn[n] * cos(2.0 * M_PI * k * n / N);
+            l_dIm -= l_fIn[n] * sin(2.0 * M_PI * k * n / N);
+        }
+
+        l_dMax = hypot(l_dRe, l_dIm) > l_dMax ? hypot(l_dRe, l_dIm) : l_dMax;
+        l_dErr = hypot(l_dRe - l_fRe[k], l_dIm - l_fIm[k]) > l_dErr ? hypot(l_dRe - l_fRe[k], l_dIm - l_fIm[k]) : l_dErr;
+    }
+
+    *forward = l_dErr / l_dMax;
+
+    realfft_inverse(&l_SFft, l_fRe, l_fIm, l_fOut, l_fScratch);
+    l_dErr = 0.0;
+
+    for (n = 0; n < N; n++) {
+        l_dErr = fabs(l_fOut[n] / size - l_fIn[n]) > l_dErr ? fabs(l_fOut[n] / size - l_fIn[n]) : l_dErr;
+    }
+
+    *inverse = l_dErr / 0.5;
+    realfft_free(&l_SFft);
+}
+
+/* Pushes sines at centre of 'bin0' (0 dBFS) and 'bin1' (-20 dBFS) to
+   channels 0 and 1 as 'sample_bytes' samples and reads last frame */
+static int analyse_sines(int sample_bytes, int bin0, int bin1, float *db) {
+    spectrum l_SSp;
+    unsigned char l_ucBlock[256 * 2 * 4];
+    struct timespec l_STs = { 0, 1000000 };
+    uint64_t l_lPosition = 0;
+    double l_dValue = 0.0;
+    long l_lFrame = 0;
+    long i = 0;
+    int l_iTries = 0;
+    int32_t l_iValue = 0;
+    int c = 0;
+
+    if (spectrum_open(&l_SSp, TEST_RATE, 2, sample_bytes, "size=1024,overlap=50") < 0) {
+        return -1;
+    }
+
+    /* Four windows in 256 frame blocks like callback */
+    for (l_lFrame = 0; l_lFrame < TEST_FFT * 4; l_lFrame += 256) {
+        for (i = 0; i < 256; i++) {
+            for (c = 0; c < 2; c++) {
+                l_dValue = c == 0 ? sin(2.0 * M_PI * bin0 * (l_lFrame + i) / TEST_FFT)
+                           : 0.1 * sin(2.0 * M_PI * bin1 * (l_lFrame + i) / TEST_FFT);
+
+                switch (sample_bytes) {
+                    case 2:
+                        ((short *)l_ucBlock)[i * 2 + c] = (short)lrint(l_dValue * 32767.0);
+                        break;
+
+                    case 4:
+                        ((int32_t *)l_ucBlock)[i * 2 + c] = (int32_t)lrint(l_dValue * 2147483647.0);
+                        break;
+
+                    case 3:
+                        l_iValue = (int32_t)lrint(l_dValue * 8388607.0);
+                        memcpy(l_ucBlock + (i * 2 + c) * 3, &l_iValue, 3);
+                        break;
+
+                    default:
+                        ((float *)l_ucBlock)[i * 2 + c] = (float)l_dValue;
+                        break;
+                }
+            }
+        }
+
+        spectrum_push(&l_SSp, l_ucBlock, 256);
+    }
+
+    /* Hop is 512 so there are 8 frames */
+    while (spectrum_written(&l_SSp) < (TEST_FFT * 4) / 512 && l_iTries++ < 2000) {
+        nanosleep(&l_STs, NULL);
+    }
+
+    c = spectrum_read(&l_SSp, spectrum_written(&l_SSp) - 1, &l_lPosition, db);
+    c = c == 0 && l_lPosition == TEST_FFT * 4 ? 0 : -1;
+    spectrum_close(&l_SSp);
+    return c;
+}
+
+static int loudest(const float *db, int bins) {
+    int l_iBest = 0;
+    int i = 0;
+
+    for (i = 1; i < bins; i++) {
+        l_iBest = db[i] > db[l_iBest] ? i : l_iBest;
+    }
+
+    return l_iBest;
+}
+
+/* Loudest bin more than 'guard' bins away from 'bin' */
+static float leakage(const float *db, int bins, int bin, int guard) {
+    float l_fMax = SPECTRUM_FLOOR_DB;
+    int i = 0;
+
+    for (i = 0; i < bins; i++) {
+        if (abs(i - bin) > guard && db[i] > l_fMax) {
+            l_fMax = db[i];
+        }
+    }
+
+    return l_fMax;
+}
+
+int main(int argc, char *argv[]) {
+    static const int l_iFormats[] = { 0, 2, 3, 4 };
+    static const char *l_strFormats[] = { "float", "16-bit", "24-bit", "32-bit" };
+    static const float l_fFloor[] = { -100.0f, -80.0f, -100.0f, -100.0f };
+    float l_fDb[2 * (TEST_FFT / 2 + 1)];
+    float *l_fOther = l_fDb + TEST_FFT / 2 + 1;
+    char l_strWhat[64];
+    double l_dForward = 0.0;
+    double l_dInverse = 0.0;
+    double l_dWorstForward = 0.0;
+    double l_dWorstInverse = 0.0;
+    int l_iBins = TEST_FFT / 2 + 1;
+    int l_iOk = 0;
+    int i = 0;
+
+    for (i = 2; i <= TEST_MAX_SIZE; i <<= 1) {
+        realfft_errors(i, &l_dForward, &l_dInverse);
+        l_dWorstForward = l_dForward > l_dWorstForward ? l_dForward : l_dWorstForward;
+        l_dWorstInverse = l_dInverse > l_dWorstInverse ? l_dInverse : l_dWorstInverse;
+    }
+
+    snprintf(l_strWhat, sizeof(l_strWhat), "realfft bins same as DFT, error %.1e", l_dWorstForward);
+    check(l_dWorstForward < 1e-5, l_strWhat);
+    snprintf(l_strWhat, sizeof(l_strWhat), "realfft inverse round trip, error %.1e", l_dWorstInverse);
+    check(l_dWorstInverse < 1e-5, l_strWhat);
+
+    for (i = 0; i < (int)(sizeof(l_iFormats) / sizeof(l_iFormats[0])); i++) {
+        l_iOk = analyse_sines(l_iFormats[i], 64, 200, l_fDb) == 0;
+        snprintf(l_strWhat, sizeof(l_strWhat), "%s: frame published", l_strFormats[i]);
+        check(l_iOk, l_strWhat);
+
+        if (!l_iOk) {
+            continue;
+        }
+
+        snprintf(l_strWhat, sizeof(l_strWhat), "%s: bin %d at %.2f dB", l_strFormats[i], loudest(l_fDb, l_iBins),
+                 l_fDb[64]);
+        check(loudest(l_fDb, l_iBins) == 64 && fabsf(l_fDb[64]) < 0.05f, l_strWhat);
+
+        snprintf(l_strWhat, sizeof(l_strWhat), "%s: channel 2 bin %d at %.2f dB", l_strFormats[i],
+                 loudest(l_fOther, l_iBins), l_fOther[200]);
+        check(loudest(l_fOther, l_iBins) == 200 && fabsf(l_fOther[200] + 20.0f) < 0.05f, l_strWhat);
+
+        /* Hann puts bin centred sine to neighbours only */
+        snprintf(l_strWhat, sizeof(l_strWhat), "%s: leakage %.1f dB", l_strFormats[i],
+                 leakage(l_fDb, l_iBins, 64, 1));
+        check(leakage(l_fDb, l_iBins, 64, 1) < l_fFloor[i] && leakage(l_fOther, l_iBins, 200, 1) < l_fFloor[i] - 20.0f,
+              l_strWhat);
+    }
+
+    return m_iFailed ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Core scaling benchmark for common/chansplit.h
+ *
+ * Splits generated noise of many channels to per-channel (or group)
+ * files with 1, 2, 4 ... workers up to number of CPUs and prints
+ * throughput as channel-samples per second, how many times faster than
+ * realtime it was, and speedup and efficiency against one worker. Input
+ * is fed as fast as ring takes it, so this is the most recorder could
+ * write. Files are removed after every run.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -O2 -I../common $(pkg-config --cflags --libs sndfile) chansplit_bench.c -std=gnu11 -Wall -lpthread -o chansplit_bench
+ *
+ * Run with ./chansplit_bench [-s audio_seconds] [-c channels] [-x group] [-r samplerate] [-w max_workers] /some/dir/rec.[wav/flac]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chansplit.h"
+
+/* Frames given to chansplit_write() at once, like one callback */
+#define BENCH_CALLBACK_FRAMES 512
+
+static long m_lSeconds = 10;
+static long m_lChannels = 64;
+static long m_lGroup = 1;
+static long m_lRate = 48000;
+static long m_lMaxWorkers = 0;
+
+static double bench_now(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+/* One second of noise that is written again and again */
+static float *bench_noise(long samples) {
+    float *l_fPcm = (float *)malloc(samples * sizeof(float));
+    unsigned int l_iSeed = 1;
+    long i = 0;
+
+    for (i = 0; l_fPcm != NULL && i < samples; i++) {
+        l_iSeed = l_iSeed * 1103515245 + 12345;
+        l_fPcm[i] = ((l_iSeed >> 8) & 0xffff) / 65536.0f - 0.5f;
+    }
+
+    return l_fPcm;
+}
+
+/* Returns wall seconds from first write until every file is closed */
+static double bench_split(const char *template, const SF_INFO *info, int workers, const float *noise) {
+    chansplit l_SSplit;
+    char l_strPath[PATH_MAX + 32];
+    long l_lFrames = m_lSeconds * m_lRate;
+    long l_lDone = 0;
+    long l_lNow = 0;
+    long l_lOffset = 0;
+    struct timespec l_SFull = { 0, 200000 };
+    double l_dStart = 0.0;
+    int i = 0;
+
+    if (chansplit_open(&l_SSplit, template, info, m_lGroup, workers) < 0) {
+        fprintf(stderr, "bench_split: Can't open channel files of %s\n", template);
+        return -1.0;
+    }
+
+    l_dStart = bench_now();
+
+    for (l_lDone = 0; l_lDone < l_lFrames; l_lDone += l_lNow) {
+        l_lOffset = l_lDone % m_lRate;
+        l_lNow = m_lRate - l_lOffset < BENCH_CALLBACK_FRAMES ? m_lRate - l_lOffset : BENCH_CALLBACK_FRAMES;
+        l_lNow = l_lFrames - l_lDone < l_lNow ? l_lFrames - l_lDone : l_lNow;
+        l_lNow = chansplit_write(&l_SSplit, noise + l_lOffset * m_lChannels, l_lNow);
+
+        /* Ring is full: workers are behind. Wait instead of dropping */
+        if (l_lNow == 0) {
+            nanosleep(&l_SFull, NULL);
+        }
+    }
+
+    if (chansplit_close(&l_SSplit) < 0) {
+        fprintf(stderr, "bench_split: Write failed\n");
+        l_dStart = -1.0;
+    } else {
+        l_dStart = bench_now() - l_dStart;
+    }
+
+    for (i = 0; i < m_lChannels; i += m_lGroup) {
+        chansplit_name(template, i, m_lChannels - i < m_lGroup ? m_lChannels - i : m_lGroup, l_strPath, sizeof(l_strPath));
+        unlink(l_strPath);
+    }
+
+    return l_dStart;
+}
+
+int main(int argc, char *argv[]) {
+    SF_INFO l_SInfo;
+    float *l_fNoise = NULL;
+    double l_dSeconds = 0.0;
+    double l_dOne = 0.0;
+    long l_lCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int l_iWorkers = 0;
+    int l_iNext = 0;
+    int l_iOpt = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "s:c:x:r:w:")) != -1) {
+        switch (l_iOpt) {
+            case 's':
+                m_lSeconds = atol(optarg);
+                break;
+
+            case 'c':
+                m_lChannels = atol(optarg);
+                break;
+
+            case 'x':
+                m_lGroup = atol(optarg);
+                break;
+
+            case 'r':
+                m_lRate = atol(optarg);
+                break;
+
+            case 'w':
+                m_lMaxWorkers = atol(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-s audio_seconds] [-c channels] [-x group] [-r samplerate] [-w max_workers] dir/rec.wav\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || m_lSeconds <= 0 || m_lChannels <= 0 || m_lChannels > CHANSPLIT_MAX_CHANNELS
+            || m_lGroup <= 0 || m_lRate <= 0 || m_lMaxWorkers < 0) {
+        fprintf(stderr, "Usage: %s [-s audio_seconds] [-c channels (1-%d)] [-x group] [-r samplerate] [-w max_workers] dir/rec.wav\n",
+                argv[0], CHANSPLIT_MAX_CHANNELS);
+        return 1;
+    }
+
+    m_lMaxWorkers = m_lMaxWorkers > 0 ? m_lMaxWorkers : l_lCpus;
+    m_lMaxWorkers = m_lMaxWorkers < CHANSPLIT_MAX_WORKERS ? m_lMaxWorkers : CHANSPLIT_MAX_WORKERS;
+
+    if ((l_fNoise = bench_noise(m_lRate * m_lChannels)) == NULL) {
+        fprintf(stderr, "main: Out of memory\n");
+        return 1;
+    }
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+    l_SInfo.channels = m_lChannels;
+    l_SInfo.samplerate = m_lRate;
+    l_SInfo.format = (strlen(argv[optind]) > 5 && !strcmp(argv[optind] + strlen(argv[optind]) - 5, ".flac")
+                      ? SF_FORMAT_FLAC : SF_FORMAT_WAV) | SF_FORMAT_PCM_16;
+
+    printf("main: %ld s of %ld Hz %ld channel audio to files of %ld channels, %ld CPUs online\n",
+           m_lSeconds, m_lRate, m_lChannels, m_lGroup, l_lCpus);
+
+    for (l_iWorkers = 1; l_iWorkers <= m_lMaxWorkers; l_iWorkers = l_iNext) {
+        if ((l_dSeconds = bench_split(argv[optind], &l_SInfo, l_iWorkers, l_fNoise)) <= 0.0) {
+            free(l_fNoise);
+            return 1;
+        }
+
+        l_dOne = l_iWorkers == 1 ? l_dSeconds : l_dOne;
+        printf("workers %2d  %8.1f M channel-samples/s  %7.1fx realtime  speedup %5.2fx  efficiency %5.1f %%\n",
+               l_iWorkers, m_lSeconds * m_lRate * m_lChannels / l_dSeconds / 1e6, m_lSeconds / l_dSeconds,
+               l_dOne / l_dSeconds, l_dOne / l_dSeconds * 100.0 / l_iWorkers);
+
+        /* Also largest count if it is not power of two */
+        l_iNext = l_iWorkers * 2;
+        if (l_iWorkers < m_lMaxWorkers && l_iNext > m_lMaxWorkers) {
+            l_iNext = m_lMaxWorkers;
+        }
+    }
+
+    free(l_fNoise);
+    return 0;
+}
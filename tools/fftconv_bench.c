@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * CPU benchmark for common/fftconv.h
+ *
+ * Convolves generated noise with generated decaying filter for every tap
+ * count and partition size and prints used CPU as milliseconds per audio
+ * second per channel, share of one core and how many times faster than
+ * realtime it was. Direct time domain FIR is measured for short filters
+ * to show where partitioned convolution starts to pay. Time to make
+ * filter spectra (done in background by players) is printed too. No
+ * sound card or files are needed.
+ *
+ * Compile with
+ * gcc -O2 -I../common $(pkg-config --cflags --libs sndfile) fftconv_bench.c -std=gnu11 -Wall -lpthread -lm -o fftconv_bench
+ *
+ * Run with ./fftconv_bench [-s audio_seconds] [-b block_frames] [-c channels] [-r samplerate] [-t taps] [-p partition]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fftconv.h"
+
+/* Direct FIR is measured up to this many taps */
+#define BENCH_DIRECT_MAX_TAPS 4096
+
+static long m_lSeconds = 10;
+static long m_lBlock = 256;
+static long m_lChannels = 2;
+static long m_lRate = 48000;
+static long m_lTaps = 0;
+static long m_lPartition = 0;
+
+static const long m_lTapList[] = { 1024, 4096, 16384, 65536, 131072, 262144 };
+static const long m_lPartitionList[] = { 64, 256, 1024 };
+
+static double bench_cpu(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+static float *bench_noise(long samples, unsigned int seed) {
+    float *l_fPcm = (float *)malloc(samples * sizeof(float));
+    long i = 0;
+
+    for (i = 0; l_fPcm != NULL && i < samples; i++) {
+        seed = seed * 1103515245 + 12345;
+        l_fPcm[i] = ((seed >> 8) & 0xffff) / 65536.0f - 0.5f;
+    }
+
+    return l_fPcm;
+}
+
+static void bench_report(const char *name, long taps, long partition, double cpu, double prepare) {
+    double l_dAudio = (double)m_lSeconds * m_lChannels;
+
+    printf("%-7s %7ld taps  partition %5ld  %8.3f ms/s per channel  %6.2f %% core  %8.1fx realtime  spectra %7.1f ms\n",
+           name, taps, partition, cpu * 1000.0 / l_dAudio, cpu * 100.0 / m_lSeconds, m_lSeconds / cpu, prepare * 1000.0);
+}
+
+/* Partitioned convolution of m_lSeconds audio in m_lBlock frame blocks */
+static int bench_fftconv(long taps, long partition, const float *filter, float *pcm) {
+    fftconv l_SConv;
+    long l_lFrames = m_lSeconds * m_lRate;
+    long l_lDone = 0;
+    long l_lNow = 0;
+    double l_dStart = 0.0;
+    double l_dPrepare = 0.0;
+
+    if (fftconv_init(&l_SConv, m_lChannels, partition, taps, 1) < 0) {
+        fprintf(stderr, "bench_fftconv: Can't allocate %ld taps with partition %ld\n", taps, partition);
+        return -1;
+    }
+
+    l_dStart = bench_cpu();
+    fftconv_prepare(&l_SConv, filter);
+    l_dPrepare = bench_cpu() - l_dStart;
+
+    l_dStart = bench_cpu();
+
+    for (l_lDone = 0; l_lDone < l_lFrames; l_lDone += l_lNow) {
+        l_lNow = l_lFrames - l_lDone < m_lBlock ? l_lFrames - l_lDone : m_lBlock;
+        fftconv_process(&l_SConv, pcm + l_lDone * m_lChannels, l_lNow);
+    }
+
+    bench_report("fftconv", taps, l_SConv.partition, bench_cpu() - l_dStart, l_dPrepare);
+    fftconv_free(&l_SConv);
+    return 0;
+}
+
+/* Plain time domain FIR with same vector dot product as head partition */
+static int bench_direct(long taps, const float *filter, float *pcm) {
+    long l_lFrames = m_lSeconds * m_lRate;
+    long l_lLength = (taps + 3) & ~3L;
+    float *l_fReversed = (float *)calloc(l_lLength, sizeof(float));
+    float *l_fHistory = (float *)calloc(l_lLength * 2 * m_lChannels, sizeof(float));
+    float *l_fChannel = NULL;
+    double l_dStart = 0.0;
+    long l_lPos = 0;
+    long i = 0;
+    long c = 0;
+
+    if (l_fReversed == NULL || l_fHistory == NULL) {
+        free(l_fReversed);
+        free(l_fHistory);
+        return -1;
+    }
+
+    for (i = 0; i < taps; i++) {
+        l_fReversed[l_lLength - 1 - i] = filter[i];
+    }
+
+    l_dStart = bench_cpu();
+
+    for (i = 0; i < l_lFrames; i++) {
+        for (c = 0; c < m_lChannels; c++) {
+            l_fChannel = l_fHistory + c * l_lLength * 2;
+            l_fChannel[l_lPos] = l_fChannel[l_lPos + l_lLength] = pcm[i * m_lChannels + c];
+            pcm[i * m_lChannels + c] = fftconv_dot(l_fReversed, l_fChannel + l_lPos + 1, l_lLength);
+        }
+
+        l_lPos = l_lPos + 1 == l_lLength ? 0 : l_lPos + 1;
+    }
+
+    bench_report("direct", taps, 0, bench_cpu() - l_dStart, 0.0);
+    free(l_fReversed);
+    free(l_fHistory);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    float *l_fFilter = NULL;
+    float *l_fSource = NULL;
+    float *l_fPcm = NULL;
+    long l_lSamples = 0;
+    long l_lMaxTaps = 0;
+    long l_lTaps = 0;
+    long l_lDecay = 0;
+    int l_iOpt = 0;
+    size_t i = 0;
+    size_t j = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "s:b:c:r:t:p:")) != -1) {
+        switch (l_iOpt) {
+            case 's':
+                m_lSeconds = atol(optarg);
+                break;
+
+            case 'b':
+                m_lBlock = atol(optarg);
+                break;
+
+            case 'c':
+                m_lChannels = atol(optarg);
+                break;
+
+            case 'r':
+                m_lRate = atol(optarg);
+                break;
+
+            case 't':
+                m_lTaps = atol(optarg);
+                break;
+
+            case 'p':
+                m_lPartition = atol(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-s audio_seconds] [-b block_frames] [-c channels] [-r samplerate] [-t taps] [-p partition]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (m_lSeconds <= 0 || m_lBlock <= 0 || m_lChannels <= 0 || m_lChannels > FFTCONV_MAX_CHANNELS || m_lRate <= 0
+            || m_lTaps < 0 || m_lTaps > FFTCONV_MAX_TAPS || m_lPartition < 0) {
+        fprintf(stderr, "main: Values must be positive, at most %d channels and %ld taps\n", FFTCONV_MAX_CHANNELS, FFTCONV_MAX_TAPS);
+        return 1;
+    }
+
+    l_lSamples = m_lSeconds * m_lRate * m_lChannels;
+    l_lMaxTaps = m_lTaps > 0 ? m_lTaps : m_lTapList[sizeof(m_lTapList) / sizeof(m_lTapList[0]) - 1];
+    l_fFilter = bench_noise(l_lMaxTaps, 1);
+    l_fSource = bench_noise(l_lSamples, 2);
+    l_fPcm = (float *)malloc(l_lSamples * sizeof(float));
+
+    if (l_fFilter == NULL || l_fSource == NULL || l_fPcm == NULL) {
+        fprintf(stderr, "main: Out of memory\n");
+        return 1;
+    }
+
+    /* Room response like decay so output stays in range */
+    l_lDecay = m_lRate / 4;
+
+    for (l_lTaps = 0; l_lTaps < l_lMaxTaps; l_lTaps++) {
+        l_fFilter[l_lTaps] *= 0.05f * expf(-(float)l_lTaps / l_lDecay);
+    }
+
+    printf("main: %ld s of %ld Hz %ld channel float audio in %ld frame blocks\n", m_lSeconds, m_lRate, m_lChannels, m_lBlock);
+
+    for (i = 0; i < sizeof(m_lTapList) / sizeof(m_lTapList[0]); i++) {
+        l_lTaps = m_lTaps > 0 ? m_lTaps : m_lTapList[i];
+
+        if (l_lTaps <= BENCH_DIRECT_MAX_TAPS) {
+            memcpy(l_fPcm, l_fSource, l_lSamples * sizeof(float));
+            bench_direct(l_lTaps, l_fFilter, l_fPcm);
+        }
+
+        for (j = 0; j < sizeof(m_lPartitionList) / sizeof(m_lPartitionList[0]); j++) {
+            memcpy(l_fPcm, l_fSource, l_lSamples * sizeof(float));
+
+            if (bench_fftconv(l_lTaps, m_lPartition > 0 ? m_lPartition : m_lPartitionList[j], l_fFilter, l_fPcm) < 0) {
+                return 1;
+            }
+
+            if (m_lPartition > 0) {
+                break;
+            }
+        }
+
+        if (m_lTaps > 0) {
+            break;
+        }
+    }
+
+    free(l_fFilter);
+    free(l_fSource);
+    free(l_fPcm);
+    return 0;
+}
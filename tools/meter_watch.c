@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Level meter watcher for players and recorders (common/meter.h)
+ *
+ * Maps meter of other process read only and draws peak and RMS bars of
+ * every channel 20 times in second. Reading never blocks audio callback
+ * of watched process: it only copies seqlocked snapshot.
+ *
+ * Compile with
+ * gcc -g -I../common meter_watch.c -lm -std=c11 -Wall -o meter_watch
+ *
+ * Run with ./meter_watch /proc/PID/fd/FD (player prints path at start)
+ */
+
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "meter.h"
+
+/* Redraw every 50 ms */
+#define WATCH_INTERVAL_MS 50
+/* Bar goes from -60 dBFS to 0 */
+#define WATCH_FLOOR_DB -60.0f
+#define WATCH_BAR_WIDTH 50
+/* Peak hold falls this much per second */
+#define WATCH_HOLD_FALL_DB 20.0f
+/* Writer is gone if nothing changes for this long */
+#define WATCH_STALL_MS 3000
+
+static volatile sig_atomic_t m_iLoop = 0;
+
+/* Handle termination with CTRL-C */
+static void handler(int sig, siginfo_t *si, void *unused) {
+    m_iLoop = 1;
+}
+
+static int bar_position(float db) {
+    if (db <= WATCH_FLOOR_DB) {
+        return 0;
+    }
+
+    if (db >= 0.0f) {
+        return WATCH_BAR_WIDTH;
+    }
+
+    return (int)((db - WATCH_FLOOR_DB) / -WATCH_FLOOR_DB * WATCH_BAR_WIDTH);
+}
+
+/* '=' is RMS, '-' is peak and '|' is peak hold */
+static void draw_channel(uint32_t channel, float peak_db, float rms_db, float hold_db) {
+    char l_strBar[WATCH_BAR_WIDTH + 1];
+    int l_iPeak = bar_position(peak_db);
+    int l_iRms = bar_position(rms_db);
+    int l_iHold = bar_position(hold_db);
+    int i = 0;
+
+    for (i = 0; i < WATCH_BAR_WIDTH; i++) {
+        l_strBar[i] = i < l_iRms ? '=' : (i < l_iPeak ? '-' : ' ');
+    }
+
+    if (l_iHold > 0) {
+        l_strBar[l_iHold - 1] = '|';
+    }
+
+    l_strBar[WATCH_BAR_WIDTH] = '\0';
+    printf("%2u [%s] %6.1f %6.1f\n", channel + 1, l_strBar, peak_db, rms_db);
+}
+
+int main(int argc, char *argv[]) {
+    meter l_SMeter;
+    meter_snapshot l_SSnap;
+    float l_fHold[METER_MAX_CHANNELS];
+    struct sigaction l_SSa;
+    struct timespec l_SSleep = { 0, WATCH_INTERVAL_MS * 1000000L };
+    uint64_t l_lLastBlocks = 0;
+    long l_lStill = 0;
+    long l_lTorn = 0;
+    uint32_t i = 0;
+    float l_fDb = 0.0f;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s /proc/PID/fd/FD\n", argv[0]);
+        return 1;
+    }
+
+    if (meter_attach(&l_SMeter, argv[1]) < 0) {
+        fprintf(stderr, "main: Not able to attach meter %s.\n", argv[1]);
+        return 1;
+    }
+
+    l_SSa.sa_flags = SA_SIGINFO;
+    sigemptyset(&l_SSa.sa_mask);
+    l_SSa.sa_sigaction = handler;
+    sigaction(SIGINT, &l_SSa, NULL);
+    sigaction(SIGHUP, &l_SSa, NULL);
+
+    memset(&l_SSnap, 0x00, sizeof(meter_snapshot));
+
+    for (i = 0; i < METER_MAX_CHANNELS; i++) {
+        l_fHold[i] = -200.0f;
+    }
+
+    printf("Watching process %u meter. Bars are peak and RMS dBFS.\n", l_SMeter.shared->pid);
+
+    while (!m_iLoop) {
+        if (meter_read(&l_SMeter, &l_SSnap) < 0) {
+            l_lTorn++;
+            nanosleep(&l_SSleep, NULL);
+            continue;
+        }
+
+        l_lStill = l_SSnap.blocks == l_lLastBlocks ? l_lStill + WATCH_INTERVAL_MS : 0;
+        l_lLastBlocks = l_SSnap.blocks;
+
+        if (l_lStill >= WATCH_STALL_MS) {
+            printf("main: No new blocks for %d ms. Stream has stopped.\n", WATCH_STALL_MS);
+            break;
+        }
+
+        if (l_SSnap.blocks > 0) {
+            printf("%.1f s, %llu clipped blocks\n", (double)l_SSnap.frames / l_SSnap.samplerate,
+                   (unsigned long long)l_SSnap.clipped);
+
+            for (i = 0; i < l_SSnap.channels; i++) {
+                l_fDb = levels_db(l_SSnap.peak[i]);
+                l_fHold[i] -= WATCH_HOLD_FALL_DB * WATCH_INTERVAL_MS / 1000.0f;
+                l_fHold[i] = l_fDb > l_fHold[i] ? l_fDb : l_fHold[i];
+                draw_channel(i, l_fDb, levels_db(l_SSnap.rms[i]), l_fHold[i]);
+            }
+
+            /* Move cursor back over this drawing */
+            printf("\033[%uA", l_SSnap.channels + 1);
+            fflush(stdout);
+        }
+
+        nanosleep(&l_SSleep, NULL);
+    }
+
+    printf("\033[%uB\nmain: %ld torn reads\n", l_SSnap.channels + 1, l_lTorn);
+    meter_close(&l_SMeter);
+    return 0;
+}
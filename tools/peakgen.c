@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Waveform peak file generator (common/peakfile.h)
+ *
+ * Decodes audio files with libsndfile and writes 'file.peaks' next to each
+ * with min/max/RMS pyramid for drawing waveform overviews. Files are done
+ * in parallel, one worker thread per CPU (-j to change).
+ *
+ * Peak file that is up to date is left alone. If audio file has only grown
+ * (recording still going on) only new part is decoded: full level 0 bins
+ * are kept, decoding continues from last partial bin and upper levels are
+ * made again from level 0. Audio is expected to only grow at end, -f makes
+ * everything again. New peak file is renamed over old one so programs that
+ * have old one mapped keep working.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common -lsndfile -lm -lpthread peakgen.c -std=c11 -Wall -o peakgen
+ *
+ * Run with ./peakgen [-j workers] [-f] some.[wav/flac/aiff] ...
+ * or       find music -name '*.flac' | ./peakgen -
+ * or       ./peakgen -i some.flac.peaks (print levels of peak file)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sndfile.h>
+
+#include "filepool.h"
+#include "peakfile.h"
+
+/* Level 0 bins decoded at once */
+#define PEAKGEN_READ_BINS 64
+
+static int m_iForce = 0;
+static atomic_long m_lFull;
+static atomic_long m_lGrown;
+static atomic_long m_lFresh;
+static atomic_llong m_lDecoded;
+static atomic_llong m_lDecodedRate;
+
+/* Keep full level 0 bins of old peak file if audio file has only grown.
+   Returns how many bins were kept, 0 to do all and -1 if nothing to do */
+static long keep_old(const char *peakpath, const struct stat *source, const SF_INFO *info,
+                     peakfile_bin **bins, long *capacity) {
+    peakfile l_SOld;
+    long l_lKeep = 0;
+
+    if (m_iForce || peakfile_map(&l_SOld, peakpath) < 0) {
+        return 0;
+    }
+
+    if (l_SOld.header->samplerate != (uint32_t)info->samplerate
+            || l_SOld.header->channels != (uint32_t)info->channels
+            || l_SOld.header->level[0].frames_per_bin != PEAKFILE_BASE_FRAMES
+            || (uint64_t)source->st_size < l_SOld.header->source_size) {
+        peakfile_unmap(&l_SOld);
+        return 0;
+    }
+
+    if ((uint64_t)source->st_size == l_SOld.header->source_size
+            && l_SOld.header->source_mtime == (int64_t)source->st_mtime) {
+        peakfile_unmap(&l_SOld);
+        return -1;
+    }
+
+    l_lKeep = l_SOld.header->frames / PEAKFILE_BASE_FRAMES;
+    *capacity = l_lKeep + PEAKGEN_READ_BINS;
+    *bins = (peakfile_bin *)malloc(*capacity * info->channels * sizeof(peakfile_bin));
+
+    if (*bins == NULL) {
+        peakfile_unmap(&l_SOld);
+        return 0;
+    }
+
+    memcpy(*bins, peakfile_bins(&l_SOld, 0), l_lKeep * info->channels * sizeof(peakfile_bin));
+    peakfile_unmap(&l_SOld);
+    return l_lKeep;
+}
+
+/* Write header and all levels to temporary file and rename it in place */
+static int save_peaks(const char *peakpath, peakfile_header *header, const peakfile_bin *bins, long count) {
+    char l_strTmp[4096 + 8];
+    char l_cHead[PEAKFILE_HEADER_SIZE];
+    char *l_ptrBody = NULL;
+    size_t l_lSize = 0;
+    FILE *l_SFile = NULL;
+    int l_iRetval = 0;
+
+    l_lSize = peakfile_layout(header, count);
+    l_ptrBody = (char *)calloc(l_lSize - PEAKFILE_HEADER_SIZE + 1, 1);
+
+    if (l_ptrBody == NULL) {
+        return -1;
+    }
+
+    if (count > 0) {
+        memcpy(l_ptrBody, bins, count * header->channels * sizeof(peakfile_bin));
+    }
+
+    peakfile_build_levels(header, l_ptrBody);
+
+    memset(l_cHead, 0x00, sizeof(l_cHead));
+    memcpy(l_cHead, header, sizeof(peakfile_header));
+    snprintf(l_strTmp, sizeof(l_strTmp), "%s.tmp", peakpath);
+
+    if (!(l_SFile = fopen(l_strTmp, "wb"))) {
+        free(l_ptrBody);
+        return -1;
+    }
+
+    if (fwrite(l_cHead, sizeof(l_cHead), 1, l_SFile) != 1
+            || fwrite(l_ptrBody, l_lSize - PEAKFILE_HEADER_SIZE, 1, l_SFile) != 1) {
+        l_iRetval = -1;
+    }
+
+    if (fclose(l_SFile) != 0 || l_iRetval < 0 || rename(l_strTmp, peakpath) < 0) {
+        unlink(l_strTmp);
+        l_iRetval = -1;
+    }
+
+    free(l_ptrBody);
+    return l_iRetval;
+}
+
+/* Make or update peak file of one audio file */
+static int peak_one(const char *path) {
+    char l_strPeakPath[4096];
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    struct stat l_SStat;
+    peakfile_header l_SHeader;
+    peakfile_bin *l_SBins = NULL;
+    peakfile_bin *l_SGrow = NULL;
+    levels l_SLevels[PEAKFILE_MAX_CHANNELS];
+    float *l_fBuffer = NULL;
+    long l_lCapacity = 0;
+    long l_lCount = 0;
+    long l_lKeep = 0;
+    long l_lFill = 0;
+    long l_lDone = 0;
+    long l_lFrames = 0;
+    long l_lBufferFrames = PEAKGEN_READ_BINS * PEAKFILE_BASE_FRAMES;
+    sf_count_t l_lGot = 0;
+    uint64_t l_lDecoded = 0;
+    int l_iEof = 0;
+    int c = 0;
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+    snprintf(l_strPeakPath, sizeof(l_strPeakPath), "%s.peaks", path);
+
+    if (stat(path, &l_SStat) < 0 || !(l_SFile = sf_open(path, SFM_READ, &l_SInfo))) {
+        fprintf(stderr, "peak_one: Not able to open %s\n", path);
+        return -1;
+    }
+
+    if (l_SInfo.channels > PEAKFILE_MAX_CHANNELS) {
+        fprintf(stderr, "peak_one: %s has too many channels (%d)\n", path, l_SInfo.channels);
+        sf_close(l_SFile);
+        return -1;
+    }
+
+    l_lKeep = keep_old(l_strPeakPath, &l_SStat, &l_SInfo, &l_SBins, &l_lCapacity);
+
+    if (l_lKeep < 0) {
+        sf_close(l_SFile);
+        atomic_fetch_add(&m_lFresh, 1);
+        return 0;
+    }
+
+    /* Decoder can't go there. Do all again */
+    if (l_lKeep > 0 && sf_seek(l_SFile, (sf_count_t)l_lKeep * PEAKFILE_BASE_FRAMES, SEEK_SET) < 0) {
+        l_lKeep = 0;
+    }
+
+    l_lCount = l_lKeep;
+    l_fBuffer = (float *)malloc(l_lBufferFrames * l_SInfo.channels * sizeof(float));
+
+    if (l_fBuffer == NULL) {
+        free(l_SBins);
+        sf_close(l_SFile);
+        return -1;
+    }
+
+    while (!l_iEof) {
+        l_lGot = sf_readf_float(l_SFile, l_fBuffer + l_lFill * l_SInfo.channels, l_lBufferFrames - l_lFill);
+        l_iEof = l_lGot <= 0;
+        l_lFill += l_lGot > 0 ? l_lGot : 0;
+        l_lDecoded += l_lGot > 0 ? l_lGot : 0;
+
+        if (l_lCount + PEAKGEN_READ_BINS > l_lCapacity) {
+            l_lCapacity = (l_lCapacity + PEAKGEN_READ_BINS) * 2;
+            l_SGrow = (peakfile_bin *)realloc(l_SBins, l_lCapacity * l_SInfo.channels * sizeof(peakfile_bin));
+
+            if (l_SGrow == NULL) {
+                free(l_SBins);
+                free(l_fBuffer);
+                sf_close(l_SFile);
+                return -1;
+            }
+
+            l_SBins = l_SGrow;
+        }
+
+        /* Full bins. At end of file also last partial one */
+        l_lDone = 0;
+
+        while (l_lFill - l_lDone >= PEAKFILE_BASE_FRAMES || (l_iEof && l_lFill > l_lDone)) {
+            l_lFrames = l_lFill - l_lDone < PEAKFILE_BASE_FRAMES ? l_lFill - l_lDone : PEAKFILE_BASE_FRAMES;
+            levels_scan_channels(l_fBuffer + l_lDone * l_SInfo.channels, l_lFrames, l_SInfo.channels, l_SLevels);
+
+            for (c = 0; c < l_SInfo.channels; c++) {
+                peakfile_bin_set(&l_SBins[l_lCount * l_SInfo.channels + c], &l_SLevels[c]);
+            }
+
+            l_lCount++;
+            l_lDone += l_lFrames;
+        }
+
+        /* Partial bin waits for more */
+        memmove(l_fBuffer, l_fBuffer + l_lDone * l_SInfo.channels, (l_lFill - l_lDone) * l_SInfo.channels * sizeof(float));
+        l_lFill -= l_lDone;
+    }
+
+    free(l_fBuffer);
+    sf_close(l_SFile);
+
+    memset(&l_SHeader, 0x00, sizeof(peakfile_header));
+    memcpy(l_SHeader.magic, PEAKFILE_MAGIC, 8);
+    l_SHeader.samplerate = l_SInfo.samplerate;
+    l_SHeader.channels = l_SInfo.channels;
+    l_SHeader.frames = (uint64_t)l_lKeep * PEAKFILE_BASE_FRAMES + l_lDecoded;
+    l_SHeader.source_size = l_SStat.st_size;
+    l_SHeader.source_mtime = l_SStat.st_mtime;
+
+    if (save_peaks(l_strPeakPath, &l_SHeader, l_SBins, l_lCount) < 0) {
+        fprintf(stderr, "peak_one: Can't write %s\n", l_strPeakPath);
+        free(l_SBins);
+        return -1;
+    }
+
+    free(l_SBins);
+    atomic_fetch_add(l_lKeep > 0 ? &m_lGrown : &m_lFull, 1);
+    atomic_fetch_add(&m_lDecoded, l_lDecoded);
+    /* Seconds of audio in 1/1000 s so different rates can be summed */
+    atomic_fetch_add(&m_lDecodedRate, l_lDecoded * 1000 / l_SInfo.samplerate);
+    return 0;
+}
+
+/* Print what is inside peak file */
+static int print_info(const char *path) {
+    peakfile l_SPeaks;
+    const peakfile_bin *l_SBins = NULL;
+    uint32_t l = 0;
+    uint64_t b = 0;
+    int16_t l_iMin = 0;
+    int16_t l_iMax = 0;
+
+    if (peakfile_map(&l_SPeaks, path) < 0) {
+        fprintf(stderr, "print_info: Not a peak file %s\n", path);
+        return 1;
+    }
+
+    printf("%s: %u Hz, %u channels, %llu frames (%.1f s)\n", path, l_SPeaks.header->samplerate,
+           l_SPeaks.header->channels, (unsigned long long)l_SPeaks.header->frames,
+           (double)l_SPeaks.header->frames / l_SPeaks.header->samplerate);
+
+    for (l = 0; l < l_SPeaks.header->levels; l++) {
+        l_SBins = peakfile_bins(&l_SPeaks, l);
+        l_iMin = 0;
+        l_iMax = 0;
+
+        for (b = 0; b < l_SPeaks.header->level[l].bins * l_SPeaks.header->channels; b++) {
+            l_iMin = l_SBins[b].min < l_iMin ? l_SBins[b].min : l_iMin;
+            l_iMax = l_SBins[b].max > l_iMax ? l_SBins[b].max : l_iMax;
+        }
+
+        printf(" level %u: %8llu frames per bin %10llu bins min %6d max %6d\n", l,
+               (unsigned long long)l_SPeaks.header->level[l].frames_per_bin,
+               (unsigned long long)l_SPeaks.header->level[l].bins, l_iMin, l_iMax);
+    }
+
+    peakfile_unmap(&l_SPeaks);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    filepool l_SPool;
+    long l_lWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    long l_lFailed = 0;
+    int l_iOpt = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "j:fi:")) != -1) {
+        switch (l_iOpt) {
+            case 'j':
+                l_lWorkers = atol(optarg);
+                break;
+
+            case 'f':
+                m_iForce = 1;
+                break;
+
+            case 'i':
+                return print_info(optarg);
+
+            default:
+                fprintf(stderr, "Usage: %s [-j workers] [-f] file ... | -\n       %s -i file.peaks\n", argv[0], argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-j workers] [-f] file ... | -\n       %s -i file.peaks\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    if (!strcmp(argv[optind], "-")) {
+        if (filepool_read_list(&l_SPool, stdin) < 0) {
+            fprintf(stderr, "main: Out of memory reading file list\n");
+            filepool_free(&l_SPool);
+            return 1;
+        }
+    } else {
+        filepool_args(&l_SPool, argv + optind, argc - optind);
+    }
+
+    atomic_init(&m_lFull, 0);
+    atomic_init(&m_lGrown, 0);
+    atomic_init(&m_lFresh, 0);
+    atomic_init(&m_lDecoded, 0);
+    atomic_init(&m_lDecodedRate, 0);
+
+    l_lFailed = filepool_run(&l_SPool, l_lWorkers, peak_one);
+
+    printf("peakgen: %ld files with %ld workers: %ld made, %ld grown, %ld up to date, %ld failed\n",
+           l_SPool.count, l_SPool.workers, (long)atomic_load(&m_lFull), (long)atomic_load(&m_lGrown),
+           (long)atomic_load(&m_lFresh), l_lFailed);
+    printf("peakgen: Decoded %lld frames (%.1f s of audio) in %.2f s (%.0fx realtime)\n",
+           (long long)atomic_load(&m_lDecoded), atomic_load(&m_lDecodedRate) / 1000.0, l_SPool.seconds,
+           l_SPool.seconds > 0.0 ? atomic_load(&m_lDecodedRate) / 1000.0 / l_SPool.seconds : 0.0);
+
+    filepool_free(&l_SPool);
+    return l_lFailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * Client of resident player daemon (common/playdaemon.h)
+ *
+ * Sends one command to daemon and prints what it answers. For play and
+ * queue it waits until daemon tells that first sample went to device and
+ * with -w until sound has ended. Relative paths are made absolute because
+ * daemon has its own working directory. Default socket is same as
+ * daemon's: '$XDG_RUNTIME_DIR/playdaemon.sock' or '/tmp/playdaemon-UID.sock'.
+ *
+ * With -n COUNT file is played COUNT times and time to first sample is
+ * printed as measured by daemon (command read to first frame in callback)
+ * and by client (command sent to 'started' answer got). Compare them to
+ * stream startup time daemon prints when it starts.
+ *
+ * Compile with
+ * gcc -g -I../common playctl.c -std=gnu11 -Wall -o playctl
+ *
+ * Run with ./playctl [-s socket] [-n count] [-w] play|queue|stop|status [file]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PLAYCTL_SOCKET_NAME "playdaemon.sock"
+#define PLAYCTL_LINE 4096
+
+static char m_strBuffer[PLAYCTL_LINE];
+static size_t m_lUsed = 0;
+
+/* Same as playdaemon_default_socket() */
+static void default_socket(char *path, size_t len) {
+    const char *l_strRuntime = getenv("XDG_RUNTIME_DIR");
+
+    if (l_strRuntime != NULL && l_strRuntime[0] == '/') {
+        snprintf(path, len, "%s/%s", l_strRuntime, PLAYCTL_SOCKET_NAME);
+    } else {
+        snprintf(path, len, "/tmp/playdaemon-%u.sock", (unsigned int)getuid());
+    }
+}
+
+static double now_us(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec * 1e6 + l_STs.tv_nsec / 1e3;
+}
+
+/* Read one answer line without newline. -1 if daemon went away */
+static int read_line(int fd, char *line, size_t len) {
+    char *l_strEnd = NULL;
+    ssize_t l_lGot = 0;
+    size_t l_lLen = 0;
+
+    while ((l_strEnd = memchr(m_strBuffer, '\n', m_lUsed)) == NULL) {
+        if (m_lUsed == sizeof(m_strBuffer)) {
+            m_lUsed = 0;
+        }
+
+        l_lGot = recv(fd, m_strBuffer + m_lUsed, sizeof(m_strBuffer) - m_lUsed, 0);
+
+        if (l_lGot < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (l_lGot <= 0) {
+            return -1;
+        }
+
+        m_lUsed += l_lGot;
+    }
+
+    l_lLen = l_strEnd - m_strBuffer;
+    l_lLen = l_lLen < len - 1 ? l_lLen : len - 1;
+    memcpy(line, m_strBuffer, l_lLen);
+    line[l_lLen] = '\0';
+    m_lUsed -= l_strEnd + 1 - m_strBuffer;
+    memmove(m_strBuffer, l_strEnd + 1, m_lUsed);
+    return 0;
+}
+
+static int connect_daemon(const char *path) {
+    struct sockaddr_un l_SAddr;
+    int l_iFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&l_SAddr, 0x00, sizeof(l_SAddr));
+    l_SAddr.sun_family = AF_UNIX;
+    snprintf(l_SAddr.sun_path, sizeof(l_SAddr.sun_path), "%s", path);
+
+    if (l_iFd < 0 || connect(l_iFd, (struct sockaddr *)&l_SAddr, sizeof(l_SAddr)) < 0) {
+        fprintf(stderr, "connect_daemon: Can't connect %s: %s\n", path, strerror(errno));
+
+        if (l_iFd >= 0) {
+            close(l_iFd);
+        }
+
+        return -1;
+    }
+
+    return l_iFd;
+}
+
+static int send_line(int fd, const char *line) {
+    size_t l_lLen = strlen(line);
+    size_t l_lSent = 0;
+    ssize_t l_lGot = 0;
+
+    while (l_lSent < l_lLen) {
+        l_lGot = send(fd, line + l_lSent, l_lLen - l_lSent, MSG_NOSIGNAL);
+
+        if (l_lGot < 0 && errno != EINTR) {
+            fprintf(stderr, "send_line: %s\n", strerror(errno));
+            return -1;
+        }
+
+        l_lSent += l_lGot > 0 ? l_lGot : 0;
+    }
+
+    return 0;
+}
+
+/* Play or queue once. Waits for 'started' (and 'done' or 'stopped' with
+   'wait_end'). Daemon and client measured times to first sample go to
+   'daemon_us' and 'client_us' */
+static int play_once(int fd, const char *line, int wait_end, int verbose, long *daemon_us, double *client_us) {
+    char l_strAnswer[PLAYCTL_LINE];
+    unsigned int l_iId = 0;
+    unsigned int l_iGot = 0;
+    double l_dSent = now_us();
+    long l_lUs = 0;
+
+    if (send_line(fd, line) < 0 || read_line(fd, l_strAnswer, sizeof(l_strAnswer)) < 0) {
+        return -1;
+    }
+
+    if (verbose) {
+        printf("%s\n", l_strAnswer);
+    }
+
+    if (sscanf(l_strAnswer, "ok %u", &l_iId) != 1) {
+        if (!verbose) {
+            fprintf(stderr, "%s\n", l_strAnswer);
+        }
+
+        return -1;
+    }
+
+    while (read_line(fd, l_strAnswer, sizeof(l_strAnswer)) == 0) {
+        if (sscanf(l_strAnswer, "started %u %ld", &l_iGot, &l_lUs) == 2 && l_iGot == l_iId) {
+            *client_us = now_us() - l_dSent;
+            *daemon_us = l_lUs;
+
+            if (verbose) {
+                printf("%s\n", l_strAnswer);
+            }
+
+            if (!wait_end) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        if ((sscanf(l_strAnswer, "done %u", &l_iGot) == 1 || sscanf(l_strAnswer, "stopped %u", &l_iGot) == 1) && l_iGot == l_iId) {
+            if (verbose) {
+                printf("%s\n", l_strAnswer);
+            }
+
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "play_once: Daemon closed connection\n");
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    char l_strLine[PLAYCTL_LINE];
+    char l_strAnswer[PLAYCTL_LINE];
+    char l_strPath[PATH_MAX];
+    char l_strDefault[PATH_MAX];
+    const char *l_strSocket = NULL;
+    const char *l_strCommand = NULL;
+    double l_dClientUs = 0.0;
+    double l_dClientMin = 0.0;
+    double l_dClientMax = 0.0;
+    double l_dClientSum = 0.0;
+    long l_lDaemonUs = 0;
+    long l_lDaemonMin = 0;
+    long l_lDaemonMax = 0;
+    double l_dDaemonSum = 0.0;
+    int l_iCount = 1;
+    int l_iWait = 0;
+    int l_iOpt = 0;
+    int l_iFd = -1;
+    int l_iRetval = 0;
+    int i = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "s:n:w")) != -1) {
+        switch (l_iOpt) {
+            case 's':
+                l_strSocket = optarg;
+                break;
+
+            case 'n':
+                l_iCount = atoi(optarg);
+                break;
+
+            case 'w':
+                l_iWait = 1;
+                break;
+
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    l_strCommand = optind < argc ? argv[optind] : "";
+
+    if (l_iCount < 1 || ((!strcmp(l_strCommand, "play") || !strcmp(l_strCommand, "queue")) ? optind + 2 != argc
+            : ((strcmp(l_strCommand, "stop") && strcmp(l_strCommand, "status")) || optind + 1 != argc))) {
+        fprintf(stderr, "Usage: %s [-s socket] [-n count] [-w] play|queue|stop|status [file]\n", argv[0]);
+        return 1;
+    }
+
+    if (l_strSocket == NULL) {
+        default_socket(l_strDefault, sizeof(l_strDefault));
+        l_strSocket = l_strDefault;
+    }
+
+    if ((l_iFd = connect_daemon(l_strSocket)) < 0) {
+        return 1;
+    }
+
+    if (optind + 2 != argc) {
+        snprintf(l_strLine, sizeof(l_strLine), "%s\n", l_strCommand);
+
+        if (send_line(l_iFd, l_strLine) < 0 || read_line(l_iFd, l_strAnswer, sizeof(l_strAnswer)) < 0) {
+            close(l_iFd);
+            return 1;
+        }
+
+        printf("%s\n", l_strAnswer);
+        close(l_iFd);
+        return strncmp(l_strAnswer, "error", 5) ? 0 : 1;
+    }
+
+    if (realpath(argv[optind + 1], l_strPath) == NULL) {
+        fprintf(stderr, "main: Can't find %s: %s\n", argv[optind + 1], strerror(errno));
+        close(l_iFd);
+        return 1;
+    }
+
+    if (snprintf(l_strLine, sizeof(l_strLine), "%s %s\n", l_strCommand, l_strPath) >= (int)sizeof(l_strLine)) {
+        fprintf(stderr, "main: Path %s is too long\n", l_strPath);
+        close(l_iFd);
+        return 1;
+    }
+
+    for (i = 0; i < l_iCount; i++) {
+        if (play_once(l_iFd, l_strLine, l_iWait, l_iCount == 1, &l_lDaemonUs, &l_dClientUs) < 0) {
+            l_iRetval = 1;
+            break;
+        }
+
+        l_lDaemonMin = i == 0 || l_lDaemonUs < l_lDaemonMin ? l_lDaemonUs : l_lDaemonMin;
+        l_lDaemonMax = l_lDaemonUs > l_lDaemonMax ? l_lDaemonUs : l_lDaemonMax;
+        l_dDaemonSum += l_lDaemonUs;
+        l_dClientMin = i == 0 || l_dClientUs < l_dClientMin ? l_dClientUs : l_dClientMin;
+        l_dClientMax = l_dClientUs > l_dClientMax ? l_dClientUs : l_dClientMax;
+        l_dClientSum += l_dClientUs;
+    }
+
+    if (i > 0) {
+        printf("Time to first sample (%d plays)\n", i);
+        printf("  daemon: min %.2f ms, avg %.2f ms, max %.2f ms\n", l_lDaemonMin / 1000.0, l_dDaemonSum / i / 1000.0, l_lDaemonMax / 1000.0);
+        printf("  client: min %.2f ms, avg %.2f ms, max %.2f ms\n", l_dClientMin / 1000.0, l_dClientSum / i / 1000.0, l_dClientMax / 1000.0);
+    }
+
+    close(l_iFd);
+    return l_iRetval;
+}
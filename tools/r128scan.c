@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * EBU R128 loudness scanner (common/loudness.h)
+ *
+ * Measures integrated loudness, loudness range and true peak of audio
+ * files in parallel, one worker thread per CPU (-j to change), and saves
+ * result with normalization gain to 'file.r128' next to each file. Files
+ * whose result is still valid are not decoded again unless -f is given.
+ *
+ * Players (libsndfile_port_play, libsndfile_pulse_play,
+ * libsndfile_pulse_threaded_play and libsndfile_sdl_play) apply saved gain.
+ * Gain takes file to target loudness (-t, default -18 LUFS) but not over
+ * -1 dBTP true peak.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common -lsndfile -lm -lpthread r128scan.c -std=c11 -Wall -o r128scan
+ *
+ * Run with ./r128scan [-j workers] [-f] [-t target_lufs] some.[wav/flac/aiff] ...
+ * or       find music -name '*.flac' | ./r128scan -
+ */
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sndfile.h>
+
+#include "filepool.h"
+#include "loudness.h"
+
+#define SCAN_FRAMES_PER_READ 4096
+
+static int m_iForce = 0;
+static double m_dTarget = LOUDNESS_DEFAULT_TARGET;
+static atomic_long m_lScanned;
+static atomic_long m_lCached;
+static atomic_llong m_lMilliseconds;
+
+static void print_result(const char *path, const loudness_result *res, double gain, const char *how) {
+    /* One call so lines of workers don't mix */
+    printf("%7.2f LUFS %6.2f LU %6.2f dBTP %+6.2f dB %-6s %s\n",
+           res->integrated, res->range, res->true_peak, gain, how, path);
+}
+
+static int scan_one(const char *path) {
+    SNDFILE *l_SFile = NULL;
+    SF_INFO l_SInfo;
+    loudness l_SLoudness;
+    loudness_result l_SResult;
+    float *l_fBuffer = NULL;
+    double l_dTarget = 0.0;
+    double l_dGain = 0.0;
+    sf_count_t l_lGot = 0;
+
+    if (!m_iForce && loudness_cache_load(path, &l_SResult, &l_dTarget, &l_dGain) == 0 && l_dTarget == m_dTarget) {
+        print_result(path, &l_SResult, l_dGain, "cached");
+        atomic_fetch_add(&m_lCached, 1);
+        return 0;
+    }
+
+    memset(&l_SInfo, 0x00, sizeof(SF_INFO));
+
+    if (!(l_SFile = sf_open(path, SFM_READ, &l_SInfo))) {
+        fprintf(stderr, "scan_one: Not able to open %s\n", path);
+        return -1;
+    }
+
+    if (loudness_init(&l_SLoudness, l_SInfo.samplerate, l_SInfo.channels) < 0
+            || !(l_fBuffer = (float *)malloc(SCAN_FRAMES_PER_READ * l_SInfo.channels * sizeof(float)))) {
+        fprintf(stderr, "scan_one: Can't measure %s (%d channels)\n", path, l_SInfo.channels);
+        sf_close(l_SFile);
+        return -1;
+    }
+
+    while ((l_lGot = sf_readf_float(l_SFile, l_fBuffer, SCAN_FRAMES_PER_READ)) > 0) {
+        if (loudness_process(&l_SLoudness, l_fBuffer, l_lGot) < 0) {
+            break;
+        }
+    }
+
+    free(l_fBuffer);
+    sf_close(l_SFile);
+    loudness_result_get(&l_SLoudness, &l_SResult);
+    loudness_free(&l_SLoudness);
+
+    if (loudness_cache_save(path, &l_SResult, m_dTarget) < 0) {
+        fprintf(stderr, "scan_one: Can't save result of %s\n", path);
+    }
+
+    print_result(path, &l_SResult, loudness_gain(&l_SResult, m_dTarget), "");
+    atomic_fetch_add(&m_lScanned, 1);
+    atomic_fetch_add(&m_lMilliseconds, (long long)(l_SResult.seconds * 1000.0));
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    filepool l_SPool;
+    double l_dAudio = 0.0;
+    long l_lWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    long l_lFailed = 0;
+    int l_iOpt = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "j:ft:")) != -1) {
+        switch (l_iOpt) {
+            case 'j':
+                l_lWorkers = atol(optarg);
+                break;
+
+            case 'f':
+                m_iForce = 1;
+                break;
+
+            case 't':
+                m_dTarget = atof(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-j workers] [-f] [-t target_lufs] file ... | -\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-j workers] [-f] [-t target_lufs] file ... | -\n", argv[0]);
+        return 1;
+    }
+
+    if (!strcmp(argv[optind], "-")) {
+        if (filepool_read_list(&l_SPool, stdin) < 0) {
+            fprintf(stderr, "main: Out of memory reading file list\n");
+            filepool_free(&l_SPool);
+            return 1;
+        }
+    } else {
+        filepool_args(&l_SPool, argv + optind, argc - optind);
+    }
+
+    atomic_init(&m_lScanned, 0);
+    atomic_init(&m_lCached, 0);
+    atomic_init(&m_lMilliseconds, 0);
+
+    printf("Integrated, range, true peak and gain to %.1f LUFS\n", m_dTarget);
+    l_lFailed = filepool_run(&l_SPool, l_lWorkers, scan_one);
+    l_dAudio = atomic_load(&m_lMilliseconds) / 1000.0;
+
+    printf("r128scan: %ld files with %ld workers: %ld scanned, %ld cached, %ld failed\n",
+           l_SPool.count, l_SPool.workers, (long)atomic_load(&m_lScanned), (long)atomic_load(&m_lCached),
+           l_lFailed);
+    printf("r128scan: Measured %.1f s of audio in %.2f s (%.0fx realtime)\n",
+           l_dAudio, l_SPool.seconds, l_SPool.seconds > 0.0 ? l_dAudio / l_SPool.seconds : 0.0);
+
+    filepool_free(&l_SPool);
+    return l_lFailed > 0 ? 1 : 0;
+}
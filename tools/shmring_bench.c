@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Throughput benchmark for common/shmring.h
+ *
+ * Moves same generated float audio from child process to parent first
+ * through a pipe and then through memfd ring and prints how fast both
+ * were. Consumer sums every sample so data is really touched on both
+ * sides and sums are compared. No sound card is needed.
+ *
+ * Compile with
+ * gcc -g -I../common shmring_bench.c -std=c11 -Wall -o shmring_bench
+ *
+ * Run with ./shmring_bench [-s audio_seconds] [-b block_frames] [-c channels] [-r samplerate]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "shmring.h"
+
+/* Ring holds this many blocks */
+#define BENCH_RING_BLOCKS 8
+
+static long m_lSeconds = 600;
+static long m_lBlock = 1024;
+static long m_lChannels = 2;
+static long m_lRate = 48000;
+
+static double bench_now(void) {
+    struct timespec l_STs;
+    clock_gettime(CLOCK_MONOTONIC, &l_STs);
+    return l_STs.tv_sec + l_STs.tv_nsec / 1e9;
+}
+
+/* Same cheap test signal for both transports */
+static void bench_generate(float *out, uint64_t first_frame, uint64_t frames) {
+    uint64_t i = 0;
+    long c = 0;
+
+    for (i = 0; i < frames; i++) {
+        for (c = 0; c < m_lChannels; c++) {
+            *out++ = (float)((first_frame + i) & 0xffff) * (1.0f / 65536.0f);
+        }
+    }
+}
+
+static double bench_sum(const float *in, uint64_t samples) {
+    double l_dSum = 0.0;
+    uint64_t i = 0;
+
+    for (i = 0; i < samples; i++) {
+        l_dSum += in[i];
+    }
+
+    return l_dSum;
+}
+
+static void bench_report(const char *name, double seconds, uint64_t frames, double sum, long waits) {
+    double l_dBytes = (double)frames * m_lChannels * sizeof(float);
+
+    printf("%-8s %8.3f s %9.1f MB/s %8.0fx realtime  consumer sleeps/reads %8ld  sum %.1f\n",
+           name, seconds, l_dBytes / seconds / 1e6, (double)frames / m_lRate / seconds, waits, sum);
+}
+
+static int bench_pipe(uint64_t total) {
+    int l_iPipe[2];
+    pid_t l_iPid = 0;
+    float *l_fBlock = NULL;
+    size_t l_lBlockBytes = m_lBlock * m_lChannels * sizeof(float);
+    uint64_t l_lFrames = 0;
+    uint64_t l_lBytes = 0;
+    ssize_t l_lGot = 0;
+    size_t l_lDone = 0;
+    long l_lReads = 0;
+    double l_dSum = 0.0;
+    double l_dStart = 0.0;
+
+    l_fBlock = (float *)malloc(l_lBlockBytes);
+
+    if (l_fBlock == NULL || pipe(l_iPipe) < 0) {
+        fprintf(stderr, "bench_pipe: %s\n", strerror(errno));
+        free(l_fBlock);
+        return -1;
+    }
+
+    /* Flush now so child doesn't print it again */
+    fflush(stdout);
+    l_dStart = bench_now();
+    l_iPid = fork();
+
+    if (l_iPid == 0) {
+        close(l_iPipe[0]);
+
+        for (l_lFrames = 0; l_lFrames < total; l_lFrames += m_lBlock) {
+            bench_generate(l_fBlock, l_lFrames, m_lBlock);
+
+            for (l_lDone = 0; l_lDone < l_lBlockBytes; l_lDone += l_lGot) {
+                l_lGot = write(l_iPipe[1], (char *)l_fBlock + l_lDone, l_lBlockBytes - l_lDone);
+
+                if (l_lGot <= 0) {
+                    _exit(1);
+                }
+            }
+        }
+
+        _exit(0);
+    }
+
+    close(l_iPipe[1]);
+
+    /* Sum only whole samples. Pipe can cut them in half */
+    while ((l_lGot = read(l_iPipe[0], (char *)l_fBlock + l_lDone, l_lBlockBytes - l_lDone)) > 0) {
+        l_lReads++;
+        l_lDone += l_lGot;
+        l_dSum += bench_sum(l_fBlock, l_lDone / sizeof(float));
+        l_lBytes += l_lDone - l_lDone % sizeof(float);
+        memmove(l_fBlock, (char *)l_fBlock + l_lDone - l_lDone % sizeof(float), l_lDone % sizeof(float));
+        l_lDone %= sizeof(float);
+    }
+
+    close(l_iPipe[0]);
+    waitpid(l_iPid, NULL, 0);
+    bench_report("pipe", bench_now() - l_dStart, l_lBytes / sizeof(float) / m_lChannels, l_dSum, l_lReads);
+    free(l_fBlock);
+    return 0;
+}
+
+static int bench_shmring(uint64_t total) {
+    shmring l_SRing;
+    pid_t l_iPid = 0;
+    float *l_fFirst = NULL;
+    float *l_fSecond = NULL;
+    const float *l_fReadFirst = NULL;
+    const float *l_fReadSecond = NULL;
+    uint64_t l_lFirst = 0;
+    uint64_t l_lSecond = 0;
+    uint64_t l_lFrames = 0;
+    uint64_t l_lCount = 0;
+    double l_dSum = 0.0;
+    double l_dStart = 0.0;
+
+    if (shmring_create(&l_SRing, m_lRate, m_lChannels, m_lBlock * BENCH_RING_BLOCKS) < 0) {
+        fprintf(stderr, "bench_shmring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Flush now so child doesn't print it again */
+    fflush(stdout);
+    l_dStart = bench_now();
+    l_iPid = fork();
+
+    if (l_iPid == 0) {
+        while (l_lFrames < total) {
+            if (shmring_get_write_regions(&l_SRing, &l_fFirst, &l_lFirst, &l_fSecond, &l_lSecond) < (uint64_t)m_lBlock) {
+                shmring_wait_space(&l_SRing, m_lBlock, 100);
+                continue;
+            }
+
+            /* Generate straight to shared memory */
+            l_lCount = total - l_lFrames < (uint64_t)m_lBlock ? total - l_lFrames : (uint64_t)m_lBlock;
+            l_lFirst = l_lFirst < l_lCount ? l_lFirst : l_lCount;
+            bench_generate(l_fFirst, l_lFrames, l_lFirst);
+            bench_generate(l_fSecond, l_lFrames + l_lFirst, l_lCount - l_lFirst);
+            shmring_write_advance(&l_SRing, l_lCount);
+            l_lFrames += l_lCount;
+        }
+
+        shmring_set_eof(&l_SRing);
+        printf("shmring: producer waits %ld wakeups %ld\n", l_SRing.waits, l_SRing.wakeups);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    while (!shmring_finished(&l_SRing)) {
+        if (shmring_wait_data(&l_SRing, m_lBlock, 100) == 0) {
+            continue;
+        }
+
+        l_lCount = shmring_get_read_regions(&l_SRing, &l_fReadFirst, &l_lFirst, &l_fReadSecond, &l_lSecond);
+        l_dSum += bench_sum(l_fReadFirst, l_lFirst * m_lChannels);
+        l_dSum += bench_sum(l_fReadSecond, l_lSecond * m_lChannels);
+        shmring_read_advance(&l_SRing, l_lCount);
+        l_lFrames += l_lCount;
+    }
+
+    waitpid(l_iPid, NULL, 0);
+    bench_report("shmring", bench_now() - l_dStart, l_lFrames, l_dSum, l_SRing.waits);
+    shmring_close(&l_SRing);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int l_iOpt = 0;
+    uint64_t l_lTotal = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "s:b:c:r:")) != -1) {
+        switch (l_iOpt) {
+            case 's':
+                m_lSeconds = atol(optarg);
+                break;
+
+            case 'b':
+                m_lBlock = atol(optarg);
+                break;
+
+            case 'c':
+                m_lChannels = atol(optarg);
+                break;
+
+            case 'r':
+                m_lRate = atol(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-s audio_seconds] [-b block_frames] [-c channels] [-r samplerate]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (m_lSeconds <= 0 || m_lBlock <= 0 || m_lChannels <= 0 || m_lRate <= 0) {
+        fprintf(stderr, "main: All values must be positive\n");
+        return 1;
+    }
+
+    l_lTotal = (uint64_t)m_lSeconds * m_lRate;
+    printf("main: %ld s of %ld Hz %ld channel float audio in %ld frame blocks\n", m_lSeconds, m_lRate, m_lChannels, m_lBlock);
+
+    if (bench_pipe(l_lTotal) < 0 || bench_shmring(l_lTotal) < 0) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Sample producer for shared memory ring (common/shmring.h)
+ *
+ * Decodes audio file with libsndfile straight into memfd ring and starts
+ * player with 'shm:FD' as last argument. Player then plays from shared
+ * memory without pipes or extra copies. Without player command it only
+ * prints path that can be given to player from another terminal.
+ *
+ * You need:
+ * Libsnfile development file (headers and libraries) http://www.mega-nerd.com/libsndfile/ at least version 1.0.25
+ *
+ * Compile with
+ * gcc -g -I../common -lsndfile shmring_producer.c -std=c11 -Wall -o shmring_producer
+ *
+ * Run with ./shmring_producer some.[wav/flac/aiff] ../portaudio/libsndfile_port_play
+ * or       ./shmring_producer some.[wav/flac/aiff] and ./libsndfile_pulse_play shm:/proc/PID/fd/FD
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sndfile.h>
+
+#include "shmring.h"
+
+/* Ring size in seconds */
+#define RING_SECONDS 1
+/* Don't wake up for less than this */
+#define PRODUCER_MIN_FRAMES 1024
+
+static volatile sig_atomic_t m_iLoop = 0;
+
+/* Handle termination with CTRL-C */
+static void handler(int sig, siginfo_t *si, void *unused) {
+    m_iLoop = 1;
+}
+
+/* Start player with 'shm:FD' appended to its arguments */
+static pid_t start_player(char *argv[], int argc, int fd) {
+    char l_strSpec[32];
+    char **l_strArgs = NULL;
+    pid_t l_iPid = 0;
+    int i = 0;
+
+    l_strArgs = (char **)calloc(argc + 2, sizeof(char *));
+
+    if (l_strArgs == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < argc; i++) {
+        l_strArgs[i] = argv[i];
+    }
+
+    snprintf(l_strSpec, sizeof(l_strSpec), "shm:%d", fd);
+    l_strArgs[argc] = l_strSpec;
+    fflush(stdout);
+    l_iPid = fork();
+
+    if (l_iPid == 0) {
+        execvp(l_strArgs[0], l_strArgs);
+        fprintf(stderr, "start_player: Can't start %s: %s\n", l_strArgs[0], strerror(errno));
+        _exit(127);
+    }
+
+    free(l_strArgs);
+    return l_iPid;
+}
+
+/* Decode as much as fits. Returns frames written or 0 at end of file */
+static sf_count_t produce(SNDFILE *file, shmring *ring) {
+    float *l_fFirst = NULL;
+    float *l_fSecond = NULL;
+    uint64_t l_lFirst = 0;
+    uint64_t l_lSecond = 0;
+    sf_count_t l_lGot = 0;
+    sf_count_t l_lTotal = 0;
+
+    shmring_get_write_regions(ring, &l_fFirst, &l_lFirst, &l_fSecond, &l_lSecond);
+
+    /* libsndfile decodes straight into shared memory */
+    l_lGot = sf_readf_float(file, l_fFirst, l_lFirst);
+    l_lTotal = l_lGot > 0 ? l_lGot : 0;
+
+    if (l_lGot == (sf_count_t)l_lFirst && l_lSecond > 0) {
+        l_lGot = sf_readf_float(file, l_fSecond, l_lSecond);
+        l_lTotal += l_lGot > 0 ? l_lGot : 0;
+    }
+
+    if (l_lTotal > 0) {
+        shmring_write_advance(ring, l_lTotal);
+    }
+
+    return l_lTotal;
+}
+
+int main(int argc, char *argv[]) {
+    SNDFILE *l_SInfile = NULL;
+    SF_INFO l_SSfinfo;
+    shmring l_SRing;
+    struct sigaction l_SSa;
+    struct timespec l_SStart;
+    struct timespec l_SEnd;
+    pid_t l_iPlayer = 0;
+    int l_iStatus = 0;
+    sf_count_t l_lFrames = 0;
+    sf_count_t l_lGot = 0;
+    double l_dSeconds = 0.0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file [player [player args]]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&l_SSfinfo, 0x00, sizeof(SF_INFO));
+
+    if (! (l_SInfile = sf_open(argv[1], SFM_READ, &l_SSfinfo))) {
+        fprintf(stderr, "main: Not able to open input file %s.\n", argv[1]) ;
+        sf_perror (NULL) ;
+        return  1 ;
+    }
+
+    if (shmring_create(&l_SRing, l_SSfinfo.samplerate, l_SSfinfo.channels, (uint64_t)l_SSfinfo.samplerate * RING_SECONDS) < 0) {
+        fprintf(stderr, "main: Can't create shared memory ring: %s\n", strerror(errno));
+        sf_close(l_SInfile);
+        return 1;
+    }
+
+    l_SSa.sa_flags = SA_SIGINFO;
+    sigemptyset(&l_SSa.sa_mask);
+    l_SSa.sa_sigaction = handler;
+
+    if (sigaction(SIGINT, &l_SSa, NULL) == -1 || sigaction(SIGHUP, &l_SSa, NULL) == -1) {
+        fprintf(stderr, "main: Can't set signal handlers!\n");
+        shmring_close(&l_SRing);
+        sf_close(l_SInfile);
+        return 1;
+    }
+
+    printf("main: %d Hz %d channels, ring %ld frames\n", l_SSfinfo.samplerate, l_SSfinfo.channels, (long)l_SRing.header->capacity);
+
+    /* Fill ring before player starts so it has something right away */
+    l_lFrames = produce(l_SInfile, &l_SRing);
+
+    if (argc > 2) {
+        l_iPlayer = start_player(argv + 2, argc - 2, l_SRing.fd);
+
+        if (l_iPlayer < 0) {
+            fprintf(stderr, "main: Can't start player: %s\n", strerror(errno));
+            shmring_close(&l_SRing);
+            sf_close(l_SInfile);
+            return 1;
+        }
+    } else {
+        printf("main: Give shm:/proc/%d/fd/%d to player\n", (int)getpid(), l_SRing.fd);
+        fflush(stdout);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &l_SStart);
+
+    while (!m_iLoop) {
+        if (shmring_write_space(&l_SRing) < PRODUCER_MIN_FRAMES) {
+            shmring_wait_space(&l_SRing, PRODUCER_MIN_FRAMES, 100);
+
+            /* Player has gone so nobody reads anymore */
+            if (l_iPlayer > 0 && waitpid(l_iPlayer, &l_iStatus, WNOHANG) == l_iPlayer) {
+                l_iPlayer = 0;
+                break;
+            }
+
+            continue;
+        }
+
+        l_lGot = produce(l_SInfile, &l_SRing);
+
+        if (l_lGot <= 0) {
+            break;
+        }
+
+        l_lFrames += l_lGot;
+    }
+
+    shmring_set_eof(&l_SRing);
+
+    /* Wait until player has played everything */
+    if (argc > 2) {
+        while (l_iPlayer > 0 && waitpid(l_iPlayer, &l_iStatus, 0) < 0 && errno == EINTR) {
+            if (m_iLoop) {
+                kill(l_iPlayer, SIGINT);
+            }
+        }
+    } else {
+        while (!m_iLoop && shmring_read_space(&l_SRing) > 0) {
+            shmring_wait_space(&l_SRing, l_SRing.header->capacity, 100);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &l_SEnd);
+    l_dSeconds = (l_SEnd.tv_sec - l_SStart.tv_sec) + (l_SEnd.tv_nsec - l_SStart.tv_nsec) / 1e9;
+    printf("main: Produced %ld frames in %.2f seconds\n", (long)l_lFrames, l_dSeconds);
+    printf("main: Producer waits %ld, consumer wakeups %ld, consumer underruns %ld\n",
+           l_SRing.waits, l_SRing.wakeups, (long)atomic_load(&l_SRing.header->underruns));
+
+    shmring_close(&l_SRing);
+    sf_close(l_SInfile);
+    return 0;
+}
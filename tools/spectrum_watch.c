@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2015 Tuukka Pasanen <tuukka.pasanen@ilmi.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Spectrum and spectrogram watcher for players and recorders
+ * (common/spectrum.h)
+ *
+ * Maps spectrum of other process read only. Bins are summed to
+ * logarithmic bands from 20 Hz to Nyquist and every band is one character
+ * from ' ' (-90 dBFS or less) to '@' (0 dBFS). By default latest frame of
+ * every channel is redrawn 20 times in second. With -g every new frame of
+ * one channel is printed as its own line so output is scrolling
+ * spectrogram. Reading never blocks watched process.
+ *
+ * Compile with
+ * gcc -g -I../common spectrum_watch.c -lm -lpthread -std=gnu11 -Wall -o spectrum_watch
+ *
+ * Run with ./spectrum_watch [-g] [-c channel] [-b bands] /proc/PID/fd/FD (player prints path at start)
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spectrum.h"
+
+/* Redraw every 50 ms */
+#define WATCH_INTERVAL_MS 50
+#define WATCH_FLOOR_DB -90.0f
+#define WATCH_LOW_HZ 20.0
+#define WATCH_MAX_BANDS 160
+/* Writer is gone if nothing changes for this long */
+#define WATCH_STALL_MS 3000
+
+static volatile sig_atomic_t m_iLoop = 0;
+static const char m_strShades[] = " .:-=+*#%@";
+
+/* Handle termination with CTRL-C */
+static void handler(int sig, siginfo_t *si, void *unused) {
+    m_iLoop = 1;
+}
+
+/* One character per band. Band power is sum of its bins */
+static void draw_bands(const float *db, const uint32_t *edges, int bands, char *line) {
+    double l_dPower = 0.0;
+    float l_fDb = 0.0f;
+    int l_iShade = 0;
+    uint32_t b = 0;
+    int i = 0;
+
+    for (i = 0; i < bands; i++) {
+        l_dPower = 0.0;
+
+        for (b = edges[i]; b < edges[i + 1]; b++) {
+            l_dPower += pow(10.0, db[b] / 10.0);
+        }
+
+        l_fDb = l_dPower > 0.0 ? 10.0f * log10f(l_dPower) : WATCH_FLOOR_DB;
+        l_iShade = (int)((l_fDb - WATCH_FLOOR_DB) / -WATCH_FLOOR_DB * (sizeof(m_strShades) - 2) + 0.5f);
+        l_iShade = l_iShade < 0 ? 0 : (l_iShade > (int)sizeof(m_strShades) - 2 ? (int)sizeof(m_strShades) - 2 : l_iShade);
+        line[i] = m_strShades[l_iShade];
+    }
+
+    line[bands] = '\0';
+}
+
+int main(int argc, char *argv[]) {
+    spectrum l_SSpectrum;
+    struct sigaction l_SSa;
+    struct timespec l_SSleep = { 0, WATCH_INTERVAL_MS * 1000000L };
+    uint32_t l_iEdges[WATCH_MAX_BANDS + 1];
+    char l_strLine[WATCH_MAX_BANDS + 1];
+    float *l_fDb = NULL;
+    uint64_t l_lNext = 0;
+    uint64_t l_lWritten = 0;
+    uint64_t l_lPosition = 0;
+    double l_dNyquist = 0.0;
+    long l_lStill = 0;
+    long l_lMissed = 0;
+    int l_iSpectrogram = 0;
+    int l_iChannel = 1;
+    int l_iBands = 64;
+    int l_iDrawn = 0;
+    int l_iOpt = 0;
+    uint32_t c = 0;
+    int i = 0;
+
+    while ((l_iOpt = getopt(argc, argv, "gc:b:")) != -1) {
+        switch (l_iOpt) {
+            case 'g':
+                l_iSpectrogram = 1;
+                break;
+
+            case 'c':
+                l_iChannel = atoi(optarg);
+                break;
+
+            case 'b':
+                l_iBands = atoi(optarg);
+                break;
+
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind >= argc || l_iBands < 1 || l_iBands > WATCH_MAX_BANDS) {
+        fprintf(stderr, "Usage: %s [-g] [-c channel] [-b bands (max %d)] /proc/PID/fd/FD\n", argv[0], WATCH_MAX_BANDS);
+        return 1;
+    }
+
+    if (spectrum_attach(&l_SSpectrum, argv[optind]) < 0) {
+        fprintf(stderr, "main: Not able to attach spectrum %s.\n", argv[optind]);
+        return 1;
+    }
+
+    if (l_iChannel < 1 || l_iChannel > (int)l_SSpectrum.shared->channels) {
+        fprintf(stderr, "main: Spectrum has channels 1..%u\n", l_SSpectrum.shared->channels);
+        spectrum_detach(&l_SSpectrum);
+        return 1;
+    }
+
+    /* Logarithmic band edges in bins. Every band has at least one bin */
+    l_dNyquist = l_SSpectrum.shared->samplerate / 2.0;
+
+    for (i = 0; i <= l_iBands; i++) {
+        l_iEdges[i] = (uint32_t)(WATCH_LOW_HZ * pow(l_dNyquist / WATCH_LOW_HZ, (double)i / l_iBands)
+                                 / l_dNyquist * (l_SSpectrum.shared->bins - 1) + 0.5);
+        l_iEdges[i] = i > 0 && l_iEdges[i] <= l_iEdges[i - 1] ? l_iEdges[i - 1] + 1 : l_iEdges[i];
+        l_iEdges[i] = l_iEdges[i] > l_SSpectrum.shared->bins ? l_SSpectrum.shared->bins : l_iEdges[i];
+    }
+
+    l_fDb = (float *)malloc(l_SSpectrum.shared->channels * l_SSpectrum.shared->bins * sizeof(float));
+
+    if (l_fDb == NULL) {
+        spectrum_detach(&l_SSpectrum);
+        return 1;
+    }
+
+    l_SSa.sa_flags = SA_SIGINFO;
+    sigemptyset(&l_SSa.sa_mask);
+    l_SSa.sa_sigaction = handler;
+    sigaction(SIGINT, &l_SSa, NULL);
+    sigaction(SIGHUP, &l_SSa, NULL);
+
+    printf("Watching process %u spectrum: %u Hz, %u point FFT every %u frames, %d bands from %.0f Hz to %.0f Hz\n",
+           l_SSpectrum.shared->pid, l_SSpectrum.shared->samplerate, l_SSpectrum.shared->fft_size,
+           l_SSpectrum.shared->hop, l_iBands, WATCH_LOW_HZ, l_dNyquist);
+    l_lNext = spectrum_written(&l_SSpectrum);
+
+    while (!m_iLoop) {
+        l_lWritten = spectrum_written(&l_SSpectrum);
+        l_lStill = l_lWritten == l_lNext ? l_lStill + WATCH_INTERVAL_MS : 0;
+
+        if (l_lStill >= WATCH_STALL_MS) {
+            printf("%smain: No new frames for %d ms. Stream has stopped.\n", l_iDrawn ? "\033[J" : "", WATCH_STALL_MS);
+            l_iDrawn = 0;
+            break;
+        }
+
+        if (l_iSpectrogram) {
+            /* Rows that were overwritten before we came are lost */
+            if (l_lWritten - l_lNext > l_SSpectrum.shared->history) {
+                l_lMissed += l_lWritten - l_lNext - l_SSpectrum.shared->history;
+                l_lNext = l_lWritten - l_SSpectrum.shared->history;
+            }
+
+            for (; l_lNext < l_lWritten; l_lNext++) {
+                if (spectrum_read(&l_SSpectrum, l_lNext, &l_lPosition, l_fDb) < 0) {
+                    l_lMissed++;
+                    continue;
+                }
+
+                draw_bands(l_fDb + (l_iChannel - 1) * l_SSpectrum.shared->bins, l_iEdges, l_iBands, l_strLine);
+                printf("%8.2f |%s|\n", (double)l_lPosition / l_SSpectrum.shared->samplerate, l_strLine);
+            }
+        } else if (l_lWritten > 0 && l_lWritten != l_lNext) {
+            l_lNext = l_lWritten;
+
+            if (spectrum_read(&l_SSpectrum, l_lWritten - 1, &l_lPosition, l_fDb) < 0) {
+                l_lMissed++;
+            } else {
+                printf("%.1f s\n", (double)l_lPosition / l_SSpectrum.shared->samplerate);
+
+                for (c = 0; c < l_SSpectrum.shared->channels; c++) {
+                    draw_bands(l_fDb + c * l_SSpectrum.shared->bins, l_iEdges, l_iBands, l_strLine);
+                    printf("%2u |%s|\n", c + 1, l_strLine);
+                }
+
+                /* Move cursor back over this drawing */
+                printf("\033[%uA", l_SSpectrum.shared->channels + 1);
+                l_iDrawn = 1;
+            }
+        }
+
+        fflush(stdout);
+        nanosleep(&l_SSleep, NULL);
+    }
+
+    if (l_iDrawn) {
+        printf("\033[%uB", l_SSpectrum.shared->channels + 1);
+    }
+
+    printf("\nmain: %ld frames missed\n", l_lMissed);
+    free(l_fDb);
+    spectrum_detach(&l_SSpectrum);
+    return 0;
+}